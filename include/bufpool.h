@@ -0,0 +1,32 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BUFPOOL_BUFFER      (1024 * 1024)   // every buffer, enough for any cluster
+#define BUFPOOL_ALIGN       4096            // covers the sector size of direct I/O
+#define BUFPOOL_DEFAULT     64              // buffers per mount
+
+// aligned I/O buffers carved out of one mapping made up front
+typedef struct BufPool BufPool;
+
+typedef struct {
+    uint32_t buffers;
+    uint32_t in_use;
+    uint64_t gets;          // handed out from the pool
+    uint64_t misses;        // pool empty, taken from the heap instead
+    int huge;               // 0 normal pages, 1 transparent huge pages, 2 reserved ones
+} BufPoolStats;
+
+// huge asks for huge pages, reserved ones first; falls back quietly
+BufPool *bufpool_open(uint32_t count, bool huge);
+void bufpool_close(BufPool *bp);
+
+// never waits: with the pool empty (or NULL) the buffer comes from the heap
+void *bufpool_get(BufPool *bp);
+void bufpool_put(BufPool *bp, void *buf);
+void bufpool_stats(BufPool *bp, BufPoolStats *st);
+
+#endif
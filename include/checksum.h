@@ -0,0 +1,31 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    SUM_CRC32C,
+    SUM_XXH64
+} SumAlgo;
+
+// streaming state for either algorithm
+typedef struct {
+    SumAlgo algo;
+    uint32_t crc;           // crc32c register, pre-inverted
+    uint64_t acc[4];        // xxh64 lanes
+    uint64_t total;
+    uint8_t tail[32];       // xxh64 bytes waiting for a full stripe
+    uint32_t tail_len;
+} Hasher;
+
+#define SUM_HEX_MAX     17
+
+int sum_parse_algo(const char *name, SumAlgo *algo);
+const char *sum_algo_name(SumAlgo algo);
+
+void sum_init(Hasher *h, SumAlgo algo);
+void sum_update(Hasher *h, const void *data, size_t len);
+void sum_final(const Hasher *h, char *hex);     // hex holds SUM_HEX_MAX bytes
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef CIMAGE_H
+#define CIMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// read-only view of a chunked, compressed image
+typedef struct CImage CImage;
+
+bool cimage_probe(int fd);
+CImage *cimage_open(int fd);
+void cimage_close(CImage *ci);
+
+uint64_t cimage_size(const CImage *ci);
+int cimage_read(CImage *ci, uint64_t offset, void *buffer, size_t len);
+
+// converters between raw and compressed images
+int cimage_pack(const char *raw_path, const char *out_path);
+int cimage_unpack(const char *packed_path, const char *out_path);
+
+#endif
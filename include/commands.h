@@ -1,8 +1,14 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include <stdio.h>
 #include "lexer.h"
 
+// command output goes to a per-thread stream, stdout by default
+FILE *cmd_output(void);
+void cmd_set_output(FILE *out);
+void cmd_printf(const char *fmt, ...);
+
 // command handlers
 void cmd_info(tokenlist *tokens);
 void cmd_exit(tokenlist *tokens);
@@ -16,9 +22,23 @@ void cmd_lsof(tokenlist *tokens);
 void cmd_lseek(tokenlist *tokens);
 void cmd_read(tokenlist *tokens);
 void cmd_write(tokenlist *tokens);
+void cmd_sync(tokenlist *tokens);
+void cmd_commit(tokenlist *tokens);
+void cmd_import(tokenlist *tokens);
+void cmd_cp(tokenlist *tokens);
+void cmd_sum(tokenlist *tokens);
+void cmd_grep(tokenlist *tokens);
+void cmd_df(tokenlist *tokens);
+void cmd_fatcheck(tokenlist *tokens);
+void cmd_truncate(tokenlist *tokens);
+void cmd_fallocate(tokenlist *tokens);
 void cmd_mv(tokenlist *tokens);
 void cmd_rm(tokenlist *tokens);
 void cmd_rmdir(tokenlist *tokens);
+void cmd_find(tokenlist *tokens);
+void cmd_du(tokenlist *tokens);
+void cmd_frag(tokenlist *tokens);
+void cmd_compact(tokenlist *tokens);
 
 int dispatch_command(tokenlist *tokens);
 
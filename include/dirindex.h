@@ -0,0 +1,56 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIRINDEX_MAX        16      // directories indexed at once
+#define DIRINDEX_RUN        32      // free runs this long or longer share one list
+
+// name tables; each maps a hash to a record's first slot and its LFN slot count
+#define DIRINDEX_LONG       0       // long names, ASCII folded to upper case
+#define DIRINDEX_SHORT      1       // 8.3 names, "." and ".." included
+#define DIRINDEX_ALIAS      2       // alias basis -> the ~N to try next
+#define DIRINDEX_TABLES     3
+
+/*
+ * What adding to a directory needs without reading it: the cluster chain,
+ * the end-of-directory slot, the runs of deleted slots in front of it and
+ * hashes of every name. Slots are numbered from the start of the directory.
+ * Indexes are built and changed under the exclusive volume lock; lookups
+ * may read them under the shared one.
+ */
+typedef struct DirIndex DirIndex;
+
+DirIndex *dirindex_find(uint32_t dir_cluster);
+// an empty index; the least recently used one goes if all are taken
+DirIndex *dirindex_create(uint32_t dir_cluster, uint32_t slots_per_cluster);
+void dirindex_drop(DirIndex *ix);
+// drops the index whose chain holds cluster, for when it is freed
+void dirindex_forget(uint32_t cluster);
+void dirindex_clear(void);
+// the index holding (cluster, offset), with the slot number there
+DirIndex *dirindex_owner(uint32_t cluster, uint32_t offset, uint32_t *slot);
+
+int dirindex_append(DirIndex *ix, uint32_t cluster);
+uint32_t dirindex_last(const DirIndex *ix);
+uint32_t dirindex_capacity(const DirIndex *ix);
+bool dirindex_locate(const DirIndex *ix, uint32_t slot, uint32_t *cluster, uint32_t *offset);
+
+uint32_t dirindex_end(const DirIndex *ix);
+void dirindex_set_end(DirIndex *ix, uint32_t slot);
+// deleted slots in front of the end marker, whether or not their runs are kept
+uint32_t dirindex_deleted(const DirIndex *ix);
+// count slots out of a free run if one is long enough, else at the end
+uint32_t dirindex_take(DirIndex *ix, uint32_t count);
+void dirindex_release(DirIndex *ix, uint32_t slot, uint32_t count);
+
+int dirindex_name_add(DirIndex *ix, int table, uint64_t hash, uint32_t slot, uint32_t lfn_count);
+void dirindex_name_remove(DirIndex *ix, int table, uint64_t hash, uint32_t slot);
+// replaces the first entry under hash, or adds one
+int dirindex_name_set(DirIndex *ix, int table, uint64_t hash, uint32_t slot);
+// walks the entries under hash; *pos starts at 0
+bool dirindex_name_next(const DirIndex *ix, int table, uint64_t hash, uint32_t *pos,
+                        uint32_t *slot, uint32_t *lfn_count);
+
+#endif
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
 // Boot sector / BPB structure
 typedef struct __attribute__((packed)) {
@@ -37,6 +39,24 @@ typedef struct __attribute__((packed)) {
     uint8_t  BS_FilSysType[8];
 } BootSector;
 
+#define EXT_NO_MIRROR   0x0080  // BPB_ExtFlags: only the active FAT is kept
+#define EXT_ACTIVE      0x000F  // BPB_ExtFlags: the active FAT
+
+// FSInfo sector, a hint of the free cluster count
+typedef struct __attribute__((packed)) {
+    uint32_t FSI_LeadSig;        // FSI_LEAD_SIG
+    uint8_t  FSI_Reserved1[480];
+    uint32_t FSI_StrucSig;       // FSI_STRUC_SIG
+    uint32_t FSI_Free_Count;     // FSI_UNKNOWN if not known
+    uint32_t FSI_Nxt_Free;
+    uint8_t  FSI_Reserved2[12];
+    uint32_t FSI_TrailSig;
+} FSInfo;
+
+#define FSI_LEAD_SIG    0x41615252
+#define FSI_STRUC_SIG   0x61417272
+#define FSI_UNKNOWN     0xFFFFFFFF
+
 // Directory entry (32 bytes)
 typedef struct __attribute__((packed)) {
     uint8_t  DIR_Name[11];       // 8.3 name
@@ -53,6 +73,18 @@ typedef struct __attribute__((packed)) {
     uint32_t DIR_FileSize;
 } DirEntry;
 
+// VFAT long name entry (32 bytes), stored in reverse order before its 8.3 entry
+typedef struct __attribute__((packed)) {
+    uint8_t  LDIR_Ord;
+    uint16_t LDIR_Name1[5];
+    uint8_t  LDIR_Attr;          // always ATTR_LONG_NAME
+    uint8_t  LDIR_Type;
+    uint8_t  LDIR_Chksum;        // checksum of the matching 8.3 name
+    uint16_t LDIR_Name2[6];
+    uint16_t LDIR_FstClusLO;     // always 0
+    uint16_t LDIR_Name3[2];
+} LfnEntry;
+
 // attributes
 #define ATTR_READ_ONLY  0x01
 #define ATTR_HIDDEN     0x02
@@ -62,22 +94,29 @@ typedef struct __attribute__((packed)) {
 #define ATTR_ARCHIVE    0x20
 #define ATTR_LONG_NAME  (ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID)
 
+// long names
+#define LFN_LAST_ENTRY  0x40
+#define LFN_ORD_MASK    0x1F
+#define LFN_CHARS       13       // UCS-2 chars per LFN entry
+#define MAX_LFN         255      // UCS-2 chars in a long name
+#define MAX_NAME        (MAX_LFN * 3 + 1)   // long name as UTF-8
+
 // FAT special values
 #define FAT_EOC         0x0FFFFFF8
 #define FAT_FREE        0x00000000
 #define FAT_BAD         0x0FFFFFF7
 #define FAT_MASK        0x0FFFFFFF
-
-#define MAX_OPEN_FILES  10
+#define FAT_RESERVED    0x0FFFFFF0   // first of the reserved values, up to FAT_BAD
 
 #define MODE_READ       0x01
 #define MODE_WRITE      0x02
 #define MODE_RW         (MODE_READ | MODE_WRITE)
 
 #define MAX_PATH        256
+#define WRITE_BUF_SIZE  (64 * 1024)   // per open file, rounded up to whole clusters
 
 typedef struct {
-    char name[12];
+    char name[MAX_NAME];
     char path[MAX_PATH];
     uint32_t first_cluster;
     uint32_t size;
@@ -86,36 +125,167 @@ typedef struct {
     bool in_use;
     uint32_t dir_cluster;
     uint32_t dir_entry_offset;
+    int next;                    // hash chain while open, free list while closed
+    // writes not yet on disk: wbuf_len bytes meant for file offset wbuf_start
+    uint8_t *wbuf;
+    uint32_t wbuf_start;
+    uint32_t wbuf_len;
+    uint32_t wbuf_cap;
 } OpenFile;
 
+// open files indexed by descriptor, plus a hash from the location of the
+// file's 8.3 entry to its descriptor for the name-based commands
 typedef struct {
-    FILE *fp;
-    BootSector bs;
-    uint32_t fat_start;
-    uint32_t data_start;
-    uint32_t total_clusters;
+    OpenFile *files;
+    int capacity;
+    int count;
+    int free_list;               // closed descriptors, -1 if none
+    int *buckets;
+    int bucket_count;            // power of two
+} FileTable;
+
+// FAT changes collected and written out sorted
+typedef struct {
+    uint32_t cluster;
+    uint32_t value;
+} FatUpdate;
+
+typedef struct {
+    FatUpdate *items;
+    size_t count;
+    size_t cap;
+} FatBatch;
+
+// a decoded directory record: 8.3 entry plus its long name (if any)
+typedef struct {
+    DirEntry entry;
+    char name[MAX_NAME];         // long name, or 8.3 name if there is none
+    uint32_t cluster;            // location of the 8.3 entry
+    uint32_t offset;
+    uint32_t lfn_cluster;        // location of the first slot (LFN or 8.3)
+    uint32_t lfn_offset;
+    uint8_t lfn_count;           // number of LFN slots in front of the entry
+} DirRecord;
+
+typedef struct {
+    uint32_t cluster;
+    uint32_t offset;
+    // LFN sequence collected so far
+    uint16_t lfn_name[LFN_CHARS * (LFN_ORD_MASK + 1)];
+    bool lfn_valid;
+    int lfn_total;
+    int lfn_next;
+    uint8_t lfn_sum;
+    uint32_t lfn_cluster;
+    uint32_t lfn_offset;
+    uint32_t steps;         // clusters followed, to stop on a looping chain
+} DirIter;
+
+#define READDIR_BATCH   64
+
+// reads a directory a whole cluster at a time and hands out records in batches
+typedef struct {
+    DirIter it;
+    uint8_t *buf;                // the cluster being decoded
+    uint32_t slot;               // next entry in buf
+    uint32_t steps;              // clusters read, bounds a looping chain
+    bool loaded;
+    bool done;
+    bool failed;
+} DirReader;
+
+// per-client state; the shell has one and so does every server connection
+typedef struct Session {
     uint32_t current_dir;
     char current_path[MAX_PATH];
+    FileTable files;
+    struct Session *next;        // all live sessions, for checks that span them
+} Session;
+
+// where new clusters go; picked before mounting
+typedef enum {
+    ALLOC_LOWEST,                // the lowest free cluster
+    ALLOC_NEXT,                  // next-fit: after the chain, else after the last allocation
+    ALLOC_GROUP                  // after the chain, else in its directory's cluster group
+} AllocPolicy;
+
+#define ALLOC_GROUP_SIZE 8192    // clusters per group, 32 KiB of FAT
+
+typedef struct {
+    int fd;
+    BootSector bs;
+    uint64_t fat_start;          // byte offsets, 64-bit for images past 4 GB
+    uint64_t data_start;
+    uint32_t total_clusters;
     char image_name[MAX_PATH];
-    OpenFile open_files[MAX_OPEN_FILES];
+    Session shell;
+    Session *sessions;
+    pthread_mutex_t sessions_lock;
+    pthread_rwlock_t lock;       // shared for lookups and reads, exclusive for changes
+    uint8_t *zero_cluster;       // read-only, for clearing new clusters
+    uint8_t compact_threshold;   // % of tombstones that triggers compaction, 0 = off
+    struct Overlay *overlay;     // copy-on-write delta, NULL when writing the image directly
+    struct CImage *cimage;       // set when the image is in the compressed format
+    struct FatCache *fat_cache;  // FAT pages, written back when the exclusive lock drops
+    struct WriteBack *writeback; // write-behind buffer, NULL when writes go straight out
+    struct BufPool *pool;        // aligned I/O buffers shared by every operation
+    bool direct;                 // image opened with O_DIRECT, bypassing the page cache
+    AllocPolicy alloc;
+    uint32_t alloc_cursor;       // where next-fit resumes
+    uint32_t alloc_group;        // the group the last new directory went to
 } FAT32;
 
 extern FAT32 fs;
 
+// the session commands on this thread run against
+extern __thread Session *fs_session;
+
 // mount/unmount
-int fat32_mount(const char *image_path);
+int fat32_mount(const char *image_path, const char *overlay_path);
 void fat32_unmount(void);
+void fat32_set_write_behind(unsigned delay_ms, size_t bytes);  // 0 ms writes through
+int fat32_sync(void);           // pushes all buffered changes to the image
+void fat32_set_direct_io(bool direct, bool huge_pages);
+void fat32_set_alloc_policy(AllocPolicy policy);
+const char *fat32_alloc_name(AllocPolicy policy);
 
 // FAT operations
+void fat32_set_fat_cache(size_t bytes);     // memory budget for later mounts
 uint32_t fat32_get_fat_entry(uint32_t cluster);
 int fat32_set_fat_entry(uint32_t cluster, uint32_t value);
+int fat32_flush_fat(void);
 uint32_t fat32_find_free_cluster(void);
-uint32_t fat32_allocate_cluster(uint32_t prev_cluster);
+// where the policy starts looking for the cluster after prev_cluster; a new
+// chain (prev_cluster 0) goes by the directory its entry is in
+uint32_t fat32_alloc_goal(uint32_t prev_cluster, uint32_t dir_cluster);
+// the directory a new directory's first cluster goes by; under the group
+// policy a cluster in the next group round, so directories spread out
+uint32_t fat32_dir_goal(uint32_t parent_cluster);
+uint32_t fat32_allocate_cluster(uint32_t prev_cluster, uint32_t dir_cluster);
+int fat32_free_chain(uint32_t cluster);
+
+// batched FAT updates
+void fat32_batch_init(FatBatch *b);
+int fat32_batch_set(FatBatch *b, uint32_t cluster, uint32_t value);
+int fat32_batch_commit(FatBatch *b);
+void fat32_batch_free(FatBatch *b);
+
+// volume lock, held around every command
+void fat32_lock_shared(void);
+void fat32_lock_exclusive(void);
+void fat32_unlock(void);
+
+// raw image I/O (positional, safe to call from several threads)
+int fat32_read_at(uint64_t offset, void *buffer, size_t len);
+int fat32_write_at(uint64_t offset, const void *buffer, size_t len);
+int fat32_write_dir_at(uint64_t offset, const void *buffer, size_t len);
+int fat32_copy_at(uint64_t from, uint64_t to, size_t len, void *bounce, bool *offloaded);
 
 // cluster ops
-uint32_t fat32_cluster_to_offset(uint32_t cluster);
+uint64_t fat32_cluster_to_offset(uint32_t cluster);
 int fat32_read_cluster(uint32_t cluster, void *buffer);
 int fat32_write_cluster(uint32_t cluster, const void *buffer);
+uint8_t *fat32_scratch(void);
 
 // directory stuff
 int fat32_read_dir_entry(uint32_t cluster, uint32_t offset, DirEntry *entry);
@@ -126,14 +296,66 @@ int fat32_add_dir_entry(uint32_t dir_cluster, DirEntry *entry);
 int fat32_remove_dir_entry(uint32_t dir_cluster, uint32_t offset);
 bool fat32_is_dir_empty(uint32_t cluster);
 
+// long name aware directory access
+void fat32_dir_open(DirIter *it, uint32_t dir_cluster);
+int fat32_dir_next(DirIter *it, DirRecord *rec);
+int fat32_dir_decode(DirIter *it, const DirEntry *ent, uint32_t cluster,
+                     uint32_t offset, DirRecord *rec);
+int fat32_readdir_open(DirReader *r, uint32_t dir_cluster);
+int fat32_readdir(DirReader *r, DirRecord *recs, int max);
+void fat32_readdir_close(DirReader *r);
+int fat32_lookup(uint32_t dir_cluster, const char *name, DirRecord *rec);
+int fat32_add_named_entry(uint32_t dir_cluster, const char *name, DirEntry *entry,
+                          uint32_t *entry_cluster, uint32_t *entry_offset);
+int fat32_remove_record(const DirRecord *rec);
+int fat32_name_slots(const char *name, DirEntry *entry, const uint8_t (*taken)[11],
+                     size_t taken_count, DirEntry *slots);
+
+// open file table
+int fat32_handle_open(const OpenFile *of);
+OpenFile *fat32_handle_get(int fd);
+int fat32_handle_find(uint32_t dir_cluster, uint32_t entry_offset);
+int fat32_handle_close(int fd);
+void fat32_handle_move(int fd, uint32_t dir_cluster, uint32_t entry_offset);
+int fat32_handles_free(void);
+bool fat32_is_open(uint32_t dir_cluster, uint32_t entry_offset);
+
+// sessions
+void fat32_session_init(Session *s);
+void fat32_session_attach(Session *s);
+int fat32_session_detach(Session *s);
+bool fat32_dir_in_use(uint32_t dir_cluster);
+
+// buffered file writes
+int fat32_file_write(OpenFile *of, const void *data, uint32_t len);
+int fat32_file_flush(OpenFile *of);
+int fat32_handles_flush(void);
+bool fat32_handles_dirty(void);
+int fat32_file_truncate(uint32_t dir_cluster, uint32_t entry_offset, uint32_t size);
+int fat32_file_allocate(uint32_t dir_cluster, uint32_t entry_offset, uint32_t size,
+                        bool keep_size);
+
+// compaction
+int fat32_dir_stats(uint32_t dir_cluster, uint32_t *live, uint32_t *deleted,
+                    uint32_t *clusters);
+int fat32_compact_dir(uint32_t dir_cluster, uint32_t *removed, uint32_t *freed);
+void fat32_auto_compact(uint32_t dir_cluster);
+
+int fat32_resolve_path(const char *path, DirRecord *rec);
+
 // name conversion
 void fat32_name_to_83(const char *name, char *name83);
 void fat32_83_to_name(const uint8_t *name83, char *name);
+bool fat32_is_short_name(const char *name);
+uint8_t fat32_lfn_checksum(const uint8_t *name83);
 
 // misc
-uint32_t fat32_get_cluster(DirEntry *entry);
+uint32_t fat32_get_cluster(const DirEntry *entry);
 void fat32_set_cluster(DirEntry *entry, uint32_t cluster);
 uint32_t fat32_get_cluster_size(void);
-uint32_t fat32_get_image_size(void);
+uint64_t fat32_get_image_size(void);
+time_t fat32_now(void);             // clock for entry timestamps
+void fat32_pin_clock(time_t t);     // replaces the wall clock, 0 releases it
+int fat32_read_fsinfo(FSInfo *info);
 
 #endif
@@ -0,0 +1,41 @@
+#ifndef FATCACHE_H
+#define FATCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define FATCACHE_PAGE       4096
+#define FATCACHE_DEFAULT    (8 * 1024 * 1024)   // memory budget per mount
+
+// page cache over the first FAT copy; dirty pages go back to every copy
+typedef struct FatCache FatCache;
+
+typedef struct {
+    uint32_t pages;         // cached now
+    uint32_t capacity;
+    uint32_t dirty;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;     // pages read ahead of a sequential miss
+    uint64_t evictions;
+    uint64_t writebacks;    // pages written, counted once for all copies
+} FatCacheStats;
+
+FatCache *fatcache_open(uint64_t fat_start, uint64_t fat_bytes, int copies, size_t budget);
+void fatcache_close(FatCache *fc);
+
+int fatcache_get(FatCache *fc, uint32_t index, uint32_t *value);
+int fatcache_set(FatCache *fc, uint32_t index, uint32_t value);
+
+// brings cached pages up to date after entries were written around the cache
+void fatcache_patch(FatCache *fc, uint32_t first, const uint32_t *values, size_t count);
+
+int fatcache_flush(FatCache *fc);
+
+// forgets every page after the first FAT was rewritten behind the cache;
+// unflushed changes are lost
+void fatcache_invalidate(FatCache *fc);
+void fatcache_stats(FatCache *fc, FatCacheStats *st);
+
+#endif
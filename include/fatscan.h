@@ -0,0 +1,42 @@
+#ifndef FATSCAN_H
+#define FATSCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MIRROR_RANGES       16      // divergent ranges kept per FAT copy
+#define FREE_RUN_BUCKETS    28      // bucket k holds runs of 2^k .. 2^(k+1)-1
+
+// what a pass over the whole FAT found, counting data clusters only
+typedef struct {
+    uint32_t clusters;
+    uint32_t free;
+    uint32_t used;
+    uint32_t bad;
+    uint32_t reserved;
+    uint32_t free_runs;
+    uint32_t largest_run;
+    uint32_t largest_run_start;
+    uint32_t run_hist[FREE_RUN_BUCKETS];
+    uint64_t fat_bytes;             // FAT bytes read
+} FatScan;
+
+int fat32_scan_fat(FatScan *scan);
+
+// how one FAT copy differs from the reference copy, in entry indexes
+typedef struct {
+    uint32_t entries;               // entries that differ
+    uint32_t ranges;                // runs of adjacent differing entries
+    uint32_t first[MIRROR_RANGES];  // the first MIRROR_RANGES runs
+    uint32_t last[MIRROR_RANGES];
+    uint64_t written;               // bytes rewritten by a repair
+} MirrorDiff;
+
+// the copy the BPB names as active, FAT 0 while mirroring is on
+int fat32_active_fat(void);
+
+// compares every FAT copy against copy ref, diffs has one slot per copy;
+// with repair set, blocks that differ are rewritten from ref
+int fat32_check_mirrors(int ref, bool repair, MirrorDiff *diffs);
+
+#endif
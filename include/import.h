@@ -0,0 +1,29 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fat32.h"
+
+typedef struct {
+    uint32_t files;
+    uint32_t dirs;
+    uint64_t bytes;
+    uint32_t clusters;
+    uint32_t extents;       // contiguous cluster runs used
+    uint32_t skipped;       // host entries that can't be represented
+    uint32_t failed;        // source files that could not be read
+    uint64_t offloaded;     // copies: bytes the kernel copied without a round trip
+} ImportStats;
+
+// copies host_path (a file, or with recursive a whole tree) into dir_cluster
+// under name; nothing becomes visible unless all data made it to the image
+int fat32_import(uint32_t dir_cluster, const char *name, const char *host_path,
+                 bool recursive, ImportStats *stats);
+
+// the same for a file or tree already in the image, copied cluster run by
+// cluster run without passing through the shell
+int fat32_copy(uint32_t dir_cluster, const char *name, const DirRecord *src,
+               bool recursive, ImportStats *stats);
+
+#endif
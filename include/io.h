@@ -0,0 +1,11 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// positioned I/O that retries short transfers and EINTR; 0 on success
+int io_pread_full(int fd, uint64_t offset, void *buffer, size_t len);
+int io_pwrite_full(int fd, uint64_t offset, const void *buffer, size_t len);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Small byte-oriented LZ77 codec. A block is a series of sequences:
+ *   token (literal count << 4 | match length - 4), extra literal count
+ *   bytes, literals, 16-bit offset, extra match length bytes
+ * where a nibble of 15 continues in following bytes (255 = keep going).
+ * The last sequence carries only literals.
+ */
+
+// returns the compressed size, or 0 if it doesn't fit in cap
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+// returns 0 if src decodes to exactly out_len bytes
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len);
+
+#endif
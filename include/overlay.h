@@ -0,0 +1,28 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// copy-on-write delta in front of a read-only base image
+typedef struct Overlay Overlay;
+
+// reads unmodified blocks from the base image
+typedef int (*OverlayBaseRead)(uint64_t offset, void *buffer, size_t len);
+
+// opens delta_path, creating it when missing; the base is never written
+// except by overlay_commit, which reopens base_path for writing
+Overlay *overlay_open(const char *delta_path, const char *base_path,
+                      uint64_t base_size, OverlayBaseRead base_read);
+void overlay_close(Overlay *ov);
+
+int overlay_read(Overlay *ov, uint64_t offset, void *buffer, size_t len);
+int overlay_write(Overlay *ov, uint64_t offset, const void *buffer, size_t len);
+
+// copies every modified block into the base and empties the delta
+int overlay_commit(Overlay *ov, uint64_t *blocks);
+
+uint64_t overlay_dirty_blocks(const Overlay *ov);
+uint32_t overlay_block_size(void);
+
+#endif
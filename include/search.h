@@ -0,0 +1,12 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SEARCH_MAX      4096    // longest pattern grep takes
+
+// the first occurrence of needle (n bytes, n >= 1) in hay, NULL if none
+const uint8_t *search_find(const uint8_t *hay, size_t len, const uint8_t *needle, size_t n);
+
+#endif
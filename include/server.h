@@ -0,0 +1,10 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// serves the command set on a unix socket; the image must be mounted
+int server_run(const char *socket_path);
+
+// line client for server_run, reads commands from stdin
+int client_run(const char *socket_path);
+
+#endif
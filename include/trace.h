@@ -0,0 +1,21 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include "lexer.h"
+
+// recording: the image must be mounted; every command run through
+// trace_dispatch is logged with its start time and latency
+int trace_record_start(const char *path);
+int trace_record_finish(void);
+
+// dispatch_command, timed and logged while a recording is active
+int trace_dispatch(tokenlist *tokens);
+
+// replays a trace against a scratch copy of image_path and reports timings
+// against baseline_path (the trace itself when NULL); returns 0 when the
+// final image matches the recorded one
+int trace_replay(const char *trace_path, const char *image_path, bool paced,
+                 const char *baseline_path, const char *record_path);
+
+#endif
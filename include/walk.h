@@ -0,0 +1,30 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "fat32.h"
+
+// per-thread scanner handed to the callbacks
+typedef struct WalkWorker WalkWorker;
+
+typedef struct {
+    // called for every record below the start directory, from any worker;
+    // for a directory the return value becomes that directory's data
+    void *(*visit)(WalkWorker *w, const DirRecord *rec, const char *path,
+                   void *parent, void *ctx);
+    // called once a directory's own entries have all been visited
+    void (*dir_done)(WalkWorker *w, void *dir, void *ctx);
+    void *ctx;
+    FILE *out;                   // where walk_emit output goes
+} WalkOps;
+
+int fat32_walk(uint32_t dir_cluster, const char *path, void *dir_data,
+               const WalkOps *ops);
+
+// helpers for callbacks
+void walk_emit(WalkWorker *w, const char *fmt, ...);
+uint32_t walk_chain_length(uint32_t cluster);
+int walk_thread_count(void);
+
+#endif
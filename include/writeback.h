@@ -0,0 +1,53 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WRITEBACK_BLOCK     4096
+#define WRITEBACK_DEFAULT   (4 * 1024 * 1024)   // dirty bytes that start a flush
+
+// write-behind buffer in front of the image: writes land in memory and a
+// background thread writes them out, sorted and coalesced, after a delay
+typedef struct WriteBack WriteBack;
+
+typedef int (*WriteBackRead)(uint64_t offset, void *buffer, size_t len);
+typedef int (*WriteBackWrite)(uint64_t offset, const void *buffer, size_t len);
+typedef void (*WriteBackHook)(void);
+
+// a flush writes file data first, then the FAT, then the directories that
+// point into both; a block written in several orders goes with the latest
+typedef enum {
+    WRITEBACK_DATA,
+    WRITEBACK_FAT,
+    WRITEBACK_DIR
+} WriteBackOrder;
+
+typedef struct {
+    uint64_t dirty;         // bytes waiting now
+    uint64_t flushes;       // passes that wrote something
+    uint64_t background;    // of those, run by the flusher thread
+    uint64_t runs;          // sequential writes issued
+    uint64_t written;
+    uint64_t stalls;        // writes that had to wait for a flush
+    int errors;             // failed background passes since the last flush
+} WriteBackStats;
+
+// flushes once threshold bytes are dirty or the oldest has waited delay_ms;
+// writers stall past four times the threshold. The flusher thread copies
+// the dirty blocks out between hold and release, so the caller can keep it
+// from seeing half of a change
+WriteBack *writeback_open(WriteBackRead read, WriteBackWrite write, uint64_t size,
+                          unsigned delay_ms, size_t threshold,
+                          WriteBackHook hold, WriteBackHook release);
+int writeback_close(WriteBack *wb);     // flushes and stops the thread
+
+int writeback_read(WriteBack *wb, uint64_t offset, void *buffer, size_t len);
+int writeback_write(WriteBack *wb, uint64_t offset, const void *buffer, size_t len,
+                    WriteBackOrder order);
+
+// writes everything out before returning
+int writeback_flush(WriteBack *wb);
+void writeback_stats(WriteBack *wb, WriteBackStats *st);
+
+#endif
@@ -0,0 +1,122 @@
+// bufpool.c
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "bufpool.h"
+
+#define HUGE_PAGE   (2 * 1024 * 1024)
+
+/*
+ * One anonymous mapping cut into BUFPOOL_BUFFER sized pieces, with a
+ * stack of the free ones. The mapping is page aligned, so every piece is
+ * too. Buffers taken from the heap when the pool runs dry go back to the
+ * heap; bufpool_put tells the two apart by address.
+ */
+struct BufPool {
+    uint8_t *base;
+    size_t bytes;           // mapped, rounded up to a huge page when reserved
+    uint32_t count;
+    uint32_t nfree;
+    uint8_t **free;
+    pthread_mutex_t lock;
+    BufPoolStats stats;
+};
+
+BufPool *bufpool_open(uint32_t count, bool huge)
+{
+    BufPool *bp = calloc(1, sizeof(BufPool));
+    if(bp == NULL)
+        return NULL;
+    bp->free = malloc((count ? count : 1) * sizeof(uint8_t *));
+    if(bp->free == NULL) {
+        free(bp);
+        return NULL;
+    }
+
+    size_t bytes = (size_t)count * BUFPOOL_BUFFER;
+    void *base = MAP_FAILED;
+    if(huge) {
+        size_t rounded = (bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+        base = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(base != MAP_FAILED) {
+            bytes = rounded;
+            bp->stats.huge = 2;
+        }
+    }
+    if(base == MAP_FAILED) {
+        base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        // no reserved pages: let the kernel back it with transparent ones
+        if(huge && base != MAP_FAILED && madvise(base, bytes, MADV_HUGEPAGE) == 0)
+            bp->stats.huge = 1;
+    }
+    if(base == MAP_FAILED) {
+        free(bp->free);
+        free(bp);
+        return NULL;
+    }
+
+    bp->base = base;
+    bp->bytes = bytes;
+    bp->count = count;
+    pthread_mutex_init(&bp->lock, NULL);
+    // handed out from the bottom, so a lightly used pool touches few pages
+    for(uint32_t i = 0; i < count; i++)
+        bp->free[i] = bp->base + (size_t)(count - 1 - i) * BUFPOOL_BUFFER;
+    bp->nfree = count;
+    bp->stats.buffers = count;
+    return bp;
+}
+
+void bufpool_close(BufPool *bp)
+{
+    if(bp == NULL)
+        return;
+    munmap(bp->base, bp->bytes);
+    pthread_mutex_destroy(&bp->lock);
+    free(bp->free);
+    free(bp);
+}
+
+void *bufpool_get(BufPool *bp)
+{
+    if(bp != NULL) {
+        pthread_mutex_lock(&bp->lock);
+        if(bp->nfree > 0) {
+            void *buf = bp->free[--bp->nfree];
+            bp->stats.gets++;
+            pthread_mutex_unlock(&bp->lock);
+            return buf;
+        }
+        bp->stats.misses++;
+        pthread_mutex_unlock(&bp->lock);
+    }
+
+    void *buf;
+    if(posix_memalign(&buf, BUFPOOL_ALIGN, BUFPOOL_BUFFER) != 0)
+        return NULL;
+    return buf;
+}
+
+void bufpool_put(BufPool *bp, void *buf)
+{
+    uint8_t *p = buf;
+
+    if(p == NULL)
+        return;
+    if(bp == NULL || p < bp->base || p >= bp->base + (size_t)bp->count * BUFPOOL_BUFFER) {
+        free(buf);
+        return;
+    }
+    pthread_mutex_lock(&bp->lock);
+    bp->free[bp->nfree++] = p;
+    pthread_mutex_unlock(&bp->lock);
+}
+
+void bufpool_stats(BufPool *bp, BufPoolStats *st)
+{
+    pthread_mutex_lock(&bp->lock);
+    *st = bp->stats;
+    st->in_use = bp->count - bp->nfree;
+    pthread_mutex_unlock(&bp->lock);
+}
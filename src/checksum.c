@@ -0,0 +1,294 @@
+// checksum.c
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "checksum.h"
+
+#define CRC32C_POLY     0x82F63B78u     // Castagnoli, reflected
+#define CRC_LONG        8192            // bytes per stream in the 3-way loop
+#define CRC_SHORT       256
+
+#define XXH_P1  11400714785074694791ULL
+#define XXH_P2  14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+static uint32_t crc_table[8][256];      // slicing-by-8
+static uint32_t crc_long[4][256];       // appends CRC_LONG zero bytes
+static uint32_t crc_short[4][256];      // appends CRC_SHORT zero bytes
+static bool crc_hw;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// the crc functions below work on the raw register, without the inversions
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while(len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while(len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while(len-- > 0)
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t crc_shift(uint32_t table[4][256], uint32_t crc)
+{
+    return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^
+           table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+}
+
+// the crc is linear, so appending n zeroes can be tabulated per byte lane
+static void build_shift_table(uint32_t table[4][256], size_t n)
+{
+    static const uint8_t zeros[CRC_LONG];
+    for(int k = 0; k < 4; k++)
+        for(uint32_t b = 0; b < 256; b++)
+            table[k][b] = crc32c_sw(b << (8 * k), zeros, n);
+}
+
+#if defined(__x86_64__)
+/*
+ * The crc32 instruction has a latency of three cycles but a throughput of
+ * one, so three independent streams over adjacent blocks keep it busy.
+ * The streams are joined by shifting the earlier crc over the later
+ * block's length and xoring.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while(len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        len--;
+    }
+
+    uint64_t c0 = crc;
+    size_t blocks[2] = { CRC_LONG, CRC_SHORT };
+    for(int b = 0; b < 2; b++)
+    {
+        size_t n = blocks[b];
+        while(len >= 3 * n) {
+            uint64_t c1 = 0, c2 = 0;
+            const uint8_t *end = p + n;
+            do {
+                uint64_t v0, v1, v2;
+                memcpy(&v0, p, 8);
+                memcpy(&v1, p + n, 8);
+                memcpy(&v2, p + 2 * n, 8);
+                c0 = __builtin_ia32_crc32di(c0, v0);
+                c1 = __builtin_ia32_crc32di(c1, v1);
+                c2 = __builtin_ia32_crc32di(c2, v2);
+                p += 8;
+            } while(p < end);
+            uint32_t (*table)[256] = (b == 0) ? crc_long : crc_short;
+            c0 = crc_shift(table, (uint32_t)c0) ^ c1;
+            c0 = crc_shift(table, (uint32_t)c0) ^ c2;
+            p += 2 * n;
+            len -= 3 * n;
+        }
+    }
+
+    while(len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = __builtin_ia32_crc32di(c0, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c0;
+    while(len-- > 0)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+static void crc_init(void)
+{
+    for(uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for(int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][n] = c;
+    }
+    for(uint32_t n = 0; n < 256; n++) {
+        uint32_t c = crc_table[0][n];
+        for(int k = 1; k < 8; k++) {
+            c = crc_table[0][c & 0xFF] ^ (c >> 8);
+            crc_table[k][n] = c;
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc_hw = __builtin_cpu_supports("sse4.2");
+    if(crc_hw) {
+        build_shift_table(crc_long, CRC_LONG);
+        build_shift_table(crc_short, CRC_SHORT);
+    }
+#endif
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t acc)
+{
+    h ^= xxh_round(0, acc);
+    return h * XXH_P1 + XXH_P4;
+}
+
+// consumes whole 32-byte stripes, returns how many bytes it used
+static size_t xxh_stripes(uint64_t *acc, const uint8_t *p, size_t len)
+{
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    size_t used = 0;
+    while(len - used >= 32) {
+        a0 = xxh_round(a0, read64(p + used));
+        a1 = xxh_round(a1, read64(p + used + 8));
+        a2 = xxh_round(a2, read64(p + used + 16));
+        a3 = xxh_round(a3, read64(p + used + 24));
+        used += 32;
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    return used;
+}
+
+int sum_parse_algo(const char *name, SumAlgo *algo)
+{
+    if(strcmp(name, "crc32c") == 0)
+        *algo = SUM_CRC32C;
+    else if(strcmp(name, "xxh64") == 0)
+        *algo = SUM_XXH64;
+    else
+        return -1;
+    return 0;
+}
+
+const char *sum_algo_name(SumAlgo algo)
+{
+    return (algo == SUM_CRC32C) ? "crc32c" : "xxh64";
+}
+
+void sum_init(Hasher *h, SumAlgo algo)
+{
+    pthread_once(&crc_once, crc_init);
+    memset(h, 0, sizeof(*h));
+    h->algo = algo;
+    h->crc = 0xFFFFFFFFu;
+    h->acc[0] = XXH_P1 + XXH_P2;
+    h->acc[1] = XXH_P2;
+    h->acc[2] = 0;
+    h->acc[3] = -XXH_P1;
+}
+
+void sum_update(Hasher *h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    if(h->algo == SUM_CRC32C) {
+#if defined(__x86_64__)
+        if(crc_hw) {
+            h->crc = crc32c_hw(h->crc, p, len);
+            return;
+        }
+#endif
+        h->crc = crc32c_sw(h->crc, p, len);
+        return;
+    }
+
+    h->total += len;
+    if(h->tail_len > 0) {
+        size_t take = 32 - h->tail_len;
+        if(take > len)
+            take = len;
+        memcpy(h->tail + h->tail_len, p, take);
+        h->tail_len += take;
+        p += take;
+        len -= take;
+        if(h->tail_len < 32)
+            return;
+        xxh_stripes(h->acc, h->tail, 32);
+        h->tail_len = 0;
+    }
+    size_t used = xxh_stripes(h->acc, p, len);
+    memcpy(h->tail, p + used, len - used);
+    h->tail_len = len - used;
+}
+
+void sum_final(const Hasher *h, char *hex)
+{
+    if(h->algo == SUM_CRC32C) {
+        snprintf(hex, SUM_HEX_MAX, "%08x", ~h->crc);
+        return;
+    }
+
+    uint64_t v;
+    if(h->total >= 32) {
+        v = rotl64(h->acc[0], 1) + rotl64(h->acc[1], 7) +
+            rotl64(h->acc[2], 12) + rotl64(h->acc[3], 18);
+        for(int k = 0; k < 4; k++)
+            v = xxh_merge(v, h->acc[k]);
+    } else {
+        v = h->acc[2] + XXH_P5;
+    }
+    v += h->total;
+
+    const uint8_t *p = h->tail;
+    uint32_t left = h->tail_len;
+    for(; left >= 8; p += 8, left -= 8) {
+        v ^= xxh_round(0, read64(p));
+        v = rotl64(v, 27) * XXH_P1 + XXH_P4;
+    }
+    if(left >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        v ^= (uint64_t)w * XXH_P1;
+        v = rotl64(v, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        left -= 4;
+    }
+    for(; left > 0; p++, left--) {
+        v ^= *p * XXH_P5;
+        v = rotl64(v, 11) * XXH_P1;
+    }
+
+    v ^= v >> 33;
+    v *= XXH_P2;
+    v ^= v >> 29;
+    v *= XXH_P3;
+    v ^= v >> 32;
+    snprintf(hex, SUM_HEX_MAX, "%016llx", (unsigned long long)v);
+}
@@ -0,0 +1,360 @@
+// cimage.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cimage.h"
+#include "lz.h"
+#include "io.h"
+
+#define CIMAGE_MAGIC        "FAT32CZ"
+#define CIMAGE_VERSION      1
+#define CIMAGE_BLOCK        (64 * 1024)
+#define CIMAGE_CACHE_SLOTS  64          // decompressed blocks kept, 4 MiB
+
+/*
+ * File layout: [header][compressed blocks][index]
+ * The index holds blocks + 1 file offsets; block i is the bytes between
+ * index[i] and index[i + 1]. An empty block is all zeroes, and a block as
+ * long as its raw size is stored uncompressed.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t raw_size;
+    uint64_t index_offset;
+} CImageHeader;
+
+typedef struct {
+    uint64_t block;
+    uint8_t *data;          // NULL = empty slot
+    uint64_t used;
+} CacheSlot;
+
+struct CImage {
+    int fd;
+    uint32_t block_size;
+    uint64_t raw_size;
+    uint64_t blocks;
+    uint64_t *index;
+    pthread_mutex_t lock;   // guards the cache, reads run in parallel
+    CacheSlot cache[CIMAGE_CACHE_SLOTS];
+    uint64_t tick;
+};
+
+static size_t block_raw_size(const CImage *ci, uint64_t block)
+{
+    uint64_t start = block * ci->block_size;
+    uint64_t left = ci->raw_size - start;
+    return (left < ci->block_size) ? (size_t)left : ci->block_size;
+}
+
+static bool all_zero(const uint8_t *p, size_t n)
+{
+    return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+bool cimage_probe(int fd)
+{
+    char magic[8];
+    return io_pread_full(fd, 0, magic, sizeof(magic)) == 0 &&
+           memcmp(magic, CIMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+CImage *cimage_open(int fd)
+{
+    CImageHeader hdr;
+    struct stat st;
+
+    if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(hdr) ||
+       io_pread_full(fd, 0, &hdr, sizeof(hdr)) != 0 ||
+       memcmp(hdr.magic, CIMAGE_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != CIMAGE_VERSION || hdr.block_size == 0 || hdr.block_size > CIMAGE_BLOCK)
+        return NULL;
+
+    // the index has to fit in the file behind the header; checked before
+    // any sum that a crafted header could make wrap
+    uint64_t fileSize = (uint64_t)st.st_size;
+    uint64_t blocks = hdr.raw_size / hdr.block_size + (hdr.raw_size % hdr.block_size != 0);
+    if(blocks >= (fileSize - sizeof(hdr)) / sizeof(uint64_t))
+        return NULL;
+    size_t indexBytes = (blocks + 1) * sizeof(uint64_t);
+    if(hdr.index_offset > fileSize - indexBytes)
+        return NULL;
+
+    CImage *ci = calloc(1, sizeof(CImage));
+    if(ci == NULL)
+        return NULL;
+    ci->fd = fd;
+    ci->block_size = hdr.block_size;
+    ci->raw_size = hdr.raw_size;
+    ci->blocks = blocks;
+
+    ci->index = malloc(indexBytes);
+    if(ci->index == NULL || io_pread_full(fd, hdr.index_offset, ci->index, indexBytes) != 0) {
+        free(ci->index);
+        free(ci);
+        return NULL;
+    }
+
+    // reject indexes that point outside the block area or overlap
+    bool ok = (ci->index[0] >= sizeof(hdr) && ci->index[ci->blocks] <= hdr.index_offset);
+    for(uint64_t b = 0; ok && b < ci->blocks; b++)
+        ok = (ci->index[b] <= ci->index[b + 1] &&
+              ci->index[b + 1] - ci->index[b] <= block_raw_size(ci, b));
+    if(!ok) {
+        free(ci->index);
+        free(ci);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ci->lock, NULL);
+    return ci;
+}
+
+void cimage_close(CImage *ci)
+{
+    if(ci == NULL)
+        return;
+    for(int i = 0; i < CIMAGE_CACHE_SLOTS; i++)
+        free(ci->cache[i].data);
+    pthread_mutex_destroy(&ci->lock);
+    free(ci->index);
+    free(ci);
+}
+
+uint64_t cimage_size(const CImage *ci)
+{
+    return ci->raw_size;
+}
+
+static bool cache_copy(CImage *ci, uint64_t block, size_t off, uint8_t *dst, size_t len)
+{
+    bool hit = false;
+
+    pthread_mutex_lock(&ci->lock);
+    for(int i = 0; i < CIMAGE_CACHE_SLOTS; i++) {
+        CacheSlot *s = &ci->cache[i];
+        if(s->data != NULL && s->block == block) {
+            memcpy(dst, s->data + off, len);
+            s->used = ++ci->tick;
+            hit = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ci->lock);
+    return hit;
+}
+
+// takes ownership of data, replacing the least recently used slot
+static void cache_insert(CImage *ci, uint64_t block, uint8_t *data)
+{
+    pthread_mutex_lock(&ci->lock);
+    CacheSlot *victim = &ci->cache[0];
+    for(int i = 0; i < CIMAGE_CACHE_SLOTS; i++) {
+        CacheSlot *s = &ci->cache[i];
+        if(s->data != NULL && s->block == block) {
+            // another reader decompressed it first
+            victim = NULL;
+            break;
+        }
+        if(s->data == NULL || s->used < victim->used)
+            victim = s;
+        if(s->data == NULL)
+            break;
+    }
+    if(victim != NULL) {
+        free(victim->data);
+        victim->block = block;
+        victim->data = data;
+        victim->used = ++ci->tick;
+        data = NULL;
+    }
+    pthread_mutex_unlock(&ci->lock);
+    free(data);
+}
+
+// copies len bytes at off inside block into dst
+static int read_block(CImage *ci, uint64_t block, size_t off, uint8_t *dst, size_t len)
+{
+    uint64_t start = ci->index[block];
+    size_t stored = (size_t)(ci->index[block + 1] - start);
+    size_t raw = block_raw_size(ci, block);
+
+    if(stored == 0) {
+        memset(dst, 0, len);
+        return 0;
+    }
+    if(stored == raw)
+        return io_pread_full(ci->fd, start + off, dst, len);
+    if(cache_copy(ci, block, off, dst, len))
+        return 0;
+
+    // decompress outside the lock so misses on different blocks overlap
+    uint8_t *in = malloc(stored);
+    uint8_t *out = malloc(ci->block_size);
+    int ret = -1;
+    if(in != NULL && out != NULL && io_pread_full(ci->fd, start, in, stored) == 0 &&
+       lz_decompress(in, stored, out, raw) == 0) {
+        memcpy(dst, out + off, len);
+        cache_insert(ci, block, out);
+        out = NULL;
+        ret = 0;
+    }
+    free(in);
+    free(out);
+    return ret;
+}
+
+int cimage_read(CImage *ci, uint64_t offset, void *buffer, size_t len)
+{
+    uint8_t *p = buffer;
+
+    if(offset + len > ci->raw_size)
+        return -1;
+
+    while(len > 0)
+    {
+        uint64_t block = offset / ci->block_size;
+        size_t off = (size_t)(offset % ci->block_size);
+        size_t n = ci->block_size - off;
+        if(n > len)
+            n = len;
+        if(read_block(ci, block, off, p, n) != 0)
+            return -1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int cimage_pack(const char *raw_path, const char *out_path)
+{
+    struct stat st;
+    int in = open(raw_path, O_RDONLY);
+    if(in < 0 || fstat(in, &st) != 0) {
+        fprintf(stderr, "Error: Cannot open %s\n", raw_path);
+        if(in >= 0)
+            close(in);
+        return -1;
+    }
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0) {
+        fprintf(stderr, "Error: Cannot create %s\n", out_path);
+        close(in);
+        return -1;
+    }
+
+    CImageHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CIMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CIMAGE_VERSION;
+    hdr.block_size = CIMAGE_BLOCK;
+    hdr.raw_size = (uint64_t)st.st_size;
+
+    uint64_t blocks = (hdr.raw_size + CIMAGE_BLOCK - 1) / CIMAGE_BLOCK;
+    uint64_t *index = malloc((blocks + 1) * sizeof(uint64_t));
+    uint8_t *raw = malloc(CIMAGE_BLOCK);
+    uint8_t *packed = malloc(CIMAGE_BLOCK);
+    uint64_t pos = sizeof(hdr);
+    int ret = (index != NULL && raw != NULL && packed != NULL) ? 0 : -1;
+
+    for(uint64_t b = 0; ret == 0 && b < blocks; b++)
+    {
+        uint64_t start = b * CIMAGE_BLOCK;
+        size_t n = (hdr.raw_size - start < CIMAGE_BLOCK) ? (size_t)(hdr.raw_size - start) : CIMAGE_BLOCK;
+
+        index[b] = pos;
+        if(io_pread_full(in, start, raw, n) != 0) {
+            ret = -1;
+            break;
+        }
+        if(all_zero(raw, n))
+            continue;
+
+        // anything that doesn't shrink is stored as is
+        size_t len = lz_compress(raw, n, packed, n - 1);
+        const uint8_t *src = (len != 0) ? packed : raw;
+        if(len == 0)
+            len = n;
+        if(io_pwrite_full(out, pos, src, len) != 0)
+            ret = -1;
+        pos += len;
+    }
+
+    if(ret == 0) {
+        index[blocks] = pos;
+        hdr.index_offset = pos;
+        if(io_pwrite_full(out, pos, index, (blocks + 1) * sizeof(uint64_t)) != 0 ||
+           io_pwrite_full(out, 0, &hdr, sizeof(hdr)) != 0)
+            ret = -1;
+    }
+
+    if(ret == 0) {
+        uint64_t total = pos + (blocks + 1) * sizeof(uint64_t);
+        printf("Packed %s: %llu -> %llu bytes (%.1f%%)\n", raw_path,
+               (unsigned long long)hdr.raw_size, (unsigned long long)total,
+               hdr.raw_size ? 100.0 * total / hdr.raw_size : 0.0);
+    } else {
+        fprintf(stderr, "Error: Failed to pack %s\n", raw_path);
+    }
+
+    free(index);
+    free(raw);
+    free(packed);
+    close(in);
+    if(close(out) != 0)
+        ret = -1;
+    return ret;
+}
+
+// zero blocks are skipped, so the raw image comes out sparse
+int cimage_unpack(const char *packed_path, const char *out_path)
+{
+    int in = open(packed_path, O_RDONLY);
+    CImage *ci = (in >= 0) ? cimage_open(in) : NULL;
+    if(ci == NULL) {
+        fprintf(stderr, "Error: %s is not a compressed image\n", packed_path);
+        if(in >= 0)
+            close(in);
+        return -1;
+    }
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0) {
+        fprintf(stderr, "Error: Cannot create %s\n", out_path);
+        cimage_close(ci);
+        close(in);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(ci->block_size);
+    int ret = (buf != NULL) ? 0 : -1;
+    for(uint64_t b = 0; ret == 0 && b < ci->blocks; b++)
+    {
+        if(ci->index[b + 1] == ci->index[b])
+            continue;
+        size_t n = block_raw_size(ci, b);
+        uint64_t start = b * ci->block_size;
+        if(read_block(ci, b, 0, buf, n) != 0 || io_pwrite_full(out, start, buf, n) != 0)
+            ret = -1;
+    }
+    if(ret == 0 && ftruncate(out, (off_t)ci->raw_size) != 0)
+        ret = -1;
+
+    if(ret == 0)
+        printf("Unpacked %s: %llu bytes\n", packed_path, (unsigned long long)ci->raw_size);
+    else
+        fprintf(stderr, "Error: Failed to unpack %s\n", packed_path);
+
+    free(buf);
+    cimage_close(ci);
+    close(in);
+    if(close(out) != 0)
+        ret = -1;
+    return ret;
+}
@@ -1,26 +1,114 @@
 // commands.c
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include "commands.h"
 #include "fat32.h"
+#include "walk.h"
+#include "overlay.h"
+#include "import.h"
+#include "checksum.h"
+#include "fatscan.h"
+#include "fatcache.h"
+#include "writeback.h"
+#include "bufpool.h"
+#include "search.h"
+
+static int get_open_file(const char *arg);
+
+// NULL means stdout; the server points this at a per-command buffer
+static __thread FILE *cmd_out;
+
+FILE *cmd_output(void)
+{
+    return cmd_out != NULL ? cmd_out : stdout;
+}
+
+void cmd_set_output(FILE *out)
+{
+    cmd_out = out;
+}
 
-static int find_open_file(const char *name);
-static int find_free_slot(void);
-static void free_cluster_chain(uint32_t cluster);
+void cmd_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(cmd_output(), fmt, ap);
+    va_end(ap);
+}
+
+// seconds on the monotonic clock, for the timings commands print
+static double mono_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// for commands that report sizes or contents: the session's buffered
+// writes go to the image first, so they see what read would
+static int flush_session(void)
+{
+    if(fat32_handles_dirty() && fat32_handles_flush() != 0) {
+        cmd_printf("Error: Could not flush open files\n");
+        return -1;
+    }
+    return 0;
+}
 
 void cmd_info(tokenlist *tokens)
 {
     (void)tokens;
 
-    printf("Position of Root Cluster (in cluster #): %u\n", fs.bs.BPB_RootClus);
-    printf("Bytes Per Sector: %u\n", fs.bs.BPB_BytsPerSec);
-    printf("Sectors Per Cluster: %u\n", fs.bs.BPB_SecPerClus);
-    printf("Total # of Clusters in Data Region: %u\n", fs.total_clusters);
-    printf("# of Entries in One FAT: %u\n", fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec / 4);
-    printf("Size of Image (in bytes): %u\n", fat32_get_image_size());
+    cmd_printf("Position of Root Cluster (in cluster #): %u\n", fs.bs.BPB_RootClus);
+    cmd_printf("Bytes Per Sector: %u\n", fs.bs.BPB_BytsPerSec);
+    cmd_printf("Sectors Per Cluster: %u\n", fs.bs.BPB_SecPerClus);
+    cmd_printf("Total # of Clusters in Data Region: %u\n", fs.total_clusters);
+    cmd_printf("# of Entries in One FAT: %u\n", fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec / 4);
+    cmd_printf("Size of Image (in bytes): %llu\n", (unsigned long long)fat32_get_image_size());
+    if(fs.cimage != NULL)
+        cmd_printf("Format: compressed, read-only without an overlay\n");
+    if(fs.overlay != NULL)
+        cmd_printf("Overlay: %llu modified blocks of %u bytes\n",
+                   (unsigned long long)overlay_dirty_blocks(fs.overlay), overlay_block_size());
+
+    FatCacheStats fc;
+    fatcache_stats(fs.fat_cache, &fc);
+    cmd_printf("FAT cache: %u of %u pages of %u bytes, %llu hits, %llu misses, "
+               "%llu read ahead, %llu evictions, %llu written back\n",
+               fc.pages, fc.capacity, FATCACHE_PAGE, (unsigned long long)fc.hits,
+               (unsigned long long)fc.misses, (unsigned long long)fc.readahead,
+               (unsigned long long)fc.evictions, (unsigned long long)fc.writebacks);
+
+    if(fs.writeback != NULL) {
+        WriteBackStats wb;
+        writeback_stats(fs.writeback, &wb);
+        cmd_printf("Write-behind: %llu KiB dirty, %llu flushes (%llu in the background), "
+                   "%llu KiB in %llu writes, %llu stalls, %d failed\n",
+                   (unsigned long long)(wb.dirty / 1024), (unsigned long long)wb.flushes,
+                   (unsigned long long)wb.background, (unsigned long long)(wb.written / 1024),
+                   (unsigned long long)wb.runs, (unsigned long long)wb.stalls, wb.errors);
+    }
+
+    static const char *const pages[] = { "", ", transparent huge pages", ", huge pages" };
+    BufPoolStats bp;
+    bufpool_stats(fs.pool, &bp);
+    cmd_printf("Buffer pool: %u of %u buffers of %u KiB in use%s, %llu handed out, "
+               "%llu from the heap\n", bp.in_use, bp.buffers, BUFPOOL_BUFFER / 1024,
+               pages[bp.huge], (unsigned long long)bp.gets, (unsigned long long)bp.misses);
+    cmd_printf("Direct I/O: %s\n", fs.direct ? "on, the page cache is bypassed" : "off");
+    cmd_printf("Allocation: %s", fat32_alloc_name(fs.alloc));
+    if(fs.alloc == ALLOC_NEXT)
+        cmd_printf(", resuming at cluster %u", fs.alloc_cursor);
+    else if(fs.alloc == ALLOC_GROUP)
+        cmd_printf(", %u clusters per group", ALLOC_GROUP_SIZE);
+    cmd_printf("\n");
 }
 
 
@@ -33,7 +121,7 @@ void cmd_exit(tokenlist *tokens)
 void cmd_cd(tokenlist *tokens)
 {
     if(tokens->size != 2){
-        printf("Error: cd needs exactly 1 argument\n");
+        cmd_printf("Error: cd needs exactly 1 argument\n");
         return;
     }
 
@@ -41,20 +129,20 @@ void cmd_cd(tokenlist *tokens)
 
     if (strcmp(dirname, "..") == 0) {
         DirEntry entry;
-        if (fat32_find_entry(fs.current_dir, "..", &entry, NULL, NULL) == 0) {
+        if (fat32_find_entry(fs_session->current_dir, "..", &entry, NULL, NULL) == 0) {
             uint32_t parent_cluster = fat32_get_cluster(&entry);
             
             if(parent_cluster == 0)
                 parent_cluster = fs.bs.BPB_RootClus;
             
-            fs.current_dir = parent_cluster;
+            fs_session->current_dir = parent_cluster;
             
-            if (strcmp(fs.current_path, "/") != 0) {
-                char *last_slash = strrchr(fs.current_path, '/');
-                if (last_slash != NULL && last_slash != fs.current_path)
+            if (strcmp(fs_session->current_path, "/") != 0) {
+                char *last_slash = strrchr(fs_session->current_path, '/');
+                if (last_slash != NULL && last_slash != fs_session->current_path)
                     *last_slash = '\0';
                 else
-                    strcpy(fs.current_path, "/");
+                    strcpy(fs_session->current_path, "/");
             }
         }
         return;
@@ -62,87 +150,241 @@ void cmd_cd(tokenlist *tokens)
 
     if (strcmp(dirname, ".") == 0) return;
 
-    DirEntry entry;
-    if (fat32_find_entry(fs.current_dir, dirname, &entry, NULL, NULL) != 0) {
-        printf("Error: %s does not exist\n", dirname);
+    DirRecord rec;
+    if (fat32_lookup(fs_session->current_dir, dirname, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", dirname);
         return;
     }
 
-    if (!(entry.DIR_Attr & ATTR_DIRECTORY)) {
-        printf("Error: %s is not a directory\n", dirname);
+    if (!(rec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+        cmd_printf("Error: %s is not a directory\n", dirname);
         return;
     }
 
-    uint32_t new_cluster = fat32_get_cluster(&entry);
+    if (strlen(fs_session->current_path) + strlen(rec.name) + 2 > MAX_PATH) {
+        cmd_printf("Error: Path too long\n");
+        return;
+    }
+
+    uint32_t new_cluster = fat32_get_cluster(&rec.entry);
     if (new_cluster == 0)
         new_cluster = fs.bs.BPB_RootClus;
-    fs.current_dir = new_cluster;
+    fs_session->current_dir = new_cluster;
 
-    if(strcmp(fs.current_path, "/") != 0)
-        strcat(fs.current_path, "/");
+    if(strcmp(fs_session->current_path, "/") != 0)
+        strcat(fs_session->current_path, "/");
     
-    char name[13];
-    fat32_83_to_name(entry.DIR_Name, name);
-    strcat(fs.current_path, name);
+    strcat(fs_session->current_path, rec.name);
+}
+
+typedef struct {
+    bool lng;               // -l
+    bool blocks;            // -s
+    char sort;              // 'n' name, 'S' size, 't' time, 0 directory order
+} LsOpts;
+
+typedef struct {
+    char *name;
+    DirEntry entry;
+    uint32_t clusters;      // chain length, only counted for -s
+} LsEntry;
+
+static __thread char ls_sort;    // qsort has no context argument
+
+static int ls_compare(const void *a, const void *b)
+{
+    const LsEntry *x = a, *y = b;
+
+    if(ls_sort == 'S' && x->entry.DIR_FileSize != y->entry.DIR_FileSize)
+        return x->entry.DIR_FileSize > y->entry.DIR_FileSize ? -1 : 1;
+    if(ls_sort == 't') {
+        uint32_t tx = ((uint32_t)x->entry.DIR_WrtDate << 16) | x->entry.DIR_WrtTime;
+        uint32_t ty = ((uint32_t)y->entry.DIR_WrtDate << 16) | y->entry.DIR_WrtTime;
+        if(tx != ty)
+            return tx > ty ? -1 : 1;
+    }
+    int c = strcasecmp(x->name, y->name);
+    return (c != 0) ? c : strcmp(x->name, y->name);
+}
+
+static void ls_format(FILE *out, const LsEntry *e, const LsOpts *opts, uint32_t clusterSize)
+{
+    const DirEntry *d = &e->entry;
+
+    if(opts->blocks)
+        fprintf(out, "%8llu ", ((unsigned long long)e->clusters * clusterSize + 1023) / 1024);
+    if(opts->lng) {
+        char attrs[6] = {
+            (d->DIR_Attr & ATTR_DIRECTORY) ? 'd' : (d->DIR_Attr & ATTR_VOLUME_ID) ? 'v' : '-',
+            (d->DIR_Attr & ATTR_READ_ONLY) ? 'r' : '-',
+            (d->DIR_Attr & ATTR_HIDDEN) ? 'h' : '-',
+            (d->DIR_Attr & ATTR_SYSTEM) ? 's' : '-',
+            (d->DIR_Attr & ATTR_ARCHIVE) ? 'a' : '-',
+            '\0'
+        };
+        fprintf(out, "%s %10u ", attrs, d->DIR_FileSize);
+        if(d->DIR_WrtDate != 0)
+            fprintf(out, "%04u-%02u-%02u %02u:%02u ", 1980 + (d->DIR_WrtDate >> 9),
+                    (d->DIR_WrtDate >> 5) & 0xF, d->DIR_WrtDate & 0x1F,
+                    d->DIR_WrtTime >> 11, (d->DIR_WrtTime >> 5) & 0x3F);
+        else
+            fprintf(out, "%-16s ", "-");
+        fprintf(out, "%8u ", fat32_get_cluster(d));
+    }
+    fprintf(out, "%s\n", e->name);
 }
 
+/*
+ * Reads the whole directory in cluster-sized batches, then sorts and
+ * formats it into one buffer so the listing goes out in a single write.
+ * Plain ls keeps directory order.
+ */
 void cmd_ls(tokenlist *tokens)
 {
-    (void)tokens;
-    uint32_t cluster = fs.current_dir;
-    uint32_t clusterSize = fat32_get_cluster_size();
-    uint32_t entries_per_cluster = clusterSize / sizeof(DirEntry);
+    LsOpts opts = { false, false, 0 };
+    const char *path = NULL;
 
-    while(cluster < FAT_EOC && cluster != 0)
+    for(size_t i = 1; i < tokens->size; i++)
     {
-        for(uint32_t i = 0; i < entries_per_cluster; i++) {
-            DirEntry entry;
-            uint32_t off = i * sizeof(DirEntry);
-
-            if(fat32_read_dir_entry(cluster, off, &entry) != 0)
+        const char *arg = tokens->items[i];
+        if(arg[0] != '-' || arg[1] == '\0') {
+            if(path != NULL) {
+                cmd_printf("Error: ls takes one directory\n");
                 return;
+            }
+            path = arg;
+            continue;
+        }
+        for(const char *f = arg + 1; *f != '\0'; f++) {
+            if(*f == 'l')
+                opts.lng = true;
+            else if(*f == 's')
+                opts.blocks = true;
+            else if(*f == 'S' || *f == 't')
+                opts.sort = *f;
+            else {
+                cmd_printf("Error: Unknown ls option -%c\n", *f);
+                return;
+            }
+        }
+    }
+    if((opts.lng || opts.blocks) && opts.sort == 0)
+        opts.sort = 'n';
+    if((opts.lng || opts.blocks || opts.sort != 0) && flush_session() != 0)
+        return;
 
-            if (entry.DIR_Name[0] == 0x00) return;
-            if (entry.DIR_Name[0] == 0xE5) continue;
-            if ((entry.DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) continue;
+    uint32_t dir = fs_session->current_dir;
+    if(path != NULL) {
+        DirRecord rec;
+        if(fat32_resolve_path(path, &rec) != 0) {
+            cmd_printf("Error: %s does not exist\n", path);
+            return;
+        }
+        if(!(rec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+            cmd_printf("Error: %s is not a directory\n", path);
+            return;
+        }
+        dir = fat32_get_cluster(&rec.entry);
+        if(dir == 0)
+            dir = fs.bs.BPB_RootClus;
+    }
+
+    DirReader reader;
+    DirRecord *batch = malloc(READDIR_BATCH * sizeof(DirRecord));
+    LsEntry *list = NULL;
+    size_t count = 0, cap = 0;
+    int n = 0;
+    bool ok = (batch != NULL && fat32_readdir_open(&reader, dir) == 0);
 
-            char name[13];
-            fat32_83_to_name(entry.DIR_Name, name);
-            printf("%s\n", name);
+    while(ok && (n = fat32_readdir(&reader, batch, READDIR_BATCH)) > 0)
+    {
+        if(count + n > cap) {
+            size_t grown = cap ? cap * 2 : 256;
+            while(grown < count + n)
+                grown *= 2;
+            LsEntry *l = realloc(list, grown * sizeof(LsEntry));
+            if(l == NULL) {
+                ok = false;
+                break;
+            }
+            list = l;
+            cap = grown;
         }
-        cluster = fat32_get_fat_entry(cluster);
+        for(int i = 0; ok && i < n; i++) {
+            LsEntry *e = &list[count];
+            e->entry = batch[i].entry;
+            e->clusters = opts.blocks ? walk_chain_length(fat32_get_cluster(&e->entry)) : 0;
+            e->name = strdup(batch[i].name);
+            if(e->name == NULL)
+                ok = false;
+            else
+                count++;
+        }
+    }
+    if(batch != NULL && reader.buf != NULL)
+        fat32_readdir_close(&reader);
+    free(batch);
+    if(n < 0)
+        ok = false;
+
+    if(ok && opts.sort != 0) {
+        ls_sort = opts.sort;
+        qsort(list, count, sizeof(LsEntry), ls_compare);
+    }
+
+    char *text = NULL;
+    size_t textLen = 0;
+    FILE *out = ok ? open_memstream(&text, &textLen) : NULL;
+    if(out != NULL) {
+        uint32_t clusterSize = fat32_get_cluster_size();
+        if(opts.blocks) {
+            uint64_t total = 0;
+            for(size_t i = 0; i < count; i++)
+                total += (uint64_t)list[i].clusters * clusterSize;
+            fprintf(out, "total %llu\n", (unsigned long long)(total + 1023) / 1024);
+        }
+        for(size_t i = 0; i < count; i++)
+            ls_format(out, &list[i], &opts, clusterSize);
+        fclose(out);
+        fwrite(text, 1, textLen, cmd_output());
+    } else {
+        cmd_printf("Error: Could not read the directory\n");
     }
+
+    free(text);
+    for(size_t i = 0; i < count; i++)
+        free(list[i].name);
+    free(list);
 }
 
 void cmd_mkdir(tokenlist *tokens)
 {
     if (tokens->size != 2) {
-        printf("Error: mkdir requires 1 argument\n");
+        cmd_printf("Error: mkdir requires 1 argument\n");
         return;
     }
 
     const char *dirname = tokens->items[1];
 
-    if(fat32_find_entry(fs.current_dir, dirname, NULL, NULL, NULL) == 0) {
-        printf("Error: %s already exists\n", dirname);
+    if(fat32_find_entry(fs_session->current_dir, dirname, NULL, NULL, NULL) == 0) {
+        cmd_printf("Error: %s already exists\n", dirname);
         return;
     }
 
-    uint32_t newCluster = fat32_allocate_cluster(0);
+    uint32_t newCluster = fat32_allocate_cluster(0, fat32_dir_goal(fs_session->current_dir));
     if(newCluster == 0){
-        printf("Error: Couldn't allocate cluster for directory\n");
+        cmd_printf("Error: Couldn't allocate cluster for directory\n");
         return;
     }
 
     DirEntry new_entry;
     memset(&new_entry, 0, sizeof(DirEntry));
-    fat32_name_to_83(dirname, (char *)new_entry.DIR_Name);
     new_entry.DIR_Attr = ATTR_DIRECTORY;
     fat32_set_cluster(&new_entry, newCluster);
     new_entry.DIR_FileSize = 0;
 
     // timestamps
-    time_t t = time(NULL);
+    time_t t = fat32_now();
     struct tm *tm = localtime(&t);
     uint16_t date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
     uint16_t timeval = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
@@ -152,8 +394,8 @@ void cmd_mkdir(tokenlist *tokens)
     new_entry.DIR_WrtTime = timeval;
     new_entry.DIR_LstAccDate = date;
 
-    if(fat32_add_dir_entry(fs.current_dir, &new_entry) != 0) {
-        printf("Error: Could not add directory entry\n");
+    if(fat32_add_named_entry(fs_session->current_dir, dirname, &new_entry, NULL, NULL) != 0) {
+        cmd_printf("Error: Could not add directory entry\n");
         fat32_set_fat_entry(newCluster, FAT_FREE);
         return;
     }
@@ -181,10 +423,10 @@ void cmd_mkdir(tokenlist *tokens)
     dotdot.DIR_Name[1] = '.';
     dotdot.DIR_Attr = ATTR_DIRECTORY;
     
-    if(fs.current_dir == fs.bs.BPB_RootClus)
+    if(fs_session->current_dir == fs.bs.BPB_RootClus)
         fat32_set_cluster(&dotdot, 0);
     else
-        fat32_set_cluster(&dotdot, fs.current_dir);
+        fat32_set_cluster(&dotdot, fs_session->current_dir);
     dotdot.DIR_CrtDate = date;
     dotdot.DIR_CrtTime = timeval;
     dotdot.DIR_WrtDate = date;
@@ -196,25 +438,18 @@ void cmd_mkdir(tokenlist *tokens)
 
 void cmd_creat(tokenlist *tokens)
 {
-    if (tokens->size != 2) {
-        printf("Error: create requires exactly one argument\n");
-        return;
-    }
-    const char *filename = tokens->items[1];
-
-    if (fat32_find_entry(fs.current_dir, filename, NULL, NULL, NULL) == 0) {
-        printf("Error: %s already exists\n", filename);
+    if (tokens->size < 2) {
+        cmd_printf("Error: creat requires at least one argument\n");
         return;
     }
 
     DirEntry newEntry;
     memset(&newEntry, 0, sizeof(DirEntry));
-    fat32_name_to_83(filename, (char*)newEntry.DIR_Name);
     newEntry.DIR_Attr = ATTR_ARCHIVE;
     fat32_set_cluster(&newEntry, 0);
     newEntry.DIR_FileSize = 0;
 
-    time_t t = time(NULL);
+    time_t t = fat32_now();
     struct tm *tm = localtime(&t);
     uint16_t date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
     uint16_t timeval = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
@@ -224,47 +459,77 @@ void cmd_creat(tokenlist *tokens)
     newEntry.DIR_WrtTime = timeval;
     newEntry.DIR_LstAccDate = date;
 
-    if (fat32_add_dir_entry(fs.current_dir, &newEntry) != 0) {
-        printf("Error: Couldnt add file entry\n");
-        return;
+    // the first add indexes the directory, after which each name costs O(1)
+    for (size_t i = 1; i < tokens->size; i++)
+    {
+        const char *filename = tokens->items[i];
+
+        if (fat32_find_entry(fs_session->current_dir, filename, NULL, NULL, NULL) == 0) {
+            cmd_printf("Error: %s already exists\n", filename);
+            continue;
+        }
+
+        DirEntry entry = newEntry;
+        if (fat32_add_named_entry(fs_session->current_dir, filename, &entry, NULL, NULL) != 0) {
+            cmd_printf("Error: Couldnt add file entry for %s\n", filename);
+            return;
+        }
     }
 }
 
-static int find_open_file(const char *name)
+/*
+ * Resolves a command's file argument to a descriptor. The argument is
+ * either "fd:N" or a name in the current directory, which is matched to
+ * its descriptor through the location of its 8.3 entry, so long names
+ * and aliases of the same file resolve alike. Prints the error and
+ * returns -1 if the file isn't open.
+ */
+static int find_open_file(const char *arg)
 {
-    char name83[11];
-    fat32_name_to_83(name, name83);
-
-    for(int idx = 0; idx < MAX_OPEN_FILES; idx++)
+    if(strncmp(arg, "fd:", 3) == 0)
     {
-        if(fs.open_files[idx].in_use)
-        {
-            char entry_name83[11];
-            fat32_name_to_83(fs.open_files[idx].name, entry_name83);
-            
-            if(memcmp(entry_name83, name83, 11) == 0 &&
-               strcmp(fs.open_files[idx].path, fs.current_path) == 0)
-            {
-                return idx;
-            }
+        char *end;
+        long fd = strtol(arg + 3, &end, 10);
+        if(end == arg + 3 || *end != '\0' || fd > INT32_MAX ||
+           fat32_handle_get((int)fd) == NULL) {
+            cmd_printf("Error: %s is not an open descriptor\n", arg);
+            return -1;
         }
+        return (int)fd;
     }
-    return -1;
+
+    uint32_t entCluster, entOffset;
+    if(fat32_find_entry(fs_session->current_dir, arg, NULL, &entCluster, &entOffset) != 0) {
+        cmd_printf("Error: %s does not exist\n", arg);
+        return -1;
+    }
+
+    int fd = fat32_handle_find(entCluster, entOffset);
+    if(fd < 0)
+        cmd_printf("Error: %s is not open\n", arg);
+    return fd;
 }
 
-static int find_free_slot(void)
+static int get_open_file(const char *arg)
 {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (!fs.open_files[i].in_use)
-            return i;
+    int fd = find_open_file(arg);
+    if(fd < 0)
+        return -1;
+
+    // another session may have grown the file since it was opened here
+    OpenFile *of = fat32_handle_get(fd);
+    DirEntry entry;
+    if(fat32_read_dir_entry(of->dir_cluster, of->dir_entry_offset, &entry) == 0) {
+        of->first_cluster = fat32_get_cluster(&entry);
+        of->size = entry.DIR_FileSize;
     }
-    return -1;
+    return fd;
 }
 
 void cmd_open(tokenlist *tokens)
 {
     if(tokens->size != 3) {
-        printf("Error: open requires both the filenames and flags arguments\n");
+        cmd_printf("Error: open requires both the filenames and flags arguments\n");
         return;
     }
 
@@ -279,68 +544,59 @@ void cmd_open(tokenlist *tokens)
     } else if(strcmp(flags, "-rw") == 0 || strcmp(flags, "-wr") == 0) {
         mode = MODE_RW;
     } else {
-        printf("Error: Invalid mode '%s'\n", flags);
+        cmd_printf("Error: Invalid mode '%s'\n", flags);
         return;
     }
 
-    DirEntry entry;
-    uint32_t entry_cluster, entry_offset;
-    if(fat32_find_entry(fs.current_dir, filename, &entry, &entry_cluster, &entry_offset) != 0){
-        printf("Error: %s does not exist\n", filename);
+    DirRecord rec;
+    if(fat32_lookup(fs_session->current_dir, filename, &rec) != 0){
+        cmd_printf("Error: %s does not exist\n", filename);
         return;
     }
 
-    if(entry.DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: %s is a directory\n", filename);
+    if(rec.entry.DIR_Attr & ATTR_DIRECTORY) {
+        cmd_printf("Error: %s is a directory\n", filename);
         return;
     }
 
-    if(find_open_file(filename) >= 0){
-        printf("Error: %s is already open\n", filename);
+    if(fat32_handle_find(rec.cluster, rec.offset) >= 0){
+        cmd_printf("Error: %s is already open\n", filename);
         return;
     }
 
-    int slot = find_free_slot();
-    if(slot < 0) {
-        printf("Error: Max number of files already open\n");
+    OpenFile of;
+    memset(&of, 0, sizeof(OpenFile));
+    strcpy(of.name, rec.name);
+    strncpy(of.path, fs_session->current_path, MAX_PATH - 1);
+    of.path[MAX_PATH - 1] = '\0';
+    of.first_cluster = fat32_get_cluster(&rec.entry);
+    of.size = rec.entry.DIR_FileSize;
+    of.offset = 0;
+    of.mode = mode;
+    of.dir_cluster = rec.cluster;
+    of.dir_entry_offset = rec.offset;
+
+    int fd = fat32_handle_open(&of);
+    if(fd < 0) {
+        cmd_printf("Error: Could not allocate a file descriptor\n");
         return;
     }
-
-    OpenFile *of = &fs.open_files[slot];
-    fat32_83_to_name(entry.DIR_Name, of->name);
-    strncpy(of->path, fs.current_path, MAX_PATH - 1);
-    of->path[MAX_PATH - 1] = '\0';
-    of->first_cluster = fat32_get_cluster(&entry);
-    of->size = entry.DIR_FileSize;
-    of->offset = 0;
-    of->mode = mode;
-    of->in_use = true;
-    of->dir_cluster = entry_cluster;
-    of->dir_entry_offset = entry_offset;
+    cmd_printf("%s opened as fd:%d\n", rec.name, fd);
 }
 
 void cmd_close(tokenlist *tokens)
 {
     if (tokens->size != 2) {
-        printf("Error: close requires FILENAME argument\n");
-        return;
-    }
-
-    const char *filename = tokens->items[1];
-
-    if(fat32_find_entry(fs.current_dir, filename, NULL, NULL, NULL) != 0)
-    {
-        printf("Error: %s does not exist\n", filename);
+        cmd_printf("Error: close requires FILENAME argument\n");
         return;
     }
 
-    int slot = find_open_file(filename);
-    if(slot < 0){
-        printf("Error: %s is not open\n", filename);
+    int fd = get_open_file(tokens->items[1]);
+    if(fd < 0)
         return;
-    }
 
-    fs.open_files[slot].in_use = false;
+    if(fat32_handle_close(fd) != 0)
+        cmd_printf("Error: Could not flush %s, buffered writes are lost\n", tokens->items[1]);
 }
 
 // list open files
@@ -349,97 +605,87 @@ void cmd_lsof(tokenlist *tokens)
     (void)tokens;
 
     int cnt = 0;
-    printf("Index\tName\t\tMode\tOffset\tPath\n");
+    cmd_printf("Index\tName\t\tMode\tOffset\tPath\n");
     
-    for(int i=0; i<MAX_OPEN_FILES; i++)
+    for(int i=0; i<fs_session->files.capacity; i++)
     {
-        if(fs.open_files[i].in_use)
+        OpenFile *of = fat32_handle_get(i);
+        if(of != NULL)
         {
             const char* mode_str;
-            switch(fs.open_files[i].mode){
+            switch(of->mode){
                 case MODE_READ: mode_str = "r"; break;
                 case MODE_WRITE: mode_str = "w"; break;
                 case MODE_RW: mode_str = "rw"; break;
                 default: mode_str = "?";  break;
             }
-            printf("%d\t%-12s\t%s\t%u\t%s\n",
+            cmd_printf("%d\t%-12s\t%s\t%u\t%s\n",
                    i,
-                   fs.open_files[i].name,
+                   of->name,
                    mode_str,
-                   fs.open_files[i].offset,
-                   fs.open_files[i].path);
+                   of->offset,
+                   of->path);
             cnt++;
         }
     }
 
-    if(cnt == 0) printf("No files are currently open\n");
+    if(cnt == 0) cmd_printf("No files are currently open\n");
 }
 
 // change file offset
 void cmd_lseek(tokenlist *tokens)
 {
     if (tokens->size != 3) {
-        printf("Error: lseek requires FILENAME and OFFSET arguments\n");
+        cmd_printf("Error: lseek requires FILENAME and OFFSET arguments\n");
         return;
     }
 
-    const char *filename = tokens->items[1];
     uint32_t offset = (uint32_t)atoi(tokens->items[2]);
 
-    DirEntry entry;
-    if (fat32_find_entry(fs.current_dir, filename, &entry, NULL, NULL) != 0) {
-        printf("Error: %s does not exist\n", filename);
+    int fd = get_open_file(tokens->items[1]);
+    if (fd < 0)
         return;
-    }
+    OpenFile *of = fat32_handle_get(fd);
 
-    int slot = find_open_file(filename);
-    if (slot < 0) {
-        printf("Error: %s isn't open\n", filename);
+    if(fat32_file_flush(of) != 0) {
+        cmd_printf("Error: Could not flush %s\n", tokens->items[1]);
         return;
     }
 
-    if(offset > fs.open_files[slot].size){
-        printf("Error: Offset %u is larger than file size %u\n", 
-               offset, fs.open_files[slot].size);
+    if(offset > of->size){
+        cmd_printf("Error: Offset %u is larger than file size %u\n", 
+               offset, of->size);
         return;
     }
 
-    fs.open_files[slot].offset = offset;
+    of->offset = offset;
 }
 
 void cmd_read(tokenlist *tokens)
 {
     if(tokens->size != 3){
-        printf("Error: read requires FILENAME and SIZE arguments\n");
+        cmd_printf("Error: read requires FILENAME and SIZE arguments\n");
         return;
     }
 
     const char *filename = tokens->items[1];
     uint32_t size = (uint32_t)atoi(tokens->items[2]);
 
-    DirEntry entry;
-    if(fat32_find_entry(fs.current_dir, filename, &entry, NULL, NULL) != 0) {
-        printf("Error: %s does not exist\n", filename);
+    int fd = get_open_file(filename);
+    if (fd < 0)
         return;
-    }
-
-    if(entry.DIR_Attr & ATTR_DIRECTORY){
-        printf("Error: %s is a directory\n", filename);
-        return;
-    }
+    OpenFile *of = fat32_handle_get(fd);
 
-    int slot = find_open_file(filename);
-    if (slot < 0) {
-        printf("Error: %s is not open\n", filename);
+    if(!(of->mode & MODE_READ)) {
+        cmd_printf("Error: %s is not open for reading\n", filename);
         return;
     }
 
-    if(!(fs.open_files[slot].mode & MODE_READ)) {
-        printf("Error: %s is not open for reading\n", filename);
+    // reads see this descriptor's own buffered writes
+    if(fat32_file_flush(of) != 0) {
+        cmd_printf("Error: Could not flush %s\n", filename);
         return;
     }
-
-    OpenFile *of = &fs.open_files[slot];
     
     if(of->offset + size > of->size)
         size = of->size - of->offset;
@@ -457,18 +703,16 @@ void cmd_read(tokenlist *tokens)
         cluster = fat32_get_fat_entry(cluster);
     }
 
-    uint8_t *buffer = malloc(clusterSize);
+    uint8_t *buffer = fat32_scratch();
     if(!buffer) {
-        printf("Error: Memory allocation failed\n");
+        cmd_printf("Error: Memory allocation failed\n");
         return;
     }
 
     while(bytesRead < size && cluster < FAT_EOC && cluster != 0)
     {
-        if (fat32_read_cluster(cluster, buffer) != 0) {
-            free(buffer);
+        if (fat32_read_cluster(cluster, buffer) != 0)
             return;
-        }
 
         uint32_t offsetInCluster = (of->offset + bytesRead) % clusterSize;
         uint32_t toRead = clusterSize - offsetInCluster;
@@ -476,8 +720,7 @@ void cmd_read(tokenlist *tokens)
         if(toRead > size - bytesRead)
             toRead = size - bytesRead;
 
-        for(uint32_t i = 0; i < toRead; ++i)
-            putchar(buffer[offsetInCluster + i]);
+        fwrite(buffer + offsetInCluster, 1, toRead, cmd_output());
 
         bytesRead += toRead;
         
@@ -485,15 +728,14 @@ void cmd_read(tokenlist *tokens)
             cluster = fat32_get_fat_entry(cluster);
     }
 
-    printf("\n");
+    cmd_printf("\n");
     of->offset += bytesRead;
-    free(buffer);
 }
 
 void cmd_write(tokenlist *tokens)
 {
     if(tokens->size < 3) {
-        printf("Error: write requires both the filename and string arguments\n");
+        cmd_printf("Error: write requires both the filename and string arguments\n");
         return;
     }
 
@@ -525,148 +767,424 @@ void cmd_write(tokenlist *tokens)
 
     uint32_t writeSize = strlen(string);
 
-    DirEntry entry;
-    uint32_t entryCluster, entryOffset;
-    if (fat32_find_entry(fs.current_dir, filename, &entry, &entryCluster, &entryOffset) != 0) {
-        printf("Error: %s does not exist\n", filename);
+    int fd = get_open_file(filename);
+    if(fd < 0)
         return;
+    OpenFile *of = fat32_handle_get(fd);
+
+    if (!(of->mode & MODE_WRITE)) {
+        cmd_printf("Error: %s is not open for writing\n", filename);
+        return;
+    }
+
+    if(fat32_file_write(of, string, writeSize) != 0)
+        cmd_printf("Error: Could not write to %s\n", filename);
+}
+
+// byte count with an optional k, M or G suffix, up to the FAT32 file size limit
+static int parse_file_size(const char *arg, uint32_t *size)
+{
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if(end == arg || *arg == '-')
+        return -1;
+
+    unsigned long long unit = 1;
+    switch(*end) {
+        case '\0': break;
+        case 'k': unit = 1024; break;
+        case 'M': unit = 1024 * 1024; break;
+        case 'G': unit = 1024 * 1024 * 1024; break;
+        default: return -1;
     }
+    if((*end != '\0' && end[1] != '\0') || n > UINT32_MAX / unit)
+        return -1;
+    *size = (uint32_t)(n * unit);
+    return 0;
+}
 
-    if (entry.DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: %s is a directory\n", filename);
+// shared by truncate and fallocate, which differ in whether they shrink;
+// fallocate -k reserves clusters without changing the file's size
+static void resize_file(tokenlist *tokens, bool shrink)
+{
+    const char *cmd = tokens->items[0];
+    bool keepSize = (!shrink && tokens->size == 4 && strcmp(tokens->items[1], "-k") == 0);
+    if(tokens->size != 3 && !keepSize) {
+        cmd_printf("Error: %s requires FILENAME and SIZE arguments\n", cmd);
         return;
     }
 
-    int slot = find_open_file(filename);
-    if(slot < 0) {
-        printf("Error: %s is not open\n", filename);
+    const char *filename = tokens->items[tokens->size - 2];
+    const char *sizeArg = tokens->items[tokens->size - 1];
+    uint32_t size;
+    if(parse_file_size(sizeArg, &size) != 0) {
+        cmd_printf("Error: Invalid size %s\n", sizeArg);
         return;
     }
 
-    if (!(fs.open_files[slot].mode & MODE_WRITE)) {
-        printf("Error: %s is not open for writing\n", filename);
+    DirRecord rec;
+    if(fat32_lookup(fs_session->current_dir, filename, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", filename);
+        return;
+    }
+    if(rec.entry.DIR_Attr & ATTR_DIRECTORY) {
+        cmd_printf("Error: %s is a directory\n", filename);
         return;
     }
 
-    OpenFile *of = &fs.open_files[slot];
-    uint32_t clusterSize = fat32_get_cluster_size();
-    uint32_t neededSize = of->offset + writeSize;
-    
-    // first cluster if empty
-    if(of->first_cluster == 0)
-    {
-        uint32_t newClus = fat32_allocate_cluster(0);
-        if(newClus == 0) {
-            printf("Error: Couldn't allocate cluster\n");
+    int ret = shrink ? fat32_file_truncate(rec.cluster, rec.offset, size)
+                     : fat32_file_allocate(rec.cluster, rec.offset, size, keepSize);
+    if(ret != 0)
+        cmd_printf("Error: Could not %s %s\n", cmd, filename);
+}
+
+void cmd_truncate(tokenlist *tokens)
+{
+    resize_file(tokens, true);
+}
+
+// reserves space up front, contiguously where possible
+void cmd_fallocate(tokenlist *tokens)
+{
+    resize_file(tokens, false);
+}
+
+// push buffered writes to the image: one file, or all of this session's
+void cmd_sync(tokenlist *tokens)
+{
+    if(tokens->size > 2) {
+        cmd_printf("Error: sync takes at most one FILENAME argument\n");
+        return;
+    }
+
+    if(tokens->size == 1) {
+        if(fat32_handles_flush() != 0)
+            cmd_printf("Error: Could not flush all open files\n");
+    } else {
+        int fd = get_open_file(tokens->items[1]);
+        if(fd < 0)
+            return;
+        if(fat32_file_flush(fat32_handle_get(fd)) != 0)
+            cmd_printf("Error: Could not flush %s\n", tokens->items[1]);
+    }
+
+    // and wait for the write-behind buffer to reach the image
+    if(fat32_sync() != 0)
+        cmd_printf("Error: Could not write back buffered changes\n");
+}
+
+void cmd_commit(tokenlist *tokens)
+{
+    if(tokens->size != 1) {
+        cmd_printf("Error: commit takes no arguments\n");
+        return;
+    }
+    if(fs.overlay == NULL) {
+        cmd_printf("Error: %s is not mounted with an overlay\n", fs.image_name);
+        return;
+    }
+    if(fs.cimage != NULL) {
+        cmd_printf("Error: %s is compressed, unpack it to commit into it\n", fs.image_name);
+        return;
+    }
+
+    // buffered writes of this session belong in the commit too
+    if(fat32_handles_flush() != 0 || fat32_sync() != 0) {
+        cmd_printf("Error: Could not flush all pending writes\n");
+        return;
+    }
+
+    uint64_t blocks;
+    if(overlay_commit(fs.overlay, &blocks) != 0) {
+        cmd_printf("Error: Commit failed, the overlay is kept\n");
+        return;
+    }
+    cmd_printf("Committed %llu blocks\n", (unsigned long long)blocks);
+}
+
+void cmd_import(tokenlist *tokens)
+{
+    bool recursive = (tokens->size == 4 && strcmp(tokens->items[1], "-r") == 0);
+    if(tokens->size != 3 && !recursive) {
+        cmd_printf("Error: import takes [-r] HOSTPATH NAME\n");
+        return;
+    }
+
+    const char *host = tokens->items[tokens->size - 2];
+    const char *name = tokens->items[tokens->size - 1];
+    if(fat32_find_entry(fs_session->current_dir, name, NULL, NULL, NULL) == 0) {
+        cmd_printf("Error: %s already exists\n", name);
+        return;
+    }
+
+    double start = mono_secs();
+
+    ImportStats st;
+    if(fat32_import(fs_session->current_dir, name, host, recursive, &st) != 0)
+        return;
+
+    double secs = mono_secs() - start;
+    cmd_printf("Imported %u files and %u directories, %llu bytes in %u clusters (%u extents) in %.3f s",
+               st.files, st.dirs, (unsigned long long)st.bytes, st.clusters, st.extents, secs);
+    if(secs > 0)
+        cmd_printf(" (%.1f MB/s)", st.bytes / secs / 1e6);
+    cmd_printf("\n");
+    if(st.skipped > 0)
+        cmd_printf("Skipped %u host entries\n", st.skipped);
+}
+
+void cmd_cp(tokenlist *tokens)
+{
+    bool recursive = (tokens->size == 4 && strcmp(tokens->items[1], "-r") == 0);
+    if(tokens->size != 3 && !recursive) {
+        cmd_printf("Error: cp takes [-r] SOURCE DEST\n");
+        return;
+    }
+    const char *src = tokens->items[tokens->size - 2];
+    const char *dst = tokens->items[tokens->size - 1];
+
+    // the copy reads the image, so this session's buffered writes go first
+    if(fat32_handles_flush() != 0) {
+        cmd_printf("Error: Could not flush open files\n");
+        return;
+    }
+
+    DirRecord srcRec;
+    if(fat32_resolve_path(src, &srcRec) != 0) {
+        cmd_printf("Error: %s does not exist\n", src);
+        return;
+    }
+
+    // an existing directory receives the copy under the source's name,
+    // anything else names the copy itself
+    DirRecord dstRec;
+    char *parent = strdup(dst);
+    const char *name;
+    if(parent == NULL) {
+        cmd_printf("Error: Out of memory\n");
+        return;
+    }
+    if(fat32_resolve_path(dst, &dstRec) == 0) {
+        if(!(dstRec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+            cmd_printf("Error: %s already exists\n", dst);
+            free(parent);
+            return;
+        }
+        name = srcRec.name;
+        if(strcmp(name, "/") == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            cmd_printf("Error: cp needs a name for the copy of %s\n", src);
+            free(parent);
+            return;
+        }
+    } else {
+        char *slash = strrchr(parent, '/');
+        name = (slash != NULL) ? slash + 1 : parent;
+        if(slash != NULL)
+            *slash = '\0';
+        const char *dirPath = (slash == NULL) ? "." : (slash == parent) ? "/" : parent;
+        if(fat32_resolve_path(dirPath, &dstRec) != 0 ||
+           !(dstRec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+            cmd_printf("Error: %s does not exist\n", dirPath);
+            free(parent);
             return;
         }
-        of->first_cluster = newClus;
-        entry.DIR_FstClusLO = newClus & 0xFFFF;
-        entry.DIR_FstClusHI = (newClus >> 16) & 0xFFFF;
     }
-    uint32_t cluster = of->first_cluster;
-    uint32_t currentPos = 0;
 
-    while(currentPos + clusterSize <= of->offset)
+    uint32_t dirCluster = fat32_get_cluster(&dstRec.entry);
+    if(dirCluster == 0)
+        dirCluster = fs.bs.BPB_RootClus;
+    if(name[0] == '\0' || fat32_find_entry(dirCluster, name, NULL, NULL, NULL) == 0) {
+        cmd_printf("Error: %s already exists\n", name[0] ? name : dst);
+        free(parent);
+        return;
+    }
+
+    double start = mono_secs();
+
+    ImportStats st;
+    int ret = fat32_copy(dirCluster, name, &srcRec, recursive, &st);
+    free(parent);
+    if(ret != 0)
+        return;
+
+    double secs = mono_secs() - start;
+    cmd_printf("Copied %u files and %u directories, %llu bytes in %u clusters (%u extents) in %.3f s",
+               st.files, st.dirs, (unsigned long long)st.bytes, st.clusters, st.extents, secs);
+    if(secs > 0)
+        cmd_printf(" (%.1f MB/s)", st.bytes / secs / 1e6);
+    cmd_printf(", %llu bytes copied in the kernel\n", (unsigned long long)st.offloaded);
+}
+
+static void df_line(const char *label, uint32_t clusters, const FatScan *scan)
+{
+    uint64_t kib = (uint64_t)clusters * fat32_get_cluster_size() / 1024;
+    double pct = scan->clusters ? 100.0 * clusters / scan->clusters : 0.0;
+    cmd_printf("%-9s %10u clusters %12llu KiB %6.2f%%\n", label, clusters,
+               (unsigned long long)kib, pct);
+}
+
+void cmd_df(tokenlist *tokens)
+{
+    if(tokens->size != 1) {
+        cmd_printf("Error: df takes no arguments\n");
+        return;
+    }
+
+    double start = mono_secs();
+
+    FatScan scan;
+    if(fat32_scan_fat(&scan) != 0) {
+        cmd_printf("Error: Could not read the FAT\n");
+        return;
+    }
+
+    double secs = mono_secs() - start;
+
+    cmd_printf("%u clusters of %u bytes\n", scan.clusters, fat32_get_cluster_size());
+    df_line("Used", scan.used, &scan);
+    df_line("Free", scan.free, &scan);
+    df_line("Bad", scan.bad, &scan);
+    df_line("Reserved", scan.reserved, &scan);
+
+    cmd_printf("Free runs: %u", scan.free_runs);
+    if(scan.free_runs > 0)
+        cmd_printf(", largest %u clusters at cluster %u, average %.1f",
+                   scan.largest_run, scan.largest_run_start, (double)scan.free / scan.free_runs);
+    cmd_printf("\n");
+    for(int k = 0; k < FREE_RUN_BUCKETS; k++) {
+        if(scan.run_hist[k] == 0)
+            continue;
+        uint32_t lo = 1u << k;
+        if(lo == 1)
+            cmd_printf("  %10u          %u\n", lo, scan.run_hist[k]);
+        else
+            cmd_printf("  %10u-%-8u %u\n", lo, (lo << 1) - 1, scan.run_hist[k]);
+    }
+
+    FSInfo info;
+    if(fat32_read_fsinfo(&info) != 0)
+        cmd_printf("FSInfo: missing or invalid\n");
+    else if(info.FSI_Free_Count == FSI_UNKNOWN)
+        cmd_printf("FSInfo: free count unknown\n");
+    else if(info.FSI_Free_Count == scan.free)
+        cmd_printf("FSInfo: free count %u matches\n", info.FSI_Free_Count);
+    else
+        cmd_printf("FSInfo: free count %u is stale, off by %+lld\n", info.FSI_Free_Count,
+                   (long long)info.FSI_Free_Count - scan.free);
+
+    cmd_printf("Scanned %llu bytes of FAT in %.3f s\n", (unsigned long long)scan.fat_bytes, secs);
+}
+
+static void fatcheck_report(int c, const MirrorDiff *d, int ref)
+{
+    if(d->entries == 0) {
+        cmd_printf("FAT %d: matches\n", c);
+        return;
+    }
+    cmd_printf("FAT %d: %u entries differ in %u ranges\n", c, d->entries, d->ranges);
+    uint32_t shown = (d->ranges < MIRROR_RANGES) ? d->ranges : MIRROR_RANGES;
+    for(uint32_t k = 0; k < shown; k++) {
+        if(d->first[k] == d->last[k])
+            cmd_printf("  entry %u\n", d->first[k]);
+        else
+            cmd_printf("  entries %u-%u\n", d->first[k], d->last[k]);
+    }
+    if(d->ranges > shown)
+        cmd_printf("  ... %u more ranges\n", d->ranges - shown);
+    if(d->written > 0)
+        cmd_printf("  resynced from FAT %d, %llu KiB written\n", ref,
+                   (unsigned long long)(d->written / 1024));
+}
+
+void cmd_fatcheck(tokenlist *tokens)
+{
+    int copies = fs.bs.BPB_NumFATs;
+    int ref = fat32_active_fat();
+    bool repair = false;
+
+    for(size_t i = 1; i < tokens->size; i++)
     {
-        uint32_t next = fat32_get_fat_entry(cluster);
-        if(next >= FAT_EOC){
-            uint32_t newClus = fat32_allocate_cluster(cluster);
-            if(newClus == 0){
-                printf("Error: Couldn't allocate cluster\n");
+        const char *arg = tokens->items[i];
+        char *end;
+        if(strcmp(arg, "-r") == 0) {
+            repair = true;
+        } else if(strcmp(arg, "-f") == 0 && i + 1 < tokens->size) {
+            ref = (int)strtol(tokens->items[++i], &end, 10);
+            if(*end != '\0' || end == tokens->items[i] || ref < 0 || ref >= copies) {
+                cmd_printf("Error: FAT copy must be 0 to %d\n", copies - 1);
                 return;
             }
-            cluster = newClus;
         } else {
-            cluster = next;
+            cmd_printf("Error: fatcheck takes [-r] [-f COPY]\n");
+            return;
         }
-        currentPos += clusterSize;
     }
 
-    uint32_t bytesWritten = 0;
-    uint8_t* buf = malloc(clusterSize);
-    if(buf == NULL){
-        printf("Error: Memory allocation failed\n");
+    if(copies < 2) {
+        cmd_printf("Only one FAT copy, nothing to compare\n");
         return;
     }
+    if(fs.bs.BPB_ExtFlags & EXT_NO_MIRROR)
+        cmd_printf("Mirroring is off, FAT %d is active\n", fat32_active_fat());
 
-    while(bytesWritten < writeSize)
-    {
-        fat32_read_cluster(cluster, buf);
-
-        uint32_t offsetInCluster = (of->offset + bytesWritten) % clusterSize;
-        uint32_t toWrite = clusterSize - offsetInCluster;
-        
-        if (toWrite > writeSize - bytesWritten)
-            toWrite = writeSize - bytesWritten;
-
-        memcpy(buf + offsetInCluster, string + bytesWritten, toWrite);
-        fat32_write_cluster(cluster, buf);
-        bytesWritten += toWrite;
-
-        if(bytesWritten < writeSize) {
-            uint32_t next = fat32_get_fat_entry(cluster);
-            if(next >= FAT_EOC) {
-                uint32_t newClus = fat32_allocate_cluster(cluster);
-                if(newClus == 0) {
-                    printf("Error: Couldn't allocate cluster\n");
-                    free(buf);
-                    return;
-                }
-                cluster = newClus;
-            } else {
-                cluster = next;
-            }
-        }
+    MirrorDiff *diffs = malloc(copies * sizeof(MirrorDiff));
+    if(diffs == NULL) {
+        cmd_printf("Error: Out of memory\n");
+        return;
     }
 
-    free(buf);
+    double start = mono_secs();
+    int ret = fat32_check_mirrors(ref, repair, diffs);
+    double secs = mono_secs() - start;
 
-    if(neededSize > of->size) {
-        of->size = neededSize;
-        entry.DIR_FileSize = neededSize;
+    if(ret != 0) {
+        cmd_printf("Error: Could not %s the FAT copies\n", repair ? "resync" : "read");
+        free(diffs);
+        return;
     }
 
-    fat32_set_cluster(&entry, of->first_cluster);
-    entry.DIR_FileSize = of->size;
-
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    uint16_t date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
-    uint16_t timeval = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
-    entry.DIR_WrtDate = date;
-    entry.DIR_WrtTime = timeval;
-    
-    fat32_write_dir_entry(entryCluster, entryOffset, &entry);
-    of->offset += bytesWritten;
+    uint32_t bad = 0;
+    cmd_printf("FAT %d: reference\n", ref);
+    for(int c = 0; c < copies; c++) {
+        if(c == ref)
+            continue;
+        fatcheck_report(c, &diffs[c], ref);
+        bad += (diffs[c].entries > 0);
+    }
+    if(bad > 0 && !repair)
+        cmd_printf("%u of %d mirrors differ, fatcheck -r rewrites them from FAT %d\n",
+                   bad, copies - 1, ref);
+    cmd_printf("Compared %d copies of %llu bytes in %.3f s\n", copies,
+               (unsigned long long)fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec, secs);
+    free(diffs);
 }
 
 void cmd_mv(tokenlist *tokens)
 {
     if(tokens->size != 3){
-        printf("Error: mv needs both source and destination arguments\n");
+        cmd_printf("Error: mv needs both source and destination arguments\n");
         return;
     }
 
     const char* src = tokens->items[1];
     const char* dest = tokens->items[2];
 
-    DirEntry srcEntry;
-    uint32_t srcCluster, srcOffset;
-    if(fat32_find_entry(fs.current_dir, src, &srcEntry, &srcCluster, &srcOffset) != 0)
+    DirRecord srcRec;
+    if(fat32_lookup(fs_session->current_dir, src, &srcRec) != 0)
     {
-        printf("Error: %s doesnt exist\n", src);
+        cmd_printf("Error: %s doesnt exist\n", src);
         return;
     }
+    DirEntry srcEntry = srcRec.entry;
 
-    if (find_open_file(src) >= 0) {
-        printf("Error: %s is open\n", src);
+    if (fat32_is_open(srcRec.cluster, srcRec.offset)) {
+        cmd_printf("Error: %s is open\n", src);
         return;
     }
 
     DirEntry destEntry;
     uint32_t destCluster, destOffset;
-    int destExists = fat32_find_entry(fs.current_dir, dest, &destEntry, &destCluster, &destOffset);
+    int destExists = fat32_find_entry(fs_session->current_dir, dest, &destEntry, &destCluster, &destOffset);
 
     if(destExists == 0)
     {
@@ -674,19 +1192,18 @@ void cmd_mv(tokenlist *tokens)
         {
             uint32_t destDirCluster = fat32_get_cluster(&destEntry);
             
-            char srcName[13];
-            fat32_83_to_name(srcEntry.DIR_Name, srcName);
-            if(fat32_find_entry(destDirCluster, srcName, NULL, NULL, NULL) == 0){
-                printf("Error: %s already exists in destination directory\n", srcName);
+            if(fat32_find_entry(destDirCluster, srcRec.name, NULL, NULL, NULL) == 0){
+                cmd_printf("Error: %s already exists in destination directory\n", srcRec.name);
                 return;
             }
 
-            if(fat32_add_dir_entry(destDirCluster, &srcEntry) != 0){
-                printf("Error: Could not move entry\n");
+            if(fat32_add_named_entry(destDirCluster, srcRec.name, &srcEntry, NULL, NULL) != 0){
+                cmd_printf("Error: Could not move entry\n");
                 return;
             }
 
-            fat32_remove_dir_entry(srcCluster, srcOffset);
+            fat32_remove_record(&srcRec);
+            fat32_auto_compact(fs_session->current_dir);
 
             if(srcEntry.DIR_Attr & ATTR_DIRECTORY)
             {
@@ -698,108 +1215,997 @@ void cmd_mv(tokenlist *tokens)
             }
         }
         else {
-            printf("Error: %s is a file\n", dest);
+            cmd_printf("Error: %s is a file\n", dest);
             return;
         }
     }
     else
     {
-        fat32_name_to_83(dest, (char *)srcEntry.DIR_Name);
-        fat32_write_dir_entry(srcCluster, srcOffset, &srcEntry);
+        // the new name may need a different number of slots, so re-add it
+        if(fat32_add_named_entry(fs_session->current_dir, dest, &srcEntry, NULL, NULL) != 0) {
+            cmd_printf("Error: Could not rename %s\n", src);
+            return;
+        }
+        fat32_remove_record(&srcRec);
+        fat32_auto_compact(fs_session->current_dir);
+    }
+}
+
+// everything below a directory that rm -r is about to remove
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t *firsts;            // first cluster of every file and directory
+    size_t count;
+    size_t cap;
+    uint32_t files;
+    uint32_t dirs;
+    bool failed;
+    char busy[MAX_PATH];         // an open file or working directory found below
+} RmTree;
+
+static int push_cluster(uint32_t **list, size_t *count, size_t *cap, uint32_t cluster)
+{
+    if(*count == *cap) {
+        size_t grown = *cap ? *cap * 2 : 256;
+        uint32_t *p = realloc(*list, grown * sizeof(uint32_t));
+        if(p == NULL)
+            return -1;
+        *list = p;
+        *cap = grown;
     }
+    (*list)[(*count)++] = cluster;
+    return 0;
+}
+
+static void *rm_visit(WalkWorker *w, const DirRecord *rec, const char *path,
+                      void *parent, void *ctx)
+{
+    (void)w;
+    (void)parent;
+    RmTree *t = ctx;
+    uint32_t first = fat32_get_cluster(&rec->entry);
+    bool isDir = rec->entry.DIR_Attr & ATTR_DIRECTORY;
+    bool busy = isDir ? fat32_dir_in_use(first) : fat32_is_open(rec->cluster, rec->offset);
+
+    pthread_mutex_lock(&t->lock);
+    if(busy && t->busy[0] == '\0')
+        snprintf(t->busy, sizeof(t->busy), "%s", path);
+    if(isDir)
+        t->dirs++;
+    else
+        t->files++;
+    if(first >= 2 && push_cluster(&t->firsts, &t->count, &t->cap, first) != 0)
+        t->failed = true;
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
 }
 
-static void free_cluster_chain(uint32_t cluster)
+// frees every collected chain in one batch; returns the cluster count
+static uint64_t free_tree_chains(const RmTree *t)
 {
-    while(cluster < FAT_EOC && cluster != 0){
-        uint32_t next = fat32_get_fat_entry(cluster);
-        fat32_set_fat_entry(cluster, FAT_FREE);
-        cluster = next;
+    FatBatch batch;
+    fat32_batch_init(&batch);
+    uint64_t freed = 0;
+
+    for(size_t i = 0; i < t->count; i++) {
+        uint32_t steps = 0;
+        for(uint32_t c = t->firsts[i]; c >= 2 && c < FAT_EOC && steps++ <= fs.total_clusters;
+            c = fat32_get_fat_entry(c)) {
+            if(fat32_batch_set(&batch, c, FAT_FREE) != 0) {
+                fat32_batch_free(&batch);
+                return 0;
+            }
+            freed++;
+        }
     }
+
+    if(fat32_batch_commit(&batch) != 0)
+        freed = 0;
+    fat32_batch_free(&batch);
+    return freed;
+}
+
+/*
+ * rm -r: walks the subtree collecting chains, refuses if anything below
+ * is open or some session's working directory, then takes the top entry
+ * out of its parent and frees all chains with one sorted FAT batch. The
+ * directories below are never rewritten; freeing their clusters drops
+ * their indexes.
+ */
+static void remove_tree(const DirRecord *rec)
+{
+    double start = mono_secs();
+
+    uint32_t top = fat32_get_cluster(&rec->entry);
+    if(top < 2 || fat32_dir_in_use(top)) {
+        cmd_printf("Error: %s is in use\n", rec->name);
+        return;
+    }
+
+    RmTree t;
+    memset(&t, 0, sizeof(t));
+    pthread_mutex_init(&t.lock, NULL);
+
+    WalkOps ops = { rm_visit, NULL, &t, cmd_output() };
+    t.dirs = 1;
+    if(push_cluster(&t.firsts, &t.count, &t.cap, top) != 0 ||
+       fat32_walk(top, rec->name, NULL, &ops) != 0 || t.failed)
+        cmd_printf("Error: Could not walk %s\n", rec->name);
+    else if(t.busy[0] != '\0')
+        cmd_printf("Error: %s is open or in use\n", t.busy);
+    else if(fat32_remove_record(rec) != 0)
+        cmd_printf("Error: Could not remove %s\n", rec->name);
+    else {
+        uint64_t freed = free_tree_chains(&t);
+        fat32_auto_compact(fs_session->current_dir);
+
+        double secs = mono_secs() - start;
+        cmd_printf("Removed %u files and %u directories, freed %llu clusters in %.3f s",
+                   t.files, t.dirs, (unsigned long long)freed, secs);
+        if(secs > 0)
+            cmd_printf(" (%.0f clusters/s)", freed / secs);
+        cmd_printf("\n");
+    }
+
+    free(t.firsts);
+    pthread_mutex_destroy(&t.lock);
 }
 
 void cmd_rm(tokenlist *tokens)
 {
-    if (tokens->size != 2) {
-        printf("Error: rm requires FILENAME argument\n");
+    bool recursive = (tokens->size == 3 && strcmp(tokens->items[1], "-r") == 0);
+    if (tokens->size != 2 && !recursive) {
+        cmd_printf("Error: rm requires FILENAME argument\n");
         return;
     }
 
-    const char *filename = tokens->items[1];
+    const char *filename = tokens->items[tokens->size - 1];
 
-    DirEntry entry;
-    uint32_t entCluster, entOffset;
-    if (fat32_find_entry(fs.current_dir, filename, &entry, &entCluster, &entOffset) != 0) {
-        printf("Error: %s does not exist\n", filename);
+    if(recursive && (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0)) {
+        cmd_printf("Error: Cannot remove %s\n", filename);
+        return;
+    }
+
+    DirRecord rec;
+    if (fat32_lookup(fs_session->current_dir, filename, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", filename);
         return;
     }
 
-    if(entry.DIR_Attr & ATTR_DIRECTORY) {
-        printf("Error: %s is a directory\n", filename);
+    if(rec.entry.DIR_Attr & ATTR_DIRECTORY) {
+        if(recursive)
+            remove_tree(&rec);
+        else
+            cmd_printf("Error: %s is a directory\n", filename);
         return;
     }
 
-    if(find_open_file(filename) >= 0){
-        printf("Error: %s is open\n", filename);
+    if(fat32_is_open(rec.cluster, rec.offset)){
+        cmd_printf("Error: %s is open\n", filename);
         return;
     }
 
-    uint32_t clus = fat32_get_cluster(&entry);
+    uint32_t clus = fat32_get_cluster(&rec.entry);
     if(clus != 0)
-        free_cluster_chain(clus);
+        fat32_free_chain(clus);
 
-    fat32_remove_dir_entry(entCluster, entOffset);
+    fat32_remove_record(&rec);
+    fat32_auto_compact(fs_session->current_dir);
 }
 
 void cmd_rmdir(tokenlist *tokens)
 {
     if(tokens->size != 2) {
-        printf("Error: rmdir requires DIRNAME argument\n");
+        cmd_printf("Error: rmdir requires DIRNAME argument\n");
         return;
     }
 
     const char *dirname = tokens->items[1];
 
     if(strcmp(dirname, ".") == 0 || strcmp(dirname, "..") == 0){
-        printf("Error: Cannot remove %s\n", dirname);
+        cmd_printf("Error: Cannot remove %s\n", dirname);
         return;
     }
-    DirEntry entry;
-    uint32_t entryCluster, entryOffset;
-    if(fat32_find_entry(fs.current_dir, dirname, &entry, &entryCluster, &entryOffset) != 0)
+    DirRecord rec;
+    if(fat32_lookup(fs_session->current_dir, dirname, &rec) != 0)
     {
-        printf("Error: %s does not exist\n", dirname);
+        cmd_printf("Error: %s does not exist\n", dirname);
         return;
     }
-    if(!(entry.DIR_Attr & ATTR_DIRECTORY)){
-        printf("Error: %s is not a directory\n", dirname);
+    if(!(rec.entry.DIR_Attr & ATTR_DIRECTORY)){
+        cmd_printf("Error: %s is not a directory\n", dirname);
         return;
     }
 
-    uint32_t dirCluster = fat32_get_cluster(&entry);
+    uint32_t dirCluster = fat32_get_cluster(&rec.entry);
 
     if(!fat32_is_dir_empty(dirCluster)) {
-        printf("Error: %s is not empty\n", dirname);
+        cmd_printf("Error: %s is not empty\n", dirname);
+        return;
+    }
+
+    // the same checks rm -r makes for each directory below it
+    if(fat32_dir_in_use(dirCluster) || fat32_is_open(rec.cluster, rec.offset)) {
+        cmd_printf("Error: %s is in use\n", dirname);
         return;
     }
 
-    for(int i = 0; i < MAX_OPEN_FILES; i++)
+    if (dirCluster != 0) fat32_free_chain(dirCluster);
+
+    fat32_remove_record(&rec);
+    fat32_auto_compact(fs_session->current_dir);
+}
+
+typedef struct {
+    const char *name;       // -name pattern, or NULL
+    char size_cmp;          // '+', '-', '=' or 0 for no -size test
+    uint64_t size_units;
+    uint64_t unit;
+} FindOpts;
+
+static bool find_matches(const FindOpts *opts, const DirRecord *rec)
+{
+    if(opts->name != NULL && fnmatch(opts->name, rec->name, FNM_CASEFOLD) != 0)
+        return false;
+
+    if(opts->size_cmp != 0) {
+        // like find(1), sizes are rounded up to the unit before comparing
+        uint64_t units = (rec->entry.DIR_FileSize + opts->unit - 1) / opts->unit;
+        if(opts->size_cmp == '+' && !(units > opts->size_units)) return false;
+        if(opts->size_cmp == '-' && !(units < opts->size_units)) return false;
+        if(opts->size_cmp == '=' && units != opts->size_units) return false;
+    }
+    return true;
+}
+
+static void *find_visit(WalkWorker *w, const DirRecord *rec, const char *path,
+                        void *parent, void *ctx)
+{
+    (void)parent;
+    if(find_matches(ctx, rec))
+        walk_emit(w, "%s\n", path);
+    return NULL;
+}
+
+static int parse_size_arg(const char *arg, FindOpts *opts)
+{
+    opts->size_cmp = '=';
+    if(*arg == '+' || *arg == '-')
+        opts->size_cmp = *arg++;
+
+    char *end;
+    opts->size_units = strtoull(arg, &end, 10);
+    if(end == arg)
+        return -1;
+
+    switch(*end) {
+        case '\0':
+        case 'c': opts->unit = 1; break;
+        case 'k': opts->unit = 1024; break;
+        case 'M': opts->unit = 1024 * 1024; break;
+        case 'G': opts->unit = 1024 * 1024 * 1024; break;
+        default: return -1;
+    }
+    if(*end != '\0' && end[1] != '\0')
+        return -1;
+    return 0;
+}
+
+void cmd_find(tokenlist *tokens)
+{
+    if(tokens->size < 2) {
+        cmd_printf("Error: find requires a PATH argument\n");
+        return;
+    }
+
+    const char *path = tokens->items[1];
+    FindOpts opts;
+    memset(&opts, 0, sizeof(FindOpts));
+
+    for(size_t i = 2; i < tokens->size; i++)
     {
-        if(fs.open_files[i].in_use) {
-            char expectedPath[MAX_PATH];
-            if(strcmp(fs.current_path, "/") == 0)
-                snprintf(expectedPath, MAX_PATH, "/%s", dirname);
-            else
-                snprintf(expectedPath, MAX_PATH, "%s/%s", fs.current_path, dirname);
-            
-            if(strcmp(fs.open_files[i].path, expectedPath) == 0) {
-                printf("Error: A file in %s is open\n", dirname);
+        if(strcmp(tokens->items[i], "-name") == 0 && i + 1 < tokens->size) {
+            opts.name = tokens->items[++i];
+        } else if(strcmp(tokens->items[i], "-size") == 0 && i + 1 < tokens->size) {
+            if(parse_size_arg(tokens->items[++i], &opts) != 0) {
+                cmd_printf("Error: Invalid size '%s'\n", tokens->items[i]);
                 return;
             }
+        } else {
+            cmd_printf("Error: Unknown find option '%s'\n", tokens->items[i]);
+            return;
         }
     }
+    if(opts.size_cmp != 0 && flush_session() != 0)
+        return;
+
+    DirRecord rec;
+    if(fat32_resolve_path(path, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", path);
+        return;
+    }
 
-    if (dirCluster != 0) free_cluster_chain(dirCluster);
+    if(find_matches(&opts, &rec))
+        cmd_printf("%s\n", path);
 
-    fat32_remove_dir_entry(entryCluster, entryOffset);
+    if(!(rec.entry.DIR_Attr & ATTR_DIRECTORY))
+        return;
+
+    uint32_t dirCluster = fat32_get_cluster(&rec.entry);
+    if(dirCluster == 0)
+        dirCluster = fs.bs.BPB_RootClus;
+
+    fflush(cmd_output());
+    WalkOps ops = { find_visit, NULL, &opts, cmd_output() };
+    if(fat32_walk(dirCluster, path, NULL, &ops) != 0)
+        cmd_printf("Error: Could not walk %s\n", path);
+}
+
+#define SUM_CHUNK   BUFPOOL_BUFFER
+
+// a regular file sum or grep reads straight from its chain
+typedef struct {
+    char *path;
+    uint32_t first;
+    uint32_t size;
+    bool failed;
+} TreeFile;
+
+// processes files[i] using buf, one SUM_CHUNK buffer per worker
+typedef int (*TreeFileFn)(void *ctx, size_t i, const TreeFile *f, uint8_t *buf);
+
+typedef struct {
+    pthread_mutex_t lock;
+    TreeFile *files;
+    size_t count, cap;
+    bool failed;
+    TreeFileFn fn;
+    void *ctx;
+    size_t next;
+} FileTree;
+
+static int add_tree_file(FileTree *t, const char *path, const DirEntry *entry)
+{
+    if(t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 256;
+        TreeFile *grown = realloc(t->files, cap * sizeof(TreeFile));
+        if(grown == NULL)
+            return -1;
+        t->files = grown;
+        t->cap = cap;
+    }
+    TreeFile *f = &t->files[t->count];
+    memset(f, 0, sizeof(*f));
+    f->path = strdup(path);
+    if(f->path == NULL)
+        return -1;
+    f->first = fat32_get_cluster(entry);
+    f->size = entry->DIR_FileSize;
+    t->count++;
+    return 0;
+}
+
+static void *tree_visit(WalkWorker *w, const DirRecord *rec, const char *path,
+                        void *parent, void *ctx)
+{
+    (void)w;
+    (void)parent;
+    FileTree *t = ctx;
+
+    if(rec->entry.DIR_Attr & ATTR_DIRECTORY)
+        return NULL;
+    pthread_mutex_lock(&t->lock);
+    if(add_tree_file(t, path, &rec->entry) != 0)
+        t->failed = true;
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static int cmp_tree_files(const void *a, const void *b)
+{
+    return strcmp(((const TreeFile *)a)->path, ((const TreeFile *)b)->path);
+}
+
+/*
+ * Lists the file at path, or with recursive every regular file under the
+ * directory at path, using the parallel walker. The list is sorted by
+ * path. Errors are reported here.
+ */
+static int tree_collect(FileTree *t, const char *path, bool recursive)
+{
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+
+    DirRecord rec;
+    if(fat32_resolve_path(path, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", path);
+        return -1;
+    }
+    bool isDir = rec.entry.DIR_Attr & ATTR_DIRECTORY;
+    if(isDir && !recursive) {
+        cmd_printf("Error: %s is a directory (use -r)\n", path);
+        return -1;
+    }
+
+    if(!isDir) {
+        if(add_tree_file(t, path, &rec.entry) != 0)
+            t->failed = true;
+    } else {
+        uint32_t dirCluster = fat32_get_cluster(&rec.entry);
+        if(dirCluster == 0)
+            dirCluster = fs.bs.BPB_RootClus;
+        WalkOps ops = { tree_visit, NULL, t, cmd_output() };
+        if(fat32_walk(dirCluster, path, NULL, &ops) != 0)
+            t->failed = true;
+    }
+    if(t->failed) {
+        cmd_printf("Error: Could not walk %s\n", path);
+        return -1;
+    }
+    qsort(t->files, t->count, sizeof(TreeFile), cmp_tree_files);
+    return 0;
+}
+
+static void *tree_worker(void *arg)
+{
+    FileTree *t = arg;
+    uint8_t *buf = bufpool_get(fs.pool);
+
+    while(1)
+    {
+        size_t i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+        if(i >= t->count)
+            break;
+        TreeFile *f = &t->files[i];
+        f->failed = (buf == NULL || t->fn(t->ctx, i, f, buf) != 0);
+    }
+    bufpool_put(fs.pool, buf);
+    return NULL;
+}
+
+// runs fn on every listed file, spread over a pool of threads
+static void tree_run(FileTree *t, TreeFileFn fn, void *ctx)
+{
+    int count = walk_thread_count();
+    if((size_t)count > t->count)
+        count = t->count ? (int)t->count : 1;
+    pthread_t threads[count];
+    int started = 0;
+
+    t->fn = fn;
+    t->ctx = ctx;
+    t->next = 0;
+    for(int i = 1; i < count; i++) {
+        if(pthread_create(&threads[i], NULL, tree_worker, t) != 0)
+            break;
+        started++;
+    }
+    tree_worker(t);
+    for(int i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void tree_free(FileTree *t)
+{
+    for(size_t i = 0; i < t->count; i++)
+        free(t->files[i].path);
+    free(t->files);
+    pthread_mutex_destroy(&t->lock);
+}
+
+typedef struct {
+    SumAlgo algo;
+    char (*hex)[SUM_HEX_MAX];   // one per listed file
+} SumJob;
+
+// hashes a file straight from its chain, one read per run of adjacent clusters
+static int sum_chain(void *ctx, size_t i, const TreeFile *f, uint8_t *buf)
+{
+    const SumJob *job = ctx;
+    uint32_t clusterSize = fat32_get_cluster_size();
+    uint32_t maxRun = (SUM_CHUNK / clusterSize) ? SUM_CHUNK / clusterSize : 1;
+    uint32_t cluster = f->first;
+    uint32_t left = f->size;
+    uint32_t steps = 0;
+    Hasher h;
+
+    sum_init(&h, job->algo);
+    while(left > 0)
+    {
+        if(cluster < 2 || cluster >= FAT_EOC || steps > fs.total_clusters)
+            return -1;
+
+        uint32_t run = 1;
+        while(run < maxRun && (uint64_t)run * clusterSize < left &&
+              fat32_get_fat_entry(cluster + run - 1) == cluster + run)
+            run++;
+
+        uint32_t n = ((uint64_t)run * clusterSize < left) ? run * clusterSize : left;
+        if(fat32_read_at(fat32_cluster_to_offset(cluster), buf, n) != 0)
+            return -1;
+        sum_update(&h, buf, n);
+
+        left -= n;
+        steps += run;
+        cluster = fat32_get_fat_entry(cluster + run - 1);
+    }
+    sum_final(&h, job->hex[i]);
+    return 0;
+}
+
+/*
+ * sum FILE | sum -r DIR, optionally naming the algorithm. The tree is
+ * listed with the parallel walker, then files are hashed by a thread pool
+ * following chains through the FAT cache and printed sorted by path.
+ */
+void cmd_sum(tokenlist *tokens)
+{
+    bool recursive = (tokens->size >= 3 && strcmp(tokens->items[1], "-r") == 0);
+    size_t argi = recursive ? 2 : 1;
+    SumJob job;
+
+    memset(&job, 0, sizeof(job));
+    job.algo = SUM_CRC32C;
+    if(tokens->size < argi + 1 || tokens->size > argi + 2 ||
+       (tokens->size == argi + 2 && sum_parse_algo(tokens->items[argi + 1], &job.algo) != 0)) {
+        cmd_printf("Error: sum takes FILE or -r DIR, then crc32c (default) or xxh64\n");
+        return;
+    }
+
+    if(flush_session() != 0)
+        return;
+
+    double start = mono_secs();
+
+    const char *path = tokens->items[argi];
+    FileTree t;
+    if(tree_collect(&t, path, recursive) != 0) {
+        tree_free(&t);
+        return;
+    }
+    job.hex = calloc(t.count ? t.count : 1, SUM_HEX_MAX);
+    if(job.hex == NULL) {
+        cmd_printf("Error: Out of memory\n");
+        tree_free(&t);
+        return;
+    }
+    tree_run(&t, sum_chain, &job);
+
+    uint64_t bytes = 0;
+    for(size_t i = 0; i < t.count; i++) {
+        TreeFile *f = &t.files[i];
+        if(f->failed) {
+            cmd_printf("Error: Could not read %s\n", f->path);
+            continue;
+        }
+        cmd_printf("%s  %s\n", job.hex[i], f->path);
+        bytes += f->size;
+    }
+
+    if(recursive) {
+        double secs = mono_secs() - start;
+        cmd_printf("Hashed %zu files, %llu bytes with %s in %.3f s", t.count,
+                   (unsigned long long)bytes, sum_algo_name(job.algo), secs);
+        if(secs > 0)
+            cmd_printf(" (%.1f MB/s)", bytes / secs / 1e6);
+        cmd_printf("\n");
+    }
+
+    free(job.hex);
+    tree_free(&t);
+}
+
+#define GREP_SHOWN  16      // offsets listed per file, further matches are only counted
+
+typedef struct {
+    uint64_t matches;
+    uint64_t offsets[GREP_SHOWN];
+} GrepHits;
+
+typedef struct {
+    const uint8_t *pattern;
+    size_t pattern_len;
+    GrepHits *hits;         // one per listed file
+} GrepJob;
+
+static void grep_match(GrepHits *h, uint64_t offset)
+{
+    if(h->matches < GREP_SHOWN)
+        h->offsets[h->matches] = offset;
+    h->matches++;
+}
+
+/*
+ * Searches a file straight from its chain, one read per run of adjacent
+ * clusters. Reads land SEARCH_MAX bytes into buf; the last pattern_len - 1
+ * bytes of the previous read are moved in front of them, so a match that
+ * straddles two reads is found whole. Matches don't overlap.
+ */
+static int grep_chain(void *ctx, size_t i, const TreeFile *f, uint8_t *buf)
+{
+    const GrepJob *job = ctx;
+    GrepHits *hits = &job->hits[i];
+    uint32_t clusterSize = fat32_get_cluster_size();
+    uint32_t room = SUM_CHUNK - SEARCH_MAX;
+    uint32_t maxRun = (room / clusterSize) ? room / clusterSize : 1;
+    size_t m = job->pattern_len;
+    uint8_t *data = buf + SEARCH_MAX;
+    uint32_t cluster = f->first;
+    uint32_t left = f->size;
+    uint32_t steps = 0;
+    uint64_t base = 0;          // file offset of data[0]
+    uint64_t resume = 0;        // where the next match may start
+    size_t carry = 0;
+
+    while(left > 0)
+    {
+        if(cluster < 2 || cluster >= FAT_EOC || steps > fs.total_clusters)
+            return -1;
+
+        uint32_t run = 1;
+        while(run < maxRun && (uint64_t)run * clusterSize < left &&
+              fat32_get_fat_entry(cluster + run - 1) == cluster + run)
+            run++;
+
+        uint32_t n = ((uint64_t)run * clusterSize < left) ? run * clusterSize : left;
+        if(fat32_read_at(fat32_cluster_to_offset(cluster), data, n) != 0)
+            return -1;
+
+        const uint8_t *from = data - carry;
+        size_t span = carry + n;
+        uint64_t fromOff = base - carry;
+        size_t skip = (resume > fromOff) ? (size_t)(resume - fromOff) : 0;
+        while(skip + m <= span) {
+            const uint8_t *p = search_find(from + skip, span - skip, job->pattern, m);
+            if(p == NULL)
+                break;
+            skip = (size_t)(p - from) + m;
+            grep_match(hits, fromOff + (size_t)(p - from));
+            resume = fromOff + skip;
+        }
+
+        carry = (span < m - 1) ? span : m - 1;
+        memmove(data - carry, from + span - carry, carry);
+        base += n;
+        left -= n;
+        steps += run;
+        cluster = fat32_get_fat_entry(cluster + run - 1);
+    }
+    return 0;
+}
+
+/*
+ * grep PATTERN FILE | grep -r PATTERN DIR. Like sum, the tree is listed
+ * with the parallel walker and files are searched by a thread pool that
+ * follows chains through the FAT cache; every match prints as PATH:OFFSET,
+ * sorted by path, with the byte offset of the match in the file.
+ */
+void cmd_grep(tokenlist *tokens)
+{
+    bool recursive = (tokens->size == 4 && strcmp(tokens->items[1], "-r") == 0);
+    size_t argi = recursive ? 2 : 1;
+    GrepJob job;
+
+    memset(&job, 0, sizeof(job));
+    if(tokens->size != argi + 2) {
+        cmd_printf("Error: grep takes PATTERN FILE or -r PATTERN DIR\n");
+        return;
+    }
+    job.pattern = (const uint8_t *)tokens->items[argi];
+    job.pattern_len = strlen(tokens->items[argi]);
+    if(job.pattern_len == 0 || job.pattern_len > SEARCH_MAX) {
+        cmd_printf("Error: The pattern has to be 1 to %d bytes long\n", SEARCH_MAX);
+        return;
+    }
+
+    if(flush_session() != 0)
+        return;
+
+    double start = mono_secs();
+
+    const char *path = tokens->items[argi + 1];
+    FileTree t;
+    if(tree_collect(&t, path, recursive) != 0) {
+        tree_free(&t);
+        return;
+    }
+    job.hits = calloc(t.count ? t.count : 1, sizeof(GrepHits));
+    if(job.hits == NULL) {
+        cmd_printf("Error: Out of memory\n");
+        tree_free(&t);
+        return;
+    }
+    tree_run(&t, grep_chain, &job);
+
+    uint64_t bytes = 0, matches = 0;
+    size_t hitFiles = 0;
+    for(size_t i = 0; i < t.count; i++) {
+        TreeFile *f = &t.files[i];
+        GrepHits *h = &job.hits[i];
+        if(f->failed) {
+            cmd_printf("Error: Could not read %s\n", f->path);
+            continue;
+        }
+        bytes += f->size;
+        if(h->matches == 0)
+            continue;
+        hitFiles++;
+        matches += h->matches;
+        for(uint64_t k = 0; k < h->matches && k < GREP_SHOWN; k++)
+            cmd_printf("%s:%llu\n", f->path, (unsigned long long)h->offsets[k]);
+        if(h->matches > GREP_SHOWN)
+            cmd_printf("%s: %llu more matches\n", f->path,
+                       (unsigned long long)(h->matches - GREP_SHOWN));
+    }
+
+    if(recursive) {
+        double secs = mono_secs() - start;
+        cmd_printf("Searched %zu files, %llu bytes in %.3f s", t.count,
+                   (unsigned long long)bytes, secs);
+        if(secs > 0)
+            cmd_printf(" (%.1f MB/s)", bytes / secs / 1e6);
+        cmd_printf(", %llu matches in %zu files\n", (unsigned long long)matches, hitFiles);
+    }
+
+    free(job.hits);
+    tree_free(&t);
+}
+
+// one directory still being summed; completes when its own scan and all
+// of its subdirectories are done
+typedef struct DuNode {
+    struct DuNode *parent;
+    char *path;
+    uint64_t bytes;
+    long pending;
+} DuNode;
+
+typedef struct {
+    bool summary;
+    uint32_t cluster_size;
+} DuOpts;
+
+static void *du_visit(WalkWorker *w, const DirRecord *rec, const char *path,
+                      void *parent, void *ctx)
+{
+    (void)w;
+    DuOpts *opts = ctx;
+    DuNode *p = parent;
+    uint64_t bytes = (uint64_t)walk_chain_length(fat32_get_cluster(&rec->entry)) *
+                     opts->cluster_size;
+
+    if(!(rec->entry.DIR_Attr & ATTR_DIRECTORY)) {
+        __atomic_add_fetch(&p->bytes, bytes, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    DuNode *node = malloc(sizeof(DuNode));
+    if(node == NULL)
+        return NULL;
+    node->parent = p;
+    node->path = strdup(path);
+    node->bytes = bytes;
+    node->pending = 1;
+    __atomic_add_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+    return node;
+}
+
+static void du_dir_done(WalkWorker *w, void *dir, void *ctx)
+{
+    DuOpts *opts = ctx;
+    DuNode *node = dir;
+
+    while(node != NULL && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        DuNode *parent = node->parent;
+        uint64_t bytes = __atomic_load_n(&node->bytes, __ATOMIC_ACQUIRE);
+
+        if(!opts->summary || parent == NULL)
+            walk_emit(w, "%llu\t%s\n", (unsigned long long)((bytes + 1023) / 1024),
+                      node->path ? node->path : "?");
+
+        if(parent != NULL) {
+            __atomic_add_fetch(&parent->bytes, bytes, __ATOMIC_RELEASE);
+            free(node->path);
+            free(node);
+        }
+        node = parent;
+    }
+}
+
+// disk usage in KiB, from the length of each cluster chain
+void cmd_du(tokenlist *tokens)
+{
+    DuOpts opts = { false, fat32_get_cluster_size() };
+    const char *path = ".";
+
+    for(size_t i = 1; i < tokens->size; i++) {
+        if(strcmp(tokens->items[i], "-s") == 0)
+            opts.summary = true;
+        else
+            path = tokens->items[i];
+    }
+    if(flush_session() != 0)
+        return;
+
+    DirRecord rec;
+    if(fat32_resolve_path(path, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", path);
+        return;
+    }
+
+    uint32_t first = fat32_get_cluster(&rec.entry);
+    if(!(rec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+        uint64_t bytes = (uint64_t)walk_chain_length(first) * opts.cluster_size;
+        cmd_printf("%llu\t%s\n", (unsigned long long)((bytes + 1023) / 1024), path);
+        return;
+    }
+    if(first == 0)
+        first = fs.bs.BPB_RootClus;
+
+    DuNode root = { NULL, (char *)path, 0, 1 };
+    root.bytes = (uint64_t)walk_chain_length(first) * opts.cluster_size;
+
+    fflush(cmd_output());
+    WalkOps ops = { du_visit, du_dir_done, &opts, cmd_output() };
+    if(fat32_walk(first, path, &root, &ops) != 0)
+        cmd_printf("Error: Could not walk %s\n", path);
+}
+
+typedef struct {
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t clusters;
+    uint64_t extents;
+    uint64_t fragmented;    // chains of more than one extent
+    uint64_t gaps;          // clusters skipped, forward or back, between extents
+    uint64_t reach;         // from the cluster holding each entry to its data
+    uint32_t most;          // extents of the worst chain
+} FragStats;
+
+// adds one chain; entry is the directory cluster holding its entry, 0 if none
+static void frag_chain(FragStats *st, uint32_t first, uint32_t entry, bool dir)
+{
+    if(first < 2 || first >= FAT_EOC)
+        return;
+
+    uint32_t clusters = 1, extents = 1;
+    uint64_t gaps = 0;
+    for(uint32_t c = first, next; clusters <= fs.total_clusters; c = next, clusters++) {
+        next = fat32_get_fat_entry(c);
+        if(next < 2 || next >= FAT_EOC)
+            break;
+        if(next != c + 1) {
+            extents++;
+            gaps += (next > c) ? next - c - 1 : c + 1 - next;
+        }
+    }
+
+    __atomic_add_fetch(dir ? &st->dirs : &st->files, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->clusters, clusters, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->extents, extents, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->gaps, gaps, __ATOMIC_RELAXED);
+    if(entry >= 2)
+        __atomic_add_fetch(&st->reach, (first > entry) ? first - entry : entry - first,
+                           __ATOMIC_RELAXED);
+    if(extents > 1)
+        __atomic_add_fetch(&st->fragmented, 1, __ATOMIC_RELAXED);
+
+    uint32_t most = __atomic_load_n(&st->most, __ATOMIC_RELAXED);
+    while(extents > most &&
+          !__atomic_compare_exchange_n(&st->most, &most, extents, true,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void *frag_visit(WalkWorker *w, const DirRecord *rec, const char *path,
+                        void *parent, void *ctx)
+{
+    (void)w;
+    (void)path;
+    (void)parent;
+    bool dir = (rec->entry.DIR_Attr & ATTR_DIRECTORY) != 0;
+    frag_chain(ctx, fat32_get_cluster(&rec->entry), rec->cluster, dir);
+    return NULL;
+}
+
+/*
+ * How scattered the chains below a path are: how many extents they take,
+ * how far a reader reading each one front to back has to jump between
+ * them, and how far each file's data sits from its directory entry.
+ */
+void cmd_frag(tokenlist *tokens)
+{
+    if(tokens->size > 2) {
+        cmd_printf("Error: frag takes at most one path argument\n");
+        return;
+    }
+
+    if(flush_session() != 0)
+        return;
+
+    const char *path = (tokens->size == 2) ? tokens->items[1] : ".";
+    DirRecord rec;
+    if(fat32_resolve_path(path, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", path);
+        return;
+    }
+
+    FragStats st;
+    memset(&st, 0, sizeof(st));
+    uint32_t first = fat32_get_cluster(&rec.entry);
+    if(!(rec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+        frag_chain(&st, first, rec.cluster, false);
+    } else {
+        if(first == 0)
+            first = fs.bs.BPB_RootClus;
+        frag_chain(&st, first, 0, true);
+
+        fflush(cmd_output());
+        WalkOps ops = { frag_visit, NULL, &st, cmd_output() };
+        if(fat32_walk(first, path, NULL, &ops) != 0) {
+            cmd_printf("Error: Could not walk %s\n", path);
+            return;
+        }
+    }
+
+    uint64_t chains = st.files + st.dirs;
+    uint32_t clusterSize = fat32_get_cluster_size();
+    cmd_printf("%llu files and %llu directories in %llu clusters, %llu extents\n",
+               (unsigned long long)st.files, (unsigned long long)st.dirs,
+               (unsigned long long)st.clusters, (unsigned long long)st.extents);
+    if(chains == 0)
+        return;
+    cmd_printf("Fragmented: %llu chains (%.1f%%), %.2f extents per chain, at most %u\n",
+               (unsigned long long)st.fragmented, 100.0 * st.fragmented / chains,
+               (double)st.extents / chains, st.most);
+    cmd_printf("Seek distance: %llu clusters between extents, %llu from entries to data, "
+               "%.1f MiB in all\n", (unsigned long long)st.gaps, (unsigned long long)st.reach,
+               (double)(st.gaps + st.reach) * clusterSize / (1024 * 1024));
+}
+
+void cmd_compact(tokenlist *tokens)
+{
+    if(tokens->size == 3 && strcmp(tokens->items[1], "-auto") == 0)
+    {
+        const char *arg = tokens->items[2];
+        long pct = 0;
+        if(strcmp(arg, "off") != 0) {
+            char *end;
+            pct = strtol(arg, &end, 10);
+            if(end == arg || *end != '\0' || pct < 1 || pct > 100) {
+                cmd_printf("Error: -auto takes a percentage (1-100) or off\n");
+                return;
+            }
+        }
+        fs.compact_threshold = (uint8_t)pct;
+        return;
+    }
+
+    if(tokens->size > 2) {
+        cmd_printf("Error: compact takes at most one DIRNAME argument\n");
+        return;
+    }
+
+    const char *path = (tokens->size == 2) ? tokens->items[1] : ".";
+    DirRecord rec;
+    if(fat32_resolve_path(path, &rec) != 0) {
+        cmd_printf("Error: %s does not exist\n", path);
+        return;
+    }
+    if(!(rec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+        cmd_printf("Error: %s is not a directory\n", path);
+        return;
+    }
+
+    uint32_t dirCluster = fat32_get_cluster(&rec.entry);
+    if(dirCluster == 0)
+        dirCluster = fs.bs.BPB_RootClus;
+
+    uint32_t removed, freed;
+    if(fat32_compact_dir(dirCluster, &removed, &freed) != 0) {
+        cmd_printf("Error: Could not compact %s\n", path);
+        return;
+    }
+    cmd_printf("Removed %u deleted entries, freed %u clusters\n", removed, freed);
 }
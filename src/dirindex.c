@@ -0,0 +1,426 @@
+// dirindex.c
+#include <stdlib.h>
+#include <pthread.h>
+#include "dirindex.h"
+#include "fat32.h"
+
+typedef struct {
+    uint64_t key;           // 0 marks an empty cell
+    uint32_t a;
+    uint32_t b;
+} Cell;
+
+// open addressing with linear probing; keys may repeat
+typedef struct {
+    Cell *cells;
+    uint32_t mask;          // capacity - 1, a power of two
+    uint32_t count;
+} Table;
+
+typedef struct {
+    uint32_t *starts;
+    uint32_t count;
+    uint32_t cap;
+} RunList;
+
+/*
+ * Free runs are kept twice, by first slot and by the slot after them, so
+ * a released run merges with its neighbours in O(1). The lists sort run
+ * starts by length for dirindex_take; entries of runs that were merged or
+ * taken since are left in place and skipped when they come up.
+ */
+struct DirIndex {
+    uint32_t first;
+    uint32_t per_cluster;
+    uint32_t *chain;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t end;
+    uint32_t deleted;       // slots in front of end that are free runs
+    uint64_t stamp;
+    Table where;            // cluster -> position in the chain
+    Table runs;             // first slot -> length
+    Table run_ends;         // slot after the run -> first slot
+    RunList lists[DIRINDEX_RUN + 1];
+    Table names[DIRINDEX_TABLES];
+};
+
+static DirIndex *indexes[DIRINDEX_MAX];
+static uint64_t index_clock;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t cell_home(const Table *t, uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key & t->mask;
+}
+
+static int table_grow(Table *t)
+{
+    uint32_t oldCap = (t->cells != NULL) ? t->mask + 1 : 0;
+    uint32_t cap = oldCap ? oldCap * 2 : 64;
+    Cell *old = t->cells;
+
+    t->cells = calloc(cap, sizeof(Cell));
+    if(t->cells == NULL) {
+        t->cells = old;
+        return -1;
+    }
+    t->mask = cap - 1;
+    for(uint32_t i = 0; i < oldCap; i++) {
+        if(old[i].key == 0)
+            continue;
+        uint32_t h = cell_home(t, old[i].key);
+        while(t->cells[h].key != 0)
+            h = (h + 1) & t->mask;
+        t->cells[h] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static int table_put(Table *t, uint64_t key, uint32_t a, uint32_t b)
+{
+    if((t->cells == NULL || (t->count + 1) * 4 > (t->mask + 1) * 3) && table_grow(t) != 0)
+        return -1;
+
+    uint32_t h = cell_home(t, key);
+    while(t->cells[h].key != 0)
+        h = (h + 1) & t->mask;
+    t->cells[h].key = key;
+    t->cells[h].a = a;
+    t->cells[h].b = b;
+    t->count++;
+    return 0;
+}
+
+// the next cell under key from probe position *pos on, which is advanced
+static Cell *table_next(const Table *t, uint64_t key, uint32_t *pos)
+{
+    if(t->cells == NULL)
+        return NULL;
+    for(uint32_t i = (cell_home(t, key) + *pos) & t->mask; t->cells[i].key != 0;
+        i = (i + 1) & t->mask) {
+        (*pos)++;
+        if(t->cells[i].key == key)
+            return &t->cells[i];
+    }
+    return NULL;
+}
+
+static Cell *table_find(const Table *t, uint64_t key)
+{
+    uint32_t pos = 0;
+    return table_next(t, key, &pos);
+}
+
+// backward-shift deletion, so probe chains never hold tombstones
+static void table_delete(Table *t, Cell *c)
+{
+    uint32_t i = (uint32_t)(c - t->cells), j = i;
+
+    for(;;) {
+        j = (j + 1) & t->mask;
+        if(t->cells[j].key == 0)
+            break;
+        uint32_t h = cell_home(t, t->cells[j].key);
+        if(((j - h) & t->mask) >= ((j - i) & t->mask)) {
+            t->cells[i] = t->cells[j];
+            i = j;
+        }
+    }
+    t->cells[i].key = 0;
+    t->count--;
+}
+
+static void table_free(Table *t)
+{
+    free(t->cells);
+    t->cells = NULL;
+    t->mask = t->count = 0;
+}
+
+static inline uint64_t name_key(uint64_t hash)
+{
+    return hash ? hash : 1;
+}
+
+static void index_free(DirIndex *ix)
+{
+    free(ix->chain);
+    table_free(&ix->where);
+    table_free(&ix->runs);
+    table_free(&ix->run_ends);
+    for(int i = 0; i <= DIRINDEX_RUN; i++)
+        free(ix->lists[i].starts);
+    for(int i = 0; i < DIRINDEX_TABLES; i++)
+        table_free(&ix->names[i]);
+    free(ix);
+}
+
+DirIndex *dirindex_find(uint32_t dir_cluster)
+{
+    DirIndex *found = NULL;
+
+    pthread_mutex_lock(&index_lock);
+    for(int i = 0; i < DIRINDEX_MAX; i++) {
+        if(indexes[i] != NULL && indexes[i]->first == dir_cluster) {
+            found = indexes[i];
+            found->stamp = ++index_clock;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    return found;
+}
+
+DirIndex *dirindex_create(uint32_t dir_cluster, uint32_t slots_per_cluster)
+{
+    DirIndex *ix = calloc(1, sizeof(DirIndex));
+    if(ix == NULL)
+        return NULL;
+    ix->first = dir_cluster;
+    ix->per_cluster = slots_per_cluster;
+
+    pthread_mutex_lock(&index_lock);
+    int victim = 0;
+    for(int i = 0; i < DIRINDEX_MAX; i++) {
+        if(indexes[i] == NULL) {
+            victim = i;
+            break;
+        }
+        if(indexes[i]->stamp < indexes[victim]->stamp)
+            victim = i;
+    }
+    if(indexes[victim] != NULL)
+        index_free(indexes[victim]);
+    ix->stamp = ++index_clock;
+    indexes[victim] = ix;
+    pthread_mutex_unlock(&index_lock);
+    return ix;
+}
+
+void dirindex_drop(DirIndex *ix)
+{
+    pthread_mutex_lock(&index_lock);
+    for(int i = 0; i < DIRINDEX_MAX; i++) {
+        if(indexes[i] == ix) {
+            indexes[i] = NULL;
+            index_free(ix);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void dirindex_forget(uint32_t cluster)
+{
+    pthread_mutex_lock(&index_lock);
+    for(int i = 0; i < DIRINDEX_MAX; i++) {
+        if(indexes[i] != NULL && table_find(&indexes[i]->where, cluster) != NULL) {
+            index_free(indexes[i]);
+            indexes[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void dirindex_clear(void)
+{
+    pthread_mutex_lock(&index_lock);
+    for(int i = 0; i < DIRINDEX_MAX; i++) {
+        if(indexes[i] != NULL)
+            index_free(indexes[i]);
+        indexes[i] = NULL;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+DirIndex *dirindex_owner(uint32_t cluster, uint32_t offset, uint32_t *slot)
+{
+    DirIndex *found = NULL;
+
+    pthread_mutex_lock(&index_lock);
+    for(int i = 0; i < DIRINDEX_MAX && found == NULL; i++) {
+        Cell *c = (indexes[i] != NULL) ? table_find(&indexes[i]->where, cluster) : NULL;
+        if(c != NULL) {
+            found = indexes[i];
+            *slot = c->a * found->per_cluster + offset / sizeof(DirEntry);
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    return found;
+}
+
+int dirindex_append(DirIndex *ix, uint32_t cluster)
+{
+    // a cluster already in the chain means the chain loops
+    if(table_find(&ix->where, cluster) != NULL)
+        return -1;
+    if(ix->count == ix->cap) {
+        uint32_t cap = ix->cap ? ix->cap * 2 : 16;
+        uint32_t *grown = realloc(ix->chain, cap * sizeof(uint32_t));
+        if(grown == NULL)
+            return -1;
+        ix->chain = grown;
+        ix->cap = cap;
+    }
+    if(table_put(&ix->where, cluster, ix->count, 0) != 0)
+        return -1;
+    ix->chain[ix->count++] = cluster;
+    return 0;
+}
+
+uint32_t dirindex_last(const DirIndex *ix)
+{
+    return ix->count ? ix->chain[ix->count - 1] : 0;
+}
+
+uint32_t dirindex_capacity(const DirIndex *ix)
+{
+    return ix->count * ix->per_cluster;
+}
+
+bool dirindex_locate(const DirIndex *ix, uint32_t slot, uint32_t *cluster, uint32_t *offset)
+{
+    if(slot >= dirindex_capacity(ix))
+        return false;
+    *cluster = ix->chain[slot / ix->per_cluster];
+    *offset = (slot % ix->per_cluster) * sizeof(DirEntry);
+    return true;
+}
+
+uint32_t dirindex_end(const DirIndex *ix)
+{
+    return ix->end;
+}
+
+void dirindex_set_end(DirIndex *ix, uint32_t slot)
+{
+    ix->end = slot;
+}
+
+uint32_t dirindex_deleted(const DirIndex *ix)
+{
+    return ix->deleted;
+}
+
+// best effort: a run that fails to go in is only space not reused
+static void run_add(DirIndex *ix, uint32_t start, uint32_t len)
+{
+    if(table_put(&ix->runs, (uint64_t)start + 1, len, 0) != 0)
+        return;
+    if(table_put(&ix->run_ends, (uint64_t)start + len + 1, start, 0) != 0) {
+        table_delete(&ix->runs, table_find(&ix->runs, (uint64_t)start + 1));
+        return;
+    }
+
+    RunList *l = &ix->lists[len < DIRINDEX_RUN ? len : DIRINDEX_RUN];
+    if(l->count == l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 16;
+        uint32_t *grown = realloc(l->starts, cap * sizeof(uint32_t));
+        if(grown == NULL)
+            return;
+        l->starts = grown;
+        l->cap = cap;
+    }
+    l->starts[l->count++] = start;
+}
+
+static void run_delete(DirIndex *ix, uint32_t start, uint32_t len)
+{
+    Cell *c = table_find(&ix->runs, (uint64_t)start + 1);
+    if(c != NULL)
+        table_delete(&ix->runs, c);
+    c = table_find(&ix->run_ends, (uint64_t)start + len + 1);
+    if(c != NULL)
+        table_delete(&ix->run_ends, c);
+}
+
+uint32_t dirindex_take(DirIndex *ix, uint32_t count)
+{
+    for(uint32_t len = count; len <= DIRINDEX_RUN; len++)
+    {
+        RunList *l = &ix->lists[len];
+        while(l->count > 0)
+        {
+            uint32_t start = l->starts[--l->count];
+            Cell *c = table_find(&ix->runs, (uint64_t)start + 1);
+            if(c == NULL || (len < DIRINDEX_RUN ? c->a != len : c->a < DIRINDEX_RUN))
+                continue;
+
+            uint32_t have = c->a;
+            run_delete(ix, start, have);
+            ix->deleted -= count;
+            if(have > count)
+                run_add(ix, start + count, have - count);
+            return start;
+        }
+    }
+
+    uint32_t start = ix->end;
+    ix->end += count;
+    return start;
+}
+
+void dirindex_release(DirIndex *ix, uint32_t slot, uint32_t count)
+{
+    ix->deleted += count;
+    Cell *c = table_find(&ix->run_ends, (uint64_t)slot + 1);
+    if(c != NULL) {
+        uint32_t left = c->a;
+        run_delete(ix, left, slot - left);
+        count += slot - left;
+        slot = left;
+    }
+    c = table_find(&ix->runs, (uint64_t)slot + count + 1);
+    if(c != NULL) {
+        uint32_t right = c->a;
+        run_delete(ix, slot + count, right);
+        count += right;
+    }
+    run_add(ix, slot, count);
+}
+
+int dirindex_name_add(DirIndex *ix, int table, uint64_t hash, uint32_t slot, uint32_t lfn_count)
+{
+    return table_put(&ix->names[table], name_key(hash), slot, lfn_count);
+}
+
+void dirindex_name_remove(DirIndex *ix, int table, uint64_t hash, uint32_t slot)
+{
+    Table *t = &ix->names[table];
+    uint32_t pos = 0;
+    Cell *c;
+
+    while((c = table_next(t, name_key(hash), &pos)) != NULL) {
+        if(c->a == slot) {
+            table_delete(t, c);
+            return;
+        }
+    }
+}
+
+int dirindex_name_set(DirIndex *ix, int table, uint64_t hash, uint32_t slot)
+{
+    Cell *c = table_find(&ix->names[table], name_key(hash));
+    if(c != NULL) {
+        c->a = slot;
+        return 0;
+    }
+    return table_put(&ix->names[table], name_key(hash), slot, 0);
+}
+
+bool dirindex_name_next(const DirIndex *ix, int table, uint64_t hash, uint32_t *pos,
+                        uint32_t *slot, uint32_t *lfn_count)
+{
+    Cell *c = table_next(&ix->names[table], name_key(hash), pos);
+    if(c == NULL)
+        return false;
+    *slot = c->a;
+    if(lfn_count != NULL)
+        *lfn_count = c->b;
+    return true;
+}
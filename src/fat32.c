@@ -1,30 +1,380 @@
 // fat32.c
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include "fat32.h"
+#include "overlay.h"
+#include "cimage.h"
+#include "fatcache.h"
+#include "writeback.h"
+#include "bufpool.h"
+#include "dirindex.h"
+#include "io.h"
 
 FAT32 fs;
+__thread Session *fs_session;
 
-int fat32_mount(const char *image_path)
+static size_t fat_cache_budget = FATCACHE_DEFAULT;
+static unsigned write_behind_ms;
+static size_t write_behind_bytes = WRITEBACK_DEFAULT;
+static bool direct_io;
+static bool huge_buffers;
+static AllocPolicy alloc_policy = ALLOC_LOWEST;
+
+// set while a trace runs so replays stamp the same times as the recording
+static time_t pinned_clock;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+// scratch buffers are pool buffers; threads give theirs back when they exit
+static void scratch_release(void *buf)
+{
+    bufpool_put(fs.pool, buf);
+}
+
+static void scratch_key_init(void)
+{
+    pthread_key_create(&scratch_key, scratch_release);
+}
+
+void fat32_lock_shared(void)
+{
+    pthread_rwlock_rdlock(&fs.lock);
+}
+
+void fat32_lock_exclusive(void)
+{
+    pthread_rwlock_wrlock(&fs.lock);
+}
+
+void fat32_unlock(void)
+{
+    // FAT pages only get dirty under the exclusive lock; they reach the
+    // image before anyone else gets to look at it
+    fatcache_flush(fs.fat_cache);
+    pthread_rwlock_unlock(&fs.lock);
+}
+
+#define DIRECT_ALIGN    BUFPOOL_ALIGN
+
+// read-modify-write of sectors shared with a neighbouring write
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool direct_aligned(uint64_t offset, const void *buffer, size_t len)
+{
+    return ((offset | len | (uintptr_t)buffer) & (DIRECT_ALIGN - 1)) == 0;
+}
+
+/*
+ * O_DIRECT wants the offset, the length and the memory sector aligned.
+ * Requests that are go straight to the image; the rest pass through a
+ * pool buffer, up to a megabyte of whole sectors per syscall.
+ */
+static int direct_read(uint64_t offset, void *buffer, size_t len)
+{
+    if(direct_aligned(offset, buffer, len))
+        return io_pread_full(fs.fd, offset, buffer, len);
+
+    uint8_t *window = bufpool_get(fs.pool);
+    if(window == NULL)
+        return -1;
+
+    uint8_t *p = buffer;
+    int ret = 0;
+    while(len > 0 && ret == 0)
+    {
+        uint64_t start = offset & ~(uint64_t)(DIRECT_ALIGN - 1);
+        size_t skip = (size_t)(offset - start);
+        size_t n = (len < BUFPOOL_BUFFER - skip) ? len : BUFPOOL_BUFFER - skip;
+        size_t span = (skip + n + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+
+        ret = io_pread_full(fs.fd, start, window, span);
+        if(ret == 0)
+            memcpy(p, window + skip, n);
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    bufpool_put(fs.pool, window);
+    return ret;
+}
+
+static int direct_write(uint64_t offset, const void *buffer, size_t len)
+{
+    if(direct_aligned(offset, buffer, len))
+        return io_pwrite_full(fs.fd, offset, buffer, len);
+
+    uint8_t *window = bufpool_get(fs.pool);
+    if(window == NULL)
+        return -1;
+
+    const uint8_t *p = buffer;
+    int ret = 0;
+    while(len > 0 && ret == 0)
+    {
+        uint64_t start = offset & ~(uint64_t)(DIRECT_ALIGN - 1);
+        size_t skip = (size_t)(offset - start);
+        size_t n = (len < BUFPOOL_BUFFER - skip) ? len : BUFPOOL_BUFFER - skip;
+        size_t span = (skip + n + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        size_t tail = span - DIRECT_ALIGN;
+        bool headPartial = (skip != 0);
+        bool tailPartial = ((skip + n) % DIRECT_ALIGN != 0);
+
+        // the bytes around the write in its first and last sector come
+        // from the image
+        if(headPartial || tailPartial)
+            pthread_mutex_lock(&direct_lock);
+        if(headPartial)
+            ret = io_pread_full(fs.fd, start, window, DIRECT_ALIGN);
+        if(ret == 0 && tailPartial && !(headPartial && tail == 0))
+            ret = io_pread_full(fs.fd, start + tail, window + tail, DIRECT_ALIGN);
+        if(ret == 0) {
+            memcpy(window + skip, p, n);
+            ret = io_pwrite_full(fs.fd, start, window, span);
+        }
+        if(headPartial || tailPartial)
+            pthread_mutex_unlock(&direct_lock);
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    bufpool_put(fs.pool, window);
+    return ret;
+}
+
+// the image itself, below any overlay
+static int image_read(uint64_t offset, void *buffer, size_t len)
+{
+    if(fs.cimage != NULL)
+        return cimage_read(fs.cimage, offset, buffer, len);
+    if(fs.direct)
+        return direct_read(offset, buffer, len);
+    return io_pread_full(fs.fd, offset, buffer, len);
+}
+
+// the image or its delta, below the write-behind buffer
+static int store_read(uint64_t offset, void *buffer, size_t len)
+{
+    if(fs.overlay != NULL)
+        return overlay_read(fs.overlay, offset, buffer, len);
+    return image_read(offset, buffer, len);
+}
+
+static int store_write(uint64_t offset, const void *buffer, size_t len)
+{
+    if(fs.overlay != NULL)
+        return overlay_write(fs.overlay, offset, buffer, len);
+    if(fs.direct)
+        return direct_write(offset, buffer, len);
+    return io_pwrite_full(fs.fd, offset, buffer, len);
+}
+
+// positional I/O on the image; offsets are 64-bit so images past 4 GB work
+int fat32_read_at(uint64_t offset, void *buffer, size_t len)
+{
+    if(fs.writeback != NULL)
+        return writeback_read(fs.writeback, offset, buffer, len);
+    return store_read(offset, buffer, len);
+}
+
+// compressed images are only writable through an overlay
+static int write_ordered(uint64_t offset, const void *buffer, size_t len, WriteBackOrder order)
+{
+    if(fs.cimage != NULL && fs.overlay == NULL)
+        return -1;
+    if(fs.writeback != NULL)
+        return writeback_write(fs.writeback, offset, buffer, len, order);
+    return store_write(offset, buffer, len);
+}
+
+// the reserved sectors and the FATs go out with the FAT, the rest as file data
+int fat32_write_at(uint64_t offset, const void *buffer, size_t len)
+{
+    return write_ordered(offset, buffer, len,
+                         (offset < fs.data_start) ? WRITEBACK_FAT : WRITEBACK_DATA);
+}
+
+// directory contents, which write-behind holds back until the FAT is out
+int fat32_write_dir_at(uint64_t offset, const void *buffer, size_t len)
+{
+    return write_ordered(offset, buffer, len, WRITEBACK_DIR);
+}
+
+// the flusher copies dirty blocks between commands, never halfway through one
+static void flusher_hold(void)
+{
+    pthread_rwlock_rdlock(&fs.lock);
+}
+
+static void flusher_release(void)
+{
+    pthread_rwlock_unlock(&fs.lock);
+}
+
+// cleared once the kernel turns copy_file_range down for the image
+static bool copy_offload = true;
+
+/*
+ * Copies len bytes within the image. With the image written directly the
+ * kernel does it (and may share the blocks on filesystems that can);
+ * otherwise, or when it refuses, the bytes go through bounce. Direct I/O
+ * skips the kernel copy, which would go through the page cache.
+ */
+int fat32_copy_at(uint64_t from, uint64_t to, size_t len, void *bounce, bool *offloaded)
+{
+    *offloaded = false;
+    if(fs.overlay == NULL && fs.cimage == NULL && fs.writeback == NULL && !fs.direct &&
+       __atomic_load_n(&copy_offload, __ATOMIC_RELAXED))
+    {
+        loff_t in = (loff_t)from, out = (loff_t)to;
+        while(len > 0) {
+            ssize_t n = copy_file_range(fs.fd, &in, fs.fd, &out, len, 0);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0) {
+                if(n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP ||
+                             errno == EINVAL))
+                    __atomic_store_n(&copy_offload, false, __ATOMIC_RELAXED);
+                break;
+            }
+            len -= n;
+        }
+        if(len == 0) {
+            *offloaded = true;
+            return 0;
+        }
+        from = (uint64_t)in;
+        to = (uint64_t)out;
+    }
+
+    if(fat32_read_at(from, bounce, len) != 0 || fat32_write_at(to, bounce, len) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Switches the image to O_DIRECT. It has to be a whole number of sectors,
+ * and some filesystems take the flag only to fail the first read.
+ */
+static bool direct_open(uint64_t size)
+{
+    int flags = fcntl(fs.fd, F_GETFL);
+    if(flags < 0 || size % DIRECT_ALIGN != 0 || fcntl(fs.fd, F_SETFL, flags | O_DIRECT) != 0)
+        return false;
+
+    uint8_t *probe = bufpool_get(fs.pool);
+    bool ok = (probe != NULL && io_pread_full(fs.fd, 0, probe, DIRECT_ALIGN) == 0);
+    bufpool_put(fs.pool, probe);
+    if(!ok)
+        fcntl(fs.fd, F_SETFL, flags);
+    return ok;
+}
+
+static void mount_cleanup(void)
+{
+    fatcache_close(fs.fat_cache);
+    fs.fat_cache = NULL;
+    writeback_close(fs.writeback);
+    fs.writeback = NULL;
+    // only now that the flusher is gone
+    pthread_rwlock_destroy(&fs.lock);
+    overlay_close(fs.overlay);
+    fs.overlay = NULL;
+    cimage_close(fs.cimage);
+    fs.cimage = NULL;
+    bufpool_close(fs.pool);
+    fs.pool = NULL;
+    fs.direct = false;
+    dirindex_clear();
+    if(fs.fd >= 0) {
+        close(fs.fd);
+        fs.fd = -1;
+    }
+}
+
+// with an overlay_path the image is only read and all writes go to the delta
+int fat32_mount(const char *image_path, const char *overlay_path)
 {
-    fs.fp = fopen(image_path, "r+b");
-    if(fs.fp == NULL) {
+    fs.fd = open(image_path, (overlay_path != NULL) ? O_RDONLY : O_RDWR);
+    if(fs.fd < 0)
+        fs.fd = open(image_path, O_RDONLY);
+    if(fs.fd < 0) {
         fprintf(stderr, "Error: %s does not exist\n", image_path);
         return -1;
     }
 
-    if(fread(&fs.bs, sizeof(BootSector), 1, fs.fp) != 1){
+    // a steady stream of readers must not starve writers; the write-behind
+    // flusher takes it too
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs.lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    struct stat st;
+    fs.cimage = NULL;
+    fs.overlay = NULL;
+    fs.fat_cache = NULL;
+    fs.writeback = NULL;
+    fs.direct = false;
+    fs.alloc = alloc_policy;
+    fs.pool = bufpool_open(BUFPOOL_DEFAULT, huge_buffers);
+    if(fs.pool == NULL) {
+        fprintf(stderr, "Error: Cannot set up the buffer pool\n");
+        mount_cleanup();
+        return -1;
+    }
+    if(cimage_probe(fs.fd) && (fs.cimage = cimage_open(fs.fd)) == NULL) {
+        fprintf(stderr, "Error: %s is a damaged compressed image\n", image_path);
+        mount_cleanup();
+        return -1;
+    }
+    uint64_t size = (fs.cimage != NULL) ? cimage_size(fs.cimage) :
+                    (fstat(fs.fd, &st) == 0) ? (uint64_t)st.st_size : 0;
+    // compressed images are read in frames through their own buffers
+    if(direct_io && fs.cimage == NULL) {
+        fs.direct = direct_open(size);
+        if(!fs.direct)
+            fprintf(stderr, "Cannot use direct I/O on %s, going through the page cache\n",
+                    image_path);
+    }
+    if(overlay_path != NULL) {
+        fs.overlay = overlay_open(overlay_path, image_path, size, image_read);
+        if(fs.overlay == NULL) {
+            mount_cleanup();
+            return -1;
+        }
+    }
+    if(write_behind_ms > 0 && (fs.cimage == NULL || fs.overlay != NULL)) {
+        fs.writeback = writeback_open(store_read, store_write, size,
+                                      write_behind_ms, write_behind_bytes,
+                                      flusher_hold, flusher_release);
+        if(fs.writeback == NULL) {
+            fprintf(stderr, "Error: Cannot start the write-behind flusher\n");
+            mount_cleanup();
+            return -1;
+        }
+    }
+
+    if(fat32_read_at(0, &fs.bs, sizeof(BootSector)) != 0){
         fprintf(stderr, "Error: Failed to read boot sector\n");
-        fclose(fs.fp);
+        mount_cleanup();
         return -1;
     }
 
-    fs.fat_start = fs.bs.BPB_RsvdSecCnt * fs.bs.BPB_BytsPerSec;
+    fs.fat_start = (uint64_t)fs.bs.BPB_RsvdSecCnt * fs.bs.BPB_BytsPerSec;
     
     fs.data_start = fs.fat_start + 
-                    (fs.bs.BPB_NumFATs * fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec);
+                    ((uint64_t)fs.bs.BPB_NumFATs * fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec);
 
     uint32_t totSectors = (fs.bs.BPB_TotSec16 != 0) ? 
                            fs.bs.BPB_TotSec16 : fs.bs.BPB_TotSec32;
@@ -33,8 +383,13 @@ int fat32_mount(const char *image_path)
                             fs.bs.BPB_NumFATs * fs.bs.BPB_FATSz32);
     fs.total_clusters = dataSectors / fs.bs.BPB_SecPerClus;
 
-    fs.current_dir = fs.bs.BPB_RootClus;
-    strcpy(fs.current_path, "/");
+    fs.fat_cache = fatcache_open(fs.fat_start, (uint64_t)fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec,
+                                 fs.bs.BPB_NumFATs, fat_cache_budget);
+    if(fs.fat_cache == NULL) {
+        fprintf(stderr, "Error: Cannot set up the FAT cache\n");
+        mount_cleanup();
+        return -1;
+    }
 
     const char *name = strrchr(image_path, '/');
     if(name != NULL)
@@ -45,47 +400,125 @@ int fat32_mount(const char *image_path)
     fs.image_name[MAX_PATH - 1] = '\0';
 
     char *ext = strstr(fs.image_name, ".img");
+    if(ext == NULL)
+        ext = strstr(fs.image_name, ".fcz");
     if(ext != NULL)
         *ext = '\0';
 
-    for(int i=0; i<MAX_OPEN_FILES; i++)
-        fs.open_files[i].in_use = false;
+    // aligned so whole clusters of it can go out with O_DIRECT
+    void *zero;
+    if(posix_memalign(&zero, DIRECT_ALIGN, fat32_get_cluster_size()) != 0) {
+        mount_cleanup();
+        return -1;
+    }
+    fs.zero_cluster = memset(zero, 0, fat32_get_cluster_size());
+
+    // next-fit picks up where the last writer of the volume says it left off
+    FSInfo info;
+    fs.alloc_cursor = 2;
+    fs.alloc_group = 0;
+    if(fat32_read_fsinfo(&info) == 0 && info.FSI_Nxt_Free >= 2 &&
+       info.FSI_Nxt_Free < fs.total_clusters + 2)
+        fs.alloc_cursor = info.FSI_Nxt_Free;
+
+    pthread_mutex_init(&fs.sessions_lock, NULL);
+
+    fs.sessions = NULL;
+    fat32_session_init(&fs.shell);
+    fat32_session_attach(&fs.shell);
+    fs_session = &fs.shell;
 
     return 0;
 }
 
+// leaves FSInfo's next-free hint where next-fit stopped, for the next mount
+static void save_next_free(void)
+{
+    FSInfo info;
+    if(fs.alloc != ALLOC_NEXT || fat32_read_fsinfo(&info) != 0 || info.FSI_Nxt_Free == fs.alloc_cursor)
+        return;
+    uint32_t next = fs.alloc_cursor;
+    fat32_write_at((uint64_t)fs.bs.BPB_FSInfo * fs.bs.BPB_BytsPerSec + offsetof(FSInfo, FSI_Nxt_Free),
+                   &next, sizeof(next));
+}
+
 void fat32_unmount(void)
 {
-    if (fs.fp != NULL) {
-        fclose(fs.fp);
-        fs.fp = NULL;
+    while(fs.sessions != NULL) {
+        if(fat32_session_detach(fs.sessions) != 0)
+            fprintf(stderr, "Error: Buffered writes of an open file were lost\n");
     }
+    save_next_free();
+    if(fat32_sync() != 0)
+        fprintf(stderr, "Error: Some changes could not be written to %s\n", fs.image_name);
+
+    pthread_once(&scratch_once, scratch_key_init);
+    bufpool_put(fs.pool, pthread_getspecific(scratch_key));
+    pthread_setspecific(scratch_key, NULL);
+    free(fs.zero_cluster);
+    fs.zero_cluster = NULL;
+    pthread_mutex_destroy(&fs.sessions_lock);
+    mount_cleanup();
+}
+
+void fat32_set_fat_cache(size_t bytes)
+{
+    fat_cache_budget = bytes;
+}
+
+void fat32_set_write_behind(unsigned delay_ms, size_t bytes)
+{
+    write_behind_ms = delay_ms;
+    write_behind_bytes = bytes;
+}
+
+void fat32_set_alloc_policy(AllocPolicy policy)
+{
+    alloc_policy = policy;
+}
+
+const char *fat32_alloc_name(AllocPolicy policy)
+{
+    static const char *names[] = { "lowest", "next", "group" };
+    return names[policy];
+}
+
+void fat32_set_direct_io(bool direct, bool huge_pages)
+{
+    direct_io = direct;
+    huge_buffers = huge_pages;
+}
+
+// FAT pages first, they land in the write-behind buffer like everything else
+int fat32_sync(void)
+{
+    int ret = fatcache_flush(fs.fat_cache);
+    if(fs.writeback != NULL && writeback_flush(fs.writeback) != 0)
+        ret = -1;
+    return ret;
 }
 
+// entries go through the FAT cache; changes reach every FAT copy on unlock
 uint32_t fat32_get_fat_entry(uint32_t cluster)
 {
-    uint32_t fatOffset = fs.fat_start + (cluster * 4);
     uint32_t entry;
 
-    fseek(fs.fp, fatOffset, SEEK_SET);
-    fread(&entry, 4, 1, fs.fp);
+    if(fatcache_get(fs.fat_cache, cluster, &entry) != 0)
+        return FAT_EOC;
 
     return(entry & FAT_MASK);
 }
 
 int fat32_set_fat_entry(uint32_t cluster, uint32_t value)
 {
-    uint32_t fat_offset = fs.fat_start + (cluster * 4);
-
-    for(int i = 0; i < fs.bs.BPB_NumFATs; i++){
-        uint32_t offset = fat_offset + (i * fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec);
-        fseek(fs.fp, offset, SEEK_SET);
-        if(fwrite(&value, 4, 1, fs.fp) != 1)
-            return -1;
-    }
+    if(value == FAT_FREE)
+        dirindex_forget(cluster);
+    return fatcache_set(fs.fat_cache, cluster, value);
+}
 
-    fflush(fs.fp);
-    return 0;
+int fat32_flush_fat(void)
+{
+    return fatcache_flush(fs.fat_cache);
 }
 
 uint32_t fat32_find_free_cluster(void)
@@ -98,88 +531,260 @@ uint32_t fat32_find_free_cluster(void)
     return 0; // none are free
 }
 
-uint32_t fat32_allocate_cluster(uint32_t prev_cluster)
+uint32_t fat32_alloc_goal(uint32_t prev_cluster, uint32_t dir_cluster)
+{
+    uint32_t end = fs.total_clusters + 2;
+    uint32_t goal = 2;
+
+    if(fs.alloc != ALLOC_LOWEST && prev_cluster >= 2)
+        goal = prev_cluster + 1;
+    else if(fs.alloc == ALLOC_NEXT)
+        goal = fs.alloc_cursor;
+    else if(fs.alloc == ALLOC_GROUP) {
+        if(dir_cluster < 2)
+            dir_cluster = fs.bs.BPB_RootClus;
+        goal = 2 + (dir_cluster - 2) / ALLOC_GROUP_SIZE * ALLOC_GROUP_SIZE;
+    }
+    return (goal >= 2 && goal < end) ? goal : 2;
+}
+
+uint32_t fat32_dir_goal(uint32_t parent_cluster)
+{
+    uint32_t groups = (fs.total_clusters + ALLOC_GROUP_SIZE - 1) / ALLOC_GROUP_SIZE;
+
+    if(fs.alloc != ALLOC_GROUP || groups < 2)
+        return parent_cluster;
+    fs.alloc_group = (fs.alloc_group + 1) % groups;
+    return 2 + fs.alloc_group * ALLOC_GROUP_SIZE;
+}
+
+// the first free cluster at or after goal, wrapping around once
+static uint32_t find_free_from(uint32_t goal)
+{
+    uint32_t end = fs.total_clusters + 2;
+
+    for(uint32_t i = goal; i < end; i++) {
+        if(fat32_get_fat_entry(i) == FAT_FREE)
+            return i;
+    }
+    for(uint32_t i = 2; i < goal; i++) {
+        if(fat32_get_fat_entry(i) == FAT_FREE)
+            return i;
+    }
+    return 0;
+}
+
+uint32_t fat32_allocate_cluster(uint32_t prev_cluster, uint32_t dir_cluster)
 {
-    uint32_t newCluster = fat32_find_free_cluster();
+    uint32_t newCluster = find_free_from(fat32_alloc_goal(prev_cluster, dir_cluster));
     if(newCluster == 0) return 0;
 
     fat32_set_fat_entry(newCluster, FAT_EOC);
 
     if(prev_cluster != 0) fat32_set_fat_entry(prev_cluster, newCluster);
 
-    uint32_t clus_size = fat32_get_cluster_size();
-    uint8_t *buffer = calloc(1, clus_size);
-    if(buffer != NULL) {
-        fat32_write_cluster(newCluster, buffer);
-        free(buffer);
-    }
+    fat32_write_cluster(newCluster, fs.zero_cluster);
+    fs.alloc_cursor = newCluster + 1;
 
     return newCluster;
 }
 
-uint32_t fat32_cluster_to_offset(uint32_t cluster)
+void fat32_batch_init(FatBatch *b)
 {
-    return fs.data_start + ((cluster - 2) * fs.bs.BPB_SecPerClus * fs.bs.BPB_BytsPerSec);
+    b->items = NULL;
+    b->count = b->cap = 0;
 }
 
-uint32_t fat32_get_cluster_size(void)
+int fat32_batch_set(FatBatch *b, uint32_t cluster, uint32_t value)
 {
-    return fs.bs.BPB_SecPerClus * fs.bs.BPB_BytsPerSec;
+    if(value == FAT_FREE)
+        dirindex_forget(cluster);
+    if(b->count == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        FatUpdate *grown = realloc(b->items, cap * sizeof(FatUpdate));
+        if(grown == NULL)
+            return -1;
+        b->items = grown;
+        b->cap = cap;
+    }
+    b->items[b->count].cluster = cluster;
+    b->items[b->count].value = value;
+    b->count++;
+    return 0;
 }
 
-uint32_t fat32_get_image_size(void)
+void fat32_batch_free(FatBatch *b)
 {
-    uint32_t tot_sectors = (fs.bs.BPB_TotSec16 != 0) ? 
-                            fs.bs.BPB_TotSec16 : fs.bs.BPB_TotSec32;
-    return tot_sectors * fs.bs.BPB_BytsPerSec;
+    free(b->items);
+    fat32_batch_init(b);
 }
 
-int fat32_read_cluster(uint32_t cluster, void *buffer)
+typedef struct {
+    uint32_t cluster;
+    uint32_t value;
+    size_t seq;
+} SortedUpdate;
+
+static int compare_updates(const void *a, const void *b)
 {
-    uint32_t off = fat32_cluster_to_offset(cluster);
-    uint32_t sz = fat32_get_cluster_size();
+    const SortedUpdate *x = a, *y = b;
+    if(x->cluster != y->cluster)
+        return x->cluster < y->cluster ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
 
-    fseek(fs.fp, off, SEEK_SET);
-    if(fread(buffer, 1, sz, fs.fp) != sz)
+/*
+ * Writes the batch sorted by cluster; where a cluster was set more than
+ * once the last value wins. Runs of adjacent entries go out as a single
+ * pwrite to each FAT copy. The batch is emptied either way.
+ */
+int fat32_batch_commit(FatBatch *b)
+{
+    if(b->count == 0)
+        return 0;
+
+    SortedUpdate *sorted = malloc(b->count * sizeof(SortedUpdate));
+    uint32_t *run = malloc(b->count * sizeof(uint32_t));
+    if(sorted == NULL || run == NULL) {
+        free(sorted);
+        free(run);
+        b->count = 0;
         return -1;
+    }
 
-    return 0;
+    for(size_t i = 0; i < b->count; i++) {
+        sorted[i].cluster = b->items[i].cluster;
+        sorted[i].value = b->items[i].value;
+        sorted[i].seq = i;
+    }
+    qsort(sorted, b->count, sizeof(SortedUpdate), compare_updates);
+
+    uint64_t fatBytes = (uint64_t)fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec;
+    int ret = 0;
+    size_t i = 0;
+    while(ret == 0 && i < b->count)
+    {
+        uint32_t first = sorted[i].cluster;
+        size_t len = 0;
+        while(i < b->count && sorted[i].cluster == first + len) {
+            while(i + 1 < b->count && sorted[i + 1].cluster == sorted[i].cluster)
+                i++;
+            run[len++] = sorted[i++].value;
+        }
+
+        for(int f = 0; f < fs.bs.BPB_NumFATs && ret == 0; f++) {
+            uint64_t off = fs.fat_start + f * fatBytes + (uint64_t)first * 4;
+            ret = fat32_write_at(off, run, len * sizeof(uint32_t));
+        }
+        if(ret == 0)
+            fatcache_patch(fs.fat_cache, first, run, len);
+    }
+
+    free(sorted);
+    free(run);
+    b->count = 0;
+    return ret;
 }
 
-int fat32_write_cluster(uint32_t cluster, const void *buffer)
+// frees a whole chain with one batched FAT update
+int fat32_free_chain(uint32_t cluster)
 {
-    uint32_t offset = fat32_cluster_to_offset(cluster);
-    uint32_t size = fat32_get_cluster_size();
+    FatBatch batch;
+    fat32_batch_init(&batch);
+
+    uint32_t steps = 0;
+    while(cluster >= 2 && cluster < FAT_EOC && steps++ <= fs.total_clusters) {
+        uint32_t next = fat32_get_fat_entry(cluster);
+        if(fat32_batch_set(&batch, cluster, FAT_FREE) != 0) {
+            fat32_batch_free(&batch);
+            return -1;
+        }
+        cluster = next;
+    }
 
-    fseek(fs.fp, offset, SEEK_SET);
-    if (fwrite(buffer, 1, size, fs.fp) != size)
-        return -1;
+    int ret = fat32_batch_commit(&batch);
+    fat32_batch_free(&batch);
+    return ret;
+}
 
-    fflush(fs.fp);
-    return 0;
+uint64_t fat32_cluster_to_offset(uint32_t cluster)
+{
+    return fs.data_start + ((uint64_t)(cluster - 2) * fs.bs.BPB_SecPerClus * fs.bs.BPB_BytsPerSec);
 }
 
-int fat32_read_dir_entry(uint32_t cluster, uint32_t offset, DirEntry *entry)
+uint32_t fat32_get_cluster_size(void)
 {
-    uint32_t byteOffset = fat32_cluster_to_offset(cluster) + offset;
+    return fs.bs.BPB_SecPerClus * fs.bs.BPB_BytsPerSec;
+}
 
-    fseek(fs.fp, byteOffset, SEEK_SET);
-    if(fread(entry, sizeof(DirEntry), 1, fs.fp) != 1)
+// fails when the volume has no FSInfo sector or its signatures are wrong
+int fat32_read_fsinfo(FSInfo *info)
+{
+    uint16_t sector = fs.bs.BPB_FSInfo;
+    if(sector == 0 || sector == 0xFFFF || sector >= fs.bs.BPB_RsvdSecCnt)
+        return -1;
+    if(fat32_read_at((uint64_t)sector * fs.bs.BPB_BytsPerSec, info, sizeof(FSInfo)) != 0)
+        return -1;
+    if(info->FSI_LeadSig != FSI_LEAD_SIG || info->FSI_StrucSig != FSI_STRUC_SIG)
         return -1;
-
     return 0;
 }
 
-int fat32_write_dir_entry(uint32_t cluster, uint32_t offset, DirEntry* entry)
+time_t fat32_now(void)
 {
-    uint32_t byte_offset = fat32_cluster_to_offset(cluster) + offset;
+    return (pinned_clock != 0) ? pinned_clock : time(NULL);
+}
 
-    fseek(fs.fp, byte_offset, SEEK_SET);
-    if(fwrite(entry, sizeof(DirEntry), 1, fs.fp) != 1)
-        return -1;
+void fat32_pin_clock(time_t t)
+{
+    pinned_clock = t;
+}
 
-    fflush(fs.fp);
-    return 0;
+uint64_t fat32_get_image_size(void)
+{
+    uint32_t tot_sectors = (fs.bs.BPB_TotSec16 != 0) ? 
+                            fs.bs.BPB_TotSec16 : fs.bs.BPB_TotSec32;
+    return (uint64_t)tot_sectors * fs.bs.BPB_BytsPerSec;
+}
+
+int fat32_read_cluster(uint32_t cluster, void *buffer)
+{
+    return fat32_read_at(fat32_cluster_to_offset(cluster), buffer,
+                         fat32_get_cluster_size());
+}
+
+int fat32_write_cluster(uint32_t cluster, const void *buffer)
+{
+    return fat32_write_at(fat32_cluster_to_offset(cluster), buffer,
+                          fat32_get_cluster_size());
+}
+
+// a cluster-sized buffer private to the calling thread, returned when it exits
+uint8_t *fat32_scratch(void)
+{
+    pthread_once(&scratch_once, scratch_key_init);
+
+    uint8_t *buf = pthread_getspecific(scratch_key);
+    if(buf == NULL) {
+        buf = bufpool_get(fs.pool);
+        if(buf != NULL && pthread_setspecific(scratch_key, buf) != 0) {
+            bufpool_put(fs.pool, buf);
+            buf = NULL;
+        }
+    }
+    return buf;
+}
+
+int fat32_read_dir_entry(uint32_t cluster, uint32_t offset, DirEntry *entry)
+{
+    return fat32_read_at(fat32_cluster_to_offset(cluster) + offset,
+                         entry, sizeof(DirEntry));
+}
+
+int fat32_write_dir_entry(uint32_t cluster, uint32_t offset, DirEntry* entry)
+{
+    return fat32_write_dir_at(fat32_cluster_to_offset(cluster) + offset,
+                          entry, sizeof(DirEntry));
 }
 
 void fat32_name_to_83(const char *name, char *name83)
@@ -223,7 +828,7 @@ void fat32_83_to_name(const uint8_t *name83, char *name)
     name[j] = '\0';
 }
 
-uint32_t fat32_get_cluster(DirEntry *entry)
+uint32_t fat32_get_cluster(const DirEntry *entry)
 {
     return ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
 }
@@ -234,114 +839,1977 @@ void fat32_set_cluster(DirEntry *entry, uint32_t cluster)
     entry->DIR_FstClusLO = cluster & 0xFFFF;
 }
 
-int fat32_find_entry(uint32_t dir_cluster, const char *name, DirEntry *entry,
-                     uint32_t *entry_cluster, uint32_t *entry_offset)
+// UTF-8 <-> UCS-2 conversion for long names (BMP only)
+static int utf8_to_ucs2(const char *str, uint16_t *out, int max)
 {
-    char name83[11];
-    fat32_name_to_83(name, name83);
-
-    uint32_t clus = dir_cluster;
-    uint32_t clusSize = fat32_get_cluster_size();
-    uint32_t entriesPerCluster = clusSize / sizeof(DirEntry);
+    const unsigned char *p = (const unsigned char *)str;
+    int n = 0;
 
-    while(clus < FAT_EOC && clus != 0)
+    while(*p != '\0')
     {
-        for(uint32_t i = 0; i < entriesPerCluster; i++)
-        {
-            DirEntry tmp;
-            uint32_t off = i * sizeof(DirEntry);
-
-            if(fat32_read_dir_entry(clus, off, &tmp) != 0)
-                return -1;
-
-            if(tmp.DIR_Name[0] == 0x00)
-                return -1;
-
-            if(tmp.DIR_Name[0] == 0xE5 || 
-               (tmp.DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME)
-                continue;
-
-            if(memcmp(tmp.DIR_Name, name83, 11) == 0)
-            {
-                if(entry != NULL) *entry = tmp;
-                if(entry_cluster != NULL) *entry_cluster = clus;
-                if(entry_offset != NULL) *entry_offset = off;
-                return 0;
-            }
+        uint16_t c;
+        if(p[0] < 0x80) {
+            c = p[0];
+            p += 1;
+        } else if((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
+            c = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else if((p[0] & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+            c = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            p += 3;
+        } else {
+            c = '_'; // malformed or outside the BMP
+            p += 1;
         }
 
-        clus = fat32_get_fat_entry(clus);
+        if(n >= max) return -1;
+        out[n++] = c;
     }
-
-    return -1;
+    return n;
 }
 
-int fat32_add_dir_entry(uint32_t dir_cluster, DirEntry *entry)
+// fails if the UTF-8 form and its terminator don't fit in size bytes
+static int ucs2_to_utf8(const uint16_t *in, int len, char *out, size_t size)
 {
-    uint32_t cluster = dir_cluster;
-    uint32_t cluster_size = fat32_get_cluster_size();
-    uint32_t entries_per_cluster = cluster_size / sizeof(DirEntry);
-    uint32_t prevCluster = 0;
-
-    while(cluster < FAT_EOC && cluster != 0)
+    size_t j = 0;
+    for(int i = 0; i < len; i++)
     {
-        for(uint32_t i = 0; i < entries_per_cluster; ++i)
-        {
-            DirEntry temp;
-            uint32_t offset = i * sizeof(DirEntry);
+        uint16_t c = in[i];
+        size_t n = (c < 0x80) ? 1 : (c < 0x800) ? 2 : 3;
+        if(j + n >= size)
+            return -1;
 
-            if(fat32_read_dir_entry(cluster, offset, &temp) != 0) return -1;
-            if(temp.DIR_Name[0] == 0x00 || temp.DIR_Name[0] == 0xE5)
-                return fat32_write_dir_entry(cluster, offset, entry);
+        if(c < 0x80) {
+            out[j++] = (char)c;
+        } else if(c < 0x800) {
+            out[j++] = (char)(0xC0 | (c >> 6));
+            out[j++] = (char)(0x80 | (c & 0x3F));
+        } else {
+            out[j++] = (char)(0xE0 | (c >> 12));
+            out[j++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[j++] = (char)(0x80 | (c & 0x3F));
         }
+    }
+    out[j] = '\0';
+    return 0;
+}
+
+static uint16_t ucs2_upper(uint16_t c)
+{
+    return (c < 0x80) ? (uint16_t)toupper(c) : c;
+}
+
+// the 13 name chars of an LFN slot live in three separate fields
+static void lfn_get_chars(const LfnEntry *lfn, uint16_t *chars)
+{
+    const uint8_t *raw = (const uint8_t *)lfn;
+    memcpy(chars, raw + 1, 10);
+    memcpy(chars + 5, raw + 14, 12);
+    memcpy(chars + 11, raw + 28, 4);
+}
+
+static void lfn_set_chars(LfnEntry *lfn, const uint16_t *chars)
+{
+    uint8_t *raw = (uint8_t *)lfn;
+    memcpy(raw + 1, chars, 10);
+    memcpy(raw + 14, chars + 5, 12);
+    memcpy(raw + 28, chars + 11, 4);
+}
+
+static bool is_lfn(const DirEntry *entry)
+{
+    return (entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME;
+}
+
+uint8_t fat32_lfn_checksum(const uint8_t *name83)
+{
+    uint8_t sum = 0;
+    for(int i = 0; i < 11; i++)
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + name83[i];
+    return sum;
+}
+
+static bool is_83_char(char c)
+{
+    return isalnum((unsigned char)c) || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+// true if the name can be stored as a plain 8.3 entry without an LFN
+bool fat32_is_short_name(const char *name)
+{
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return true;
+
+    const char *dot = strchr(name, '.');
+    size_t base = (dot != NULL) ? (size_t)(dot - name) : strlen(name);
+    size_t ext = (dot != NULL) ? strlen(dot + 1) : 0;
+
+    if(base == 0 || base > 8 || ext > 3 || (dot != NULL && ext == 0))
+        return false;
+
+    for(const char *p = name; *p != '\0'; p++) {
+        if(p != dot && !is_83_char(*p))
+            return false;
+    }
+    return true;
+}
+
+void fat32_dir_open(DirIter *it, uint32_t dir_cluster)
+{
+    it->cluster = dir_cluster;
+    it->offset = 0;
+    it->lfn_valid = false;
+    it->steps = 0;
+}
+
+/*
+ * Feeds one raw slot read from (cluster, offset) into the iterator's LFN
+ * state. Returns 1 when a record is complete, 0 if the slot was consumed
+ * without producing one, and -1 at the end-of-directory marker.
+ */
+int fat32_dir_decode(DirIter *it, const DirEntry *ent, uint32_t cluster,
+                     uint32_t offset, DirRecord *rec)
+{
+    if(ent->DIR_Name[0] == 0x00)
+        return -1;
+
+    if(ent->DIR_Name[0] == 0xE5) {
+        it->lfn_valid = false;
+        return 0;
+    }
+
+    if(is_lfn(ent))
+    {
+        const LfnEntry *lfn = (const LfnEntry *)ent;
+        int ord = lfn->LDIR_Ord & LFN_ORD_MASK;
+
+        if(lfn->LDIR_Ord & LFN_LAST_ENTRY) {
+            it->lfn_valid = (ord != 0 && ord * LFN_CHARS <= MAX_LFN + LFN_CHARS);
+            it->lfn_total = ord;
+            it->lfn_sum = lfn->LDIR_Chksum;
+            it->lfn_cluster = cluster;
+            it->lfn_offset = offset;
+        } else if(!it->lfn_valid || ord != it->lfn_next ||
+                  lfn->LDIR_Chksum != it->lfn_sum) {
+            it->lfn_valid = false;
+        }
+
+        if(it->lfn_valid) {
+            lfn_get_chars(lfn, &it->lfn_name[(ord - 1) * LFN_CHARS]);
+            it->lfn_next = ord - 1;
+        }
+        return 0;
+    }
+
+    rec->entry = *ent;
+    rec->cluster = cluster;
+    rec->offset = offset;
+
+    // a chain spelling out more than MAX_LFN chars is corrupt; the 8.3 name stands
+    int len = 0;
+    bool hasLfn = it->lfn_valid && it->lfn_next == 0 &&
+                  it->lfn_sum == fat32_lfn_checksum(ent->DIR_Name);
+    if(hasLfn) {
+        while(len < it->lfn_total * LFN_CHARS && it->lfn_name[len] != 0x0000)
+            len++;
+        hasLfn = len <= MAX_LFN &&
+                 ucs2_to_utf8(it->lfn_name, len, rec->name, sizeof(rec->name)) == 0;
+    }
+
+    if(hasLfn)
+    {
+        rec->lfn_cluster = it->lfn_cluster;
+        rec->lfn_offset = it->lfn_offset;
+        rec->lfn_count = it->lfn_total;
+    }
+    else
+    {
+        fat32_83_to_name(ent->DIR_Name, rec->name);
+        rec->lfn_cluster = cluster;
+        rec->lfn_offset = offset;
+        rec->lfn_count = 0;
+    }
+
+    it->lfn_valid = false;
+    return 1;
+}
+
+// returns 1 with the next live record, 0 at the end of the directory, -1 on error
+int fat32_dir_next(DirIter *it, DirRecord *rec)
+{
+    uint32_t clusSize = fat32_get_cluster_size();
+
+    while(it->cluster >= 2 && it->cluster < FAT_EOC)
+    {
+        if(it->offset >= clusSize) {
+            if(it->steps++ >= fs.total_clusters)
+                return -1;
+            it->cluster = fat32_get_fat_entry(it->cluster);
+            it->offset = 0;
+            continue;
+        }
+
+        DirEntry ent;
+        uint32_t off = it->offset;
+        if(fat32_read_dir_entry(it->cluster, off, &ent) != 0)
+            return -1;
+
+        int res = fat32_dir_decode(it, &ent, it->cluster, off, rec);
+        if(res < 0) {
+            it->cluster = 0;
+            return 0;
+        }
+        it->offset += sizeof(DirEntry);
+        if(res == 1)
+            return 1;
+    }
+
+    return 0;
+}
+
+int fat32_readdir_open(DirReader *r, uint32_t dir_cluster)
+{
+    fat32_dir_open(&r->it, dir_cluster);
+    r->buf = bufpool_get(fs.pool);
+    r->slot = 0;
+    r->steps = 0;
+    r->loaded = false;
+    r->done = false;
+    r->failed = false;
+    return (r->buf != NULL) ? 0 : -1;
+}
+
+/*
+ * Fills recs with up to max live records. Returns how many, 0 once the
+ * directory is exhausted, and -1 if a cluster could not be read; records
+ * decoded before a failed read are still returned first.
+ */
+int fat32_readdir(DirReader *r, DirRecord *recs, int max)
+{
+    uint32_t perCluster = fat32_get_cluster_size() / sizeof(DirEntry);
+    int n = 0;
+
+    while(n < max && !r->done)
+    {
+        if(!r->loaded) {
+            uint32_t clus = r->it.cluster;
+            if(clus < 2 || clus >= FAT_EOC || r->steps++ > fs.total_clusters) {
+                r->done = true;
+                break;
+            }
+            if(fat32_read_cluster(clus, r->buf) != 0) {
+                r->done = r->failed = true;
+                break;
+            }
+            r->loaded = true;
+            r->slot = 0;
+        }
+        if(r->slot == perCluster) {
+            r->it.cluster = fat32_get_fat_entry(r->it.cluster);
+            r->loaded = false;
+            continue;
+        }
+
+        const DirEntry *ent = (const DirEntry *)r->buf + r->slot;
+        int res = fat32_dir_decode(&r->it, ent, r->it.cluster,
+                                   r->slot * sizeof(DirEntry), &recs[n]);
+        r->slot++;
+        if(res < 0)
+            r->done = true;
+        else if(res == 1)
+            n++;
+    }
+
+    if(n == 0 && r->failed)
+        return -1;
+    return n;
+}
+
+void fat32_readdir_close(DirReader *r)
+{
+    bufpool_put(fs.pool, r->buf);
+    r->buf = NULL;
+}
+
+// FNV-1a over a long name as lookups compare it, ASCII folded to upper case
+static uint64_t long_hash(const uint16_t *name, int len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(int i = 0; i < len; i++) {
+        h ^= ucs2_upper(name[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t short_hash(const uint8_t *name83)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(int i = 0; i < 11; i++) {
+        h ^= name83[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// enters a record whose slots start at first under its 8.3 and long names
+static int index_names(DirIndex *ix, uint32_t first, int lfn_count, const uint8_t *name83,
+                       const char *name)
+{
+    if(dirindex_name_add(ix, DIRINDEX_SHORT, short_hash(name83), first, lfn_count) != 0)
+        return -1;
+    if(lfn_count == 0 || name == NULL)
+        return 0;
+
+    uint16_t lname[MAX_LFN];
+    int len = utf8_to_ucs2(name, lname, MAX_LFN);
+    if(len <= 0)
+        return 0; // too long to be looked up anyway
+    return dirindex_name_add(ix, DIRINDEX_LONG, long_hash(lname, len), first, lfn_count);
+}
+
+static void unindex_names(DirIndex *ix, uint32_t first, const DirRecord *rec)
+{
+    dirindex_name_remove(ix, DIRINDEX_SHORT, short_hash(rec->entry.DIR_Name), first);
+    if(rec->lfn_count == 0)
+        return;
+
+    uint16_t lname[MAX_LFN];
+    int len = utf8_to_ucs2(rec->name, lname, MAX_LFN);
+    if(len > 0)
+        dirindex_name_remove(ix, DIRINDEX_LONG, long_hash(lname, len), first);
+}
+
+/*
+ * The directory's index, built with one pass over its clusters if there
+ * is none yet. Runs of deleted slots become free runs and every record is
+ * entered under its names. NULL if the directory can't be indexed.
+ */
+static DirIndex *dir_index(uint32_t dir_cluster)
+{
+    DirIndex *ix = dirindex_find(dir_cluster);
+    if(ix != NULL)
+        return ix;
+
+    uint32_t perCluster = fat32_get_cluster_size() / sizeof(DirEntry);
+    uint8_t *buf = bufpool_get(fs.pool);
+    if(buf == NULL || (ix = dirindex_create(dir_cluster, perCluster)) == NULL) {
+        bufpool_put(fs.pool, buf);
+        return NULL;
+    }
+
+    DirIter it;
+    DirRecord rec;
+    fat32_dir_open(&it, dir_cluster);
+    uint32_t slot = 0, runStart = 0, steps = 0;
+    bool end = false, ok = true;
+
+    for(uint32_t c = dir_cluster; ok && c >= 2 && c < FAT_EOC && steps++ <= fs.total_clusters;
+        c = fat32_get_fat_entry(c))
+    {
+        ok = (dirindex_append(ix, c) == 0);
+        if(!ok || end)
+            continue;
+        ok = (fat32_read_cluster(c, buf) == 0);
+
+        const DirEntry *ents = (const DirEntry *)buf;
+        for(uint32_t i = 0; ok && i < perCluster; i++, slot++)
+        {
+            if(ents[i].DIR_Name[0] == 0x00) {
+                end = true;
+                break;
+            }
+            if(ents[i].DIR_Name[0] != 0xE5) {
+                if(slot > runStart)
+                    dirindex_release(ix, runStart, slot - runStart);
+                runStart = slot + 1;
+            }
+            if(fat32_dir_decode(&it, &ents[i], c, i * sizeof(DirEntry), &rec) == 1)
+                ok = (index_names(ix, slot - rec.lfn_count, rec.lfn_count,
+                                  rec.entry.DIR_Name, rec.name) == 0);
+        }
+    }
+    bufpool_put(fs.pool, buf);
+
+    if(!ok) {
+        dirindex_drop(ix);
+        return NULL;
+    }
+    if(slot > runStart)
+        dirindex_release(ix, runStart, slot - runStart);
+    dirindex_set_end(ix, slot);
+    return ix;
+}
+
+// decodes the record whose slots start at first
+static int index_record(const DirIndex *ix, uint32_t first, DirRecord *rec)
+{
+    DirIter it;
+    uint32_t cluster, offset;
+
+    if(!dirindex_locate(ix, first, &cluster, &offset))
+        return -1;
+    fat32_dir_open(&it, cluster);
+    it.offset = offset;
+    return (fat32_dir_next(&it, rec) == 1) ? 0 : -1;
+}
+
+static bool same_long_name(const char *name, const uint16_t *target, int len)
+{
+    uint16_t lname[MAX_LFN];
+    if(utf8_to_ucs2(name, lname, MAX_LFN) != len)
+        return false;
+    for(int i = 0; i < len; i++) {
+        if(ucs2_upper(lname[i]) != ucs2_upper(target[i]))
+            return false;
+    }
+    return true;
+}
+
+// fat32_lookup through an index; hash hits are checked against the disk
+static int index_lookup(const DirIndex *ix, const uint16_t *target, int len,
+                        const char *name83, DirRecord *rec)
+{
+    DirRecord tmp;
+    uint32_t pos = 0, first, lfnCount;
+
+    if(rec == NULL)
+        rec = &tmp;
+
+    while(dirindex_name_next(ix, DIRINDEX_LONG, long_hash(target, len), &pos, &first, &lfnCount)) {
+        if(index_record(ix, first, rec) == 0 && rec->lfn_count > 0 &&
+           same_long_name(rec->name, target, len))
+            return 0;
+    }
+
+    pos = 0;
+    while(name83 != NULL &&
+          dirindex_name_next(ix, DIRINDEX_SHORT, short_hash((const uint8_t *)name83), &pos,
+                             &first, &lfnCount)) {
+        if(index_record(ix, first, rec) == 0 && memcmp(rec->entry.DIR_Name, name83, 11) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+// compares one LFN slot against the matching 13-char chunk of the target name
+static bool lfn_chunk_matches(const LfnEntry *lfn, const uint16_t *target, int len, int idx)
+{
+    uint16_t chars[LFN_CHARS];
+    lfn_get_chars(lfn, chars);
+
+    for(int i = 0; i < LFN_CHARS; i++)
+    {
+        int pos = idx * LFN_CHARS + i;
+        if(pos == len)
+            return chars[i] == 0x0000;
+        if(ucs2_upper(chars[i]) != ucs2_upper(target[pos]))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Finds a record by long or 8.3 name. LFN sequences are never assembled
+ * while scanning: a sequence is only a candidate if its slot count matches
+ * the target length, and each slot is compared in place against its chunk
+ * of the target. The full record is decoded only once a match is paired
+ * with its 8.3 entry through the checksum.
+ */
+int fat32_lookup(uint32_t dir_cluster, const char *name, DirRecord *rec)
+{
+    uint16_t target[MAX_LFN];
+    int len = utf8_to_ucs2(name, target, MAX_LFN);
+    if(len <= 0)
+        return -1;
+
+    int wantSlots = (len + LFN_CHARS - 1) / LFN_CHARS;
+    bool shortOk = fat32_is_short_name(name);
+    char name83[11];
+    if(shortOk)
+        fat32_name_to_83(name, name83);
+
+    // an index is only used if an earlier change built one
+    DirIndex *ix = dirindex_find(dir_cluster);
+    if(ix != NULL)
+        return index_lookup(ix, target, len, shortOk ? name83 : NULL, rec);
+
+    uint32_t clus = dir_cluster;
+    uint32_t clusSize = fat32_get_cluster_size();
+    uint32_t entriesPerCluster = clusSize / sizeof(DirEntry);
+
+    bool seqValid = false, candidate = false;
+    int seqNext = 0;
+    uint8_t seqSum = 0;
+    uint32_t seqCluster = 0, seqOffset = 0;
+    uint32_t steps = 0;
+
+    while(clus >= 2 && clus < FAT_EOC && steps++ <= fs.total_clusters)
+    {
+        for(uint32_t i = 0; i < entriesPerCluster; i++)
+        {
+            DirEntry tmp;
+            uint32_t off = i * sizeof(DirEntry);
+
+            if(fat32_read_dir_entry(clus, off, &tmp) != 0)
+                return -1;
+
+            if(tmp.DIR_Name[0] == 0x00)
+                return -1;
+
+            if(tmp.DIR_Name[0] == 0xE5) {
+                seqValid = false;
+                continue;
+            }
+
+            if(is_lfn(&tmp))
+            {
+                LfnEntry *lfn = (LfnEntry *)&tmp;
+                int ord = lfn->LDIR_Ord & LFN_ORD_MASK;
+
+                if(lfn->LDIR_Ord & LFN_LAST_ENTRY) {
+                    seqValid = (ord != 0);
+                    seqSum = lfn->LDIR_Chksum;
+                    seqCluster = clus;
+                    seqOffset = off;
+                    candidate = (ord == wantSlots);
+                } else if(!seqValid || ord != seqNext || lfn->LDIR_Chksum != seqSum) {
+                    seqValid = false;
+                }
+
+                if(seqValid) {
+                    if(candidate)
+                        candidate = lfn_chunk_matches(lfn, target, len, ord - 1);
+                    seqNext = ord - 1;
+                }
+                continue;
+            }
+
+            bool hasLfn = seqValid && seqNext == 0 &&
+                          seqSum == fat32_lfn_checksum(tmp.DIR_Name);
+            seqValid = false;
+
+            if((hasLfn && candidate) ||
+               (shortOk && memcmp(tmp.DIR_Name, name83, 11) == 0))
+            {
+                if(rec == NULL)
+                    return 0;
+                if(!hasLfn) {
+                    rec->entry = tmp;
+                    fat32_83_to_name(tmp.DIR_Name, rec->name);
+                    rec->cluster = rec->lfn_cluster = clus;
+                    rec->offset = rec->lfn_offset = off;
+                    rec->lfn_count = 0;
+                    return 0;
+                }
+                DirIter it;
+                fat32_dir_open(&it, seqCluster);
+                it.offset = seqOffset;
+                return (fat32_dir_next(&it, rec) == 1) ? 0 : -1;
+            }
+        }
+
+        clus = fat32_get_fat_entry(clus);
+    }
+
+    return -1;
+}
+
+int fat32_find_entry(uint32_t dir_cluster, const char *name, DirEntry *entry,
+                     uint32_t *entry_cluster, uint32_t *entry_offset)
+{
+    DirRecord rec;
+    if(fat32_lookup(dir_cluster, name, &rec) != 0)
+        return -1;
+
+    if(entry != NULL) *entry = rec.entry;
+    if(entry_cluster != NULL) *entry_cluster = rec.cluster;
+    if(entry_offset != NULL) *entry_offset = rec.offset;
+    return 0;
+}
+
+/*
+ * Resolves an absolute or cwd-relative path. The start directory (and the
+ * root, which has no entry of its own) is returned as a synthesized
+ * directory record.
+ */
+int fat32_resolve_path(const char *path, DirRecord *rec)
+{
+    uint32_t root = fs.bs.BPB_RootClus;
+    uint32_t dir = (path[0] == '/') ? root : fs_session->current_dir;
+
+    memset(rec, 0, sizeof(DirRecord));
+    rec->entry.DIR_Attr = ATTR_DIRECTORY;
+    fat32_set_cluster(&rec->entry, dir);
+    strcpy(rec->name, (path[0] == '/') ? "/" : ".");
+
+    char *buf = strdup(path);
+    if(buf == NULL)
+        return -1;
+
+    char *save = NULL;
+    for(char *comp = strtok_r(buf, "/", &save); comp != NULL;
+        comp = strtok_r(NULL, "/", &save))
+    {
+        if(!(rec->entry.DIR_Attr & ATTR_DIRECTORY)) {
+            free(buf);
+            return -1;
+        }
+        if(strcmp(comp, ".") == 0)
+            continue;
+
+        dir = fat32_get_cluster(&rec->entry);
+        if(dir == 0)
+            dir = root;
+        if(strcmp(comp, "..") == 0 && dir == root)
+            continue;
+
+        if(fat32_lookup(dir, comp, rec) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+/*
+ * Places the slots through the directory's index: in a run of deleted
+ * slots if one is long enough, else at the end marker, growing the chain
+ * when they don't fit. The slots about to be overwritten are checked
+ * first; if the disk disagrees with the index, the index is dropped and
+ * 1 returned so the caller can scan instead.
+ */
+static int write_indexed(DirIndex *ix, const DirEntry *slots, int count, const char *name,
+                         uint32_t *entry_cluster, uint32_t *entry_offset)
+{
+    uint32_t clusSize = fat32_get_cluster_size();
+    uint32_t end = dirindex_end(ix);
+    uint32_t first = dirindex_take(ix, count);
+    uint32_t cluster, offset;
+
+    for(int k = 0; k < count && dirindex_locate(ix, first + k, &cluster, &offset); k++)
+    {
+        DirEntry old;
+        if(fat32_read_dir_entry(cluster, offset, &old) != 0) {
+            dirindex_drop(ix);
+            return -1;
+        }
+        if(first < end ? old.DIR_Name[0] != 0xE5 : old.DIR_Name[0] != 0x00) {
+            dirindex_drop(ix);
+            return 1;
+        }
+        if(first >= end)
+            break; // everything after the marker is free
+    }
+
+    while(first + count > dirindex_capacity(ix)) {
+        uint32_t c = fat32_allocate_cluster(dirindex_last(ix), 0);
+        if(c == 0 || dirindex_append(ix, c) != 0) {
+            dirindex_drop(ix);
+            return -1;
+        }
+    }
+
+    // the run is contiguous within each cluster, so one write per cluster
+    for(int k = 0; k < count; )
+    {
+        dirindex_locate(ix, first + k, &cluster, &offset);
+        int n = (clusSize - offset) / sizeof(DirEntry);
+        if(n > count - k)
+            n = count - k;
+        if(fat32_write_dir_at(fat32_cluster_to_offset(cluster) + offset, &slots[k],
+                          n * sizeof(DirEntry)) != 0) {
+            dirindex_drop(ix);
+            return -1;
+        }
+        k += n;
+    }
+
+    if(index_names(ix, first, count - 1, slots[count - 1].DIR_Name, name) != 0)
+        dirindex_drop(ix);
+
+    dirindex_locate(ix, first + count - 1, &cluster, &offset);
+    if(entry_cluster != NULL) *entry_cluster = cluster;
+    if(entry_offset != NULL) *entry_offset = offset;
+    return 0;
+}
+
+// writes a run of consecutive slots, growing the directory if needed
+static int write_dir_slots(uint32_t dir_cluster, const DirEntry *slots, int count,
+                           const char *name, uint32_t *entry_cluster, uint32_t *entry_offset)
+{
+    DirIndex *ix = dir_index(dir_cluster);
+    if(ix != NULL) {
+        int ret = write_indexed(ix, slots, count, name, entry_cluster, entry_offset);
+        if(ret <= 0)
+            return ret;
+    }
+
+    uint32_t runCluster[LFN_ORD_MASK + 1];
+    uint32_t runOffset[LFN_ORD_MASK + 1];
+    int run = 0;
+
+    uint32_t cluster = dir_cluster;
+    uint32_t cluster_size = fat32_get_cluster_size();
+    uint32_t entries_per_cluster = cluster_size / sizeof(DirEntry);
+    uint32_t prevCluster = 0;
+    uint32_t steps = 0;
+    bool atEnd = false;
+
+    while(run < count)
+    {
+        if(steps++ > fs.total_clusters)
+            return -1;
+        if(cluster >= FAT_EOC || cluster == 0) {
+            cluster = fat32_allocate_cluster(prevCluster, 0);
+            if(cluster == 0) return -1;
+            atEnd = true; // new clusters come back zeroed
+        }
+
+        for(uint32_t i = 0; i < entries_per_cluster && run < count; ++i)
+        {
+            uint32_t offset = i * sizeof(DirEntry);
+
+            if(!atEnd) {
+                DirEntry temp;
+                if(fat32_read_dir_entry(cluster, offset, &temp) != 0) return -1;
+                if(temp.DIR_Name[0] == 0x00)
+                    atEnd = true;
+                else if(temp.DIR_Name[0] != 0xE5) {
+                    run = 0;
+                    continue;
+                }
+            }
+
+            runCluster[run] = cluster;
+            runOffset[run] = offset;
+            run++;
+        }
+
+        prevCluster = cluster;
+        if(run < count)
+            cluster = fat32_get_fat_entry(cluster);
+    }
+
+    for(int k = 0; k < count; k++) {
+        if(fat32_write_dir_entry(runCluster[k], runOffset[k], (DirEntry *)&slots[k]) != 0)
+            return -1;
+    }
+
+    if(entry_cluster != NULL) *entry_cluster = runCluster[count - 1];
+    if(entry_offset != NULL) *entry_offset = runOffset[count - 1];
+    return 0;
+}
+
+int fat32_add_dir_entry(uint32_t dir_cluster, DirEntry *entry)
+{
+    return write_dir_slots(dir_cluster, entry, 1, NULL, NULL, NULL);
+}
+
+static char alias_char(char c)
+{
+    if((unsigned char)c >= 0x80 || strchr("+,;=[]", c) != NULL)
+        return '_';
+    return (char)toupper((unsigned char)c);
+}
+
+// the 8.3 names already in a directory, for picking unique aliases
+static int collect_short_names(uint32_t dir_cluster, uint8_t (**out)[11], size_t *out_count)
+{
+    uint8_t (*names)[11] = NULL;
+    size_t count = 0, cap = 0;
+    uint32_t clus = dir_cluster;
+    uint32_t entriesPerCluster = fat32_get_cluster_size() / sizeof(DirEntry);
+    uint32_t steps = 0;
+    bool done = false;
+
+    while(!done && clus >= 2 && clus < FAT_EOC && steps++ <= fs.total_clusters)
+    {
+        for(uint32_t i = 0; i < entriesPerCluster; i++)
+        {
+            DirEntry tmp;
+            if(fat32_read_dir_entry(clus, i * sizeof(DirEntry), &tmp) != 0 ||
+               tmp.DIR_Name[0] == 0x00) {
+                done = true;
+                break;
+            }
+            if(tmp.DIR_Name[0] == 0xE5 || is_lfn(&tmp))
+                continue;
+
+            if(count == cap) {
+                cap = cap ? cap * 2 : 64;
+                uint8_t (*grown)[11] = realloc(names, cap * sizeof(*names));
+                if(grown == NULL) {
+                    free(names);
+                    return -1;
+                }
+                names = grown;
+            }
+            memcpy(names[count++], tmp.DIR_Name, 11);
+        }
+        if(!done)
+            clus = fat32_get_fat_entry(clus);
+    }
+
+    *out = names;
+    *out_count = count;
+    return 0;
+}
+
+// the up to 8 + 3 chars a long name's aliases are made from
+static void alias_basis(const char *name, char *base, int *base_len, char *ext, int *ext_len)
+{
+    int b = 0, e = 0;
+
+    const char *dot = strrchr(name, '.');
+    for(const char *p = name; *p != '\0' && p != dot; p++) {
+        if(*p == '.' || *p == ' ' || ((unsigned char)*p & 0xC0) == 0x80)
+            continue;
+        if(b < 8) base[b++] = alias_char(*p);
+    }
+    if(dot != NULL) {
+        for(const char *p = dot + 1; *p != '\0' && e < 3; p++) {
+            if(*p == ' ' || ((unsigned char)*p & 0xC0) == 0x80)
+                continue;
+            ext[e++] = alias_char(*p);
+        }
+    }
+    if(b == 0)
+        base[b++] = '_';
+    *base_len = b;
+    *ext_len = e;
+}
+
+static void alias_format(const char *base, int b, const char *ext, int e, uint32_t n,
+                         uint8_t *name83)
+{
+    char tail[9];
+    int tl = snprintf(tail, sizeof(tail), "~%u", n);
+    int keep = (b < 8 - tl) ? b : 8 - tl;
+
+    memset(name83, ' ', 11);
+    memcpy(name83, base, keep);
+    memcpy(name83 + keep, tail, tl);
+    memcpy(name83 + 8, ext, e);
+}
+
+// builds the first BASIS~N.EXT alias for a long name that is not in taken
+static int make_short_alias(const char *name, const uint8_t (*taken)[11], size_t count,
+                            uint8_t *name83)
+{
+    char base[8], ext[3];
+    int b, e;
+    alias_basis(name, base, &b, ext, &e);
+
+    uint8_t extPad[3] = { ' ', ' ', ' ' };
+    memcpy(extPad, ext, e);
+
+    // one pass marks the ~N tails this basis already uses; among the
+    // first count + 1 numbers at least one is free. The basis may hold a
+    // '~' of its own, so the tail starts at the last one and a name only
+    // counts if it is exactly the alias that tail would produce.
+    uint32_t limit = (count < 999999) ? (uint32_t)count + 1 : 999999;
+    uint8_t *used = calloc(limit + 1, 1);
+    if(used == NULL)
+        return -1;
+    for(size_t k = 0; k < count; k++)
+    {
+        const uint8_t *t = taken[k];
+        const uint8_t *tilde = memrchr(t, '~', 8);
+        if(tilde == NULL || memcmp(t + 8, extPad, 3) != 0)
+            continue;
+
+        uint32_t n = 0;
+        for(const uint8_t *d = tilde + 1; d < t + 8 && *d >= '0' && *d <= '9' && n <= limit; d++)
+            n = n * 10 + (*d - '0');
+        if(n == 0 || n > limit)
+            continue;
+
+        uint8_t alias[11];
+        alias_format(base, b, ext, e, n, alias);
+        if(memcmp(alias, t, 11) == 0)
+            used[n] = 1;
+    }
+
+    uint32_t n = 1;
+    while(n <= limit && used[n])
+        n++;
+    free(used);
+    if(n > limit)
+        return -1;
+
+    alias_format(base, b, ext, e, n, name83);
+    return 0;
+}
+
+// true if a live 8.3 entry in the indexed directory already has name83
+static bool index_short_taken(const DirIndex *ix, const uint8_t *name83)
+{
+    uint32_t pos = 0, first, lfnCount, cluster, offset;
+
+    while(dirindex_name_next(ix, DIRINDEX_SHORT, short_hash(name83), &pos, &first, &lfnCount)) {
+        DirEntry ent;
+        if(!dirindex_locate(ix, first + lfnCount, &cluster, &offset) ||
+           fat32_read_dir_entry(cluster, offset, &ent) != 0 ||
+           memcmp(ent.DIR_Name, name83, 11) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * make_short_alias for an indexed directory. The index remembers where
+ * each basis left off, so a run of names sharing one basis tries one
+ * alias each instead of collecting every 8.3 name first.
+ */
+static int index_short_alias(DirIndex *ix, const char *name, uint8_t *name83)
+{
+    char base[8], ext[3];
+    int b, e;
+    alias_basis(name, base, &b, ext, &e);
+
+    uint8_t key[11];
+    memset(key, ' ', 11);
+    memcpy(key, base, b);
+    memcpy(key + 8, ext, e);
+    uint64_t basis = short_hash(key);
+
+    uint32_t pos = 0, from = 1;
+    dirindex_name_next(ix, DIRINDEX_ALIAS, basis, &pos, &from, NULL);
+
+    for(uint32_t k = 0; k < 999999; k++)
+    {
+        uint32_t n = (from - 1 + k) % 999999 + 1;
+        alias_format(base, b, ext, e, n, name83);
+        if(!index_short_taken(ix, name83))
+            return dirindex_name_set(ix, DIRINDEX_ALIAS, basis, n % 999999 + 1);
+    }
+    return -1;
+}
+
+// the LFN slots for name followed by the entry, whose alias is already set
+static int lfn_slots(const char *name, const DirEntry *entry, DirEntry *slots)
+{
+    uint16_t lname[MAX_LFN];
+    int len = utf8_to_ucs2(name, lname, MAX_LFN);
+    if(len <= 0)
+        return -1;
+
+    uint8_t sum = fat32_lfn_checksum(entry->DIR_Name);
+    int n = (len + LFN_CHARS - 1) / LFN_CHARS;
+
+    for(int k = 0; k < n; k++)
+    {
+        int ord = n - k; // highest ordinal is stored first
+        uint16_t chars[LFN_CHARS];
+        for(int i = 0; i < LFN_CHARS; i++) {
+            int pos = (ord - 1) * LFN_CHARS + i;
+            chars[i] = (pos < len) ? lname[pos] : (pos == len ? 0x0000 : 0xFFFF);
+        }
+
+        LfnEntry *lfn = (LfnEntry *)&slots[k];
+        memset(lfn, 0, sizeof(LfnEntry));
+        lfn->LDIR_Ord = ord | (k == 0 ? LFN_LAST_ENTRY : 0);
+        lfn->LDIR_Attr = ATTR_LONG_NAME;
+        lfn->LDIR_Chksum = sum;
+        lfn_set_chars(lfn, chars);
+    }
+    slots[n] = *entry;
+    return n + 1;
+}
+
+/*
+ * Lays out the slots for an entry under the given name: one slot for names
+ * that fit 8.3, otherwise LFN slots followed by the entry with a BASIS~N
+ * alias that is not among the taken 8.3 names. The entry's DIR_Name is
+ * filled in. Returns the number of slots, at most LFN_ORD_MASK + 1.
+ */
+int fat32_name_slots(const char *name, DirEntry *entry, const uint8_t (*taken)[11],
+                     size_t taken_count, DirEntry *slots)
+{
+    if(fat32_is_short_name(name)) {
+        fat32_name_to_83(name, (char *)entry->DIR_Name);
+        slots[0] = *entry;
+        return 1;
+    }
+
+    if(make_short_alias(name, taken, taken_count, entry->DIR_Name) != 0)
+        return -1;
+    return lfn_slots(name, entry, slots);
+}
+
+// adds an entry under the given name; the 8.3 slot location is returned
+int fat32_add_named_entry(uint32_t dir_cluster, const char *name, DirEntry *entry,
+                          uint32_t *entry_cluster, uint32_t *entry_offset)
+{
+    DirEntry slots[LFN_ORD_MASK + 1];
+    uint8_t (*names)[11] = NULL;
+    size_t count = 0;
+    int n;
+
+    DirIndex *ix = fat32_is_short_name(name) ? NULL : dir_index(dir_cluster);
+    if(ix != NULL) {
+        n = -1;
+        if(index_short_alias(ix, name, entry->DIR_Name) == 0)
+            n = lfn_slots(name, entry, slots);
+    } else {
+        if(!fat32_is_short_name(name) && collect_short_names(dir_cluster, &names, &count) != 0)
+            return -1;
+        n = fat32_name_slots(name, entry, (const uint8_t (*)[11])names, count, slots);
+        free(names);
+    }
+    if(n < 0)
+        return -1;
+
+    return write_dir_slots(dir_cluster, slots, n, name, entry_cluster, entry_offset);
+}
+
+int fat32_remove_dir_entry(uint32_t cluster, uint32_t offset)
+{
+    DirEntry entry;
+    
+    if (fat32_read_dir_entry(cluster, offset, &entry) != 0)
+        return -1;
+
+    entry.DIR_Name[0] = 0xE5; // deleted marker
+    
+    return fat32_write_dir_entry(cluster, offset, &entry);
+}
+
+// deletes the 8.3 entry and every LFN slot that belongs to it
+int fat32_remove_record(const DirRecord *rec)
+{
+    uint32_t cluster = rec->lfn_cluster;
+    uint32_t offset = rec->lfn_offset;
+    uint32_t clusSize = fat32_get_cluster_size();
+    uint32_t first;
+    DirIndex *ix = dirindex_owner(cluster, offset, &first);
+    int ret = 0;
+
+    for(int i = 0; i < rec->lfn_count && ret == 0; i++)
+    {
+        if(offset >= clusSize) {
+            cluster = fat32_get_fat_entry(cluster);
+            offset = 0;
+        }
+        ret = fat32_remove_dir_entry(cluster, offset);
+        offset += sizeof(DirEntry);
+    }
+    if(ret == 0)
+        ret = fat32_remove_dir_entry(rec->cluster, rec->offset);
+
+    // the slots become a free run of the directory's index
+    if(ix != NULL && ret == 0) {
+        dirindex_release(ix, first, rec->lfn_count + 1);
+        unindex_names(ix, first, rec);
+    } else if(ix != NULL) {
+        dirindex_drop(ix);
+    }
+    return ret;
+}
+
+bool fat32_is_dir_empty(uint32_t cluster)
+{
+    DirIter it;
+    DirRecord rec;
+    fat32_dir_open(&it, cluster);
+
+    while(fat32_dir_next(&it, &rec) == 1)
+    {
+        if(strcmp(rec.name, ".") != 0 && strcmp(rec.name, "..") != 0)
+            return false;
+    }
+
+    return true;
+}
+
+// counts used and deleted slots up to the end-of-directory marker
+int fat32_dir_stats(uint32_t dir_cluster, uint32_t *live, uint32_t *deleted,
+                    uint32_t *clusters)
+{
+    uint32_t entriesPerCluster = fat32_get_cluster_size() / sizeof(DirEntry);
+    uint32_t clus = dir_cluster;
+    bool end = false;
+
+    *live = *deleted = *clusters = 0;
+
+    while(clus >= 2 && clus < FAT_EOC && *clusters <= fs.total_clusters)
+    {
+        (*clusters)++;
+        for(uint32_t i = 0; i < entriesPerCluster && !end; i++)
+        {
+            DirEntry ent;
+            if(fat32_read_dir_entry(clus, i * sizeof(DirEntry), &ent) != 0)
+                return -1;
+            if(ent.DIR_Name[0] == 0x00)
+                end = true;
+            else if(ent.DIR_Name[0] == 0xE5)
+                (*deleted)++;
+            else
+                (*live)++;
+        }
+        clus = fat32_get_fat_entry(clus);
+    }
+    return 0;
+}
+
+static void handle_move(FileTable *t, int fd, uint32_t dir_cluster, uint32_t entry_offset);
+
+static int compact_chain(const uint32_t *chain, uint32_t count, DirEntry *oldEnts,
+                         DirEntry *newEnts, uint32_t *moved,
+                         uint32_t *removed, uint32_t *freed)
+{
+    uint32_t clusSize = fat32_get_cluster_size();
+    uint32_t entriesPerCluster = clusSize / sizeof(DirEntry);
+    uint32_t slots = count * entriesPerCluster;
+
+    for(uint32_t k = 0; k < count; k++) {
+        if(fat32_read_cluster(chain[k], (uint8_t *)oldEnts + (size_t)k * clusSize) != 0)
+            return -1;
+    }
+
+    uint32_t used = 0;
+    for(uint32_t i = 0; i < slots && oldEnts[i].DIR_Name[0] != 0x00; i++)
+    {
+        if(oldEnts[i].DIR_Name[0] == 0xE5) {
+            (*removed)++;
+            continue;
+        }
+        moved[i] = used;
+        newEnts[used++] = oldEnts[i];
+    }
 
-        prevCluster = cluster;
-        cluster = fat32_get_fat_entry(cluster);
+    uint32_t keep = (used + entriesPerCluster - 1) / entriesPerCluster;
+    if(keep == 0)
+        keep = 1;
+
+    for(uint32_t k = 0; k < keep; k++) {
+        if(fat32_write_dir_at(fat32_cluster_to_offset(chain[k]),
+                              (uint8_t *)newEnts + (size_t)k * clusSize, clusSize) != 0)
+            return -1;
     }
 
-    uint32_t newClus = fat32_allocate_cluster(prevCluster);
-    if(newClus == 0) return -1;
-    return fat32_write_dir_entry(newClus, 0, entry);
+    pthread_mutex_lock(&fs.sessions_lock);
+    for(Session *s = fs.sessions; s != NULL; s = s->next)
+    {
+        for(int fd = 0; fd < s->files.capacity; fd++)
+        {
+            OpenFile *of = &s->files.files[fd];
+            if(!of->in_use)
+                continue;
+            for(uint32_t k = 0; k < count; k++) {
+                if(of->dir_cluster != chain[k])
+                    continue;
+                uint32_t newSlot = moved[k * entriesPerCluster + of->dir_entry_offset / sizeof(DirEntry)];
+                handle_move(&s->files, fd, chain[newSlot / entriesPerCluster],
+                            (newSlot % entriesPerCluster) * sizeof(DirEntry));
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs.sessions_lock);
+
+    // the new layout is on disk; now cut the chain after the last used cluster
+    if(keep < count) {
+        FatBatch batch;
+        fat32_batch_init(&batch);
+        int ret = fat32_batch_set(&batch, chain[keep - 1], FAT_EOC);
+        for(uint32_t k = keep; k < count && ret == 0; k++)
+            ret = fat32_batch_set(&batch, chain[k], FAT_FREE);
+        if(ret == 0)
+            ret = fat32_batch_commit(&batch);
+        fat32_batch_free(&batch);
+        if(ret != 0)
+            return -1;
+        *freed = count - keep;
+    }
+    return 0;
 }
 
-int fat32_remove_dir_entry(uint32_t cluster, uint32_t offset)
+/*
+ * Rewrites a directory's live slots densely from its first cluster and
+ * frees the clusters that are no longer needed. Slot order is kept, so
+ * LFN runs stay in front of their 8.3 entry and "." / ".." stay in slots
+ * 0 and 1. Open files whose entry moved are pointed at the new location.
+ */
+int fat32_compact_dir(uint32_t dir_cluster, uint32_t *removed, uint32_t *freed)
+{
+    uint32_t clusSize = fat32_get_cluster_size();
+    uint32_t *chain = NULL;
+    uint32_t count = 0, cap = 0;
+
+    *removed = *freed = 0;
+    dirindex_forget(dir_cluster);
+
+    for(uint32_t c = dir_cluster; c < FAT_EOC && c != 0 && count <= fs.total_clusters;
+        c = fat32_get_fat_entry(c))
+    {
+        if(count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *grown = realloc(chain, cap * sizeof(uint32_t));
+            if(grown == NULL) {
+                free(chain);
+                return -1;
+            }
+            chain = grown;
+        }
+        chain[count++] = c;
+    }
+
+    int ret = -1;
+    DirEntry *oldEnts = malloc((size_t)count * clusSize);
+    DirEntry *newEnts = calloc(count, clusSize);
+    uint32_t *moved = malloc((size_t)count * (clusSize / sizeof(DirEntry)) * sizeof(uint32_t));
+
+    if(count > 0 && oldEnts != NULL && newEnts != NULL && moved != NULL)
+        ret = compact_chain(chain, count, oldEnts, newEnts, moved, removed, freed);
+
+    free(chain);
+    free(oldEnts);
+    free(newEnts);
+    free(moved);
+    return ret;
+}
+
+/*
+ * Compacts after a removal once tombstones pass fs.compact_threshold. The
+ * directory's index keeps the counts as entries come and go, so only a
+ * directory that can't be indexed is scanned.
+ */
+void fat32_auto_compact(uint32_t dir_cluster)
+{
+    uint32_t live, deleted, clusters;
+
+    if(fs.compact_threshold == 0)
+        return;
+    DirIndex *ix = dir_index(dir_cluster);
+    if(ix != NULL) {
+        deleted = dirindex_deleted(ix);
+        live = dirindex_end(ix) - deleted;
+        clusters = dirindex_capacity(ix) / (fat32_get_cluster_size() / sizeof(DirEntry));
+    } else if(fat32_dir_stats(dir_cluster, &live, &deleted, &clusters) != 0) {
+        return;
+    }
+    if(clusters < 2)
+        return;
+
+    if(deleted * 100 >= (uint32_t)fs.compact_threshold * (live + deleted)) {
+        uint32_t removed, freed;
+        fat32_compact_dir(dir_cluster, &removed, &freed);
+    }
+}
+
+static void set_write_time(DirEntry *entry)
+{
+    time_t t = fat32_now();
+    struct tm tm;
+    localtime_r(&t, &tm);
+    entry->DIR_WrtDate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    entry->DIR_WrtTime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+// next cluster of a file, extending the chain if it ends here
+static uint32_t next_or_allocate(uint32_t cluster)
+{
+    uint32_t next = fat32_get_fat_entry(cluster);
+    if(next >= FAT_EOC)
+        next = fat32_allocate_cluster(cluster, 0);
+    return next;
+}
+
+/*
+ * Writes the buffered range into the file's chain. Pieces that land on
+ * physically adjacent clusters go out in one pwrite, and partial clusters
+ * are patched in place rather than read and rewritten. The directory
+ * entry is updated once, with the new size and write time.
+ */
+int fat32_file_flush(OpenFile *of)
 {
+    if(of->wbuf_len == 0)
+        return 0;
+
+    uint32_t clusterSize = fat32_get_cluster_size();
+    uint32_t start = of->wbuf_start;
+    uint32_t len = of->wbuf_len;
+
+    // another descriptor may have flushed to the same file meanwhile
     DirEntry entry;
-    
-    if (fat32_read_dir_entry(cluster, offset, &entry) != 0)
+    if(fat32_read_dir_entry(of->dir_cluster, of->dir_entry_offset, &entry) != 0)
         return -1;
+    of->first_cluster = fat32_get_cluster(&entry);
+    if(entry.DIR_FileSize > of->size)
+        of->size = entry.DIR_FileSize;
 
-    entry.DIR_Name[0] = 0xE5; // deleted marker
-    
-    return fat32_write_dir_entry(cluster, offset, &entry);
+    if(of->first_cluster == 0) {
+        of->first_cluster = fat32_allocate_cluster(0, of->dir_cluster);
+        if(of->first_cluster == 0)
+            return -1;
+    }
+
+    uint32_t cluster = of->first_cluster;
+    for(uint32_t pos = clusterSize; pos <= start; pos += clusterSize) {
+        cluster = next_or_allocate(cluster);
+        if(cluster == 0)
+            return -1;
+    }
+
+    uint64_t runOffset = 0;
+    uint32_t runLen = 0, runSrc = 0;
+    uint32_t done = 0;
+    int ret = 0;
+
+    while(done < len)
+    {
+        uint32_t inCluster = (start + done) % clusterSize;
+        uint32_t n = clusterSize - inCluster;
+        if(n > len - done)
+            n = len - done;
+
+        uint64_t diskOffset = fat32_cluster_to_offset(cluster) + inCluster;
+        if(runLen > 0 && diskOffset != runOffset + runLen) {
+            if(fat32_write_at(runOffset, of->wbuf + runSrc, runLen) != 0) {
+                ret = -1;
+                break;
+            }
+            runLen = 0;
+        }
+        if(runLen == 0) {
+            runOffset = diskOffset;
+            runSrc = done;
+        }
+        runLen += n;
+        done += n;
+
+        if(done < len) {
+            cluster = next_or_allocate(cluster);
+            if(cluster == 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if(ret == 0 && runLen > 0 && fat32_write_at(runOffset, of->wbuf + runSrc, runLen) != 0)
+        ret = -1;
+    if(ret != 0)
+        return -1;
+
+    if(start + len > of->size)
+        of->size = start + len;
+    of->wbuf_len = 0;
+
+    fat32_set_cluster(&entry, of->first_cluster);
+    entry.DIR_FileSize = of->size;
+    set_write_time(&entry);
+    return fat32_write_dir_entry(of->dir_cluster, of->dir_entry_offset, &entry);
 }
 
-bool fat32_is_dir_empty(uint32_t cluster)
+// appends to the file's buffer at of->offset, flushing when it fills up
+// or when the write doesn't continue the buffered range
+int fat32_file_write(OpenFile *of, const void *data, uint32_t len)
+{
+    const uint8_t *src = data;
+
+    if(of->wbuf == NULL) {
+        uint32_t clusterSize = fat32_get_cluster_size();
+        uint32_t cap = (WRITE_BUF_SIZE + clusterSize - 1) / clusterSize * clusterSize;
+        of->wbuf = malloc(cap);
+        if(of->wbuf == NULL)
+            return -1;
+        of->wbuf_cap = cap;
+        of->wbuf_len = 0;
+    }
+
+    while(len > 0)
+    {
+        if(of->wbuf_len > 0 && of->offset != of->wbuf_start + of->wbuf_len &&
+           fat32_file_flush(of) != 0)
+            return -1;
+        if(of->wbuf_len == of->wbuf_cap && fat32_file_flush(of) != 0)
+            return -1;
+        if(of->wbuf_len == 0)
+            of->wbuf_start = of->offset;
+
+        uint32_t n = of->wbuf_cap - of->wbuf_len;
+        if(n > len)
+            n = len;
+        memcpy(of->wbuf + of->wbuf_len, src, n);
+        of->wbuf_len += n;
+        of->offset += n;
+        src += n;
+        len -= n;
+    }
+
+    if(of->wbuf_len == of->wbuf_cap)
+        return fat32_file_flush(of);
+    return 0;
+}
+
+static uint32_t handle_hash(uint32_t dir_cluster, uint32_t entry_offset)
+{
+    return (dir_cluster * 2654435761u) ^ ((entry_offset / sizeof(DirEntry)) * 40503u);
+}
+
+static void handle_link(FileTable *t, int fd)
+{
+    OpenFile *of = &t->files[fd];
+    uint32_t b = handle_hash(of->dir_cluster, of->dir_entry_offset) & (t->bucket_count - 1);
+
+    of->next = t->buckets[b];
+    t->buckets[b] = fd;
+}
+
+static void handle_unlink(FileTable *t, int fd)
+{
+    OpenFile *of = &t->files[fd];
+    int *link = &t->buckets[handle_hash(of->dir_cluster, of->dir_entry_offset) & (t->bucket_count - 1)];
+
+    while(*link != -1 && *link != fd)
+        link = &t->files[*link].next;
+    if(*link == fd)
+        *link = of->next;
+}
+
+// keeps the load factor under 1 so chains stay short
+static int handle_rehash(FileTable *t, int bucket_count)
+{
+    int *buckets = malloc(bucket_count * sizeof(int));
+    if(buckets == NULL)
+        return -1;
+
+    for(int b = 0; b < bucket_count; b++)
+        buckets[b] = -1;
+    free(t->buckets);
+    t->buckets = buckets;
+    t->bucket_count = bucket_count;
+
+    for(int fd = 0; fd < t->capacity; fd++) {
+        if(t->files[fd].in_use)
+            handle_link(t, fd);
+    }
+    return 0;
+}
+
+// stores a copy of *of under a new descriptor and returns it, -1 on failure
+int fat32_handle_open(const OpenFile *of)
+{
+    FileTable *t = &fs_session->files;
+
+    if(t->free_list == -1)
+    {
+        int cap = t->capacity ? t->capacity * 2 : 16;
+        OpenFile *grown = realloc(t->files, cap * sizeof(OpenFile));
+        if(grown == NULL)
+            return -1;
+        t->files = grown;
+
+        // push the new descriptors so the lowest is handed out first
+        for(int fd = cap - 1; fd >= t->capacity; fd--) {
+            t->files[fd].in_use = false;
+            t->files[fd].next = t->free_list;
+            t->free_list = fd;
+        }
+        t->capacity = cap;
+    }
+
+    if(t->count + 1 > t->bucket_count &&
+       handle_rehash(t, t->bucket_count ? t->bucket_count * 2 : 16) != 0)
+        return -1;
+
+    int fd = t->free_list;
+    t->free_list = t->files[fd].next;
+    t->files[fd] = *of;
+    t->files[fd].in_use = true;
+    t->count++;
+    handle_link(t, fd);
+    return fd;
+}
+
+OpenFile *fat32_handle_get(int fd)
+{
+    FileTable *t = &fs_session->files;
+    if(fd < 0 || fd >= t->capacity || !t->files[fd].in_use)
+        return NULL;
+    return &t->files[fd];
+}
+
+static int handle_find(const FileTable *t, uint32_t dir_cluster, uint32_t entry_offset)
+{
+    if(t->bucket_count == 0)
+        return -1;
+
+    int fd = t->buckets[handle_hash(dir_cluster, entry_offset) & (t->bucket_count - 1)];
+    while(fd != -1) {
+        if(t->files[fd].dir_cluster == dir_cluster &&
+           t->files[fd].dir_entry_offset == entry_offset)
+            return fd;
+        fd = t->files[fd].next;
+    }
+    return -1;
+}
+
+int fat32_handle_find(uint32_t dir_cluster, uint32_t entry_offset)
+{
+    return handle_find(&fs_session->files, dir_cluster, entry_offset);
+}
+
+// open in any session, not just the current one
+bool fat32_is_open(uint32_t dir_cluster, uint32_t entry_offset)
+{
+    bool open = false;
+
+    pthread_mutex_lock(&fs.sessions_lock);
+    for(Session *s = fs.sessions; s != NULL && !open; s = s->next)
+        open = handle_find(&s->files, dir_cluster, entry_offset) >= 0;
+    pthread_mutex_unlock(&fs.sessions_lock);
+    return open;
+}
+
+// flushes whatever the file still buffers; the handle is closed either
+// way, and -1 means the buffered writes were lost
+int fat32_handle_close(int fd)
+{
+    FileTable *t = &fs_session->files;
+    OpenFile *of = fat32_handle_get(fd);
+    if(of == NULL)
+        return 0;
+
+    int ret = fat32_file_flush(of);
+    free(of->wbuf);
+    of->wbuf = NULL;
+
+    handle_unlink(t, fd);
+    t->files[fd].in_use = false;
+    t->files[fd].next = t->free_list;
+    t->free_list = fd;
+    t->count--;
+    return ret;
+}
+
+static void handle_move(FileTable *t, int fd, uint32_t dir_cluster, uint32_t entry_offset)
+{
+    if(fd < 0 || fd >= t->capacity || !t->files[fd].in_use)
+        return;
+
+    OpenFile *of = &t->files[fd];
+    handle_unlink(t, fd);
+    of->dir_cluster = dir_cluster;
+    of->dir_entry_offset = entry_offset;
+    handle_link(t, fd);
+}
+
+// for when the file's directory entry is relocated
+void fat32_handle_move(int fd, uint32_t dir_cluster, uint32_t entry_offset)
+{
+    handle_move(&fs_session->files, fd, dir_cluster, entry_offset);
+}
+
+// -1 if the buffered writes of some file could not be flushed
+static int handle_table_free(FileTable *t)
+{
+    int ret = 0;
+
+    for(int fd = 0; fd < t->capacity; fd++) {
+        if(t->files[fd].in_use) {
+            if(fat32_file_flush(&t->files[fd]) != 0)
+                ret = -1;
+            free(t->files[fd].wbuf);
+        }
+    }
+    free(t->files);
+    free(t->buckets);
+    memset(t, 0, sizeof(FileTable));
+    t->free_list = -1;
+    return ret;
+}
+
+int fat32_handles_free(void)
+{
+    return handle_table_free(&fs_session->files);
+}
+
+// flushes every file the current session has open
+int fat32_handles_flush(void)
+{
+    FileTable *t = &fs_session->files;
+    int ret = 0;
+
+    for(int fd = 0; fd < t->capacity; fd++) {
+        if(t->files[fd].in_use && fat32_file_flush(&t->files[fd]) != 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+// whether any descriptor of the current session holds buffered writes
+bool fat32_handles_dirty(void)
+{
+    FileTable *t = &fs_session->files;
+
+    for(int fd = 0; fd < t->capacity; fd++) {
+        if(t->files[fd].in_use && t->files[fd].wbuf_len > 0)
+            return true;
+    }
+    return false;
+}
+
+void fat32_session_init(Session *s)
+{
+    memset(s, 0, sizeof(Session));
+    s->current_dir = fs.bs.BPB_RootClus;
+    strcpy(s->current_path, "/");
+    s->files.free_list = -1;
+}
+
+void fat32_session_attach(Session *s)
+{
+    pthread_mutex_lock(&fs.sessions_lock);
+    s->next = fs.sessions;
+    fs.sessions = s;
+    pthread_mutex_unlock(&fs.sessions_lock);
+}
+
+// unlinks the session and closes everything it had open
+// closes the session's files; -1 if some buffered writes were lost
+int fat32_session_detach(Session *s)
+{
+    pthread_mutex_lock(&fs.sessions_lock);
+    Session **link = &fs.sessions;
+    while(*link != NULL && *link != s)
+        link = &(*link)->next;
+    if(*link == s)
+        *link = s->next;
+    pthread_mutex_unlock(&fs.sessions_lock);
+
+    int ret = handle_table_free(&s->files);
+    if(fs_session == s)
+        fs_session = &fs.shell;
+    return ret;
+}
+
+// true if some session has the directory as its working directory
+bool fat32_dir_in_use(uint32_t dir_cluster)
+{
+    bool used = false;
+
+    pthread_mutex_lock(&fs.sessions_lock);
+    for(Session *s = fs.sessions; s != NULL && !used; s = s->next)
+        used = (s->current_dir == dir_cluster);
+    pthread_mutex_unlock(&fs.sessions_lock);
+    return used;
+}
+
+#define ZERO_IOV    64
+
+// fills a byte range of the image with zeros, many clusters per syscall
+static int zero_range(uint64_t offset, uint64_t len)
 {
-    uint32_t curr = cluster;
     uint32_t clusterSize = fat32_get_cluster_size();
-    uint32_t entriesPerClus = clusterSize / sizeof(DirEntry);
+    struct iovec iov[ZERO_IOV];
 
-    while(curr < FAT_EOC && curr != 0)
+    // O_DIRECT takes its zeros a megabyte at a time from an aligned buffer
+    if(fs.direct && fs.overlay == NULL && fs.writeback == NULL) {
+        uint8_t *zeros = bufpool_get(fs.pool);
+        if(zeros == NULL)
+            return -1;
+        memset(zeros, 0, (len < BUFPOOL_BUFFER) ? (size_t)len : BUFPOOL_BUFFER);
+        int ret = 0;
+        while(len > 0 && ret == 0) {
+            size_t piece = (len < BUFPOOL_BUFFER) ? (size_t)len : BUFPOOL_BUFFER;
+            ret = direct_write(offset, zeros, piece);
+            offset += piece;
+            len -= piece;
+        }
+        bufpool_put(fs.pool, zeros);
+        return ret;
+    }
+
+    // the delta and the write-behind buffer have to see every write, and a
+    // bare compressed image none
+    while((fs.overlay != NULL || fs.cimage != NULL || fs.writeback != NULL) && len > 0) {
+        uint32_t piece = (len < clusterSize) ? (uint32_t)len : clusterSize;
+        if(fat32_write_at(offset, fs.zero_cluster, piece) != 0)
+            return -1;
+        offset += piece;
+        len -= piece;
+    }
+
+    while(len > 0)
     {
-        for(uint32_t i = 0; i < entriesPerClus; i++)
-        {
-            DirEntry ent;
-            uint32_t off = i * sizeof(DirEntry);
+        int n = 0;
+        uint64_t chunk = 0;
+        while(n < ZERO_IOV && chunk < len) {
+            size_t piece = (len - chunk < clusterSize) ? (size_t)(len - chunk) : clusterSize;
+            iov[n].iov_base = fs.zero_cluster;
+            iov[n].iov_len = piece;
+            chunk += piece;
+            n++;
+        }
+
+        ssize_t w = pwritev(fs.fd, iov, n, (off_t)offset);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            return -1;
+        offset += w;
+        len -= w;
+    }
+    return 0;
+}
 
-            if(fat32_read_dir_entry(curr, off, &ent) != 0) return true;
-            if(ent.DIR_Name[0] == 0x00) return true;
-            if(ent.DIR_Name[0] == 0xE5) continue;
-            if((ent.DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) continue;
+// the clusters of a chain in order; *count is 0 for an empty file
+static uint32_t *load_chain(uint32_t first, uint32_t *count)
+{
+    uint32_t *chain = NULL;
+    uint32_t cap = 0;
 
-            char name[13];
-            fat32_83_to_name(ent.DIR_Name, name);
-            
-            if(strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
-                return false;
+    *count = 0;
+    for(uint32_t c = first; c >= 2 && c < FAT_EOC && *count <= fs.total_clusters;
+        c = fat32_get_fat_entry(c))
+    {
+        if(*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *grown = realloc(chain, cap * sizeof(uint32_t));
+            if(grown == NULL) {
+                free(chain);
+                *count = 0;
+                return NULL;
+            }
+            chain = grown;
         }
-        curr = fat32_get_fat_entry(curr);
+        chain[(*count)++] = c;
     }
+    if(chain == NULL)
+        chain = malloc(sizeof(uint32_t));
+    return chain;
+}
 
+static bool run_is_free(uint32_t start, uint32_t count, uint32_t end)
+{
+    if(start < 2 || start + count > end)
+        return false;
+    for(uint32_t k = 0; k < count; k++) {
+        if(fat32_get_fat_entry(start + k) != FAT_FREE)
+            return false;
+    }
     return true;
 }
+
+/*
+ * Picks count free clusters for a file in dir_cluster whose chain ends at
+ * last (0 if it has none). Prefers the clusters right after last, then the
+ * first free run that is long enough from where the allocation policy
+ * starts, and only then whatever free clusters come first from there. The
+ * new clusters are zeroed and linked in one FAT batch. Returns the first
+ * new cluster, 0 on failure.
+ */
+static uint32_t extend_chain(uint32_t last, uint32_t count, uint32_t dir_cluster)
+{
+    uint32_t end = fs.total_clusters + 2;
+    uint32_t fatEntries = fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec / 4;
+    if(end > fatEntries)
+        end = fatEntries;
+
+    uint32_t goal = fat32_alloc_goal(last, dir_cluster);
+    if(goal >= end)
+        goal = 2;
+
+    uint32_t start = 0;
+    if(last >= 2 && run_is_free(last + 1, count, end))
+        start = last + 1;
+    // runs from goal to the end, then from the start up to goal
+    for(int pass = 0; pass < 2 && start == 0; pass++) {
+        uint32_t from = pass ? 2 : goal, to = pass ? goal + count - 1 : end;
+        if(to > end)
+            to = end;
+        for(uint32_t c = from; start == 0 && c + count <= to; ) {
+            uint32_t len = 0;
+            while(len < count && fat32_get_fat_entry(c + len) == FAT_FREE)
+                len++;
+            if(len == count)
+                start = c;
+            else
+                c += len + 1;
+        }
+    }
+
+    uint32_t *list = malloc(count * sizeof(uint32_t));
+    uint32_t got = 0;
+    if(list != NULL) {
+        if(start != 0) {
+            for(; got < count; got++)
+                list[got] = start + got;
+        } else {
+            for(uint32_t k = 0; k < end - 2 && got < count; k++) {
+                uint32_t c = 2 + (goal - 2 + k) % (end - 2);
+                if(fat32_get_fat_entry(c) == FAT_FREE)
+                    list[got++] = c;
+            }
+        }
+    }
+    if(got < count) {
+        free(list);
+        return 0;
+    }
+
+    uint32_t clusterSize = fat32_get_cluster_size();
+    int ret = 0;
+    for(uint32_t k = 0; k < count && ret == 0; ) {
+        uint32_t run = 1;
+        while(k + run < count && list[k + run] == list[k] + run)
+            run++;
+        ret = zero_range(fat32_cluster_to_offset(list[k]), (uint64_t)run * clusterSize);
+        k += run;
+    }
+
+    FatBatch batch;
+    fat32_batch_init(&batch);
+    if(last >= 2 && ret == 0)
+        ret = fat32_batch_set(&batch, last, list[0]);
+    for(uint32_t k = 0; k < count && ret == 0; k++)
+        ret = fat32_batch_set(&batch, list[k], k + 1 < count ? list[k + 1] : FAT_EOC);
+    if(ret == 0)
+        ret = fat32_batch_commit(&batch);
+    fat32_batch_free(&batch);
+
+    uint32_t first = list[0];
+    if(ret == 0)
+        fs.alloc_cursor = list[count - 1] + 1;
+    free(list);
+    return ret == 0 ? first : 0;
+}
+
+// every session's descriptor for the file gets its buffered writes out
+static int flush_file_handles(uint32_t dir_cluster, uint32_t entry_offset)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&fs.sessions_lock);
+    for(Session *s = fs.sessions; s != NULL; s = s->next) {
+        int fd = handle_find(&s->files, dir_cluster, entry_offset);
+        if(fd >= 0 && fat32_file_flush(&s->files.files[fd]) != 0)
+            ret = -1;
+    }
+    pthread_mutex_unlock(&fs.sessions_lock);
+    return ret;
+}
+
+static void update_file_handles(uint32_t dir_cluster, uint32_t entry_offset,
+                                uint32_t first_cluster, uint32_t size)
+{
+    pthread_mutex_lock(&fs.sessions_lock);
+    for(Session *s = fs.sessions; s != NULL; s = s->next) {
+        int fd = handle_find(&s->files, dir_cluster, entry_offset);
+        if(fd < 0)
+            continue;
+        OpenFile *of = &s->files.files[fd];
+        of->first_cluster = first_cluster;
+        of->size = size;
+        if(of->offset > size)
+            of->offset = size;
+    }
+    pthread_mutex_unlock(&fs.sessions_lock);
+}
+
+/*
+ * Sets the file's size to size. Shrinking cuts the chain and frees the
+ * tail in one FAT batch, including clusters reserved past the end; growing
+ * appends a preferably contiguous run and zero-fills everything between
+ * the old and the new end. With keep_size the chain grows to cover size
+ * but the file keeps its size, so the clusters wait, zeroed, for writes
+ * past the end.
+ */
+static int file_resize(uint32_t dir_cluster, uint32_t entry_offset, uint32_t size,
+                       bool shrink, bool keep_size)
+{
+    if(flush_file_handles(dir_cluster, entry_offset) != 0)
+        return -1;
+
+    DirEntry entry;
+    if(fat32_read_dir_entry(dir_cluster, entry_offset, &entry) != 0 ||
+       (entry.DIR_Attr & ATTR_DIRECTORY))
+        return -1;
+
+    uint32_t oldSize = entry.DIR_FileSize;
+    if(size <= oldSize && !shrink)
+        return 0;
+
+    uint32_t clusterSize = fat32_get_cluster_size();
+    uint32_t first = fat32_get_cluster(&entry);
+    uint32_t have;
+    uint32_t *chain = load_chain(first, &have);
+    if(chain == NULL)
+        return -1;
+
+    uint32_t need = (uint32_t)(((uint64_t)size + clusterSize - 1) / clusterSize);
+    int ret = 0;
+
+    if(size == oldSize && need >= have) {
+        free(chain);
+        return 0;
+    }
+
+    if(need < have && shrink)
+    {
+        FatBatch batch;
+        fat32_batch_init(&batch);
+        if(need > 0)
+            ret = fat32_batch_set(&batch, chain[need - 1], FAT_EOC);
+        for(uint32_t k = need; k < have && ret == 0; k++)
+            ret = fat32_batch_set(&batch, chain[k], FAT_FREE);
+        if(ret == 0)
+            ret = fat32_batch_commit(&batch);
+        fat32_batch_free(&batch);
+        if(need == 0)
+            first = 0;
+    }
+
+    // stale bytes past the old end inside clusters the file already had
+    for(uint32_t k = oldSize / clusterSize; ret == 0 && !keep_size && size > oldSize &&
+                                            k < have && k < need; k++) {
+        uint64_t from = (uint64_t)k * clusterSize;
+        uint64_t to = from + clusterSize;
+        if(from < oldSize)
+            from = oldSize;
+        if(to > size)
+            to = size;
+        if(to > from)
+            ret = zero_range(fat32_cluster_to_offset(chain[k]) + (from - (uint64_t)k * clusterSize),
+                             to - from);
+    }
+
+    if(ret == 0 && need > have) {
+        uint32_t added = extend_chain(have > 0 ? chain[have - 1] : 0, need - have, dir_cluster);
+        if(added == 0)
+            ret = -1;
+        else if(first == 0)
+            first = added;
+    }
+    free(chain);
+    if(ret != 0)
+        return -1;
+
+    fat32_set_cluster(&entry, first);
+    if(!keep_size) {
+        entry.DIR_FileSize = size;
+        set_write_time(&entry);
+    }
+    if(fat32_write_dir_entry(dir_cluster, entry_offset, &entry) != 0)
+        return -1;
+
+    update_file_handles(dir_cluster, entry_offset, first, entry.DIR_FileSize);
+    return 0;
+}
+
+int fat32_file_truncate(uint32_t dir_cluster, uint32_t entry_offset, uint32_t size)
+{
+    return file_resize(dir_cluster, entry_offset, size, true, false);
+}
+
+// like truncate, but never shrinks; keep_size reserves without growing the file
+int fat32_file_allocate(uint32_t dir_cluster, uint32_t entry_offset, uint32_t size,
+                        bool keep_size)
+{
+    return file_resize(dir_cluster, entry_offset, size, false, keep_size);
+}
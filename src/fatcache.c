@@ -0,0 +1,432 @@
+// fatcache.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fatcache.h"
+#include "fat32.h"
+
+#define FATCACHE_READAHEAD  4       // pages read at once on a sequential miss
+#define FATCACHE_RUN        16      // dirty pages per write-back
+#define FATCACHE_MIN_SLOTS  (2 * FATCACHE_READAHEAD)
+#define FATCACHE_STRIPES    64      // page locks, by page number modulo this
+
+#define SLOT_REF            1       // used since the hand last passed
+#define SLOT_DIRTY          2
+
+// a lock over every page whose number maps to it, on its own cache line
+typedef struct {
+    pthread_rwlock_t lock;
+    uint64_t hits;
+} __attribute__((aligned(64))) Stripe;
+
+/*
+ * Pages are FATCACHE_PAGE bytes of the first FAT copy, held in a fixed
+ * array of slots. A page to slot map makes lookups O(1); it costs 4 bytes
+ * per FAT page, about 0.1% of the FAT. Eviction is CLOCK: the hand clears
+ * reference bits until it finds a slot nobody used since its last pass,
+ * writing the page back first if it is dirty.
+ *
+ * A hit only takes the stripe lock of its page, shared to read an entry and
+ * exclusive to change one, so threads on different pages don't meet. lock
+ * is taken on a miss and for eviction, flush and invalidation; a page's
+ * slot_of entry changes only with both lock and the page's stripe held
+ * exclusively. Flags are set and cleared atomically.
+ */
+struct FatCache {
+    uint64_t fat_start;
+    uint64_t fat_bytes;
+    int copies;
+    uint32_t npages;
+    uint32_t nslots;
+    uint32_t used;          // slots handed out so far
+    uint32_t hand;
+    uint32_t last_miss;
+    int32_t *slot_of;       // page -> slot, -1 when not cached
+    uint32_t *page_of;      // slot -> page
+    uint8_t *flags;
+    uint8_t *data;
+    uint8_t *bounce;        // staging for multi-page reads and writes
+    pthread_mutex_t lock;   // misses, eviction and write-back
+    Stripe stripes[FATCACHE_STRIPES];
+    FatCacheStats stats;    // hits are counted per stripe
+};
+
+static inline uint8_t *slot_data(FatCache *fc, uint32_t slot)
+{
+    return fc->data + (size_t)slot * FATCACHE_PAGE;
+}
+
+static inline pthread_rwlock_t *page_lock(FatCache *fc, uint32_t page)
+{
+    return &fc->stripes[page % FATCACHE_STRIPES].lock;
+}
+
+static inline uint8_t slot_flags(FatCache *fc, uint32_t slot)
+{
+    return __atomic_load_n(&fc->flags[slot], __ATOMIC_RELAXED);
+}
+
+static inline uint8_t set_flags(FatCache *fc, uint32_t slot, uint8_t bits)
+{
+    return __atomic_fetch_or(&fc->flags[slot], bits, __ATOMIC_RELAXED);
+}
+
+static inline uint8_t clear_flags(FatCache *fc, uint32_t slot, uint8_t bits)
+{
+    return __atomic_fetch_and(&fc->flags[slot], (uint8_t)~bits, __ATOMIC_RELAXED);
+}
+
+static inline void count_hit(FatCache *fc, uint32_t index)
+{
+    uint32_t page = (uint32_t)((uint64_t)index * 4 / FATCACHE_PAGE);
+    __atomic_add_fetch(&fc->stripes[page % FATCACHE_STRIPES].hits, 1, __ATOMIC_RELAXED);
+}
+
+static inline void count_dirty(FatCache *fc, int32_t delta)
+{
+    __atomic_add_fetch(&fc->stats.dirty, (uint32_t)delta, __ATOMIC_RELAXED);
+}
+
+// bytes of FAT in count pages starting at page; only the last can be short
+static size_t span_bytes(const FatCache *fc, uint32_t page, uint32_t count)
+{
+    uint64_t start = (uint64_t)page * FATCACHE_PAGE;
+    uint64_t len = (uint64_t)count * FATCACHE_PAGE;
+    return (size_t)((start + len > fc->fat_bytes) ? fc->fat_bytes - start : len);
+}
+
+static int write_pages(FatCache *fc, uint32_t page, const uint8_t *buf, uint32_t count)
+{
+    uint64_t off = (uint64_t)page * FATCACHE_PAGE;
+    size_t len = span_bytes(fc, page, count);
+
+    for(int c = 0; c < fc->copies; c++) {
+        if(fat32_write_at(fc->fat_start + c * fc->fat_bytes + off, buf, len) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+FatCache *fatcache_open(uint64_t fat_start, uint64_t fat_bytes, int copies, size_t budget)
+{
+    // the stripes want their cache lines
+    FatCache *fc;
+    if(posix_memalign((void **)&fc, 64, sizeof(FatCache)) != 0)
+        return NULL;
+    memset(fc, 0, sizeof(FatCache));
+    pthread_mutex_init(&fc->lock, NULL);
+    for(int i = 0; i < FATCACHE_STRIPES; i++)
+        pthread_rwlock_init(&fc->stripes[i].lock, NULL);
+
+    fc->fat_start = fat_start;
+    fc->fat_bytes = fat_bytes;
+    fc->copies = copies;
+    fc->npages = (uint32_t)((fat_bytes + FATCACHE_PAGE - 1) / FATCACHE_PAGE);
+    fc->nslots = budget / FATCACHE_PAGE;
+    if(fc->nslots < FATCACHE_MIN_SLOTS)
+        fc->nslots = FATCACHE_MIN_SLOTS;
+    if(fc->nslots > fc->npages)
+        fc->nslots = fc->npages;
+    fc->last_miss = UINT32_MAX;
+
+    uint32_t stage = (FATCACHE_RUN > FATCACHE_READAHEAD) ? FATCACHE_RUN : FATCACHE_READAHEAD;
+    fc->slot_of = malloc((size_t)fc->npages * sizeof(int32_t));
+    fc->page_of = calloc(fc->nslots ? fc->nslots : 1, sizeof(uint32_t));
+    fc->flags = calloc(fc->nslots ? fc->nslots : 1, 1);
+    // page aligned, so pages can go to an O_DIRECT image without a copy
+    if(posix_memalign((void **)&fc->data, FATCACHE_PAGE,
+                      (size_t)(fc->nslots ? fc->nslots : 1) * FATCACHE_PAGE) != 0)
+        fc->data = NULL;
+    if(posix_memalign((void **)&fc->bounce, FATCACHE_PAGE, (size_t)stage * FATCACHE_PAGE) != 0)
+        fc->bounce = NULL;
+    if(fc->slot_of == NULL || fc->page_of == NULL || fc->flags == NULL ||
+       fc->data == NULL || fc->bounce == NULL) {
+        fatcache_close(fc);
+        return NULL;
+    }
+    for(uint32_t p = 0; p < fc->npages; p++)
+        fc->slot_of[p] = -1;
+    fc->stats.capacity = fc->nslots;
+    return fc;
+}
+
+void fatcache_close(FatCache *fc)
+{
+    if(fc == NULL)
+        return;
+    pthread_mutex_destroy(&fc->lock);
+    for(int i = 0; i < FATCACHE_STRIPES; i++)
+        pthread_rwlock_destroy(&fc->stripes[i].lock);
+    free(fc->slot_of);
+    free(fc->page_of);
+    free(fc->flags);
+    free(fc->data);
+    free(fc->bounce);
+    free(fc);
+}
+
+// a free slot, evicting with the clock hand once all are in use
+static int32_t take_slot(FatCache *fc)
+{
+    if(fc->used < fc->nslots)
+        return (int32_t)fc->used++;
+
+    // two passes clear every reference bit; a third only meets failed writes
+    for(uint32_t step = 0; step < 3 * fc->nslots; step++)
+    {
+        uint32_t s = fc->hand;
+        fc->hand = (fc->hand + 1) % fc->nslots;
+        if(clear_flags(fc, s, SLOT_REF) & SLOT_REF)
+            continue;
+
+        // hits on the page are done once its stripe is ours
+        uint32_t page = fc->page_of[s];
+        pthread_rwlock_wrlock(page_lock(fc, page));
+        if(clear_flags(fc, s, SLOT_REF) & SLOT_REF) {
+            pthread_rwlock_unlock(page_lock(fc, page));
+            continue;
+        }
+        if(slot_flags(fc, s) & SLOT_DIRTY) {
+            if(write_pages(fc, page, slot_data(fc, s), 1) != 0) {
+                pthread_rwlock_unlock(page_lock(fc, page));
+                continue;
+            }
+            clear_flags(fc, s, SLOT_DIRTY);
+            count_dirty(fc, -1);
+            fc->stats.writebacks++;
+        }
+        fc->slot_of[page] = -1;
+        pthread_rwlock_unlock(page_lock(fc, page));
+        fc->stats.pages--;
+        fc->stats.evictions++;
+        return (int32_t)s;
+    }
+    return -1;
+}
+
+// loads page, and a few after it when the misses walk forward
+static int32_t load_page(FatCache *fc, uint32_t page)
+{
+    uint32_t count = 1;
+    if(page == fc->last_miss + 1) {
+        while(count < FATCACHE_READAHEAD && page + count < fc->npages &&
+              fc->slot_of[page + count] < 0)
+            count++;
+    }
+    fc->last_miss = page + count - 1;
+
+    size_t len = span_bytes(fc, page, count);
+    memset(fc->bounce + len, 0, (size_t)count * FATCACHE_PAGE - len);
+    if(fat32_read_at(fc->fat_start + (uint64_t)page * FATCACHE_PAGE, fc->bounce, len) != 0)
+        return -1;
+
+    int32_t first = -1;
+    for(uint32_t k = 0; k < count; k++)
+    {
+        int32_t s = take_slot(fc);
+        if(s < 0)
+            break;
+        memcpy(slot_data(fc, s), fc->bounce + (size_t)k * FATCACHE_PAGE, FATCACHE_PAGE);
+        // pages read ahead get no second chance until someone uses them
+        __atomic_store_n(&fc->flags[s], (k == 0) ? SLOT_REF : 0, __ATOMIC_RELAXED);
+        pthread_rwlock_wrlock(page_lock(fc, page + k));
+        fc->page_of[s] = page + k;
+        fc->slot_of[page + k] = s;
+        pthread_rwlock_unlock(page_lock(fc, page + k));
+        fc->stats.pages++;
+        if(k == 0)
+            first = s;
+        else
+            fc->stats.readahead++;
+    }
+    return first;
+}
+
+/*
+ * Reads entry index into *value, or with set writes *value there, if its
+ * page is cached. Returns 1 if it is not, -1 if index is past the FAT.
+ */
+static int cached_entry(FatCache *fc, uint32_t index, uint32_t *value, bool set)
+{
+    uint64_t byte = (uint64_t)index * 4;
+    if(byte + 4 > fc->fat_bytes)
+        return -1;
+    uint32_t page = (uint32_t)(byte / FATCACHE_PAGE);
+    pthread_rwlock_t *lock = page_lock(fc, page);
+
+    if(set)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
+    int32_t s = fc->slot_of[page];
+    if(s >= 0) {
+        uint8_t *p = slot_data(fc, s) + byte % FATCACHE_PAGE;
+        if(set) {
+            memcpy(p, value, 4);
+            if(!(set_flags(fc, s, SLOT_DIRTY | SLOT_REF) & SLOT_DIRTY))
+                count_dirty(fc, 1);
+        } else {
+            memcpy(value, p, 4);
+            // a plain load first keeps hot slots' flags from bouncing between cores
+            if(!(slot_flags(fc, s) & SLOT_REF))
+                set_flags(fc, s, SLOT_REF);
+        }
+    }
+    pthread_rwlock_unlock(lock);
+    return (s >= 0) ? 0 : 1;
+}
+
+// the miss path: loads the page under fc->lock unless a racing miss did
+static int load_entry(FatCache *fc, uint32_t index, uint32_t *value, bool set)
+{
+    pthread_mutex_lock(&fc->lock);
+    int ret = cached_entry(fc, index, value, set);
+    if(ret == 0) {
+        count_hit(fc, index);
+    } else if(ret > 0) {
+        fc->stats.misses++;
+        // the page can't be evicted again before fc->lock is released
+        if(load_page(fc, (uint32_t)((uint64_t)index * 4 / FATCACHE_PAGE)) < 0)
+            ret = -1;
+        else
+            ret = cached_entry(fc, index, value, set);
+    }
+    pthread_mutex_unlock(&fc->lock);
+    return ret;
+}
+
+int fatcache_get(FatCache *fc, uint32_t index, uint32_t *value)
+{
+    int ret = cached_entry(fc, index, value, false);
+    if(ret == 0)
+        count_hit(fc, index);
+    else if(ret > 0)
+        ret = load_entry(fc, index, value, false);
+    return ret;
+}
+
+int fatcache_set(FatCache *fc, uint32_t index, uint32_t value)
+{
+    int ret = cached_entry(fc, index, &value, true);
+    if(ret == 0)
+        count_hit(fc, index);
+    else if(ret > 0)
+        ret = load_entry(fc, index, &value, true);
+    return ret;
+}
+
+void fatcache_patch(FatCache *fc, uint32_t first, const uint32_t *values, size_t count)
+{
+    uint64_t start = (uint64_t)first * 4;
+    uint64_t end = start + (uint64_t)count * 4;
+
+    pthread_mutex_lock(&fc->lock);
+    for(uint64_t pos = start; pos < end; )
+    {
+        uint32_t page = (uint32_t)(pos / FATCACHE_PAGE);
+        uint64_t page_end = (uint64_t)(page + 1) * FATCACHE_PAGE;
+        uint64_t stop = (end < page_end) ? end : page_end;
+        if(page < fc->npages && fc->slot_of[page] >= 0) {
+            pthread_rwlock_wrlock(page_lock(fc, page));
+            memcpy(slot_data(fc, fc->slot_of[page]) + pos % FATCACHE_PAGE,
+                   (const uint8_t *)values + (pos - start), (size_t)(stop - pos));
+            pthread_rwlock_unlock(page_lock(fc, page));
+        }
+        pos = stop;
+    }
+    pthread_mutex_unlock(&fc->lock);
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Writes dirty pages in page order, runs of adjacent pages in one go. Each
+ * page is copied out and marked clean under its stripe, so a change made
+ * while the run is being written dirties it again.
+ */
+int fatcache_flush(FatCache *fc)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&fc->lock);
+    if(__atomic_load_n(&fc->stats.dirty, __ATOMIC_RELAXED) == 0) {
+        pthread_mutex_unlock(&fc->lock);
+        return 0;
+    }
+
+    uint32_t *pages = malloc(fc->used * sizeof(uint32_t));
+    if(pages == NULL) {
+        pthread_mutex_unlock(&fc->lock);
+        return -1;
+    }
+    uint32_t n = 0;
+    for(uint32_t s = 0; s < fc->used; s++) {
+        if(slot_flags(fc, s) & SLOT_DIRTY)
+            pages[n++] = fc->page_of[s];
+    }
+    qsort(pages, n, sizeof(uint32_t), compare_pages);
+
+    for(uint32_t i = 0; i < n; )
+    {
+        uint32_t run = 1;
+        while(i + run < n && run < FATCACHE_RUN && pages[i + run] == pages[i] + run)
+            run++;
+        for(uint32_t k = 0; k < run; k++) {
+            uint32_t page = pages[i + k];
+            pthread_rwlock_rdlock(page_lock(fc, page));
+            memcpy(fc->bounce + (size_t)k * FATCACHE_PAGE,
+                   slot_data(fc, fc->slot_of[page]), FATCACHE_PAGE);
+            if(clear_flags(fc, fc->slot_of[page], SLOT_DIRTY) & SLOT_DIRTY)
+                count_dirty(fc, -1);
+            pthread_rwlock_unlock(page_lock(fc, page));
+        }
+
+        if(write_pages(fc, pages[i], fc->bounce, run) == 0) {
+            fc->stats.writebacks += run;
+        } else {
+            for(uint32_t k = 0; k < run; k++) {
+                if(!(set_flags(fc, fc->slot_of[pages[i + k]], SLOT_DIRTY) & SLOT_DIRTY))
+                    count_dirty(fc, 1);
+            }
+            ret = -1;
+        }
+        i += run;
+    }
+
+    free(pages);
+    pthread_mutex_unlock(&fc->lock);
+    return ret;
+}
+
+void fatcache_invalidate(FatCache *fc)
+{
+    pthread_mutex_lock(&fc->lock);
+    for(uint32_t s = 0; s < fc->used; s++) {
+        uint32_t page = fc->page_of[s];
+        pthread_rwlock_wrlock(page_lock(fc, page));
+        fc->slot_of[page] = -1;
+        pthread_rwlock_unlock(page_lock(fc, page));
+    }
+    memset(fc->flags, 0, fc->nslots);
+    fc->used = 0;
+    fc->hand = 0;
+    fc->last_miss = UINT32_MAX;
+    fc->stats.pages = 0;
+    __atomic_store_n(&fc->stats.dirty, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fc->lock);
+}
+
+void fatcache_stats(FatCache *fc, FatCacheStats *st)
+{
+    pthread_mutex_lock(&fc->lock);
+    *st = fc->stats;
+    st->dirty = __atomic_load_n(&fc->stats.dirty, __ATOMIC_RELAXED);
+    for(int i = 0; i < FATCACHE_STRIPES; i++)
+        st->hits += __atomic_load_n(&fc->stripes[i].hits, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fc->lock);
+}
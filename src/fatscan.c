@@ -0,0 +1,362 @@
+// fatscan.c
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "fatscan.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include "bufpool.h"
+#include "dirindex.h"
+
+#define SCAN_CHUNK  BUFPOOL_BUFFER          // FAT bytes per read
+#define SCAN_WORDS  (SCAN_CHUNK / 4 / 64)   // free bitmap words per chunk
+
+static bool scan_avx2;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void scan_init(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    scan_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+static inline void count_special(FatScan *s, uint32_t value)
+{
+    if(value == FAT_BAD)
+        s->bad++;
+    else
+        s->reserved++;
+}
+
+// sets bit i of bits for every free entry from index from on
+static void classify_sw(const uint32_t *e, size_t from, size_t n, uint64_t *bits, FatScan *s)
+{
+    for(size_t i = from; i < n; i++) {
+        uint32_t v = e[i] & FAT_MASK;
+        if(v == FAT_FREE)
+            bits[i >> 6] |= 1ULL << (i & 63);
+        else if(v >= FAT_RESERVED && v <= FAT_BAD)
+            count_special(s, v);
+    }
+}
+
+#if defined(__x86_64__)
+/*
+ * Eight entries per step: one compare against zero gives the free mask
+ * and a range compare flags bad or reserved values, which are rare enough
+ * to sort out one by one.
+ */
+__attribute__((target("avx2")))
+static void classify_avx2(const uint32_t *e, size_t n, uint64_t *bits, FatScan *s)
+{
+    const __m256i mask = _mm256_set1_epi32(FAT_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i below = _mm256_set1_epi32(FAT_RESERVED - 1);
+    const __m256i above = _mm256_set1_epi32(FAT_BAD + 1);
+    size_t i = 0;
+
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(e + i)), mask);
+        uint32_t f = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero)));
+        bits[i >> 6] |= (uint64_t)f << (i & 63);
+
+        __m256i special = _mm256_and_si256(_mm256_cmpgt_epi32(v, below),
+                                           _mm256_cmpgt_epi32(above, v));
+        uint32_t m = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(special));
+        while(m != 0) {
+            count_special(s, e[i + __builtin_ctz(m)] & FAT_MASK);
+            m &= m - 1;
+        }
+    }
+    classify_sw(e, i, n, bits, s);
+}
+#endif
+
+static void end_run(FatScan *s, uint32_t *run, uint32_t start)
+{
+    if(*run == 0)
+        return;
+    s->free_runs++;
+    int bucket = 31 - __builtin_clz(*run);
+    if(bucket >= FREE_RUN_BUCKETS)
+        bucket = FREE_RUN_BUCKETS - 1;
+    s->run_hist[bucket]++;
+    if(*run > s->largest_run) {
+        s->largest_run = *run;
+        s->largest_run_start = start;
+    }
+    *run = 0;
+}
+
+// walks the free bitmap a word at a time, jumping over whole runs with ctz
+static void track_runs(FatScan *s, const uint64_t *bits, size_t words, uint32_t base,
+                       uint32_t *run, uint32_t *start)
+{
+    for(size_t w = 0; w < words; w++, base += 64)
+    {
+        uint64_t word = bits[w];
+        s->free += __builtin_popcountll(word);
+        if(word == ~0ULL) {
+            if(*run == 0)
+                *start = base;
+            *run += 64;
+            continue;
+        }
+
+        int pos = 0;
+        while(pos < 64) {
+            uint64_t rest = word >> pos;
+            if(rest & 1) {
+                int len = __builtin_ctzll(~rest);
+                if(*run == 0)
+                    *start = base + pos;
+                *run += len;
+                pos += len;
+            } else {
+                end_run(s, run, *start);
+                if(rest == 0)
+                    break;
+                pos += __builtin_ctzll(rest);
+            }
+        }
+    }
+}
+
+/*
+ * Reads the first FAT in large blocks. Each block becomes a bitmap of free
+ * entries, which gives both the free count (popcount) and the free runs.
+ */
+int fat32_scan_fat(FatScan *scan)
+{
+    uint32_t fatEntries = fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec / 4;
+    uint32_t end = fs.total_clusters + 2;
+    if(end > fatEntries)
+        end = fatEntries;
+
+    memset(scan, 0, sizeof(*scan));
+    if(end <= 2)
+        return 0;
+    scan->clusters = end - 2;
+    pthread_once(&scan_once, scan_init);
+
+    uint32_t *buf = bufpool_get(fs.pool);
+    uint64_t *bits = malloc(SCAN_WORDS * sizeof(uint64_t));
+    if(buf == NULL || bits == NULL) {
+        bufpool_put(fs.pool, buf);
+        free(bits);
+        return -1;
+    }
+
+    uint32_t run = 0, start = 0;
+    int ret = 0;
+    for(uint32_t base = 0; base < end; base += SCAN_CHUNK / 4)
+    {
+        size_t n = (end - base < SCAN_CHUNK / 4) ? end - base : SCAN_CHUNK / 4;
+        if(fat32_read_at(fs.fat_start + (uint64_t)base * 4, buf, n * 4) != 0) {
+            ret = -1;
+            break;
+        }
+        scan->fat_bytes += n * 4;
+
+        // entries 0 and 1 are not clusters
+        if(base == 0)
+            buf[0] = buf[1] = FAT_EOC;
+
+        size_t words = (n + 63) / 64;
+        memset(bits, 0, words * sizeof(uint64_t));
+#if defined(__x86_64__)
+        if(scan_avx2)
+            classify_avx2(buf, n, bits, scan);
+        else
+#endif
+            classify_sw(buf, 0, n, bits, scan);
+        track_runs(scan, bits, words, base, &run, &start);
+    }
+    end_run(scan, &run, start);
+
+    scan->used = scan->clusters - scan->free - scan->bad - scan->reserved;
+    bufpool_put(fs.pool, buf);
+    free(bits);
+    return ret;
+}
+
+int fat32_active_fat(void)
+{
+    if(fs.bs.BPB_ExtFlags & EXT_NO_MIRROR)
+        return fs.bs.BPB_ExtFlags & EXT_ACTIVE;
+    return 0;
+}
+
+// sets bit i of bits for every entry that differs, from index from on
+static bool diff_sw(const uint32_t *a, const uint32_t *b, size_t from, size_t n, uint64_t *bits)
+{
+    bool any = false;
+    for(size_t i = from; i < n; i++) {
+        if(a[i] != b[i]) {
+            bits[i >> 6] |= 1ULL << (i & 63);
+            any = true;
+        }
+    }
+    return any;
+}
+
+#if defined(__x86_64__)
+/*
+ * Mirrors nearly always agree, so each step tests 64 bytes of xor for
+ * zero and only works out which of the sixteen entries differ when it
+ * is not.
+ */
+__attribute__((target("avx2")))
+static bool diff_avx2(const uint32_t *a, const uint32_t *b, size_t n, uint64_t *bits)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    bool any = false;
+    size_t i = 0;
+
+    for(; i + 16 <= n; i += 16)
+    {
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                      _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 8)),
+                                      _mm256_loadu_si256((const __m256i *)(b + i + 8)));
+        __m256i x = _mm256_or_si256(x0, x1);
+        if(_mm256_testz_si256(x, x))
+            continue;
+
+        uint32_t m0 = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(x0, zero)));
+        uint32_t m1 = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(x1, zero)));
+        bits[i >> 6] |= (uint64_t)(~(m0 | m1 << 8) & 0xFFFF) << (i & 63);
+        any = true;
+    }
+    return diff_sw(a, b, i, n, bits) || any;
+}
+#endif
+
+static void end_diff(MirrorDiff *d, uint32_t *run, uint32_t start)
+{
+    if(*run == 0)
+        return;
+    if(d->ranges < MIRROR_RANGES) {
+        d->first[d->ranges] = start;
+        d->last[d->ranges] = start + *run - 1;
+    }
+    d->ranges++;
+    *run = 0;
+}
+
+// folds a block's differing entries into ranges, which may span blocks
+static void track_diffs(MirrorDiff *d, const uint64_t *bits, size_t words, uint32_t base,
+                        uint32_t *run, uint32_t *start)
+{
+    for(size_t w = 0; w < words; w++)
+    {
+        uint64_t word = bits[w];
+        while(word != 0) {
+            uint32_t i = base + (uint32_t)(w * 64) + __builtin_ctzll(word);
+            word &= word - 1;
+            d->entries++;
+            if(*run > 0 && i == *start + *run) {
+                (*run)++;
+            } else {
+                end_diff(d, run, *start);
+                *start = i;
+                *run = 1;
+            }
+        }
+    }
+}
+
+/*
+ * Reads the reference copy a block at a time and holds every other copy
+ * against it. A repair rewrites only the blocks that differ, each in one
+ * sequential write, so a healthy mirror costs reads alone.
+ */
+int fat32_check_mirrors(int ref, bool repair, MirrorDiff *diffs)
+{
+    int copies = fs.bs.BPB_NumFATs;
+    uint64_t fatBytes = (uint64_t)fs.bs.BPB_FATSz32 * fs.bs.BPB_BytsPerSec;
+
+    memset(diffs, 0, copies * sizeof(MirrorDiff));
+    if(ref < 0 || ref >= copies)
+        return -1;
+    pthread_once(&scan_once, scan_init);
+
+    // cached changes have not reached any copy yet
+    if(fat32_flush_fat() != 0)
+        return -1;
+
+    uint32_t *refBuf = bufpool_get(fs.pool);
+    uint32_t *buf = bufpool_get(fs.pool);
+    uint64_t *bits = malloc(SCAN_WORDS * sizeof(uint64_t));
+    uint32_t *run = calloc(copies, sizeof(uint32_t));
+    uint32_t *start = calloc(copies, sizeof(uint32_t));
+    int ret = (refBuf && buf && bits && run && start) ? 0 : -1;
+
+    for(uint64_t off = 0; off < fatBytes && ret == 0; off += SCAN_CHUNK)
+    {
+        size_t len = (fatBytes - off < SCAN_CHUNK) ? (size_t)(fatBytes - off) : SCAN_CHUNK;
+        size_t n = len / 4;
+        uint32_t base = (uint32_t)(off / 4);
+        if(fat32_read_at(fs.fat_start + ref * fatBytes + off, refBuf, len) != 0) {
+            ret = -1;
+            break;
+        }
+
+        for(int c = 0; c < copies && ret == 0; c++)
+        {
+            if(c == ref)
+                continue;
+            uint64_t at = fs.fat_start + c * fatBytes + off;
+            if(fat32_read_at(at, buf, len) != 0) {
+                ret = -1;
+                break;
+            }
+
+            size_t words = (n + 63) / 64;
+            memset(bits, 0, words * sizeof(uint64_t));
+            bool differs;
+#if defined(__x86_64__)
+            if(scan_avx2)
+                differs = diff_avx2(refBuf, buf, n, bits);
+            else
+#endif
+                differs = diff_sw(refBuf, buf, 0, n, bits);
+            if(!differs)
+                continue;
+            track_diffs(&diffs[c], bits, words, base, &run[c], &start[c]);
+
+            if(repair) {
+                if(fat32_write_at(at, refBuf, len) != 0)
+                    ret = -1;
+                else
+                    diffs[c].written += len;
+            }
+        }
+    }
+
+    if(run != NULL && start != NULL) {
+        for(int c = 0; c < copies; c++)
+            end_diff(&diffs[c], &run[c], start[c]);
+    }
+
+    // the cache holds pages of FAT 0, which may just have been rewritten,
+    // and directory indexes hold chains read through it
+    if(diffs[0].written > 0) {
+        fatcache_invalidate(fs.fat_cache);
+        dirindex_clear();
+    }
+
+    bufpool_put(fs.pool, refBuf);
+    bufpool_put(fs.pool, buf);
+    free(bits);
+    free(run);
+    free(start);
+    return ret;
+}
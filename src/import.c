@@ -0,0 +1,922 @@
+// import.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "import.h"
+#include "fat32.h"
+#include "commands.h"
+#include "walk.h"
+#include "io.h"
+#include "bufpool.h"
+#include "fatscan.h"
+
+#define IMPORT_CHUNK    BUFPOOL_BUFFER  // largest single read/write of file data
+
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} Extent;
+
+typedef struct {
+    char *name;             // name inside the image
+    char *host;             // NULL when copying from the image itself
+    uint32_t src_cluster;   // copies: first cluster of the source
+    size_t src_first;       // copies: the source chain as extents
+    size_t src_count;
+    bool is_dir;
+    uint32_t size;
+    time_t mtime;
+    int parent;             // -1 for the top node
+    int first_child;        // children are stored next to each other
+    int child_count;
+    uint32_t clusters;
+    size_t ext_first;
+    size_t ext_count;
+    DirEntry *ents;         // directories: every slot, padded to whole clusters
+    uint32_t slot;          // where this node's 8.3 entry sits in the parent's ents
+    int failed;
+} ImportNode;
+
+typedef struct {
+    int node;
+    uint64_t file_offset;   // in the host file, or in the image for copies
+    uint64_t image_offset;
+    uint32_t len;
+} ImportJob;
+
+typedef struct {
+    ImportNode *nodes;
+    size_t count, cap;
+    Extent *ext;
+    size_t ext_count, ext_cap;
+    Extent *src_ext;        // source chains of a copy
+    size_t src_ext_count, src_ext_cap;
+    ImportJob *jobs;
+    size_t job_count, job_cap;
+    size_t next_job;
+    int write_failed;
+    bool from_image;
+    uint32_t cluster_size;
+    ImportStats *stats;
+} Import;
+
+// free cluster search through the FAT cache, next fit from cursor; taken
+// marks the clusters handed out so far, which the FAT doesn't show yet
+typedef struct {
+    uint8_t *taken;
+    uint32_t end;
+    uint32_t cursor;
+} Alloc;
+
+static void set_times(DirEntry *e, time_t t)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if(tm.tm_year < 80) {
+        // FAT dates start in 1980
+        tm.tm_year = 80;
+        tm.tm_mon = 0;
+        tm.tm_mday = 1;
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    }
+    uint16_t date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    uint16_t timeval = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    e->DIR_CrtDate = e->DIR_WrtDate = e->DIR_LstAccDate = date;
+    e->DIR_CrtTime = e->DIR_WrtTime = timeval;
+}
+
+static bool valid_name(const char *name)
+{
+    for(const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        if(*p < 0x20 || strchr("\"*/:<>?\\|", *p) != NULL)
+            return false;
+    }
+    return strlen(name) <= MAX_LFN;
+}
+
+static char *join(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if(path != NULL)
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static int add_node(Import *im, char *name, char *host, bool is_dir, uint32_t size,
+                    time_t mtime, int parent)
+{
+    if(im->count == im->cap) {
+        size_t cap = im->cap ? im->cap * 2 : 256;
+        ImportNode *grown = realloc(im->nodes, cap * sizeof(ImportNode));
+        if(grown == NULL)
+            return -1;
+        im->nodes = grown;
+        im->cap = cap;
+    }
+    ImportNode *n = &im->nodes[im->count++];
+    memset(n, 0, sizeof(*n));
+    n->name = name;
+    n->host = host;
+    n->is_dir = is_dir;
+    n->size = is_dir ? 0 : size;
+    n->mtime = mtime;
+    n->parent = parent;
+    n->first_child = -1;
+    return 0;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// appends the importable entries of a host directory as children of node idx
+static int scan_dir(Import *im, int idx)
+{
+    DIR *d = opendir(im->nodes[idx].host);
+    if(d == NULL) {
+        cmd_printf("Skipping %s: %s\n", im->nodes[idx].host, strerror(errno));
+        im->stats->skipped++;
+        return 0;
+    }
+
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *de;
+    int ret = 0;
+    while(ret == 0 && (de = readdir(d)) != NULL)
+    {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if(count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(names, cap * sizeof(char *));
+            if(grown == NULL) {
+                ret = -1;
+                break;
+            }
+            names = grown;
+        }
+        if((names[count] = strdup(de->d_name)) == NULL)
+            ret = -1;
+        else
+            count++;
+    }
+    closedir(d);
+
+    // sorted, so the same tree always gives the same image
+    qsort(names, count, sizeof(char *), cmp_names);
+
+    im->nodes[idx].first_child = (int)im->count;
+    for(size_t i = 0; i < count; i++)
+    {
+        char *name = names[i];
+        char *host = (ret == 0) ? join(im->nodes[idx].host, name) : NULL;
+        struct stat st;
+        const char *why = NULL;
+
+        if(host == NULL)
+            ret = -1;
+        else if(lstat(host, &st) != 0)
+            why = strerror(errno);
+        else if(!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+            why = "not a regular file or directory";
+        else if(S_ISREG(st.st_mode) && (uint64_t)st.st_size > UINT32_MAX)
+            why = "larger than 4 GB";
+        else if(!valid_name(name))
+            why = "name not allowed in FAT";
+
+        // FAT names are case-insensitive, so the first spelling wins
+        for(int k = im->nodes[idx].first_child; why == NULL && k < (int)im->count; k++) {
+            if(strcasecmp(im->nodes[k].name, name) == 0)
+                why = "name clash";
+        }
+
+        if(ret == 0 && why != NULL) {
+            cmd_printf("Skipping %s: %s\n", host, why);
+            im->stats->skipped++;
+        }
+        if(ret != 0 || why != NULL ||
+           add_node(im, name, host, S_ISDIR(st.st_mode), (uint32_t)st.st_size, st.st_mtime, idx) != 0) {
+            if(ret == 0 && why == NULL)
+                ret = -1;
+            free(name);
+            free(host);
+        }
+    }
+    im->nodes[idx].child_count = (int)im->count - im->nodes[idx].first_child;
+    free(names);
+    return ret;
+}
+
+// appends the entries of a directory in the image as children of node idx
+static int scan_image_dir(Import *im, int idx)
+{
+    DirReader r;
+    DirRecord *recs = malloc(READDIR_BATCH * sizeof(DirRecord));
+    time_t now = fat32_now();
+    int ret = 0, n;
+
+    if(recs == NULL || fat32_readdir_open(&r, im->nodes[idx].src_cluster) != 0) {
+        free(recs);
+        return -1;
+    }
+
+    im->nodes[idx].first_child = (int)im->count;
+    while(ret == 0 && (n = fat32_readdir(&r, recs, READDIR_BATCH)) > 0)
+    {
+        for(int i = 0; i < n && ret == 0; i++)
+        {
+            const DirEntry *e = &recs[i].entry;
+            if(strcmp(recs[i].name, ".") == 0 || strcmp(recs[i].name, "..") == 0 ||
+               (e->DIR_Attr & ATTR_VOLUME_ID))
+                continue;
+
+            char *name = strdup(recs[i].name);
+            bool isDir = e->DIR_Attr & ATTR_DIRECTORY;
+            if(name == NULL || add_node(im, name, NULL, isDir, e->DIR_FileSize, now, idx) != 0) {
+                free(name);
+                ret = -1;
+                break;
+            }
+            im->nodes[im->count - 1].src_cluster = fat32_get_cluster(e);
+        }
+    }
+    if(r.failed)
+        ret = -1;
+    fat32_readdir_close(&r);
+    free(recs);
+
+    im->nodes[idx].child_count = (int)im->count - im->nodes[idx].first_child;
+    return ret;
+}
+
+static int append_slots(DirEntry **ents, uint32_t *count, uint32_t *cap,
+                        const DirEntry *slots, int n)
+{
+    if(*count + n > *cap) {
+        uint32_t grown_cap = *cap ? *cap * 2 : 64;
+        while(grown_cap < *count + n)
+            grown_cap *= 2;
+        DirEntry *grown = realloc(*ents, grown_cap * sizeof(DirEntry));
+        if(grown == NULL)
+            return -1;
+        *ents = grown;
+        *cap = grown_cap;
+    }
+    memcpy(*ents + *count, slots, n * sizeof(DirEntry));
+    *count += n;
+    return 0;
+}
+
+/*
+ * Builds every slot of a new directory in memory: . and .., then the
+ * children. Names that fit 8.3 go first so generated aliases can avoid
+ * them. Cluster numbers are patched in after allocation.
+ */
+static int layout_dir(Import *im, int idx)
+{
+    ImportNode *dir = &im->nodes[idx];
+    uint32_t perCluster = im->cluster_size / sizeof(DirEntry);
+    DirEntry *ents = NULL;
+    uint32_t count = 0, cap = 0;
+    uint8_t (*taken)[11] = malloc((dir->child_count + 1) * sizeof(*taken));
+    size_t takenCount = 0;
+
+    if(taken == NULL)
+        return -1;
+
+    DirEntry dots[2];
+    memset(dots, 0, sizeof(dots));
+    memset(dots[0].DIR_Name, ' ', 11);
+    memset(dots[1].DIR_Name, ' ', 11);
+    dots[0].DIR_Name[0] = '.';
+    dots[1].DIR_Name[0] = dots[1].DIR_Name[1] = '.';
+    dots[0].DIR_Attr = dots[1].DIR_Attr = ATTR_DIRECTORY;
+    set_times(&dots[0], dir->mtime);
+    set_times(&dots[1], dir->mtime);
+    int ret = append_slots(&ents, &count, &cap, dots, 2);
+
+    for(int pass = 0; pass < 2 && ret == 0; pass++)
+    {
+        for(int k = 0; k < dir->child_count && ret == 0; k++)
+        {
+            ImportNode *child = &im->nodes[dir->first_child + k];
+            if(fat32_is_short_name(child->name) != (pass == 0))
+                continue;
+
+            DirEntry e, slots[LFN_ORD_MASK + 1];
+            memset(&e, 0, sizeof(e));
+            e.DIR_Attr = child->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+            e.DIR_FileSize = child->size;
+            set_times(&e, child->mtime);
+
+            int n = fat32_name_slots(child->name, &e, (const uint8_t (*)[11])taken,
+                                     takenCount, slots);
+            if(n < 0 || append_slots(&ents, &count, &cap, slots, n) != 0) {
+                ret = -1;
+                break;
+            }
+            memcpy(taken[takenCount++], e.DIR_Name, 11);
+            child->slot = count - 1;
+        }
+    }
+    free(taken);
+
+    // pad with end-of-directory slots up to whole clusters
+    uint32_t clusters = (count + perCluster - 1) / perCluster;
+    if(ret == 0 && count < clusters * perCluster) {
+        DirEntry zero;
+        memset(&zero, 0, sizeof(zero));
+        while(ret == 0 && count < clusters * perCluster)
+            ret = append_slots(&ents, &count, &cap, &zero, 1);
+    }
+    if(ret != 0) {
+        free(ents);
+        return -1;
+    }
+
+    dir->ents = ents;
+    dir->clusters = clusters;
+    return 0;
+}
+
+static int push_extent(Extent **ext, size_t *count, size_t *cap, uint32_t start, uint32_t n)
+{
+    if(*count == *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 256;
+        Extent *grown = realloc(*ext, grown_cap * sizeof(Extent));
+        if(grown == NULL)
+            return -1;
+        *ext = grown;
+        *cap = grown_cap;
+    }
+    (*ext)[*count].start = start;
+    (*ext)[*count].count = n;
+    (*count)++;
+    return 0;
+}
+
+static int add_extent(Import *im, uint32_t start, uint32_t count)
+{
+    return push_extent(&im->ext, &im->ext_count, &im->ext_cap, start, count);
+}
+
+// records the runs of a source file's chain; a chain too short for the size fails the node
+static int chain_extents(Import *im, int idx)
+{
+    ImportNode *n = &im->nodes[idx];
+    uint32_t c = n->src_cluster;
+
+    n->src_first = im->src_ext_count;
+    for(uint32_t got = 0; got < n->clusters; got++)
+    {
+        if(c < 2 || c >= fs.total_clusters + 2) {
+            n->failed = 1;
+            break;
+        }
+        Extent *last = (n->src_count > 0) ? &im->src_ext[im->src_ext_count - 1] : NULL;
+        if(last != NULL && c == last->start + last->count) {
+            last->count++;
+        } else {
+            if(push_extent(&im->src_ext, &im->src_ext_count, &im->src_ext_cap, c, 1) != 0)
+                return -1;
+            n->src_count++;
+        }
+        c = fat32_get_fat_entry(c);
+    }
+    return 0;
+}
+
+// length of the free run at c, capped at max
+static uint32_t free_run(const Alloc *a, uint32_t c, uint32_t max)
+{
+    uint32_t len = 0;
+    while(len < max && c + len < a->end &&
+          !(a->taken[(c + len) / 8] & (1u << ((c + len) % 8))) &&
+          fat32_get_fat_entry(c + len) == FAT_FREE)
+        len++;
+    return len;
+}
+
+static void take(Alloc *a, uint32_t start, uint32_t count)
+{
+    for(uint32_t c = start; c < start + count; c++)
+        a->taken[c / 8] |= 1u << (c % 8);
+    a->cursor = start + count;
+    if(a->cursor >= a->end)
+        a->cursor = 2;
+}
+
+/*
+ * Gives node idx its clusters as extents. The first free run from the
+ * cursor that fits the whole node wins; if there is none the node is
+ * spread over the free runs that follow the cursor.
+ */
+static int allocate_node(Import *im, Alloc *a, int idx)
+{
+    ImportNode *n = &im->nodes[idx];
+    uint32_t need = n->clusters;
+
+    n->ext_first = im->ext_count;
+    if(need == 0)
+        return 0;
+
+    uint32_t span = a->end - 2;
+    for(uint32_t i = 0; i < span; )
+    {
+        uint32_t c = 2 + (a->cursor - 2 + i) % span;
+        uint32_t len = free_run(a, c, need);
+        if(len == need) {
+            take(a, c, need);
+            n->ext_count = 1;
+            return add_extent(im, c, need);
+        }
+        i += len + 1;
+    }
+
+    for(uint32_t i = 0; i < span && need > 0; )
+    {
+        uint32_t c = 2 + (a->cursor - 2 + i) % span;
+        uint32_t len = free_run(a, c, need);
+        if(len > 0) {
+            if(add_extent(im, c, len) != 0)
+                return -1;
+            take(a, c, len);
+            n->ext_count++;
+            need -= len;
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+    return (need == 0) ? 0 : -1;
+}
+
+static uint32_t first_cluster(const Import *im, int idx)
+{
+    const ImportNode *n = &im->nodes[idx];
+    return (n->ext_count > 0) ? im->ext[n->ext_first].start : 0;
+}
+
+static int add_job(Import *im, int node, uint64_t file_offset, uint64_t image_offset, uint32_t len)
+{
+    if(im->job_count == im->job_cap) {
+        size_t cap = im->job_cap ? im->job_cap * 2 : 256;
+        ImportJob *grown = realloc(im->jobs, cap * sizeof(ImportJob));
+        if(grown == NULL)
+            return -1;
+        im->jobs = grown;
+        im->job_cap = cap;
+    }
+    ImportJob *j = &im->jobs[im->job_count++];
+    j->node = node;
+    j->file_offset = file_offset;
+    j->image_offset = image_offset;
+    j->len = len;
+    return 0;
+}
+
+// copies: chunks that cross neither a source nor a destination extent
+static int plan_copy_jobs(Import *im, int idx)
+{
+    const ImportNode *n = &im->nodes[idx];
+    size_t se = 0, de = 0;
+    uint64_t sdone = 0, ddone = 0;
+
+    for(uint64_t off = 0; off < n->size; )
+    {
+        const Extent *x = &im->src_ext[n->src_first + se];
+        const Extent *y = &im->ext[n->ext_first + de];
+        uint64_t srcLeft = (uint64_t)x->count * im->cluster_size - sdone;
+        uint64_t dstLeft = (uint64_t)y->count * im->cluster_size - ddone;
+        uint64_t len = n->size - off;
+        if(len > srcLeft)
+            len = srcLeft;
+        if(len > dstLeft)
+            len = dstLeft;
+        if(len > IMPORT_CHUNK)
+            len = IMPORT_CHUNK;
+
+        if(add_job(im, idx, fat32_cluster_to_offset(x->start) + sdone,
+                   fat32_cluster_to_offset(y->start) + ddone, (uint32_t)len) != 0)
+            return -1;
+        off += len;
+        sdone += len;
+        ddone += len;
+        if(sdone == (uint64_t)x->count * im->cluster_size) {
+            se++;
+            sdone = 0;
+        }
+        if(ddone == (uint64_t)y->count * im->cluster_size) {
+            de++;
+            ddone = 0;
+        }
+    }
+    return 0;
+}
+
+// splits every file into chunks that never cross an extent
+static int plan_jobs(Import *im)
+{
+    for(size_t i = 0; i < im->count; i++)
+    {
+        const ImportNode *n = &im->nodes[i];
+        uint64_t off = 0;
+        if(n->is_dir)
+            continue;
+        if(im->from_image) {
+            if(plan_copy_jobs(im, (int)i) != 0)
+                return -1;
+            continue;
+        }
+        for(size_t e = 0; e < n->ext_count && off < n->size; e++)
+        {
+            const Extent *x = &im->ext[n->ext_first + e];
+            uint64_t pos = fat32_cluster_to_offset(x->start);
+            uint64_t left = (uint64_t)x->count * im->cluster_size;
+            if(left > n->size - off)
+                left = n->size - off;
+            while(left > 0) {
+                uint32_t len = (left < IMPORT_CHUNK) ? (uint32_t)left : IMPORT_CHUNK;
+                if(add_job(im, (int)i, off, pos, len) != 0)
+                    return -1;
+                off += len;
+                pos += len;
+                left -= len;
+            }
+        }
+    }
+    return 0;
+}
+
+// host reads and image writes of different chunks overlap across workers
+static void *import_worker(void *arg)
+{
+    Import *im = arg;
+    uint8_t *buf = bufpool_get(fs.pool);
+    int fd = -1;
+    int fdNode = -1;
+
+    while(1)
+    {
+        size_t j = __atomic_fetch_add(&im->next_job, 1, __ATOMIC_RELAXED);
+        if(j >= im->job_count)
+            break;
+        const ImportJob *job = &im->jobs[j];
+        ImportNode *n = &im->nodes[job->node];
+
+        if(im->from_image) {
+            bool offloaded;
+            if(buf == NULL ||
+               fat32_copy_at(job->file_offset, job->image_offset, job->len, buf, &offloaded) != 0)
+                __atomic_store_n(&im->write_failed, 1, __ATOMIC_RELAXED);
+            else if(offloaded)
+                __atomic_fetch_add(&im->stats->offloaded, job->len, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if(fdNode != job->node) {
+            if(fd >= 0)
+                close(fd);
+            fd = open(n->host, O_RDONLY);
+            fdNode = job->node;
+        }
+        if(buf == NULL || fd < 0 || io_pread_full(fd, job->file_offset, buf, job->len) != 0) {
+            __atomic_store_n(&n->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(fat32_write_at(job->image_offset, buf, job->len) != 0)
+            __atomic_store_n(&im->write_failed, 1, __ATOMIC_RELAXED);
+    }
+
+    if(fd >= 0)
+        close(fd);
+    bufpool_put(fs.pool, buf);
+    return NULL;
+}
+
+static void run_jobs(Import *im)
+{
+    int count = walk_thread_count();
+    pthread_t threads[count];
+    int started = 0;
+
+    for(int i = 1; i < count; i++) {
+        if(pthread_create(&threads[i], NULL, import_worker, im) != 0)
+            break;
+        started++;
+    }
+    import_worker(im);
+    for(int i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static int write_dirs(Import *im, uint32_t parent_cluster)
+{
+    for(size_t i = 0; i < im->count; i++)
+    {
+        ImportNode *n = &im->nodes[i];
+        if(!n->is_dir)
+            continue;
+
+        uint32_t up = (n->parent >= 0) ? first_cluster(im, n->parent) : parent_cluster;
+        if(up == fs.bs.BPB_RootClus)
+            up = 0;
+        fat32_set_cluster(&n->ents[0], first_cluster(im, (int)i));
+        fat32_set_cluster(&n->ents[1], up);
+
+        for(int k = 0; k < n->child_count; k++) {
+            int c = n->first_child + k;
+            fat32_set_cluster(&n->ents[im->nodes[c].slot], first_cluster(im, c));
+        }
+
+        const DirEntry *src = n->ents;
+        for(size_t e = 0; e < n->ext_count; e++) {
+            const Extent *x = &im->ext[n->ext_first + e];
+            size_t len = (size_t)x->count * im->cluster_size;
+            if(fat32_write_dir_at(fat32_cluster_to_offset(x->start), src, len) != 0)
+                return -1;
+            src += len / sizeof(DirEntry);
+        }
+    }
+    return 0;
+}
+
+// links (or with value FAT_FREE releases) every allocated chain in one batch
+static int commit_chains(Import *im, bool release)
+{
+    FatBatch batch;
+    int ret = 0;
+
+    fat32_batch_init(&batch);
+    for(size_t i = 0; i < im->count && ret == 0; i++)
+    {
+        const ImportNode *n = &im->nodes[i];
+        for(size_t e = 0; e < n->ext_count && ret == 0; e++)
+        {
+            const Extent *x = &im->ext[n->ext_first + e];
+            for(uint32_t k = 0; k < x->count && ret == 0; k++)
+            {
+                uint32_t next;
+                if(release)
+                    next = FAT_FREE;
+                else if(k + 1 < x->count)
+                    next = x->start + k + 1;
+                else if(e + 1 < n->ext_count)
+                    next = im->ext[n->ext_first + e + 1].start;
+                else
+                    next = FAT_EOC;
+                ret = fat32_batch_set(&batch, x->start + k, next);
+            }
+        }
+    }
+    if(ret == 0)
+        ret = fat32_batch_commit(&batch);
+    fat32_batch_free(&batch);
+    return ret;
+}
+
+// reports every node whose source could not be read; any one fails the import
+static bool report_failed(Import *im, const char *source)
+{
+    for(size_t i = 0; i < im->count; i++) {
+        const ImportNode *n = &im->nodes[i];
+        if(n->failed) {
+            // copies name their files after the copy, except the top one
+            cmd_printf("Error: Could not read %s\n", (n->host != NULL) ? n->host :
+                       (i == 0) ? source : n->name);
+            im->stats->failed++;
+        }
+    }
+    if(im->stats->failed > 0)
+        cmd_printf("Error: Nothing was added for %s\n", source);
+    return im->stats->failed > 0;
+}
+
+static void import_free(Import *im)
+{
+    for(size_t i = 0; i < im->count; i++) {
+        free(im->nodes[i].name);
+        free(im->nodes[i].host);
+        free(im->nodes[i].ents);
+    }
+    free(im->nodes);
+    free(im->ext);
+    free(im->src_ext);
+    free(im->jobs);
+}
+
+/*
+ * Lays out every new directory in memory, checks the space needed, then
+ * hands out extents next-fit through the FAT cache so the data lands in long
+ * contiguous runs. File data is copied by a pool of threads, each
+ * directory is written in one go, all chains are linked in one FAT batch
+ * and the new entry is added to dir_cluster last.
+ */
+static int import_finish(Import *im, uint32_t dir_cluster, const char *name, const char *source)
+{
+    ImportStats *stats = im->stats;
+    uint64_t need = 0;
+    int ret = 0;
+
+    for(size_t i = 0; i < im->count && ret == 0; i++)
+    {
+        ImportNode *n = &im->nodes[i];
+        if(n->is_dir) {
+            ret = layout_dir(im, (int)i);
+            stats->dirs++;
+        } else {
+            n->clusters = (uint32_t)(((uint64_t)n->size + im->cluster_size - 1) / im->cluster_size);
+            if(im->from_image)
+                ret = chain_extents(im, (int)i);
+            stats->files++;
+            stats->bytes += n->size;
+        }
+        need += n->clusters;
+    }
+    if(ret != 0) {
+        cmd_printf("Error: Out of memory while scanning %s\n", source);
+        return -1;
+    }
+    // a copy whose source chain is too short stops before anything is allocated
+    if(report_failed(im, source))
+        return -1;
+
+    // the scan reads the FAT from the image, so cached changes go out first
+    FatScan scan;
+    if(fat32_flush_fat() != 0 || fat32_scan_fat(&scan) != 0) {
+        cmd_printf("Error: Could not read the FAT\n");
+        return -1;
+    }
+    if(need > scan.free) {
+        cmd_printf("Error: Not enough space: need %llu clusters, %u free\n",
+                   (unsigned long long)need, scan.free);
+        return -1;
+    }
+
+    Alloc a;
+    a.end = scan.clusters + 2;
+    a.cursor = fat32_alloc_goal(0, dir_cluster);
+    a.taken = calloc(a.end / 8 + 1, 1);
+    if(a.taken == NULL) {
+        cmd_printf("Error: Out of memory while scanning %s\n", source);
+        return -1;
+    }
+
+    for(size_t i = 0; i < im->count && ret == 0; i++)
+        ret = allocate_node(im, &a, (int)i);
+    free(a.taken);
+    fs.alloc_cursor = a.cursor;
+    if(ret == 0)
+        ret = plan_jobs(im);
+    if(ret != 0) {
+        cmd_printf("Error: Could not allocate space for %s\n", source);
+        return -1;
+    }
+
+    // no chain is linked yet, so failing here leaves the clusters free
+    run_jobs(im);
+    if(report_failed(im, source))
+        return -1;
+
+    if(im->write_failed || write_dirs(im, dir_cluster) != 0) {
+        cmd_printf("Error: Could not write to the image\n");
+        return -1;
+    }
+    if(commit_chains(im, false) != 0) {
+        cmd_printf("Error: Could not update the FAT\n");
+        commit_chains(im, true);
+        return -1;
+    }
+
+    ImportNode *top = &im->nodes[0];
+    DirEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.DIR_Attr = top->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+    entry.DIR_FileSize = top->size;
+    set_times(&entry, top->mtime);
+    fat32_set_cluster(&entry, first_cluster(im, 0));
+    if(fat32_add_named_entry(dir_cluster, name, &entry, NULL, NULL) != 0) {
+        cmd_printf("Error: Could not add %s\n", name);
+        commit_chains(im, true);
+        return -1;
+    }
+
+    stats->clusters = (uint32_t)need;
+    stats->extents = (uint32_t)im->ext_count;
+    return 0;
+}
+
+int fat32_import(uint32_t dir_cluster, const char *name, const char *host_path,
+                 bool recursive, ImportStats *stats)
+{
+    Import im;
+    struct stat st;
+
+    memset(&im, 0, sizeof(im));
+    memset(stats, 0, sizeof(*stats));
+    im.stats = stats;
+    im.cluster_size = fat32_get_cluster_size();
+
+    if(stat(host_path, &st) != 0) {
+        cmd_printf("Error: %s: %s\n", host_path, strerror(errno));
+        return -1;
+    }
+    if(S_ISDIR(st.st_mode) && !recursive) {
+        cmd_printf("Error: %s is a directory (use -r)\n", host_path);
+        return -1;
+    }
+    if(!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        cmd_printf("Error: %s is not a regular file or directory\n", host_path);
+        return -1;
+    }
+    if(S_ISREG(st.st_mode) && (uint64_t)st.st_size > UINT32_MAX) {
+        cmd_printf("Error: %s is larger than 4 GB\n", host_path);
+        return -1;
+    }
+
+    char *topName = strdup(name);
+    char *topHost = strdup(host_path);
+    if(topName == NULL || topHost == NULL ||
+       add_node(&im, topName, topHost, S_ISDIR(st.st_mode), (uint32_t)st.st_size,
+                st.st_mtime, -1) != 0) {
+        free(topName);
+        free(topHost);
+        cmd_printf("Error: Out of memory\n");
+        return -1;
+    }
+
+    // breadth first, the node array doubles as the queue
+    int ret = 0;
+    for(size_t i = 0; i < im.count && ret == 0; i++) {
+        if(im.nodes[i].is_dir)
+            ret = scan_dir(&im, (int)i);
+    }
+    if(ret != 0) {
+        cmd_printf("Error: Out of memory while scanning %s\n", host_path);
+        import_free(&im);
+        return -1;
+    }
+
+    ret = import_finish(&im, dir_cluster, name, host_path);
+    import_free(&im);
+    return ret;
+}
+
+/*
+ * Same pipeline with a tree inside the image as the source. The source is
+ * read before anything is written and the copy only appears at the end,
+ * so copying a directory into itself takes a snapshot and stops there.
+ */
+int fat32_copy(uint32_t dir_cluster, const char *name, const DirRecord *src,
+               bool recursive, ImportStats *stats)
+{
+    Import im;
+    bool isDir = src->entry.DIR_Attr & ATTR_DIRECTORY;
+
+    memset(&im, 0, sizeof(im));
+    memset(stats, 0, sizeof(*stats));
+    im.stats = stats;
+    im.cluster_size = fat32_get_cluster_size();
+    im.from_image = true;
+
+    if(isDir && !recursive) {
+        cmd_printf("Error: %s is a directory (use -r)\n", src->name);
+        return -1;
+    }
+
+    char *topName = strdup(name);
+    if(topName == NULL ||
+       add_node(&im, topName, NULL, isDir, src->entry.DIR_FileSize, fat32_now(), -1) != 0) {
+        free(topName);
+        cmd_printf("Error: Out of memory\n");
+        return -1;
+    }
+    im.nodes[0].src_cluster = fat32_get_cluster(&src->entry);
+    if(isDir && im.nodes[0].src_cluster == 0)
+        im.nodes[0].src_cluster = fs.bs.BPB_RootClus;
+
+    int ret = 0;
+    for(size_t i = 0; i < im.count && ret == 0; i++) {
+        if(im.nodes[i].is_dir)
+            ret = scan_image_dir(&im, (int)i);
+    }
+    if(ret != 0) {
+        cmd_printf("Error: Could not read %s\n", src->name);
+        import_free(&im);
+        return -1;
+    }
+
+    ret = import_finish(&im, dir_cluster, name, src->name);
+    import_free(&im);
+    return ret;
+}
@@ -0,0 +1,38 @@
+// io.c
+#include <errno.h>
+#include <unistd.h>
+#include "io.h"
+
+int io_pread_full(int fd, uint64_t offset, void *buffer, size_t len)
+{
+    uint8_t *p = buffer;
+    while(len > 0)
+    {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int io_pwrite_full(int fd, uint64_t offset, const void *buffer, size_t len)
+{
+    const uint8_t *p = buffer;
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -57,13 +57,27 @@ void add_token(tokenlist *tokens, char *item)
 tokenlist *get_tokens(char *input)
 {
     char* buf = (char *)malloc(strlen(input) + 1);
-    strcpy(buf, input);
     tokenlist *tokens = new_tokenlist();
-    
-    char *tok = strtok(buf, " ");
-    while(tok != NULL) {
-        add_token(tokens, tok);
-        tok = strtok(NULL, " ");
+    const char *p = input;
+
+    // split on spaces; a token wrapped in double quotes may contain spaces
+    while(*p != '\0')
+    {
+        while(*p == ' ') p++;
+        if(*p == '\0') break;
+
+        int len = 0;
+        if(*p == '"') {
+            p++;
+            while(*p != '\0' && *p != '"')
+                buf[len++] = *p++;
+            if(*p == '"') p++;
+        } else {
+            while(*p != '\0' && *p != ' ')
+                buf[len++] = *p++;
+        }
+        buf[len] = '\0';
+        add_token(tokens, buf);
     }
     
     free(buf);
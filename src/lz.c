@@ -0,0 +1,155 @@
+// lz.c
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+#define LZ_HASH_BITS    14
+
+static inline uint32_t hash4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, const uint8_t *end, size_t n)
+{
+    while(n >= 255) {
+        if(op >= end)
+            return NULL;
+        *op++ = 255;
+        n -= 255;
+    }
+    if(op >= end)
+        return NULL;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// match_len 0 writes the closing literals-only sequence
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *end, const uint8_t *lit,
+                             size_t lit_len, size_t offset, size_t match_len)
+{
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    if(op >= end)
+        return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+
+    if(lit_len >= 15 && (op = put_length(op, end, lit_len - 15)) == NULL)
+        return NULL;
+    if((size_t)(end - op) < lit_len)
+        return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if(match_len == 0)
+        return op;
+    if(end - op < 2)
+        return NULL;
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+    if(ml >= 15 && (op = put_length(op, end, ml - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+// greedy single-probe matcher; table holds position + 1, 0 = empty
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *anchor = src;
+    const uint8_t *end = dst + cap;
+    uint8_t *op = dst;
+    size_t i = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while(i + LZ_MIN_MATCH <= len)
+    {
+        uint32_t h = hash4(src + i);
+        size_t cand = table[h];
+        table[h] = (uint32_t)(i + 1);
+
+        if(cand == 0 || i - (cand - 1) > LZ_MAX_OFFSET ||
+           memcmp(src + cand - 1, src + i, LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+
+        size_t ref = cand - 1;
+        size_t m = LZ_MIN_MATCH;
+        while(i + m < len && src[ref + m] == src[i + m])
+            m++;
+
+        op = put_sequence(op, end, anchor, (size_t)(src + i - anchor), i - ref, m);
+        if(op == NULL)
+            return 0;
+        i += m;
+        anchor = src + i;
+    }
+
+    op = put_sequence(op, end, anchor, (size_t)(src + len - anchor), 0, 0);
+    return (op != NULL) ? (size_t)(op - dst) : 0;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+    uint8_t b;
+    do {
+        if(*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while(b == 255);
+    return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + out_len;
+
+    while(ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if(lit == 15 && get_length(&ip, iend, &lit) != 0)
+            return -1;
+        if((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if(ip == iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t m = token & 15;
+        if(m == 15 && get_length(&ip, iend, &m) != 0)
+            return -1;
+        m += LZ_MIN_MATCH;
+        if(offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < m)
+            return -1;
+
+        // overlapping copies repeat the last offset bytes, so go bytewise
+        const uint8_t *ref = op - offset;
+        if(offset >= m) {
+            memcpy(op, ref, m);
+        } else {
+            for(size_t k = 0; k < m; k++)
+                op[k] = ref[k];
+        }
+        op += m;
+    }
+
+    return (op == oend) ? 0 : -1;
+}
@@ -2,24 +2,169 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "lexer.h"
 #include "fat32.h"
 #include "commands.h"
+#include "server.h"
+#include "cimage.h"
+#include "trace.h"
+#include "writeback.h"
+
+// a byte count with an optional k, M or G suffix
+static int parse_bytes(const char *arg, size_t *bytes)
+{
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    int shift = 0;
+
+    if(end == arg)
+        return -1;
+    if(*end == 'k' || *end == 'K')
+        shift = 10;
+    else if(*end == 'm' || *end == 'M')
+        shift = 20;
+    else if(*end == 'g' || *end == 'G')
+        shift = 30;
+    if(shift != 0)
+        end++;
+    if(*end != '\0' || n > (SIZE_MAX >> shift))
+        return -1;
+    *bytes = (size_t)(n << shift);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--overlay DELTA] [--fat-cache SIZE] [--write-behind MS [--dirty SIZE]]\n"
+                    "       %*s [--direct] [--huge-pages] [--alloc POLICY] [--record TRACE] [FAT32 ISO]\n",
+                    prog, (int)strlen(prog), "");
+    fprintf(stderr, "       %s --serve SOCKET [--overlay DELTA] [--fat-cache SIZE] [--write-behind MS [--dirty SIZE]]\n"
+                    "       %*s [--direct] [--huge-pages] [--alloc POLICY] [FAT32 ISO]\n", prog, (int)strlen(prog), "");
+    fprintf(stderr, "       %s --replay TRACE [--pace] [--baseline TRACE] [--record TRACE] [--alloc POLICY] [FAT32 ISO]\n", prog);
+    fprintf(stderr, "       POLICY is lowest (the default), next or group\n");
+    fprintf(stderr, "       %s --connect SOCKET\n", prog);
+    fprintf(stderr, "       %s --pack RAW_IMAGE COMPRESSED_IMAGE\n", prog);
+    fprintf(stderr, "       %s --unpack COMPRESSED_IMAGE RAW_IMAGE\n", prog);
+}
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s [FAT32 ISO]\n", argv[0]);
+    const char *image = NULL;
+    const char *socketPath = NULL;
+    const char *overlayPath = NULL;
+    const char *recordPath = NULL;
+    const char *replayPath = NULL;
+    const char *baselinePath = NULL;
+    bool paced = false;
+    unsigned writeBehind = 0;
+    size_t dirtyBytes = WRITEBACK_DEFAULT;
+    bool dirtySet = false;
+    bool direct = false;
+    bool hugePages = false;
+
+    if(argc == 3 && strcmp(argv[1], "--connect") == 0)
+        return client_run(argv[2]) == 0 ? 0 : 1;
+    if(argc == 4 && strcmp(argv[1], "--pack") == 0)
+        return cimage_pack(argv[2], argv[3]) == 0 ? 0 : 1;
+    if(argc == 4 && strcmp(argv[1], "--unpack") == 0)
+        return cimage_unpack(argv[2], argv[3]) == 0 ? 0 : 1;
+
+    int i = 1;
+    while(i + 1 < argc && strncmp(argv[i], "--", 2) == 0)
+    {
+        if(strcmp(argv[i], "--pace") == 0 || strcmp(argv[i], "--direct") == 0 ||
+           strcmp(argv[i], "--huge-pages") == 0) {
+            paced |= (strcmp(argv[i], "--pace") == 0);
+            direct |= (strcmp(argv[i], "--direct") == 0);
+            hugePages |= (strcmp(argv[i], "--huge-pages") == 0);
+            i++;
+            continue;
+        }
+        if(strcmp(argv[i], "--serve") == 0)
+            socketPath = argv[i + 1];
+        else if(strcmp(argv[i], "--overlay") == 0)
+            overlayPath = argv[i + 1];
+        else if(strcmp(argv[i], "--record") == 0)
+            recordPath = argv[i + 1];
+        else if(strcmp(argv[i], "--replay") == 0)
+            replayPath = argv[i + 1];
+        else if(strcmp(argv[i], "--baseline") == 0)
+            baselinePath = argv[i + 1];
+        else if(strcmp(argv[i], "--fat-cache") == 0) {
+            size_t bytes;
+            if(parse_bytes(argv[i + 1], &bytes) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            fat32_set_fat_cache(bytes);
+        }
+        else if(strcmp(argv[i], "--write-behind") == 0) {
+            char *end;
+            unsigned long ms = strtoul(argv[i + 1], &end, 10);
+            if(end == argv[i + 1] || *end != '\0' || ms > 3600000) {
+                usage(argv[0]);
+                return 1;
+            }
+            writeBehind = (unsigned)ms;
+        }
+        else if(strcmp(argv[i], "--alloc") == 0) {
+            const char *arg = argv[i + 1];
+            if(strcmp(arg, "lowest") == 0)
+                fat32_set_alloc_policy(ALLOC_LOWEST);
+            else if(strcmp(arg, "next") == 0)
+                fat32_set_alloc_policy(ALLOC_NEXT);
+            else if(strcmp(arg, "group") == 0)
+                fat32_set_alloc_policy(ALLOC_GROUP);
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--dirty") == 0) {
+            if(parse_bytes(argv[i + 1], &dirtyBytes) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            dirtySet = true;
+        }
+        else
+            break;
+        i += 2;
+    }
+    bool replayOnly = (paced || baselinePath != NULL) && replayPath == NULL;
+    bool shellOnly = socketPath != NULL && (recordPath != NULL || replayPath != NULL);
+    if(i + 1 != argc || strncmp(argv[i], "--", 2) == 0 || replayOnly || shellOnly ||
+       (replayPath != NULL && overlayPath != NULL) || (dirtySet && writeBehind == 0)) {
+        usage(argv[0]);
         return 1;
     }
-    if(fat32_mount(argv[1]) != 0){
-        fprintf(stderr, "Error: Could not mount %s\n", argv[1]);
+    image = argv[i];
+    fat32_set_write_behind(writeBehind, dirtyBytes);
+    fat32_set_direct_io(direct, hugePages);
+
+    if(replayPath != NULL)
+        return trace_replay(replayPath, image, paced, baselinePath, recordPath) == 0 ? 0 : 1;
+
+    if(fat32_mount(image, overlayPath) != 0){
+        fprintf(stderr, "Error: Could not mount %s\n", image);
+        return 1;
+    }
+
+    if(socketPath != NULL) {
+        int ret = server_run(socketPath);
+        fat32_unmount();
+        return ret == 0 ? 0 : 1;
+    }
+
+    if(recordPath != NULL && trace_record_start(recordPath) != 0) {
+        fat32_unmount();
         return 1;
     }
 
     while(1)
     {
-        printf("%s%s> ", fs.image_name, fs.current_path);
+        printf("%s%s> ", fs.image_name, fs_session->current_path);
         fflush(stdout);
 
         char* input = get_input();
@@ -31,7 +176,7 @@ int main(int argc, char *argv[])
 
         tokenlist *tokens = get_tokens(input);
         if(tokens->size > 0) {
-            int result = dispatch_command(tokens);
+            int result = trace_dispatch(tokens);
             if(result == -1) {
                 free(input);
                 free_tokens(tokens);
@@ -43,16 +188,26 @@ int main(int argc, char *argv[])
         free_tokens(tokens);
     }
 
+    int ret = trace_record_finish();
     fat32_unmount();
 
-    return 0;
+    return ret == 0 ? 0 : 1;
 }
 
-int dispatch_command(tokenlist *tokens)
-{
-    if(tokens->size == 0)
-        return 0;
+// commands that leave the volume alone and can run side by side; the
+// rest get the volume to themselves
+static const char *shared_commands[] = {
+    "info", "exit", "cd", "ls", "open", "close", "lsof", "lseek", "read",
+    "find", "du", "frag", "sum", "grep", "df", NULL
+};
+
+// shared commands that first flush the session's buffered writes
+static const char *flushing_commands[] = {
+    "close", "lseek", "read", "ls", "find", "du", "frag", "sum", "grep", NULL
+};
 
+static int run_command(tokenlist *tokens)
+{
     const char* cmd = tokens->items[0];
 
     if (strcmp(cmd, "info") == 0) {
@@ -82,16 +237,70 @@ int dispatch_command(tokenlist *tokens)
         cmd_read(tokens);
     else if(strcmp(cmd, "write") == 0)
         cmd_write(tokens);
+    else if(strcmp(cmd, "sync") == 0)
+        cmd_sync(tokens);
+    else if(strcmp(cmd, "import") == 0)
+        cmd_import(tokens);
+    else if(strcmp(cmd, "cp") == 0)
+        cmd_cp(tokens);
+    else if(strcmp(cmd, "commit") == 0)
+        cmd_commit(tokens);
+    else if(strcmp(cmd, "truncate") == 0)
+        cmd_truncate(tokens);
+    else if(strcmp(cmd, "fallocate") == 0)
+        cmd_fallocate(tokens);
     else if (strcmp(cmd, "mv") == 0)
         cmd_mv(tokens);
     else if(strcmp(cmd, "rm") == 0)
         cmd_rm(tokens);
     else if (strcmp(cmd, "rmdir") == 0)
         cmd_rmdir(tokens);
+    else if(strcmp(cmd, "find") == 0)
+        cmd_find(tokens);
+    else if(strcmp(cmd, "df") == 0)
+        cmd_df(tokens);
+    else if(strcmp(cmd, "fatcheck") == 0)
+        cmd_fatcheck(tokens);
+    else if(strcmp(cmd, "sum") == 0)
+        cmd_sum(tokens);
+    else if(strcmp(cmd, "grep") == 0)
+        cmd_grep(tokens);
+    else if(strcmp(cmd, "du") == 0)
+        cmd_du(tokens);
+    else if(strcmp(cmd, "frag") == 0)
+        cmd_frag(tokens);
+    else if(strcmp(cmd, "compact") == 0)
+        cmd_compact(tokens);
     else {
-        printf("Error: Unknown command '%s'\n", cmd);
+        cmd_printf("Error: Unknown command '%s'\n", cmd);
         return 1;
     }
 
     return 0;
 }
+
+int dispatch_command(tokenlist *tokens)
+{
+    if(tokens->size == 0)
+        return 0;
+
+    bool shared = false;
+    for(int i = 0; shared_commands[i] != NULL && !shared; i++)
+        shared = (strcmp(tokens->items[0], shared_commands[i]) == 0);
+
+    // a flush writes the image, so it needs the volume to itself; only
+    // this thread touches the session's buffers, so peeking is safe
+    for(int i = 0; flushing_commands[i] != NULL && shared; i++) {
+        if(strcmp(tokens->items[0], flushing_commands[i]) == 0)
+            shared = !fat32_handles_dirty();
+    }
+
+    if(shared)
+        fat32_lock_shared();
+    else
+        fat32_lock_exclusive();
+    int result = run_command(tokens);
+    fat32_unlock();
+
+    return result;
+}
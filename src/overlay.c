@@ -0,0 +1,294 @@
+// overlay.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "overlay.h"
+#include "io.h"
+
+#define OVERLAY_BLOCK       4096
+#define OVERLAY_MAGIC       "FAT32COW"
+#define OVERLAY_VERSION     1
+#define COMMIT_BUF_SIZE     (1024 * 1024)
+
+/*
+ * Delta file layout, all parts block aligned:
+ *   [header][bitmap, one bit per base block][data]
+ * Block i of the base lives at data_start + i * OVERLAY_BLOCK, so the data
+ * area is a sparse mirror of the base and runs of modified blocks stay
+ * contiguous in both files.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t base_size;
+} OverlayHeader;
+
+struct Overlay {
+    int fd;
+    OverlayBaseRead base_read;
+    char *base_path;
+    uint64_t base_size;
+    uint64_t blocks;
+    uint8_t *map;           // bit set = block lives in the delta
+    size_t map_bytes;
+    uint64_t data_start;
+    uint64_t dirty;
+    pthread_rwlock_t lock;  // shared by readers; writes and commit hold it alone,
+                            // as the write-behind flusher writes from its own thread
+};
+
+static inline int block_present(const Overlay *ov, uint64_t block)
+{
+    return (ov->map[block >> 3] >> (block & 7)) & 1;
+}
+
+static uint64_t count_dirty(const Overlay *ov)
+{
+    uint64_t n = 0;
+    for(size_t i = 0; i < ov->map_bytes; i++)
+        n += __builtin_popcount(ov->map[i]);
+    return n;
+}
+
+uint32_t overlay_block_size(void)
+{
+    return OVERLAY_BLOCK;
+}
+
+Overlay *overlay_open(const char *delta_path, const char *base_path,
+                      uint64_t base_size, OverlayBaseRead base_read)
+{
+    struct stat st;
+    Overlay *ov = calloc(1, sizeof(Overlay));
+    if(ov == NULL)
+        return NULL;
+    ov->base_read = base_read;
+    ov->base_size = base_size;
+    ov->blocks = (ov->base_size + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK;
+    ov->map_bytes = (ov->blocks + 7) / 8;
+    ov->data_start = OVERLAY_BLOCK +
+        (ov->map_bytes + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK * OVERLAY_BLOCK;
+    ov->base_path = strdup(base_path);
+    ov->map = calloc(ov->map_bytes ? ov->map_bytes : 1, 1);
+    pthread_rwlock_init(&ov->lock, NULL);
+    ov->fd = open(delta_path, O_RDWR | O_CREAT, 0644);
+    if(ov->base_path == NULL || ov->map == NULL || ov->fd < 0) {
+        fprintf(stderr, "Error: Cannot open overlay %s\n", delta_path);
+        overlay_close(ov);
+        return NULL;
+    }
+
+    OverlayHeader hdr;
+    if(fstat(ov->fd, &st) == 0 && st.st_size > 0) {
+        if(io_pread_full(ov->fd, 0, &hdr, sizeof(hdr)) != 0 ||
+           memcmp(hdr.magic, OVERLAY_MAGIC, 8) != 0 ||
+           hdr.version != OVERLAY_VERSION || hdr.block_size != OVERLAY_BLOCK ||
+           hdr.base_size != ov->base_size ||
+           io_pread_full(ov->fd, OVERLAY_BLOCK, ov->map, ov->map_bytes) != 0) {
+            fprintf(stderr, "Error: %s is not an overlay for %s\n", delta_path, base_path);
+            overlay_close(ov);
+            return NULL;
+        }
+        ov->dirty = count_dirty(ov);
+        return ov;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, OVERLAY_MAGIC, 8);
+    hdr.version = OVERLAY_VERSION;
+    hdr.block_size = OVERLAY_BLOCK;
+    hdr.base_size = ov->base_size;
+    if(io_pwrite_full(ov->fd, 0, &hdr, sizeof(hdr)) != 0 ||
+       ftruncate(ov->fd, (off_t)ov->data_start) != 0) {
+        fprintf(stderr, "Error: Cannot initialize overlay %s\n", delta_path);
+        overlay_close(ov);
+        return NULL;
+    }
+    return ov;
+}
+
+void overlay_close(Overlay *ov)
+{
+    if(ov == NULL)
+        return;
+    if(ov->fd >= 0)
+        close(ov->fd);
+    pthread_rwlock_destroy(&ov->lock);
+    free(ov->map);
+    free(ov->base_path);
+    free(ov);
+}
+
+uint64_t overlay_dirty_blocks(const Overlay *ov)
+{
+    return ov->dirty;
+}
+
+// serves each run of blocks with the same placement with one pread
+int overlay_read(Overlay *ov, uint64_t offset, void *buffer, size_t len)
+{
+    uint8_t *p = buffer;
+    int ret = 0;
+
+    if(offset + len > ov->base_size)
+        return -1;
+
+    // held across the preads too, so a block can't move into the delta midway
+    pthread_rwlock_rdlock(&ov->lock);
+    while(ret == 0 && len > 0)
+    {
+        uint64_t block = offset / OVERLAY_BLOCK;
+        int present = block_present(ov, block);
+        uint64_t end = (block + 1) * OVERLAY_BLOCK;
+        while(end < offset + len && block_present(ov, end / OVERLAY_BLOCK) == present)
+            end += OVERLAY_BLOCK;
+
+        size_t n = (end - offset < len) ? (size_t)(end - offset) : len;
+        ret = present ? io_pread_full(ov->fd, ov->data_start + offset, p, n)
+                      : ov->base_read(offset, p, n);
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    pthread_rwlock_unlock(&ov->lock);
+    return (ret == 0) ? 0 : -1;
+}
+
+// records blocks first..last as present, in memory and in the delta
+static int mark_blocks(Overlay *ov, uint64_t first, uint64_t last)
+{
+    for(uint64_t b = first; b <= last; b++) {
+        if(!block_present(ov, b)) {
+            ov->map[b >> 3] |= 1 << (b & 7);
+            ov->dirty++;
+        }
+    }
+    size_t lo = first >> 3;
+    size_t hi = last >> 3;
+    return io_pwrite_full(ov->fd, OVERLAY_BLOCK + lo, ov->map + lo, hi - lo + 1);
+}
+
+// copies block b up from the base and patches in the part of the write it holds
+static int copy_up(Overlay *ov, uint64_t b, uint64_t offset, const uint8_t *src, size_t len)
+{
+    uint8_t block[OVERLAY_BLOCK];
+    uint64_t bstart = b * OVERLAY_BLOCK;
+    uint64_t bend = bstart + OVERLAY_BLOCK;
+    uint64_t end = offset + len;
+    uint64_t lo = (offset > bstart) ? offset : bstart;
+    uint64_t hi = (end < bend) ? end : bend;
+
+    if(bend > ov->base_size)
+        bend = ov->base_size;
+    if(block_present(ov, b) || (lo == bstart && hi == bend))
+        return 0;
+
+    if(ov->base_read(bstart, block, bend - bstart) != 0)
+        return -1;
+    memcpy(block + (lo - bstart), src + (lo - offset), hi - lo);
+    if(io_pwrite_full(ov->fd, ov->data_start + bstart, block, bend - bstart) != 0)
+        return -1;
+    return mark_blocks(ov, b, b);
+}
+
+/*
+ * Only the first and last block of a write can be partly covered; those are
+ * copied up from the base if they are not in the delta yet. Everything else
+ * goes straight to the mirrored offset in the delta, so a write spanning many
+ * blocks is a single pwrite. Data is written before the bitmap so a crash
+ * never exposes blocks that were not written.
+ */
+int overlay_write(Overlay *ov, uint64_t offset, const void *buffer, size_t len)
+{
+    if(len == 0)
+        return 0;
+    if(offset + len > ov->base_size)
+        return -1;
+
+    uint64_t first = offset / OVERLAY_BLOCK;
+    uint64_t last = (offset + len - 1) / OVERLAY_BLOCK;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&ov->lock);
+    if(copy_up(ov, first, offset, buffer, len) != 0 ||
+       (last != first && copy_up(ov, last, offset, buffer, len) != 0) ||
+       io_pwrite_full(ov->fd, ov->data_start + offset, buffer, len) != 0 ||
+       mark_blocks(ov, first, last) != 0)
+        ret = -1;
+    pthread_rwlock_unlock(&ov->lock);
+    return ret;
+}
+
+static int commit_blocks(Overlay *ov, uint64_t *blocks)
+{
+    *blocks = 0;
+    if(ov->dirty == 0)
+        return 0;
+
+    int wfd = open(ov->base_path, O_RDWR);
+    if(wfd < 0)
+        return -1;
+
+    uint8_t *buf = malloc(COMMIT_BUF_SIZE);
+    if(buf == NULL) {
+        close(wfd);
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t b = 0;
+    while(ret == 0 && b < ov->blocks)
+    {
+        if(ov->map[b >> 3] == 0) {
+            b = (b | 7) + 1;
+            continue;
+        }
+        if(!block_present(ov, b)) {
+            b++;
+            continue;
+        }
+
+        uint64_t run = 1;
+        while(b + run < ov->blocks && block_present(ov, b + run) &&
+              run < COMMIT_BUF_SIZE / OVERLAY_BLOCK)
+            run++;
+
+        uint64_t off = b * OVERLAY_BLOCK;
+        size_t n = run * OVERLAY_BLOCK;
+        if(off + n > ov->base_size)
+            n = ov->base_size - off;
+        if(io_pread_full(ov->fd, ov->data_start + off, buf, n) != 0 ||
+           io_pwrite_full(wfd, off, buf, n) != 0)
+            ret = -1;
+        *blocks += run;
+        b += run;
+    }
+    free(buf);
+
+    if(ret == 0 && fsync(wfd) != 0)
+        ret = -1;
+    close(wfd);
+    if(ret != 0)
+        return -1;
+
+    // the base now holds everything, so the delta can start over
+    memset(ov->map, 0, ov->map_bytes);
+    ov->dirty = 0;
+    if(io_pwrite_full(ov->fd, OVERLAY_BLOCK, ov->map, ov->map_bytes) != 0 ||
+       ftruncate(ov->fd, (off_t)ov->data_start) != 0)
+        return -1;
+    return 0;
+}
+
+int overlay_commit(Overlay *ov, uint64_t *blocks)
+{
+    pthread_rwlock_wrlock(&ov->lock);
+    int ret = commit_blocks(ov, blocks);
+    pthread_rwlock_unlock(&ov->lock);
+    return ret;
+}
@@ -0,0 +1,72 @@
+// search.c
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "search.h"
+
+static bool search_avx2;
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
+static void search_init(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    search_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+#if defined(__x86_64__)
+/*
+ * 32 positions per step: a candidate has the needle's first byte where it
+ * starts and its last byte where it would end, and only candidates get a
+ * memcmp. Input that keeps producing false candidates, like long runs of
+ * one byte, is handed to memmem, whose two-way search stays linear.
+ */
+__attribute__((target("avx2")))
+static const uint8_t *find_avx2(const uint8_t *hay, size_t len, const uint8_t *needle, size_t n)
+{
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[n - 1]);
+    size_t misses = 0;
+    size_t i = 0;
+
+    for(; i + n + 31 <= len; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + n - 1));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                     _mm256_cmpeq_epi8(b, last)));
+        while(m != 0) {
+            size_t at = i + __builtin_ctz(m);
+            if(memcmp(hay + at + 1, needle + 1, n - 2) == 0)
+                return hay + at;
+            misses++;
+            m &= m - 1;
+        }
+        if(misses > 64 + i / 16) {
+            i += 32;
+            break;
+        }
+    }
+
+    return (i < len) ? memmem(hay + i, len - i, needle, n) : NULL;
+}
+#endif
+
+const uint8_t *search_find(const uint8_t *hay, size_t len, const uint8_t *needle, size_t n)
+{
+    if(n > len)
+        return NULL;
+    if(n == 1)
+        return memchr(hay, needle[0], len);
+
+    pthread_once(&search_once, search_init);
+#if defined(__x86_64__)
+    if(search_avx2)
+        return find_avx2(hay, len, needle, n);
+#endif
+    return memmem(hay, len, needle, n);
+}
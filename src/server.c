@@ -0,0 +1,623 @@
+// server.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "fat32.h"
+#include "lexer.h"
+#include "commands.h"
+
+#define MAX_EVENTS      64
+#define MAX_LINE        (64 * 1024)
+#define READ_CHUNK      4096
+#define MAX_WORKERS     16
+
+/*
+ * Protocol: the client sends one command per line; the server answers
+ * with the length of the command's output as a decimal line, then the
+ * output itself (which may hold any bytes, e.g. from read).
+ *
+ * The epoll loop only moves bytes. Complete lines are handed to a pool of
+ * worker threads, one command in flight per connection, and the volume
+ * lock taken in dispatch_command lets read-only commands from different
+ * clients run side by side. Each connection has its own Session (cwd and
+ * open files).
+ */
+typedef struct Client {
+    int fd;                      // -1 once closed while a command still runs
+    Session session;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    bool closing;                // close once the output has drained
+    bool eof;                    // peer is done sending; finish its lines
+    bool busy;                   // a worker owns the command below
+    char *job;
+    char *job_out;
+    size_t job_out_len;
+    bool job_exit;
+    struct Client *job_next;     // work queue or done list
+    struct Client *next;
+} Client;
+
+static struct {
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;                 // workers signal finished commands here
+    Client *clients;
+    pthread_t workers[MAX_WORKERS];
+    int worker_count;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    Client *queue_head;
+    Client *queue_tail;
+    Client *done;
+    bool stopping;
+} srv;
+
+// epoll tags for the two non-client descriptors
+static char listen_tag, wake_tag;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+static int buf_append(char **buf, size_t *len, size_t *cap, const void *data, size_t n)
+{
+    if(*len + n > *cap) {
+        size_t grown = *cap ? *cap : READ_CHUNK;
+        while(grown < *len + n)
+            grown *= 2;
+        char *p = realloc(*buf, grown);
+        if(p == NULL)
+            return -1;
+        *buf = p;
+        *cap = grown;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+static void set_interest(Client *c, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(srv.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void client_free(Client *c)
+{
+    Client **link = &srv.clients;
+    while(*link != NULL && *link != c)
+        link = &(*link)->next;
+    if(*link == c)
+        *link = c->next;
+
+    // closing the session flushes its buffered writes; there is no one
+    // left to tell if that fails, so it goes to the server's log
+    fat32_lock_exclusive();
+    if(fat32_session_detach(&c->session) != 0)
+        fprintf(stderr, "Error: Buffered writes of a closed connection were lost\n");
+    fat32_unlock();
+    free(c->in);
+    free(c->out);
+    free(c->job);
+    free(c->job_out);
+    free(c);
+}
+
+// a client with a command in flight is freed once the command finishes
+static void client_close(Client *c)
+{
+    if(c->fd >= 0) {
+        epoll_ctl(srv.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    if(!c->busy)
+        client_free(c);
+}
+
+// runs on a worker: executes the client's command into a private buffer
+static void run_job(Client *c)
+{
+    FILE *out = open_memstream(&c->job_out, &c->job_out_len);
+    if(out == NULL) {
+        c->job_exit = true;
+        return;
+    }
+
+    fs_session = &c->session;
+    cmd_set_output(out);
+    tokenlist *tokens = get_tokens(c->job);
+    c->job_exit = (dispatch_command(tokens) == -1);
+    free_tokens(tokens);
+    cmd_set_output(NULL);
+    fs_session = NULL;
+    fclose(out);
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+
+    while(1)
+    {
+        pthread_mutex_lock(&srv.queue_lock);
+        while(srv.queue_head == NULL && !srv.stopping)
+            pthread_cond_wait(&srv.queue_cond, &srv.queue_lock);
+        Client *c = srv.queue_head;
+        if(c == NULL) {
+            pthread_mutex_unlock(&srv.queue_lock);
+            break;
+        }
+        srv.queue_head = c->job_next;
+        if(srv.queue_head == NULL)
+            srv.queue_tail = NULL;
+        pthread_mutex_unlock(&srv.queue_lock);
+
+        run_job(c);
+
+        pthread_mutex_lock(&srv.queue_lock);
+        c->job_next = srv.done;
+        srv.done = c;
+        pthread_mutex_unlock(&srv.queue_lock);
+
+        uint64_t one = 1;
+        while(write(srv.wake_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+static void submit_job(Client *c, const char *line)
+{
+    c->job = strdup(line);
+    if(c->job == NULL) {
+        c->closing = true;
+        return;
+    }
+    c->busy = true;
+    c->job_next = NULL;
+
+    pthread_mutex_lock(&srv.queue_lock);
+    if(srv.queue_tail != NULL)
+        srv.queue_tail->job_next = c;
+    else
+        srv.queue_head = c;
+    srv.queue_tail = c;
+    pthread_cond_signal(&srv.queue_cond);
+    pthread_mutex_unlock(&srv.queue_lock);
+}
+
+// returns false once the peer can't take more right now
+static bool flush_output(Client *c)
+{
+    while(c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if(n < 0) {
+            c->closing = true;
+            c->out_sent = c->out_len;
+            break;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return true;
+}
+
+// input is only read up to MAX_LINE ahead so a fast client can't queue
+// without bound
+static uint32_t input_events(const Client *c)
+{
+    return (c->in_len < MAX_LINE && !c->eof) ? EPOLLIN : 0;
+}
+
+// sends pending output, then hands the next buffered line to the workers
+static void client_pump(Client *c)
+{
+    if(!flush_output(c)) {
+        set_interest(c, EPOLLOUT);
+        return;
+    }
+    if(c->busy) {
+        set_interest(c, input_events(c));
+        return;
+    }
+    if(c->closing) {
+        client_close(c);
+        return;
+    }
+
+    char *nl = memchr(c->in, '\n', c->in_len);
+    if(nl == NULL) {
+        if(c->eof || c->in_len >= MAX_LINE)
+            client_close(c);
+        else
+            set_interest(c, EPOLLIN);
+        return;
+    }
+
+    *nl = '\0';
+    if(nl > c->in && nl[-1] == '\r')
+        nl[-1] = '\0';
+    submit_job(c, c->in);
+
+    size_t used = nl + 1 - c->in;
+    memmove(c->in, nl + 1, c->in_len - used);
+    c->in_len -= used;
+
+    if(c->closing)
+        client_close(c);
+    else
+        set_interest(c, input_events(c));
+}
+
+// back on the loop thread: queue the command's output behind its length
+static void job_finished(Client *c)
+{
+    c->busy = false;
+    free(c->job);
+    c->job = NULL;
+
+    if(c->fd < 0) {
+        client_free(c);
+        return;
+    }
+
+    char hdr[32];
+    int n = snprintf(hdr, sizeof(hdr), "%zu\n", c->job_out != NULL ? c->job_out_len : 0);
+    if(buf_append(&c->out, &c->out_len, &c->out_cap, hdr, n) != 0 ||
+       (c->job_out_len > 0 &&
+        buf_append(&c->out, &c->out_len, &c->out_cap, c->job_out, c->job_out_len) != 0))
+        c->closing = true;
+    free(c->job_out);
+    c->job_out = NULL;
+    c->job_out_len = 0;
+    if(c->job_exit)
+        c->closing = true;
+
+    client_pump(c);
+}
+
+static void drain_done(void)
+{
+    uint64_t count;
+    if(read(srv.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    pthread_mutex_lock(&srv.queue_lock);
+    Client *c = srv.done;
+    srv.done = NULL;
+    pthread_mutex_unlock(&srv.queue_lock);
+
+    while(c != NULL) {
+        Client *next = c->job_next;
+        job_finished(c);
+        c = next;
+    }
+}
+
+static void client_readable(Client *c)
+{
+    char chunk[READ_CHUNK];
+
+    while(c->in_len < MAX_LINE) {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(n == 0) {
+            c->eof = true;
+            break;
+        }
+        if(n < 0 || buf_append(&c->in, &c->in_len, &c->in_cap, chunk, n) != 0) {
+            client_close(c);
+            return;
+        }
+    }
+    client_pump(c);
+}
+
+static void accept_clients(void)
+{
+    while(1)
+    {
+        int fd = accept4(srv.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+
+        Client *c = calloc(1, sizeof(Client));
+        if(c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        fat32_session_init(&c->session);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if(epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        fat32_session_attach(&c->session);
+        c->next = srv.clients;
+        srv.clients = c;
+    }
+}
+
+static int open_listener(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror(socket_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// workers block the stop signals so they always land in epoll_wait
+static void start_workers(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 2) n = 2;
+    if(n > MAX_WORKERS) n = MAX_WORKERS;
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for(int i = 0; i < n; i++) {
+        if(pthread_create(&srv.workers[i], NULL, worker_main, NULL) != 0)
+            break;
+        srv.worker_count++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void stop_workers(void)
+{
+    pthread_mutex_lock(&srv.queue_lock);
+    srv.stopping = true;
+    pthread_cond_broadcast(&srv.queue_cond);
+    pthread_mutex_unlock(&srv.queue_lock);
+
+    for(int i = 0; i < srv.worker_count; i++)
+        pthread_join(srv.workers[i], NULL);
+
+    // commands queued but never started
+    for(Client *c = srv.queue_head; c != NULL; c = c->job_next)
+        c->busy = false;
+    for(Client *c = srv.done; c != NULL; c = c->job_next)
+        c->busy = false;
+}
+
+int server_run(const char *socket_path)
+{
+    memset(&srv, 0, sizeof(srv));
+    srv.listen_fd = open_listener(socket_path);
+    if(srv.listen_fd < 0)
+        return -1;
+
+    srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    srv.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(srv.epoll_fd < 0 || srv.wake_fd < 0) {
+        perror("server");
+        close(srv.listen_fd);
+        unlink(socket_path);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.listen_fd, &ev);
+    ev.data.ptr = &wake_tag;
+    epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.wake_fd, &ev);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pthread_mutex_init(&srv.queue_lock, NULL);
+    pthread_cond_init(&srv.queue_cond, NULL);
+    start_workers();
+
+    fprintf(stderr, "Serving %s on %s with %d workers\n", fs.image_name, socket_path,
+            srv.worker_count);
+
+    struct epoll_event events[MAX_EVENTS];
+    while(!stop_requested)
+    {
+        int n = epoll_wait(srv.epoll_fd, events, MAX_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        // finished commands can free their clients, so they are handled
+        // after every other event in this batch
+        bool woken = false;
+        for(int i = 0; i < n; i++)
+        {
+            void *tag = events[i].data.ptr;
+            if(tag == &wake_tag) {
+                woken = true;
+                continue;
+            }
+            if(tag == &listen_tag) {
+                accept_clients();
+                continue;
+            }
+
+            Client *c = tag;
+            if(events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN))
+                client_close(c);
+            else if(events[i].events & EPOLLOUT)
+                client_pump(c);
+            else
+                client_readable(c);
+        }
+        if(woken)
+            drain_done();
+    }
+
+    stop_workers();
+    while(srv.clients != NULL)
+        client_close(srv.clients);
+    pthread_cond_destroy(&srv.queue_cond);
+    pthread_mutex_destroy(&srv.queue_lock);
+    close(srv.listen_fd);
+    close(srv.epoll_fd);
+    close(srv.wake_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+// reads exactly len bytes, or returns -1 if the connection drops
+static int recv_full(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    while(got < len) {
+        ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// copies one reply from the server to stdout
+static int print_reply(int fd)
+{
+    char hdr[32];
+    size_t len = 0;
+    while(1) {
+        if(len == sizeof(hdr) - 1 || recv_full(fd, &hdr[len], 1) != 0)
+            return -1;
+        if(hdr[len] == '\n')
+            break;
+        len++;
+    }
+    hdr[len] = '\0';
+
+    unsigned long long remaining = strtoull(hdr, NULL, 10);
+    char chunk[READ_CHUNK];
+    while(remaining > 0) {
+        size_t n = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+        if(recv_full(fd, chunk, n) != 0)
+            return -1;
+        fwrite(chunk, 1, n, stdout);
+        remaining -= n;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int client_run(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(socket_path);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    bool interactive = isatty(STDIN_FILENO);
+    int ret = 0;
+
+    while(1)
+    {
+        if(interactive) {
+            printf("> ");
+            fflush(stdout);
+        }
+
+        char *input = get_input();
+        if(feof(stdin) && strlen(input) == 0) {
+            free(input);
+            break;
+        }
+
+        tokenlist *tokens = get_tokens(input);
+        bool quit = tokens->size > 0 && strcmp(tokens->items[0], "exit") == 0;
+        free_tokens(tokens);
+
+        size_t len = strlen(input);
+        bool sent = send(fd, input, len, MSG_NOSIGNAL) == (ssize_t)len &&
+                    send(fd, "\n", 1, MSG_NOSIGNAL) == 1;
+        free(input);
+
+        if(!sent || print_reply(fd) != 0) {
+            fprintf(stderr, "Error: Lost connection to server\n");
+            ret = -1;
+            break;
+        }
+        if(quit)
+            break;
+    }
+
+    close(fd);
+    return ret;
+}
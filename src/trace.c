@@ -0,0 +1,521 @@
+// trace.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "fat32.h"
+#include "commands.h"
+#include "checksum.h"
+#include "cimage.h"
+#include "io.h"
+#include "bufpool.h"
+
+#define TRACE_HEADER    "# fat32 trace 1"
+#define TRACE_HASH      SUM_XXH64
+#define TRACE_CHUNK     BUFPOOL_BUFFER
+#define TRACE_NAME_MAX  16
+#define TRACE_WORST     5       // slowest commands listed against the baseline
+
+/*
+ * A trace is a text file with one line per command:
+ *   <start us> <latency us> <unix time> <command line>
+ * Start times count from the beginning of the recording, and tokens with
+ * spaces are quoted the way the lexer reads them. The unix time is pinned
+ * as the clock while the command runs, so a replay stamps directory
+ * entries exactly like the recording did. Lines starting with '#' hold
+ * the header and the hash of the volume before and after.
+ */
+typedef struct {
+    uint64_t at;
+    uint64_t latency;
+    time_t clock;
+    char *line;
+} TraceEntry;
+
+typedef struct {
+    TraceEntry *entries;
+    size_t count;
+    char start_hash[SUM_HEX_MAX];   // empty if the trace has none
+    char end_hash[SUM_HEX_MAX];
+} Trace;
+
+typedef struct {
+    char name[TRACE_NAME_MAX];
+    size_t count;
+    uint64_t total;
+    uint64_t base;
+} CommandStats;
+
+static FILE *rec;
+static uint64_t rec_epoch;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// hashes the volume as commands see it, after flushing buffered writes
+static int hash_volume(char *hex)
+{
+    uint64_t size = fat32_get_image_size();
+    uint8_t *buf = bufpool_get(fs.pool);
+    Hasher h;
+
+    fat32_lock_exclusive();
+    int ret = (buf != NULL && fat32_handles_flush() == 0) ? fat32_flush_fat() : -1;
+    sum_init(&h, TRACE_HASH);
+    for(uint64_t off = 0; ret == 0 && off < size; off += TRACE_CHUNK)
+    {
+        size_t n = (size - off < TRACE_CHUNK) ? (size_t)(size - off) : TRACE_CHUNK;
+        ret = fat32_read_at(off, buf, n);
+        if(ret == 0)
+            sum_update(&h, buf, n);
+    }
+    fat32_unlock();
+
+    bufpool_put(fs.pool, buf);
+    if(ret == 0)
+        sum_final(&h, hex);
+    return ret;
+}
+
+static int record_open(const char *path, const char *start_hash)
+{
+    rec = fopen(path, "w");
+    if(rec == NULL) {
+        fprintf(stderr, "Error: Cannot create %s\n", path);
+        return -1;
+    }
+    fprintf(rec, TRACE_HEADER "\n# start %s %s\n", sum_algo_name(TRACE_HASH), start_hash);
+    fflush(rec);
+    rec_epoch = now_us();
+    return 0;
+}
+
+static int record_close(const char *end_hash)
+{
+    if(end_hash != NULL)
+        fprintf(rec, "# end %s %s\n", sum_algo_name(TRACE_HASH), end_hash);
+    int ret = (fclose(rec) == 0) ? 0 : -1;
+    rec = NULL;
+    return ret;
+}
+
+int trace_record_start(const char *path)
+{
+    char hex[SUM_HEX_MAX];
+
+    if(hash_volume(hex) != 0) {
+        fprintf(stderr, "Error: Could not read the image\n");
+        return -1;
+    }
+    return record_open(path, hex);
+}
+
+int trace_record_finish(void)
+{
+    char hex[SUM_HEX_MAX];
+
+    if(rec == NULL)
+        return 0;
+    if(hash_volume(hex) != 0) {
+        fprintf(stderr, "Error: Could not read the image\n");
+        record_close(NULL);
+        return -1;
+    }
+    return record_close(hex);
+}
+
+static int run_command(tokenlist *tokens, time_t clock, uint64_t *latency)
+{
+    fat32_pin_clock(clock);
+    uint64_t start = now_us();
+    int result = dispatch_command(tokens);
+    *latency = now_us() - start;
+    fat32_pin_clock(0);
+
+    if(rec == NULL)
+        return result;
+
+    fprintf(rec, "%llu %llu %lld", (unsigned long long)(start - rec_epoch),
+            (unsigned long long)*latency, (long long)clock);
+    for(size_t i = 0; i < tokens->size; i++)
+    {
+        const char *t = tokens->items[i];
+        if(t[0] == '\0' || strchr(t, ' ') != NULL)
+            fprintf(rec, " \"%s\"", t);
+        else
+            fprintf(rec, " %s", t);
+    }
+    fputc('\n', rec);
+    // a session that dies still leaves everything up to here
+    fflush(rec);
+    return result;
+}
+
+int trace_dispatch(tokenlist *tokens)
+{
+    uint64_t latency;
+
+    if(rec == NULL)
+        return dispatch_command(tokens);
+    return run_command(tokens, time(NULL), &latency);
+}
+
+static void trace_free(Trace *t)
+{
+    for(size_t i = 0; i < t->count; i++)
+        free(t->entries[i].line);
+    free(t->entries);
+    memset(t, 0, sizeof(*t));
+}
+
+static void parse_hash(const char *line, const char *which, char *hex)
+{
+    char key[32];
+    int n = snprintf(key, sizeof(key), "# %s %s ", which, sum_algo_name(TRACE_HASH));
+
+    if(strncmp(line, key, n) == 0) {
+        strncpy(hex, line + n, SUM_HEX_MAX - 1);
+        hex[SUM_HEX_MAX - 1] = '\0';
+    }
+}
+
+static int trace_load(const char *path, Trace *t)
+{
+    memset(t, 0, sizeof(*t));
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        fprintf(stderr, "Error: Cannot open %s\n", path);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0, alloc = 0, lineno = 0;
+    ssize_t len;
+    int ret = 0;
+
+    while(ret == 0 && (len = getline(&line, &cap, f)) >= 0)
+    {
+        lineno++;
+        if(len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        if(lineno == 1) {
+            if(strcmp(line, TRACE_HEADER) != 0)
+                ret = -1;
+            continue;
+        }
+        if(line[0] == '#') {
+            parse_hash(line, "start", t->start_hash);
+            parse_hash(line, "end", t->end_hash);
+            continue;
+        }
+        if(len == 0)
+            continue;
+
+        unsigned long long at, latency;
+        long long clock;
+        int used = 0;
+        if(sscanf(line, "%llu %llu %lld %n", &at, &latency, &clock, &used) != 3 ||
+           line[used] == '\0') {
+            ret = -1;
+            break;
+        }
+        if(t->count == alloc) {
+            size_t grown = alloc ? alloc * 2 : 64;
+            TraceEntry *e = realloc(t->entries, grown * sizeof(TraceEntry));
+            if(e == NULL) {
+                ret = -1;
+                break;
+            }
+            t->entries = e;
+            alloc = grown;
+        }
+        TraceEntry *e = &t->entries[t->count];
+        e->at = at;
+        e->latency = latency;
+        e->clock = (time_t)clock;
+        e->line = strdup(line + used);
+        if(e->line == NULL)
+            ret = -1;
+        else
+            t->count++;
+    }
+
+    if(ret != 0)
+        fprintf(stderr, "Error: %s line %zu is not part of a trace\n", path, lineno);
+    if(ret == 0 && lineno == 0) {
+        fprintf(stderr, "Error: %s is empty\n", path);
+        ret = -1;
+    }
+    free(line);
+    fclose(f);
+    if(ret != 0)
+        trace_free(t);
+    return ret;
+}
+
+static bool all_zero(const uint8_t *p, size_t n)
+{
+    return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+// writes the raw contents of image_path (compressed or not) to out,
+// leaving holes for zero chunks
+static int copy_image(const char *image_path, int out)
+{
+    struct stat st;
+    int in = open(image_path, O_RDONLY);
+    if(in < 0 || fstat(in, &st) != 0) {
+        fprintf(stderr, "Error: Cannot open %s\n", image_path);
+        if(in >= 0)
+            close(in);
+        return -1;
+    }
+
+    CImage *ci = NULL;
+    if(cimage_probe(in) && (ci = cimage_open(in)) == NULL) {
+        fprintf(stderr, "Error: %s is a damaged compressed image\n", image_path);
+        close(in);
+        return -1;
+    }
+
+    uint64_t size = (ci != NULL) ? cimage_size(ci) : (uint64_t)st.st_size;
+    uint8_t *buf = malloc(TRACE_CHUNK);
+    int ret = (buf != NULL) ? 0 : -1;
+    for(uint64_t off = 0; ret == 0 && off < size; off += TRACE_CHUNK)
+    {
+        size_t n = (size - off < TRACE_CHUNK) ? (size_t)(size - off) : TRACE_CHUNK;
+        ret = (ci != NULL) ? cimage_read(ci, off, buf, n) : io_pread_full(in, off, buf, n);
+        if(ret == 0 && !all_zero(buf, n))
+            ret = io_pwrite_full(out, off, buf, n);
+    }
+    if(ret == 0 && ftruncate(out, (off_t)size) != 0)
+        ret = -1;
+    if(ret != 0)
+        fprintf(stderr, "Error: Could not copy %s\n", image_path);
+
+    free(buf);
+    cimage_close(ci);
+    close(in);
+    return ret;
+}
+
+static void wait_until(uint64_t deadline)
+{
+    uint64_t now = now_us();
+    if(now >= deadline)
+        return;
+    struct timespec ts = {
+        .tv_sec = (deadline - now) / 1000000,
+        .tv_nsec = ((deadline - now) % 1000000) * 1000
+    };
+    nanosleep(&ts, NULL);
+}
+
+static void command_name(const char *line, char *name)
+{
+    size_t n = strcspn(line, " ");
+    if(n >= TRACE_NAME_MAX)
+        n = TRACE_NAME_MAX - 1;
+    memcpy(name, line, n);
+    name[n] = '\0';
+}
+
+static void print_delta(uint64_t value, uint64_t base)
+{
+    if(base > 0)
+        printf(" %+8.1f%%\n", 100.0 * ((double)value - (double)base) / base);
+    else
+        printf(" %9s\n", "-");
+}
+
+static void report(const Trace *trace, const Trace *base, const uint64_t *latency,
+                   size_t ran, uint64_t elapsed)
+{
+    CommandStats *stats = calloc(ran + 1, sizeof(CommandStats));
+    size_t kinds = 0;
+    uint64_t total = 0, base_total = 0;
+
+    for(size_t i = 0; stats != NULL && i < ran; i++)
+    {
+        char name[TRACE_NAME_MAX];
+        command_name(trace->entries[i].line, name);
+        size_t k = 0;
+        while(k < kinds && strcmp(stats[k].name, name) != 0)
+            k++;
+        if(k == kinds)
+            strcpy(stats[kinds++].name, name);
+        stats[k].count++;
+        stats[k].total += latency[i];
+        stats[k].base += base->entries[i].latency;
+        total += latency[i];
+        base_total += base->entries[i].latency;
+    }
+
+    printf("Replayed %zu of %zu commands in %.3f s, %.3f s inside commands\n",
+           ran, trace->count, elapsed / 1e6, total / 1e6);
+    printf("%-12s %7s %12s %12s %9s\n", "Command", "Count", "Mean us", "Baseline us", "Delta");
+    for(size_t k = 0; stats != NULL && k < kinds; k++)
+    {
+        printf("%-12s %7zu %12.1f %12.1f", stats[k].name, stats[k].count,
+               (double)stats[k].total / stats[k].count, (double)stats[k].base / stats[k].count);
+        print_delta(stats[k].total, stats[k].base);
+    }
+    printf("%-12s %7zu %12.1f %12.1f", "all", ran,
+           ran ? (double)total / ran : 0.0, ran ? (double)base_total / ran : 0.0);
+    print_delta(total, base_total);
+    free(stats);
+
+    // the individual commands that lost the most time
+    bool *shown = calloc(ran + 1, sizeof(bool));
+    for(int n = 0; shown != NULL && n < TRACE_WORST; n++)
+    {
+        size_t worst = ran;
+        int64_t worst_delta = 0;
+        for(size_t i = 0; i < ran; i++) {
+            int64_t d = (int64_t)latency[i] - (int64_t)base->entries[i].latency;
+            if(!shown[i] && d > worst_delta) {
+                worst = i;
+                worst_delta = d;
+            }
+        }
+        if(worst == ran)
+            break;
+        if(n == 0)
+            printf("Slowest against the baseline:\n");
+        shown[worst] = true;
+        printf("  #%-6zu +%-8lld us  %s\n", worst + 1, (long long)worst_delta,
+               trace->entries[worst].line);
+    }
+    free(shown);
+}
+
+int trace_replay(const char *trace_path, const char *image_path, bool paced,
+                 const char *baseline_path, const char *record_path)
+{
+    Trace trace, other;
+    const Trace *base = &trace;
+
+    if(trace_load(trace_path, &trace) != 0)
+        return -1;
+    if(baseline_path != NULL) {
+        if(trace_load(baseline_path, &other) != 0) {
+            trace_free(&trace);
+            return -1;
+        }
+        bool same = (other.count == trace.count);
+        for(size_t i = 0; same && i < trace.count; i++)
+            same = (strcmp(other.entries[i].line, trace.entries[i].line) == 0);
+        if(!same) {
+            fprintf(stderr, "Error: %s does not hold the same commands as %s\n",
+                    baseline_path, trace_path);
+            trace_free(&trace);
+            trace_free(&other);
+            return -1;
+        }
+        base = &other;
+    }
+
+    // commands run against a scratch copy so the image can be replayed again
+    size_t pathLen = strlen(image_path) + sizeof(".replay.XXXXXX");
+    char *scratch = malloc(pathLen);
+    int fd = -1;
+    if(scratch != NULL) {
+        snprintf(scratch, pathLen, "%s.replay.XXXXXX", image_path);
+        fd = mkstemp(scratch);
+    }
+    if(fd < 0) {
+        fprintf(stderr, "Error: Cannot create a scratch copy of %s\n", image_path);
+        free(scratch);
+        trace_free(&trace);
+        if(base != &trace)
+            trace_free(&other);
+        return -1;
+    }
+
+    int ret = copy_image(image_path, fd);
+    close(fd);
+    if(ret == 0 && fat32_mount(scratch, NULL) != 0)
+        ret = -1;
+
+    uint64_t *latency = NULL;
+    char start_hash[SUM_HEX_MAX] = "", end_hash[SUM_HEX_MAX] = "";
+    size_t ran = 0;
+    uint64_t elapsed = 0;
+
+    if(ret == 0)
+    {
+        latency = calloc(trace.count + 1, sizeof(uint64_t));
+        FILE *sink = fopen("/dev/null", "w");
+        if(latency == NULL || sink == NULL || hash_volume(start_hash) != 0)
+            ret = -1;
+        if(ret == 0 && record_path != NULL)
+            ret = record_open(record_path, start_hash);
+
+        if(ret == 0)
+        {
+            cmd_set_output(sink);
+            uint64_t epoch = now_us();
+            for(size_t i = 0; i < trace.count; i++)
+            {
+                if(paced)
+                    wait_until(epoch + trace.entries[i].at);
+                tokenlist *tokens = get_tokens(trace.entries[i].line);
+                int result = run_command(tokens, trace.entries[i].clock, &latency[i]);
+                free_tokens(tokens);
+                ran++;
+                if(result == -1)
+                    break;
+            }
+            elapsed = now_us() - epoch;
+            cmd_set_output(NULL);
+
+            if(hash_volume(end_hash) != 0)
+                ret = -1;
+            if(rec != NULL && record_close(ret == 0 ? end_hash : NULL) != 0)
+                ret = -1;
+        }
+        if(sink != NULL)
+            fclose(sink);
+        fat32_unmount();
+    }
+    unlink(scratch);
+    free(scratch);
+
+    if(ret == 0)
+    {
+        report(&trace, base, latency, ran, elapsed);
+
+        printf("Start %s %s", sum_algo_name(TRACE_HASH), start_hash);
+        if(trace.start_hash[0] != '\0' && strcmp(trace.start_hash, start_hash) != 0)
+            printf(", but the trace was recorded on %s", trace.start_hash);
+        printf("\n");
+
+        printf("End   %s %s", sum_algo_name(TRACE_HASH), end_hash);
+        if(trace.end_hash[0] == '\0') {
+            printf(", the trace has no final hash\n");
+        } else if(strcmp(trace.end_hash, end_hash) == 0) {
+            printf(", matches the recording\n");
+        } else {
+            printf(", DIFFERS from the recorded %s\n", trace.end_hash);
+            ret = -1;
+        }
+    } else {
+        fprintf(stderr, "Error: Replay of %s failed\n", trace_path);
+    }
+
+    free(latency);
+    trace_free(&trace);
+    if(base != &trace)
+        trace_free(&other);
+    return ret;
+}
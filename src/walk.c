@@ -0,0 +1,305 @@
+// walk.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "walk.h"
+
+#define MAX_WALK_THREADS    16
+#define EMIT_BUF_SIZE       (64 * 1024)
+
+typedef struct {
+    uint32_t cluster;
+    char *path;
+    void *data;
+} WalkItem;
+
+// the owner pushes and pops at the tail (depth first), thieves take the
+// oldest item from the head, which tends to be the largest subtree
+typedef struct {
+    pthread_mutex_t lock;
+    WalkItem *items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+} WalkDeque;
+
+typedef struct Walk Walk;
+
+struct WalkWorker {
+    int id;
+    Walk *walk;
+    pthread_t thread;
+    WalkDeque deque;
+    uint8_t *cluster_buf;
+    char *out;
+    size_t out_len;
+};
+
+// one per fat32_walk call, so several walks can run at once
+struct Walk {
+    WalkWorker *workers;
+    int count;
+    const WalkOps *ops;
+    long pending;   // items queued or being scanned
+    pthread_mutex_t out_lock;
+};
+
+int walk_thread_count(void)
+{
+    // directory scans block on I/O, so run a few more scanners than cores
+    long n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if(n < 2) n = 2;
+    if(n > MAX_WALK_THREADS) n = MAX_WALK_THREADS;
+    return (int)n;
+}
+
+uint32_t walk_chain_length(uint32_t cluster)
+{
+    uint32_t len = 0;
+    while(cluster >= 2 && cluster < FAT_EOC && len <= fs.total_clusters) {
+        len++;
+        cluster = fat32_get_fat_entry(cluster);
+    }
+    return len;
+}
+
+static void flush_output(WalkWorker *w)
+{
+    if(w->out_len == 0)
+        return;
+    pthread_mutex_lock(&w->walk->out_lock);
+    fwrite(w->out, 1, w->out_len, w->walk->ops->out);
+    pthread_mutex_unlock(&w->walk->out_lock);
+    w->out_len = 0;
+}
+
+// buffers output per worker so results stream out in large writes
+void walk_emit(WalkWorker *w, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(w->out + w->out_len, EMIT_BUF_SIZE - w->out_len, fmt, ap);
+    va_end(ap);
+
+    if(n < 0 || (size_t)n < EMIT_BUF_SIZE - w->out_len) {
+        if(n > 0) w->out_len += n;
+        return;
+    }
+
+    flush_output(w);
+    va_start(ap, fmt);
+    if((size_t)n < EMIT_BUF_SIZE) {
+        vsnprintf(w->out, EMIT_BUF_SIZE, fmt, ap);
+        w->out_len = n;
+    } else {
+        pthread_mutex_lock(&w->walk->out_lock);
+        vfprintf(w->walk->ops->out, fmt, ap);
+        pthread_mutex_unlock(&w->walk->out_lock);
+    }
+    va_end(ap);
+}
+
+static int push_item(WalkWorker *w, uint32_t cluster, char *path, void *data)
+{
+    WalkDeque *d = &w->deque;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->tail == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        WalkItem *grown = realloc(d->items, cap * sizeof(WalkItem));
+        if(grown == NULL) {
+            pthread_mutex_unlock(&d->lock);
+            return -1;
+        }
+        d->items = grown;
+        d->cap = cap;
+    }
+    d->items[d->tail].cluster = cluster;
+    d->items[d->tail].path = path;
+    d->items[d->tail].data = data;
+    d->tail++;
+    __atomic_add_fetch(&w->walk->pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+static bool pop_item(WalkDeque *d, WalkItem *item, bool steal)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->tail > d->head) {
+        *item = steal ? d->items[d->head++] : d->items[--d->tail];
+        found = true;
+        if(d->head == d->tail)
+            d->head = d->tail = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir);
+    bool slash = (len > 0 && dir[len - 1] == '/');
+    char *path = malloc(len + strlen(name) + 2);
+
+    if(path != NULL)
+        sprintf(path, slash ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+static void scan_dir(WalkWorker *w, WalkItem *item)
+{
+    const WalkOps *ops = w->walk->ops;
+    uint32_t entriesPerCluster = fat32_get_cluster_size() / sizeof(DirEntry);
+    uint32_t clus = item->cluster;
+    uint32_t steps = 0;
+    bool end = false;
+
+    DirIter it;
+    DirRecord rec;
+    fat32_dir_open(&it, clus);
+
+    while(!end && clus >= 2 && clus < FAT_EOC && steps++ <= fs.total_clusters)
+    {
+        if(fat32_read_cluster(clus, w->cluster_buf) != 0)
+            break;
+
+        const DirEntry *ents = (const DirEntry *)w->cluster_buf;
+        for(uint32_t i = 0; i < entriesPerCluster; i++)
+        {
+            int res = fat32_dir_decode(&it, &ents[i], clus, i * sizeof(DirEntry), &rec);
+            if(res < 0) {
+                end = true;
+                break;
+            }
+            if(res == 0 || (rec.entry.DIR_Attr & ATTR_VOLUME_ID) ||
+               strcmp(rec.name, ".") == 0 || strcmp(rec.name, "..") == 0)
+                continue;
+
+            char *child = join_path(item->path, rec.name);
+            if(child == NULL)
+                continue;
+
+            void *data = ops->visit(w, &rec, child, item->data, ops->ctx);
+            uint32_t first = fat32_get_cluster(&rec.entry);
+
+            if(!(rec.entry.DIR_Attr & ATTR_DIRECTORY)) {
+                free(child);
+            } else if(first < 2 || push_item(w, first, child, data) != 0) {
+                free(child);
+                if(ops->dir_done != NULL)
+                    ops->dir_done(w, data, ops->ctx);
+            }
+        }
+
+        clus = fat32_get_fat_entry(clus);
+    }
+
+    if(ops->dir_done != NULL)
+        ops->dir_done(w, item->data, ops->ctx);
+}
+
+static void *worker_main(void *arg)
+{
+    WalkWorker *w = arg;
+    Walk *walk = w->walk;
+    int idle = 0;
+
+    while(1)
+    {
+        WalkItem item;
+        bool found = pop_item(&w->deque, &item, false);
+
+        for(int k = 1; !found && k < walk->count; k++)
+            found = pop_item(&walk->workers[(w->id + k) % walk->count].deque, &item, true);
+
+        if(found) {
+            scan_dir(w, &item);
+            free(item.path);
+            __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+            idle = 0;
+            continue;
+        }
+
+        if(__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0)
+            break;
+
+        if(++idle < 64)
+            sched_yield();
+        else
+            usleep(100);
+    }
+
+    flush_output(w);
+    return NULL;
+}
+
+/*
+ * Walks the tree below dir_cluster with a pool of scanner threads. Each
+ * directory is one work item; a scanner pushes the subdirectories it finds
+ * onto its own deque and idle scanners steal from the others. Chains are
+ * followed through the FAT cache, whose hits don't serialize the scanners.
+ */
+int fat32_walk(uint32_t dir_cluster, const char *path, void *dir_data,
+               const WalkOps *ops)
+{
+    Walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.ops = ops;
+    walk.count = walk_thread_count();
+
+    walk.workers = calloc(walk.count, sizeof(WalkWorker));
+    if(walk.workers == NULL)
+        return -1;
+    pthread_mutex_init(&walk.out_lock, NULL);
+
+    int ret = 0;
+    for(int i = 0; i < walk.count; i++) {
+        WalkWorker *w = &walk.workers[i];
+        w->id = i;
+        w->walk = &walk;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        w->cluster_buf = malloc(fat32_get_cluster_size());
+        w->out = malloc(EMIT_BUF_SIZE);
+        if(w->cluster_buf == NULL || w->out == NULL)
+            ret = -1;
+    }
+
+    char *rootPath = strdup(path);
+    if(ret == 0 && (rootPath == NULL ||
+                    push_item(&walk.workers[0], dir_cluster, rootPath, dir_data) != 0)) {
+        free(rootPath);
+        ret = -1;
+    }
+
+    if(ret == 0) {
+        int started = 1;
+        for(int i = 1; i < walk.count; i++) {
+            if(pthread_create(&walk.workers[i].thread, NULL, worker_main, &walk.workers[i]) != 0)
+                break;
+            started++;
+        }
+        worker_main(&walk.workers[0]);
+        for(int i = 1; i < started; i++)
+            pthread_join(walk.workers[i].thread, NULL);
+    }
+
+    for(int i = 0; i < walk.count; i++) {
+        WalkWorker *w = &walk.workers[i];
+        pthread_mutex_destroy(&w->deque.lock);
+        free(w->deque.items);
+        free(w->cluster_buf);
+        free(w->out);
+    }
+    pthread_mutex_destroy(&walk.out_lock);
+    free(walk.workers);
+    fflush(ops->out);
+
+    return ret;
+}
@@ -0,0 +1,503 @@
+// writeback.c
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "writeback.h"
+
+#define WB_RUN          256     // blocks per sequential write, 1 MiB
+#define WB_LIMIT        4       // dirty bytes allowed, in thresholds, before writers stall
+
+typedef struct {
+    uint64_t block;
+    uint32_t gen;           // bumped by every write to the block
+    uint8_t order;          // WriteBackOrder, the latest of any write to it
+    struct timespec since;  // when it got dirty
+    uint8_t *data;
+} Dirty;
+
+// what a flush copied out of one block
+typedef struct {
+    uint64_t block;
+    uint32_t gen;
+    uint8_t order;
+    bool written;
+    uint8_t *data;          // the copy, in the pass's snapshot
+} Taken;
+
+/*
+ * Dirty blocks live in an array with an open-addressed hash from block
+ * number to array index. Readers hold lock shared while they read the
+ * image and patch in dirty blocks; a flush copies every dirty block at
+ * once, writes the copies out while the blocks are still in the table and
+ * drops them afterwards under the exclusive lock, so no reader can see the
+ * image between the two. Flushes run one at a time under flush_lock.
+ */
+struct WriteBack {
+    WriteBackRead read;
+    WriteBackWrite write;
+    WriteBackHook hold;
+    WriteBackHook release;
+    uint64_t size;
+    unsigned delay_ms;
+    size_t threshold;
+
+    pthread_rwlock_t lock;
+    Dirty *items;
+    size_t count;
+    size_t cap;
+    int32_t *index;         // block hash -> item, -1 when empty
+    size_t index_cap;       // power of two, at least twice count
+    uint64_t dirty_bytes;
+    struct timespec first_dirty;    // the oldest dirty block's since
+
+    pthread_mutex_t flush_lock;
+    uint8_t *bounce;
+
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    bool kicked;            // state changed, the flusher should look again
+    bool stop;
+    pthread_t thread;
+
+    pthread_mutex_t stats_lock;
+    WriteBackStats stats;
+};
+
+static inline size_t block_len(const WriteBack *wb, uint64_t block)
+{
+    uint64_t start = block * WRITEBACK_BLOCK;
+    return (start + WRITEBACK_BLOCK > wb->size) ? (size_t)(wb->size - start) : WRITEBACK_BLOCK;
+}
+
+static inline size_t hash_block(uint64_t block, size_t cap)
+{
+    return (size_t)((block * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+static int32_t lookup(const WriteBack *wb, uint64_t block)
+{
+    if(wb->count == 0)
+        return -1;
+    for(size_t h = hash_block(block, wb->index_cap); ; h = (h + 1) & (wb->index_cap - 1)) {
+        int32_t i = wb->index[h];
+        if(i < 0 || wb->items[i].block == block)
+            return i;
+    }
+}
+
+static void index_put(WriteBack *wb, int32_t i)
+{
+    size_t h = hash_block(wb->items[i].block, wb->index_cap);
+    while(wb->index[h] >= 0)
+        h = (h + 1) & (wb->index_cap - 1);
+    wb->index[h] = i;
+}
+
+static int rebuild_index(WriteBack *wb, size_t cap)
+{
+    if(cap != wb->index_cap) {
+        int32_t *grown = malloc(cap * sizeof(int32_t));
+        if(grown == NULL)
+            return -1;
+        free(wb->index);
+        wb->index = grown;
+        wb->index_cap = cap;
+    }
+    memset(wb->index, 0xFF, wb->index_cap * sizeof(int32_t));
+    for(size_t i = 0; i < wb->count; i++)
+        index_put(wb, (int32_t)i);
+    return 0;
+}
+
+static void kick(WriteBack *wb)
+{
+    pthread_mutex_lock(&wb->wake_lock);
+    wb->kicked = true;
+    pthread_cond_signal(&wb->wake);
+    pthread_mutex_unlock(&wb->wake_lock);
+}
+
+static bool before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// a new dirty block, read up from the image unless the write covers it
+static int32_t add_block(WriteBack *wb, uint64_t block, bool whole)
+{
+    if(wb->count == wb->cap) {
+        size_t cap = wb->cap ? wb->cap * 2 : 256;
+        Dirty *grown = realloc(wb->items, cap * sizeof(Dirty));
+        if(grown == NULL)
+            return -1;
+        wb->items = grown;
+        wb->cap = cap;
+    }
+    if((wb->count + 1) * 2 > wb->index_cap &&
+       rebuild_index(wb, wb->index_cap ? wb->index_cap * 2 : 512) != 0)
+        return -1;
+
+    size_t len = block_len(wb, block);
+    uint8_t *data = malloc(WRITEBACK_BLOCK);
+    if(data == NULL || (!whole && wb->read(block * WRITEBACK_BLOCK, data, len) != 0)) {
+        free(data);
+        return -1;
+    }
+
+    int32_t i = (int32_t)wb->count++;
+    wb->items[i].block = block;
+    wb->items[i].gen = 0;
+    wb->items[i].order = WRITEBACK_DATA;
+    clock_gettime(CLOCK_MONOTONIC, &wb->items[i].since);
+    wb->items[i].data = data;
+    index_put(wb, i);
+    if(wb->dirty_bytes == 0)
+        wb->first_dirty = wb->items[i].since;
+    wb->dirty_bytes += len;
+    return i;
+}
+
+static int compare_taken(const void *a, const void *b)
+{
+    const Taken *x = a, *y = b;
+    if(x->order != y->order)
+        return (x->order > y->order) - (x->order < y->order);
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+/*
+ * Writes every block that is dirty when it starts: all of file data first,
+ * then the FAT, then directories, each in block order with runs of
+ * adjacent blocks in one write. If a write fails the later orders wait for
+ * the next pass, so a directory never reaches the image ahead of the FAT
+ * it depends on. The blocks are copied up front, all at once; the flusher
+ * thread does that between wb->hold and wb->release. Blocks rewritten
+ * while the flush was under way keep their newer data and stay dirty.
+ */
+static int flush_pass(WriteBack *wb, bool background)
+{
+    int ret = 0;
+    uint64_t runs = 0, written = 0;
+
+    if(background && wb->hold != NULL)
+        wb->hold();
+    pthread_mutex_lock(&wb->flush_lock);
+    pthread_rwlock_rdlock(&wb->lock);
+    size_t n = wb->count;
+    Taken *taken = malloc((n ? n : 1) * sizeof(Taken));
+    uint8_t *copy = malloc((n ? n : 1) * WRITEBACK_BLOCK);
+    for(size_t i = 0; taken != NULL && copy != NULL && i < n; i++) {
+        const Dirty *d = &wb->items[i];
+        taken[i].block = d->block;
+        taken[i].gen = d->gen;
+        taken[i].order = d->order;
+        taken[i].written = false;
+        taken[i].data = copy + i * WRITEBACK_BLOCK;
+        memcpy(taken[i].data, d->data, WRITEBACK_BLOCK);
+    }
+    pthread_rwlock_unlock(&wb->lock);
+    if(background && wb->release != NULL)
+        wb->release();
+    if(taken == NULL || copy == NULL || n == 0) {
+        free(taken);
+        free(copy);
+        pthread_mutex_unlock(&wb->flush_lock);
+        return (taken == NULL || copy == NULL) ? -1 : 0;
+    }
+    qsort(taken, n, sizeof(Taken), compare_taken);
+
+    for(size_t i = 0; i < n && ret == 0; )
+    {
+        size_t run = 1;
+        while(i + run < n && run < WB_RUN && taken[i + run].order == taken[i].order &&
+              taken[i + run].block == taken[i].block + run)
+            run++;
+        for(size_t k = 0; k < run; k++)
+            memcpy(wb->bounce + k * WRITEBACK_BLOCK, taken[i + k].data, WRITEBACK_BLOCK);
+
+        uint64_t last = taken[i + run - 1].block;
+        size_t len = (run - 1) * WRITEBACK_BLOCK + block_len(wb, last);
+        if(wb->write(taken[i].block * WRITEBACK_BLOCK, wb->bounce, len) == 0) {
+            for(size_t k = 0; k < run; k++)
+                taken[i + k].written = true;
+            runs++;
+            written += len;
+        } else {
+            // the rest of this order still goes out, later ones wait
+            ret = -1;
+            while(i + run < n && taken[i + run].order == taken[i].order)
+                run++;
+        }
+        i += run;
+    }
+    free(copy);
+
+    pthread_rwlock_wrlock(&wb->lock);
+    for(size_t i = 0; i < n; i++) {
+        int32_t at = lookup(wb, taken[i].block);
+        if(taken[i].written && wb->items[at].gen == taken[i].gen) {
+            free(wb->items[at].data);
+            wb->items[at].data = NULL;
+            wb->dirty_bytes -= block_len(wb, taken[i].block);
+        }
+    }
+    size_t kept = 0;
+    for(size_t i = 0; i < wb->count; i++) {
+        if(wb->items[i].data == NULL)
+            continue;
+        if(kept == 0 || before(&wb->items[i].since, &wb->first_dirty))
+            wb->first_dirty = wb->items[i].since;
+        wb->items[kept++] = wb->items[i];
+    }
+    wb->count = kept;
+    rebuild_index(wb, wb->index_cap);
+    pthread_rwlock_unlock(&wb->lock);
+
+    free(taken);
+    pthread_mutex_unlock(&wb->flush_lock);
+
+    pthread_mutex_lock(&wb->stats_lock);
+    if(runs > 0) {
+        wb->stats.flushes++;
+        wb->stats.background += background;
+        wb->stats.runs += runs;
+        wb->stats.written += written;
+    }
+    if(ret != 0)
+        wb->stats.errors++;
+    pthread_mutex_unlock(&wb->stats_lock);
+    return ret;
+}
+
+static void add_ms(struct timespec *t, unsigned ms)
+{
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if(t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+static bool reached(const struct timespec *now, const struct timespec *due)
+{
+    return now->tv_sec > due->tv_sec ||
+           (now->tv_sec == due->tv_sec && now->tv_nsec >= due->tv_nsec);
+}
+
+// sleeps until something is dirty, then until it is due or the threshold is hit
+static void *flusher_main(void *arg)
+{
+    WriteBack *wb = arg;
+
+    pthread_mutex_lock(&wb->wake_lock);
+    while(!wb->stop)
+    {
+        wb->kicked = false;
+        pthread_mutex_unlock(&wb->wake_lock);
+
+        pthread_rwlock_rdlock(&wb->lock);
+        uint64_t bytes = wb->dirty_bytes;
+        struct timespec due = wb->first_dirty;
+        pthread_rwlock_unlock(&wb->lock);
+        add_ms(&due, wb->delay_ms);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bool flushed = false;
+        if(bytes >= wb->threshold || (bytes > 0 && reached(&now, &due))) {
+            flushed = (flush_pass(wb, true) == 0);
+            if(!flushed) {
+                // try again after a full delay rather than spin
+                due = now;
+                add_ms(&due, wb->delay_ms);
+            }
+        }
+
+        pthread_mutex_lock(&wb->wake_lock);
+        if(wb->stop || wb->kicked || flushed)
+            continue;
+        if(bytes == 0)
+            pthread_cond_wait(&wb->wake, &wb->wake_lock);
+        else
+            pthread_cond_timedwait(&wb->wake, &wb->wake_lock, &due);
+    }
+    pthread_mutex_unlock(&wb->wake_lock);
+    return NULL;
+}
+
+WriteBack *writeback_open(WriteBackRead read, WriteBackWrite write, uint64_t size,
+                          unsigned delay_ms, size_t threshold,
+                          WriteBackHook hold, WriteBackHook release)
+{
+    WriteBack *wb = calloc(1, sizeof(WriteBack));
+    if(wb == NULL)
+        return NULL;
+    wb->read = read;
+    wb->write = write;
+    wb->hold = hold;
+    wb->release = release;
+    wb->size = size;
+    wb->delay_ms = delay_ms;
+    wb->threshold = (threshold >= WRITEBACK_BLOCK) ? threshold : WRITEBACK_BLOCK;
+    // block aligned, so runs can go to an O_DIRECT image as they are
+    if(posix_memalign((void **)&wb->bounce, WRITEBACK_BLOCK, (size_t)WB_RUN * WRITEBACK_BLOCK) != 0) {
+        free(wb);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&wb->lock, NULL);
+    pthread_mutex_init(&wb->flush_lock, NULL);
+    pthread_mutex_init(&wb->wake_lock, NULL);
+    pthread_mutex_init(&wb->stats_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wb->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if(pthread_create(&wb->thread, NULL, flusher_main, wb) != 0) {
+        pthread_cond_destroy(&wb->wake);
+        pthread_mutex_destroy(&wb->stats_lock);
+        pthread_mutex_destroy(&wb->wake_lock);
+        pthread_mutex_destroy(&wb->flush_lock);
+        pthread_rwlock_destroy(&wb->lock);
+        free(wb->bounce);
+        free(wb);
+        return NULL;
+    }
+    return wb;
+}
+
+int writeback_close(WriteBack *wb)
+{
+    if(wb == NULL)
+        return 0;
+
+    pthread_mutex_lock(&wb->wake_lock);
+    wb->stop = true;
+    pthread_cond_signal(&wb->wake);
+    pthread_mutex_unlock(&wb->wake_lock);
+    pthread_join(wb->thread, NULL);
+
+    int ret = writeback_flush(wb);
+    for(size_t i = 0; i < wb->count; i++)
+        free(wb->items[i].data);
+    free(wb->items);
+    free(wb->index);
+    free(wb->bounce);
+    pthread_cond_destroy(&wb->wake);
+    pthread_mutex_destroy(&wb->stats_lock);
+    pthread_mutex_destroy(&wb->wake_lock);
+    pthread_mutex_destroy(&wb->flush_lock);
+    pthread_rwlock_destroy(&wb->lock);
+    free(wb);
+    return ret;
+}
+
+// copies the part of a dirty block that falls in offset..end into buffer
+static void patch(const Dirty *d, uint64_t offset, uint64_t end, uint8_t *buffer)
+{
+    uint64_t bstart = d->block * WRITEBACK_BLOCK;
+    uint64_t lo = (offset > bstart) ? offset : bstart;
+    uint64_t hi = (end < bstart + WRITEBACK_BLOCK) ? end : bstart + WRITEBACK_BLOCK;
+    memcpy(buffer + (lo - offset), d->data + (lo - bstart), hi - lo);
+}
+
+// the image below, with the dirty blocks the range touches copied over it
+int writeback_read(WriteBack *wb, uint64_t offset, void *buffer, size_t len)
+{
+    if(len == 0)
+        return 0;
+
+    uint64_t end = offset + len;
+    uint64_t first = offset / WRITEBACK_BLOCK;
+    uint64_t last = (end - 1) / WRITEBACK_BLOCK;
+
+    pthread_rwlock_rdlock(&wb->lock);
+    int ret = wb->read(offset, buffer, len);
+    if(ret == 0 && wb->count > 0) {
+        // walk whichever is shorter, the blocks of the range or the dirty list
+        if(last - first < wb->count) {
+            for(uint64_t b = first; b <= last; b++) {
+                int32_t i = lookup(wb, b);
+                if(i >= 0)
+                    patch(&wb->items[i], offset, end, buffer);
+            }
+        } else {
+            for(size_t i = 0; i < wb->count; i++) {
+                if(wb->items[i].block >= first && wb->items[i].block <= last)
+                    patch(&wb->items[i], offset, end, buffer);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&wb->lock);
+    return ret;
+}
+
+int writeback_write(WriteBack *wb, uint64_t offset, const void *buffer, size_t len,
+                    WriteBackOrder order)
+{
+    if(len == 0)
+        return 0;
+    if(offset + len > wb->size)
+        return -1;
+
+    uint64_t end = offset + len;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&wb->lock);
+    bool wasClean = (wb->dirty_bytes == 0);
+    bool wasBelow = (wb->dirty_bytes < wb->threshold);
+    for(uint64_t b = offset / WRITEBACK_BLOCK; b <= (end - 1) / WRITEBACK_BLOCK; b++)
+    {
+        uint64_t bstart = b * WRITEBACK_BLOCK;
+        uint64_t lo = (offset > bstart) ? offset : bstart;
+        uint64_t hi = (end < bstart + WRITEBACK_BLOCK) ? end : bstart + WRITEBACK_BLOCK;
+
+        int32_t i = lookup(wb, b);
+        if(i < 0)
+            i = add_block(wb, b, lo == bstart && hi - lo == block_len(wb, b));
+        if(i < 0) {
+            ret = -1;
+            break;
+        }
+        memcpy(wb->items[i].data + (lo - bstart), (const uint8_t *)buffer + (lo - offset), hi - lo);
+        wb->items[i].gen++;
+        if(order > wb->items[i].order)
+            wb->items[i].order = (uint8_t)order;
+    }
+    uint64_t bytes = wb->dirty_bytes;
+    pthread_rwlock_unlock(&wb->lock);
+
+    if(wasClean || (wasBelow && bytes >= wb->threshold))
+        kick(wb);
+
+    // past the limit the writer pays for the flush itself
+    if(bytes >= (uint64_t)WB_LIMIT * wb->threshold) {
+        pthread_mutex_lock(&wb->stats_lock);
+        wb->stats.stalls++;
+        pthread_mutex_unlock(&wb->stats_lock);
+        if(flush_pass(wb, false) != 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+int writeback_flush(WriteBack *wb)
+{
+    return flush_pass(wb, false);
+}
+
+void writeback_stats(WriteBack *wb, WriteBackStats *st)
+{
+    pthread_mutex_lock(&wb->stats_lock);
+    *st = wb->stats;
+    pthread_mutex_unlock(&wb->stats_lock);
+
+    pthread_rwlock_rdlock(&wb->lock);
+    st->dirty = wb->dirty_bytes;
+    pthread_rwlock_unlock(&wb->lock);
+}
@@ -0,0 +1,149 @@
+#ifndef TEST_H
+#define TEST_H
+
+/*
+ * Helpers shared by the tests: a minimal FAT32 formatter, raw access to
+ * the image behind the library's back, and CHECK, which reports a failed
+ * condition and lets the test carry on. Each test is its own program and
+ * exits non-zero if any check failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fat32.h"
+
+static int test_failures;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while(0)
+
+#define TEST_SECTOR     512
+#define TEST_RESERVED   32
+
+// a scratch file name under $TMPDIR (or /tmp) unique to this process
+static inline void test_path(char *out, size_t size, const char *name)
+{
+    const char *dir = getenv("TMPDIR");
+    snprintf(out, size, "%s/filesys-%d-%s", (dir != NULL) ? dir : "/tmp", (int)getpid(), name);
+}
+
+// sectors per FAT for a volume of total sectors
+static inline uint32_t test_fat_size(uint32_t total, uint8_t sec_per_clus)
+{
+    return (uint32_t)(((uint64_t)total / sec_per_clus * 4 + TEST_SECTOR - 1) / TEST_SECTOR);
+}
+
+/*
+ * A sparse, empty FAT32 volume of the given size with two FATs and the root
+ * directory in cluster 2; only the metadata is written.
+ */
+static inline int test_format(const char *path, uint64_t bytes, uint8_t sec_per_clus)
+{
+    uint32_t total = (uint32_t)(bytes / TEST_SECTOR);
+    uint32_t fatSize = test_fat_size(total, sec_per_clus);
+    uint32_t clusters = (total - TEST_RESERVED - 2 * fatSize) / sec_per_clus;
+
+    BootSector bs;
+    memset(&bs, 0, sizeof(bs));
+    memcpy(bs.BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bs.BS_OEMName, "MSWIN4.1", 8);
+    bs.BPB_BytsPerSec = TEST_SECTOR;
+    bs.BPB_SecPerClus = sec_per_clus;
+    bs.BPB_RsvdSecCnt = TEST_RESERVED;
+    bs.BPB_NumFATs = 2;
+    bs.BPB_Media = 0xF8;
+    bs.BPB_TotSec32 = total;
+    bs.BPB_FATSz32 = fatSize;
+    bs.BPB_RootClus = 2;
+    bs.BPB_FSInfo = 1;
+    bs.BPB_BkBootSec = 6;
+    bs.BS_BootSig = 0x29;
+    memcpy(bs.BS_VolLab, "NO NAME    ", 11);
+    memcpy(bs.BS_FilSysType, "FAT32   ", 8);
+
+    FSInfo info;
+    memset(&info, 0, sizeof(info));
+    info.FSI_LeadSig = FSI_LEAD_SIG;
+    info.FSI_StrucSig = FSI_STRUC_SIG;
+    info.FSI_Free_Count = clusters - 1;
+    info.FSI_Nxt_Free = 3;
+    info.FSI_TrailSig = 0xAA550000;
+
+    uint8_t sig[2] = { 0x55, 0xAA };
+    uint32_t fat[3] = { 0x0FFFFFF8, 0x0FFFFFFF, FAT_EOC };
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return -1;
+    int ok = ftruncate(fd, (off_t)total * TEST_SECTOR) == 0 &&
+             pwrite(fd, &bs, sizeof(bs), 0) == sizeof(bs) &&
+             pwrite(fd, sig, 2, 510) == 2 &&
+             pwrite(fd, &info, sizeof(info), TEST_SECTOR) == sizeof(info) &&
+             pwrite(fd, &bs, sizeof(bs), 6 * TEST_SECTOR) == sizeof(bs);
+    for(int i = 0; ok && i < 2; i++) {
+        off_t at = (off_t)(TEST_RESERVED + i * fatSize) * TEST_SECTOR;
+        ok = pwrite(fd, fat, sizeof(fat), at) == sizeof(fat);
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static inline int test_raw_write(const char *path, uint64_t offset, const void *data, size_t len)
+{
+    int fd = open(path, O_RDWR);
+    if(fd < 0)
+        return -1;
+    ssize_t n = pwrite(fd, data, len, (off_t)offset);
+    close(fd);
+    return (n == (ssize_t)len) ? 0 : -1;
+}
+
+static inline int test_raw_read(const char *path, uint64_t offset, void *data, size_t len)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    ssize_t n = pread(fd, data, len, (off_t)offset);
+    close(fd);
+    return (n == (ssize_t)len) ? 0 : -1;
+}
+
+// where cluster lands in an image made by test_format
+static inline uint64_t test_cluster_offset(uint64_t bytes, uint8_t sec_per_clus, uint32_t cluster)
+{
+    uint32_t total = (uint32_t)(bytes / TEST_SECTOR);
+    uint32_t fatSize = test_fat_size(total, sec_per_clus);
+    return ((uint64_t)TEST_RESERVED + 2 * fatSize + (uint64_t)(cluster - 2) * sec_per_clus) * TEST_SECTOR;
+}
+
+// sets a FAT entry in both copies of an image made by test_format
+static inline int test_set_fat(const char *path, uint64_t bytes, uint8_t sec_per_clus,
+                               uint32_t cluster, uint32_t value)
+{
+    uint32_t fatSize = test_fat_size((uint32_t)(bytes / TEST_SECTOR), sec_per_clus);
+    for(int i = 0; i < 2; i++) {
+        uint64_t at = ((uint64_t)TEST_RESERVED + i * fatSize) * TEST_SECTOR + cluster * 4;
+        if(test_raw_write(path, at, &value, sizeof(value)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static inline int test_done(const char *name)
+{
+    if(test_failures == 0)
+        printf("%s: ok\n", name);
+    else
+        printf("%s: %d failed\n", name, test_failures);
+    return test_failures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,155 @@
+// test_cimage.c: compressed images read back exactly, damaged ones are refused
+#include "test.h"
+#include "cimage.h"
+
+#define IMAGE_SIZE  (8 * 1024 * 1024)
+#define SPC         1
+
+// header fields, as laid out at the start of a compressed image
+#define HDR_BLOCK_SIZE      12
+#define HDR_RAW_SIZE        16
+#define HDR_INDEX_OFFSET    24
+#define HDR_SIZE            32
+
+static uint8_t *load(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    off_t size = lseek(fd, 0, SEEK_END);
+    uint8_t *buf = malloc(size > 0 ? (size_t)size : 1);
+    if(buf != NULL && pread(fd, buf, (size_t)size, 0) != size) {
+        free(buf);
+        buf = NULL;
+    }
+    close(fd);
+    *len = (size_t)size;
+    return buf;
+}
+
+// true if cimage_open accepts data (len bytes) as a compressed image
+static bool opens(const char *path, const uint8_t *data, size_t len)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || pwrite(fd, data, len, 0) != (ssize_t)len) {
+        if(fd >= 0)
+            close(fd);
+        return false;
+    }
+    CImage *ci = cimage_open(fd);
+    cimage_close(ci);
+    close(fd);
+    return ci != NULL;
+}
+
+static void put(uint8_t *p, size_t at, uint64_t value, size_t width)
+{
+    memcpy(p + at, &value, width);
+}
+
+int main(void)
+{
+    char image[256], packed[256], damaged[256];
+    test_path(image, sizeof(image), "cimage.img");
+    test_path(packed, sizeof(packed), "cimage.fcz");
+    test_path(damaged, sizeof(damaged), "cimage-damaged.fcz");
+
+    // a volume with one file, so some blocks compress and some are empty
+    CHECK(test_format(image, IMAGE_SIZE, SPC) == 0);
+    CHECK(fat32_mount(image, NULL) == 0);
+    DirEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.DIR_Attr = ATTR_ARCHIVE;
+    uint32_t entryCluster, entryOffset;
+    CHECK(fat32_add_named_entry(fs.bs.BPB_RootClus, "hello.txt", &entry,
+                                &entryCluster, &entryOffset) == 0);
+    OpenFile of;
+    memset(&of, 0, sizeof(of));
+    of.mode = MODE_RW;
+    of.dir_cluster = entryCluster;
+    of.dir_entry_offset = entryOffset;
+    static uint8_t text[100000];
+    for(size_t i = 0; i < sizeof(text); i++)
+        text[i] = (uint8_t)("compressible "[i % 13] ^ (i / 4096));
+    CHECK(fat32_file_write(&of, text, sizeof(text)) == 0 && fat32_file_flush(&of) == 0);
+    free(of.wbuf);
+    fat32_unmount();
+
+    CHECK(cimage_pack(image, packed) == 0);
+    size_t rawLen, len;
+    uint8_t *raw = load(image, &rawLen);
+    uint8_t *data = load(packed, &len);
+    if(raw == NULL || data == NULL || len <= HDR_SIZE) {
+        CHECK(!"pack");
+        return test_done("test_cimage");
+    }
+
+    // every byte reads back, also through reads that cross blocks
+    int fd = open(packed, O_RDONLY);
+    CImage *ci = cimage_open(fd);
+    CHECK(ci != NULL);
+    if(ci != NULL) {
+        CHECK(cimage_size(ci) == rawLen);
+        uint8_t *buf = malloc(rawLen);
+        bool same = true;
+        for(size_t off = 0; off < rawLen; off += 100003) {
+            size_t n = (rawLen - off < 100003) ? rawLen - off : 100003;
+            same &= cimage_read(ci, off, buf, n) == 0 && memcmp(buf, raw + off, n) == 0;
+        }
+        CHECK(same);
+        CHECK(cimage_read(ci, rawLen - 10, buf, 20) != 0);
+        free(buf);
+        cimage_close(ci);
+    }
+    close(fd);
+
+    CHECK(fat32_mount(packed, NULL) == 0);
+    DirRecord rec;
+    CHECK(fat32_lookup(fs.bs.BPB_RootClus, "hello.txt", &rec) == 0);
+    CHECK(rec.entry.DIR_FileSize == sizeof(text));
+    fat32_unmount();
+
+    uint64_t indexOffset;
+    memcpy(&indexOffset, data + HDR_INDEX_OFFSET, sizeof(indexOffset));
+
+    CHECK(opens(damaged, data, len));
+    // truncated: inside the index, right after the header, inside the header
+    CHECK(!opens(damaged, data, len - 1));
+    CHECK(!opens(damaged, data, (size_t)indexOffset));
+    CHECK(!opens(damaged, data, HDR_SIZE));
+    CHECK(!opens(damaged, data, HDR_SIZE / 2));
+    CHECK(fat32_mount(damaged, NULL) != 0);
+
+    // header fields that are out of range, or whose index length or end wraps
+    uint8_t *copy = malloc(len);
+    struct { size_t at; uint64_t value; size_t width; } bad[][2] = {
+        { { HDR_BLOCK_SIZE, 0, 4 } },
+        { { HDR_BLOCK_SIZE, 1u << 20, 4 } },
+        { { HDR_BLOCK_SIZE, 1, 4 }, { HDR_RAW_SIZE, ((uint64_t)1 << 61) - 1, 8 } },
+        { { HDR_BLOCK_SIZE, 1, 4 }, { HDR_RAW_SIZE, UINT64_MAX, 8 } },
+        { { HDR_RAW_SIZE, UINT64_MAX - 7, 8 } },
+        { { HDR_INDEX_OFFSET, UINT64_MAX - 7, 8 } },
+        { { HDR_INDEX_OFFSET, len, 8 } },
+        // index entries out of order or beyond the block area
+        { { (size_t)indexOffset + 8, UINT64_MAX, 8 } },
+        { { (size_t)indexOffset, 0, 8 } },
+        { { len - 8, indexOffset + 1, 8 } },
+    };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        memcpy(copy, data, len);
+        for(int k = 0; k < 2 && bad[i][k].width != 0; k++)
+            put(copy, bad[i][k].at, bad[i][k].value, bad[i][k].width);
+        if(opens(damaged, copy, len)) {
+            fprintf(stderr, "damaged header %zu accepted\n", i);
+            CHECK(!"damaged header");
+        }
+    }
+    free(copy);
+
+    free(raw);
+    free(data);
+    unlink(image);
+    unlink(packed);
+    unlink(damaged);
+    return test_done("test_cimage");
+}
@@ -0,0 +1,122 @@
+// test_large.c: file data past 4 GiB in a sparse image round-trips intact
+#include "test.h"
+
+#define IMAGE_SIZE  (6ULL << 30)
+#define SPC         64          // 32 KiB clusters
+#define HIGH        (5ULL << 30)
+#define FILE_SIZE   (3 * 32768 + 100)
+
+static uint8_t pattern(uint32_t i, uint8_t seed)
+{
+    return (uint8_t)(((i + seed) * 2654435761u) >> 24);
+}
+
+// the file's contents read back by following its chain
+static int read_file(uint32_t cluster, uint8_t *out, uint32_t size)
+{
+    uint32_t clusterSize = fat32_get_cluster_size();
+    uint8_t *buf = malloc(clusterSize);
+    uint32_t done = 0;
+
+    while(buf != NULL && done < size && cluster >= 2 && cluster < FAT_EOC) {
+        if(fat32_read_cluster(cluster, buf) != 0)
+            break;
+        uint32_t n = (size - done < clusterSize) ? size - done : clusterSize;
+        memcpy(out + done, buf, n);
+        done += n;
+        cluster = fat32_get_fat_entry(cluster);
+    }
+    free(buf);
+    return (done == size) ? 0 : -1;
+}
+
+static int write_file(OpenFile *of, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+    of->offset = offset;
+    // in pieces that don't line up with clusters
+    for(uint32_t done = 0; done < len; done += 1000) {
+        uint32_t n = (len - done < 1000) ? len - done : 1000;
+        if(fat32_file_write(of, data + done, n) != 0)
+            return -1;
+    }
+    return fat32_file_flush(of);
+}
+
+int main(void)
+{
+    char image[256];
+    test_path(image, sizeof(image), "large.img");
+    CHECK(test_format(image, IMAGE_SIZE, SPC) == 0);
+
+    // next-fit starts where FSInfo points, the first cluster past 5 GiB
+    uint32_t high = 2 + (uint32_t)((HIGH - test_cluster_offset(IMAGE_SIZE, SPC, 2)) /
+                                   (SPC * TEST_SECTOR)) + 1;
+    CHECK(test_raw_write(image, TEST_SECTOR + offsetof(FSInfo, FSI_Nxt_Free),
+                         &high, sizeof(high)) == 0);
+    fat32_set_alloc_policy(ALLOC_NEXT);
+
+    if(fat32_mount(image, NULL) != 0) {
+        CHECK(!"mount");
+        unlink(image);
+        return test_done("test_large");
+    }
+
+    static uint8_t expect[FILE_SIZE], got[FILE_SIZE];
+    for(uint32_t i = 0; i < FILE_SIZE; i++)
+        expect[i] = pattern(i, 0);
+
+    DirEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.DIR_Attr = ATTR_ARCHIVE;
+    uint32_t entryCluster, entryOffset;
+    CHECK(fat32_add_named_entry(fs.bs.BPB_RootClus, "large.bin", &entry,
+                                &entryCluster, &entryOffset) == 0);
+
+    OpenFile of;
+    memset(&of, 0, sizeof(of));
+    of.mode = MODE_RW;
+    of.dir_cluster = entryCluster;
+    of.dir_entry_offset = entryOffset;
+    CHECK(write_file(&of, 0, expect, FILE_SIZE) == 0);
+    free(of.wbuf);
+    fat32_unmount();
+
+    // remounted, the data is where the FAT says, past 4 GiB
+    CHECK(fat32_mount(image, NULL) == 0);
+    DirRecord rec;
+    CHECK(fat32_lookup(fs.bs.BPB_RootClus, "large.bin", &rec) == 0);
+    uint32_t first = fat32_get_cluster(&rec.entry);
+    CHECK(first == high);
+    CHECK(rec.entry.DIR_FileSize == FILE_SIZE);
+    CHECK(fat32_cluster_to_offset(first) == test_cluster_offset(IMAGE_SIZE, SPC, first));
+    CHECK(fat32_cluster_to_offset(first) > UINT32_MAX);
+
+    uint8_t raw[1024];
+    CHECK(test_raw_read(image, test_cluster_offset(IMAGE_SIZE, SPC, first), raw, sizeof(raw)) == 0);
+    CHECK(memcmp(raw, expect, sizeof(raw)) == 0);
+    CHECK(read_file(first, got, FILE_SIZE) == 0);
+    CHECK(memcmp(got, expect, FILE_SIZE) == 0);
+
+    // a rewrite straddling a cluster boundary merges with what is there
+    memset(&of, 0, sizeof(of));
+    of.mode = MODE_RW;
+    of.first_cluster = first;
+    of.size = rec.entry.DIR_FileSize;
+    of.dir_cluster = rec.cluster;
+    of.dir_entry_offset = rec.offset;
+    uint8_t patch[3000];
+    for(uint32_t i = 0; i < sizeof(patch); i++)
+        patch[i] = pattern(i, 7);
+    CHECK(write_file(&of, 32768 - 1000, patch, sizeof(patch)) == 0);
+    free(of.wbuf);
+    memcpy(expect + 32768 - 1000, patch, sizeof(patch));
+    fat32_unmount();
+
+    CHECK(fat32_mount(image, NULL) == 0);
+    CHECK(read_file(first, got, FILE_SIZE) == 0);
+    CHECK(memcmp(got, expect, FILE_SIZE) == 0);
+    fat32_unmount();
+
+    unlink(image);
+    return test_done("test_large");
+}
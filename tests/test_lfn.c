@@ -0,0 +1,137 @@
+// test_lfn.c: long name chains that are too long must not overflow a record,
+// and aliases stay unique when the basis holds a '~' of its own
+#include "test.h"
+
+#define IMAGE_SIZE  (8 * 1024 * 1024)
+#define SPC         8           // 4 KiB clusters, 128 slots in the root
+
+static void fill_slot(LfnEntry *lfn, int ord, bool last, uint8_t sum, const uint16_t *chars)
+{
+    uint8_t *raw = (uint8_t *)lfn;
+    memset(lfn, 0, sizeof(*lfn));
+    lfn->LDIR_Ord = (uint8_t)(ord | (last ? LFN_LAST_ENTRY : 0));
+    lfn->LDIR_Attr = ATTR_LONG_NAME;
+    lfn->LDIR_Chksum = sum;
+    memcpy(raw + 1, chars, 10);
+    memcpy(raw + 14, chars + 5, 12);
+    memcpy(raw + 28, chars + 11, 4);
+}
+
+/*
+ * Writes a record made of slots LFN slots spelling len copies of ch (then a
+ * terminator and padding, if there is room) and the 8.3 entry name83 at
+ * *slot, returning the slot of the 8.3 entry.
+ */
+static uint32_t put_record(DirEntry *dir, uint32_t *slot, int slots, int len, uint16_t ch,
+                           const char *name83, uint32_t cluster)
+{
+    uint16_t chars[LFN_CHARS * (LFN_ORD_MASK + 1)];
+    for(int i = 0; i < slots * LFN_CHARS; i++)
+        chars[i] = (i < len) ? ch : (i == len) ? 0x0000 : 0xFFFF;
+
+    DirEntry *entry = &dir[*slot + slots];
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->DIR_Name, name83, 11);
+    entry->DIR_Attr = ATTR_ARCHIVE;
+    fat32_set_cluster(entry, cluster);
+    entry->DIR_FileSize = 1;
+
+    uint8_t sum = fat32_lfn_checksum(entry->DIR_Name);
+    for(int k = 0; k < slots; k++) {
+        int ord = slots - k;
+        fill_slot((LfnEntry *)&dir[*slot + k], ord, k == 0, sum, &chars[(ord - 1) * LFN_CHARS]);
+    }
+    uint32_t at = *slot + slots;
+    *slot = at + 1;
+    return at;
+}
+
+// the alias fat32_name_slots picks for name next to the taken 8.3 names
+static void alias_for(const char *name, const uint8_t (*taken)[11], size_t count, uint8_t *name83)
+{
+    DirEntry entry, slots[LFN_ORD_MASK + 1];
+    memset(&entry, 0, sizeof(entry));
+    CHECK(fat32_name_slots(name, &entry, taken, count, slots) > 1);
+    memcpy(name83, entry.DIR_Name, 11);
+}
+
+static void check_tilde_aliases(void)
+{
+    // both names reduce to the basis A~BC; the first alias's tail is ~1, not ~BC~1
+    uint8_t taken[3][11];
+    alias_for("a~b c.txt", NULL, 0, taken[0]);
+    CHECK(memcmp(taken[0], "A~BC~1  TXT", 11) == 0);
+    alias_for("a~b  c.txt", (const uint8_t (*)[11])taken, 1, taken[1]);
+    CHECK(memcmp(taken[1], "A~BC~2  TXT", 11) == 0);
+
+    // a full eight-character basis is cut short for the tail
+    alias_for("ab~cdefgh.txt", (const uint8_t (*)[11])taken, 2, taken[2]);
+    CHECK(memcmp(taken[2], "AB~CDE~1TXT", 11) == 0);
+    uint8_t next[11];
+    alias_for("ab~cdefgh ij.txt", (const uint8_t (*)[11])taken, 3, next);
+    CHECK(memcmp(next, "AB~CDE~2TXT", 11) == 0);
+}
+
+int main(void)
+{
+    check_tilde_aliases();
+
+    char image[256];
+    test_path(image, sizeof(image), "lfn.img");
+    CHECK(test_format(image, IMAGE_SIZE, SPC) == 0);
+
+    // 20 slots of a three-byte character, 260 chars: more than a long name holds
+    DirEntry dir[SPC * TEST_SECTOR / sizeof(DirEntry)];
+    memset(dir, 0, sizeof(dir));
+    uint32_t slot = 0;
+    uint32_t big = put_record(dir, &slot, 20, 20 * LFN_CHARS, 0x4E00, "BIGNAME TXT", 3);
+    // the longest legal name, 255 of them, right behind it
+    uint32_t max = put_record(dir, &slot, 20, MAX_LFN, 0x4E00, "MAXNAME TXT", 4);
+
+    uint64_t root = test_cluster_offset(IMAGE_SIZE, SPC, 2);
+    CHECK(test_raw_write(image, root, dir, sizeof(dir)) == 0);
+    CHECK(test_set_fat(image, IMAGE_SIZE, SPC, 3, FAT_EOC) == 0);
+    CHECK(test_set_fat(image, IMAGE_SIZE, SPC, 4, FAT_EOC) == 0);
+
+    if(fat32_mount(image, NULL) != 0) {
+        CHECK(!"mount");
+        unlink(image);
+        return test_done("test_lfn");
+    }
+
+    DirIter it;
+    DirRecord rec;
+    fat32_dir_open(&it, fs.bs.BPB_RootClus);
+
+    // the oversized chain is ignored and the record keeps its 8.3 name and place
+    CHECK(fat32_dir_next(&it, &rec) == 1);
+    CHECK(strcmp(rec.name, "BIGNAME.TXT") == 0);
+    CHECK(rec.cluster == 2 && rec.offset == big * sizeof(DirEntry));
+    CHECK(rec.lfn_count == 0);
+    CHECK(fat32_get_cluster(&rec.entry) == 3);
+
+    CHECK(fat32_dir_next(&it, &rec) == 1);
+    CHECK(strlen(rec.name) == MAX_LFN * 3);
+    CHECK(rec.offset == max * sizeof(DirEntry));
+    CHECK(rec.lfn_count == 20);
+    char maxName[MAX_NAME];
+    strcpy(maxName, rec.name);
+
+    CHECK(fat32_dir_next(&it, &rec) == 0);
+
+    // removing it by its 8.3 name takes the entry itself out
+    CHECK(fat32_lookup(fs.bs.BPB_RootClus, "BIGNAME.TXT", &rec) == 0);
+    CHECK(rec.offset == big * sizeof(DirEntry));
+    CHECK(fat32_remove_record(&rec) == 0);
+    CHECK(fat32_lookup(fs.bs.BPB_RootClus, "BIGNAME.TXT", NULL) != 0);
+    CHECK(fat32_lookup(fs.bs.BPB_RootClus, maxName, &rec) == 0);
+    CHECK(rec.offset == max * sizeof(DirEntry));
+    fat32_unmount();
+
+    DirEntry after;
+    CHECK(test_raw_read(image, root + big * sizeof(DirEntry), &after, sizeof(after)) == 0);
+    CHECK(after.DIR_Name[0] == 0xE5);
+
+    unlink(image);
+    return test_done("test_lfn");
+}
@@ -0,0 +1,99 @@
+// test_writeback.c: write-behind flushes data, then the FAT, then directories
+#include "test.h"
+#include "writeback.h"
+
+#define STORE_SIZE  (64 * WRITEBACK_BLOCK)
+#define MAX_WRITES  64
+
+static uint8_t store[STORE_SIZE];
+static uint64_t writes[MAX_WRITES];     // offset of every write, in order
+static int write_count;
+static uint64_t fail_at = UINT64_MAX;   // a write starting here fails
+
+static int store_read(uint64_t offset, void *buffer, size_t len)
+{
+    memcpy(buffer, store + offset, len);
+    return 0;
+}
+
+static int store_write(uint64_t offset, const void *buffer, size_t len)
+{
+    if(offset == fail_at)
+        return -1;
+    memcpy(store + offset, buffer, len);
+    if(write_count < MAX_WRITES)
+        writes[write_count++] = offset;
+    return 0;
+}
+
+static int put(WriteBack *wb, int block, uint8_t fill, WriteBackOrder order)
+{
+    uint8_t buf[100];
+    memset(buf, fill, sizeof(buf));
+    return writeback_write(wb, (uint64_t)block * WRITEBACK_BLOCK + 10, buf, sizeof(buf), order);
+}
+
+static uint64_t at(int block)
+{
+    return (uint64_t)block * WRITEBACK_BLOCK;
+}
+
+int main(void)
+{
+    // nothing is due on its own during the test
+    WriteBack *wb = writeback_open(store_read, store_write, STORE_SIZE, 60000,
+                                   STORE_SIZE, NULL, NULL);
+    CHECK(wb != NULL);
+    if(wb == NULL)
+        return test_done("test_writeback");
+
+    // directory at the front, FAT in the middle, data at the back, as a
+    // volume would have them the other way round
+    CHECK(put(wb, 1, 'd', WRITEBACK_DIR) == 0);
+    CHECK(put(wb, 2, 'd', WRITEBACK_DIR) == 0);
+    CHECK(put(wb, 10, 'f', WRITEBACK_FAT) == 0);
+    CHECK(put(wb, 20, 'x', WRITEBACK_DATA) == 0);
+    CHECK(put(wb, 21, 'x', WRITEBACK_DATA) == 0);
+    // a data block that also got a directory write goes with the directories
+    CHECK(put(wb, 30, 'x', WRITEBACK_DATA) == 0);
+    CHECK(put(wb, 30, 'd', WRITEBACK_DIR) == 0);
+
+    uint8_t buf[100];
+    CHECK(writeback_read(wb, at(10) + 10, buf, sizeof(buf)) == 0 && buf[0] == 'f');
+    CHECK(store[at(10) + 10] == 0);
+
+    CHECK(writeback_flush(wb) == 0);
+    CHECK(write_count == 4);
+    CHECK(writes[0] == at(20));     // 20 and 21 in one run
+    CHECK(writes[1] == at(10));
+    CHECK(writes[2] == at(1));      // 1 and 2 in one run
+    CHECK(writes[3] == at(30));
+    CHECK(store[at(21) + 10] == 'x' && store[at(30) + 10] == 'd');
+
+    // a failed FAT write keeps the directories back, data still goes out
+    write_count = 0;
+    fail_at = at(10);
+    CHECK(put(wb, 1, 'D', WRITEBACK_DIR) == 0);
+    CHECK(put(wb, 10, 'F', WRITEBACK_FAT) == 0);
+    CHECK(put(wb, 11, 'F', WRITEBACK_FAT) == 0);
+    CHECK(put(wb, 20, 'X', WRITEBACK_DATA) == 0);
+    CHECK(writeback_flush(wb) != 0);
+    CHECK(write_count == 1 && writes[0] == at(20));
+    CHECK(store[at(1) + 10] == 'd' && store[at(10) + 10] == 'f');
+
+    WriteBackStats st;
+    writeback_stats(wb, &st);
+    CHECK(st.dirty == 3 * WRITEBACK_BLOCK);
+
+    // once the FAT can be written, everything that waited follows in order
+    write_count = 0;
+    fail_at = UINT64_MAX;
+    CHECK(writeback_flush(wb) == 0);
+    CHECK(write_count == 2 && writes[0] == at(10) && writes[1] == at(1));
+    CHECK(store[at(1) + 10] == 'D' && store[at(11) + 10] == 'F');
+    writeback_stats(wb, &st);
+    CHECK(st.dirty == 0);
+
+    CHECK(writeback_close(wb) == 0);
+    return test_done("test_writeback");
+}